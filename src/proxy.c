@@ -46,36 +46,64 @@
 volatile sig_atomic_t run = 0;
 /** PID of process which signaled to start cloning */
 pid_t signaller = -1;
+/** Threads accepting connections on additional listening sockets */
+static pthread_t *acceptor_threads = NULL;
 
-static void server_run(char *host, int port);
+static void server_run(char *host, int port, int shard);
+static void* acceptor_start(void *ptr);
 static inline void client_threads_start();
 
 /**
  * Main server loop which accepts external extensions
  *
- * @param host Host which the listening socket should be bound to.
- * @param port The port number for listening to incoming connections.
+ * @param host  Host which the listening socket should be bound to.
+ * @param port  The port number for listening to incoming connections.
+ * @param shard Index of the shard of client threads which are given
+ *              connections accepted by this loop. Shard 0 is run by the
+ *              main thread which also starts any other acceptors.
  **/
-static void server_run(char *host, int port) {
-    int serverfd, clientfd;
+static void server_run(char *host, int port, int shard) {
+    int serverfd, clientfd, i, ret;
     fd_set fds;
+    struct timeval tv;
     socklen_t clientlen;
     union sockaddr_union clientaddr;
-    proxy_thread_t *thread;
+    pthread_attr_t attr;
 
     /* Create and bind a new socket */
-    if ((serverfd = proxy_net_bind_new_socket(host, port)) < 0)
+    if ((serverfd = proxy_net_bind_new_socket(host, port, TRUE)) < 0)
         return;
 
-    /* Server event loop */
-    proxy_start_time = time(NULL);
+    if (shard == 0) {
+        /* Server event loop */
+        proxy_start_time = time(NULL);
+        run = 1;
+
+        /* Start threads for other listening sockets */
+        if (options.acceptors > 1) {
+            pthread_attr_init(&attr);
+            pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+
+            acceptor_threads = (pthread_t*) calloc(options.acceptors, sizeof(pthread_t));
+            for (i=1; i<options.acceptors; i++)
+                proxy_threading_create(&acceptor_threads[i], &attr, acceptor_start, (void*) (intptr_t) i);
+
+            pthread_attr_destroy(&attr);
+        }
+    }
+
     clientlen = sizeof(clientaddr);
-    run = 1;
     while(run) {
         FD_ZERO(&fds);
         FD_SET(serverfd, &fds);
 
-        if (select(FD_SETSIZE, &fds, NULL, NULL, NULL) != 1)
+        /* Wake up periodically to expire queued connections */
+        tv.tv_sec = options.queue_wait / 1000;
+        tv.tv_usec = (options.queue_wait % 1000) * 1000;
+        ret = select(FD_SETSIZE, &fds, NULL, NULL, options.queue_depth > 0 ? &tv : NULL);
+
+        proxy_admit_expire(shard);
+        if (ret != 1)
             continue;
 
         clientfd = accept(serverfd, &clientaddr.sa, &clientlen);
@@ -85,20 +113,47 @@ static void server_run(char *host, int port) {
             continue;
         }
 
-        /* Pick a thread to execute the work */
-        thread = &(net_threads[proxy_pool_get(thread_pool)]);
+        /* Idle connections are held by the event loops */
+        if (options.event_threads) {
+            proxy_event_add(clientfd, &clientaddr.sin);
+            continue;
+        }
 
-        /* Give work to thread and signal it to go */
-        proxy_mutex_lock(&thread->lock);
-        thread->data.work.clientfd = clientfd;
-        thread->data.work.addr = &clientaddr.sin;
-        thread->data.work.proxy = NULL;
-        proxy_cond_signal(&thread->cv);
-        proxy_mutex_unlock(&thread->lock);
+        /* Give the connection to a thread in this shard */
+        proxy_admit_add(shard, clientfd, &clientaddr.sin);
     }
 
     /* Server is shutting down, close the listening socket */
     close(serverfd);
+
+    /* Wait for other acceptors to finish */
+    if (shard == 0 && acceptor_threads) {
+        for (i=1; i<options.acceptors; i++)
+            pthread_join(acceptor_threads[i], NULL);
+
+        free(acceptor_threads);
+        acceptor_threads = NULL;
+    }
+}
+
+/**
+ * Start an additional acceptor on its own listening socket.
+ *
+ * @param ptr Index of the shard served by the acceptor.
+ *
+ * @return NULL.
+ **/
+static void* acceptor_start(void *ptr) {
+    int shard = (int) (intptr_t) ptr;
+    char name[16];
+
+    snprintf(name, 16, "Acceptor%d", shard);
+    proxy_threading_name(name);
+    proxy_threading_mask();
+
+    server_run(options.phost[0] != '\0' ? options.phost : NULL, options.pport, shard);
+
+    pthread_exit(NULL);
 }
 
 /**
@@ -118,6 +173,11 @@ static void catch_sig(int sig, __attribute__((unused)) siginfo_t *info, __attrib
             for (i=0; i<options.client_threads; i++)
                 pthread_kill(net_threads[i].thread, SIGPOLL);
 
+            /* Wake up other acceptors */
+            if (acceptor_threads)
+                for (i=1; i<options.acceptors; i++)
+                    pthread_kill(acceptor_threads[i], SIGPOLL);
+
             break;
     }
 }
@@ -129,8 +189,10 @@ static inline void client_threads_start() {
     pthread_attr_t attr;
     int i;
 
-    /* Create a thread pool */
-    thread_pool = proxy_pool_new(options.client_threads);
+    /* Create a thread pool for each acceptor */
+    thread_pools = (pool_t**) calloc(options.acceptors, sizeof(pool_t*));
+    for (i=0; i<options.acceptors; i++)
+        thread_pools[i] = proxy_pool_new(proxy_net_shard_size(i));
 
     /* Set up thread attributes */
     pthread_attr_init(&attr);
@@ -147,13 +209,14 @@ static inline void client_threads_start() {
         net_threads[i].exit = 0;
         net_threads[i].data.work.addr = NULL;
         net_threads[i].data.work.proxy = NULL;
+        net_threads[i].data.work.event = NULL;
 
         proxy_threading_create(&net_threads[i].thread, &attr, proxy_net_new_thread, (void*) &net_threads[i]);
     }
 }
 
 int main(int argc, char *argv[]) {
-    int error, ret=EX_OK;
+    int error, i, ret=EX_OK;
     struct sigaction new_action;
     FILE *pid_file;
     pid_t pid;
@@ -241,7 +304,10 @@ int main(int argc, char *argv[]) {
     }
 
     /* Initialize global status */
-    proxy_status_reset(&global_status);
+    if (proxy_stats_init(options.client_threads)) {
+        ret = EX_SOFTWARE;
+        goto out;
+    }
     global_connections = 0;
     global_running = 0;
 
@@ -251,6 +317,25 @@ int main(int argc, char *argv[]) {
     /* Set up transaction and cloning data */
     proxy_trans_init();
     proxy_clone_init();
+    proxy_epoch_init();
+
+    /* Start reporting transaction results to the coordinator */
+    if (proxy_coord_init()) {
+        ret = EX_SOFTWARE;
+        goto out;
+    }
+
+    /* Set up queueing of new connections */
+    if (proxy_admit_init()) {
+        ret = EX_SOFTWARE;
+        goto out;
+    }
+
+    /* Start event loops for client connections */
+    if (options.event_threads && proxy_event_init()) {
+        ret = EX_SOFTWARE;
+        goto out;
+    }
 
     /* Start admin thread */
     pthread_attr_init(&attr);
@@ -260,7 +345,7 @@ int main(int argc, char *argv[]) {
     /* Start proxying */
     proxy_log(LOG_INFO, "Starting proxy on %s:%d",
         options.phost[0] != '\0' ? options.phost : "0.0.0.0", options.pport);
-    server_run(options.phost[0] != '\0' ? options.phost : NULL, options.pport);
+    server_run(options.phost[0] != '\0' ? options.phost : NULL, options.pport, 0);
 
     /* Kill the admin thread */
     pthread_kill(admin_thread, SIGPOLL);
@@ -271,14 +356,27 @@ int main(int argc, char *argv[]) {
 out:
     proxy_log(LOG_INFO, "Shutting down...");
 
+    /* Close connections held by the event loops */
+    proxy_event_end();
+
     /* Cancel any outstanding client threads */
-    proxy_threading_cancel(net_threads, options.client_threads, thread_pool);
-    proxy_threading_cleanup(net_threads, options.client_threads, thread_pool);
+    for (i=0; i<options.acceptors; i++)
+        proxy_threading_cancel(net_threads + i * (options.client_threads / options.acceptors),
+            proxy_net_shard_size(i), thread_pools[i]);
+    proxy_threading_cleanup(net_threads, options.client_threads, NULL);
+
+    for (i=0; i<options.acceptors; i++)
+        proxy_pool_destroy(thread_pools[i]);
+    free(thread_pools);
+    proxy_admit_end();
 
     proxy_backend_close();
+    proxy_coord_end();
     proxy_trans_end();
+    proxy_epoch_end();
     proxy_clone_end();
     proxy_monitor_end();
+    proxy_stats_end();
     mysql_library_end();
     proxy_threading_end();
 
@@ -71,6 +71,12 @@ typedef struct {
     ulong queries_any;
     /** Number of replicated queries. */
     ulong queries_all;
+    /** Number of queries sent outside the session connection. */
+    ulong queries_balanced;
+    /** Number of replicated writes sent in a batch. */
+    ulong queries_batched;
+    /** Number of statements run in read-only transactions. */
+    ulong queries_readonly;
 } status_t;
 
 /**
@@ -84,37 +90,33 @@ static inline void proxy_status_reset(status_t *status) {
     status->queries = 0;
     status->queries_any = 0;
     status->queries_all = 0;
-}
-
-/**
- * Add the contents of one status variable to another.
- *
- * @param src         Status variable to add.
- * @param[in,out] dst Status variable to be added to.
- **/
-static inline void proxy_status_add(status_t *src, status_t *dst) {
-    (void) __sync_fetch_and_add(&dst->bytes_sent, src->bytes_sent);
-    (void) __sync_fetch_and_add(&dst->bytes_recv, src->bytes_recv);
-    (void) __sync_fetch_and_add(&dst->queries, src->queries);
-    (void) __sync_fetch_and_add(&dst->queries_any, src->queries_any);
-    (void) __sync_fetch_and_add(&dst->queries_all, src->queries_all);
+    status->queries_balanced = 0;
+    status->queries_batched = 0;
+    status->queries_readonly = 0;
 }
 
 #include "proxy_logging.h"
+#include "proxy_latency.h"
 #include "proxy_backend.h"
 #include "proxy_net.h"
+#include "proxy_event.h"
+#include "proxy_admit.h"
 #include "proxy_pool.h"
 #include "proxy_threading.h"
 #include "proxy_clone.h"
 #include "proxy_monitor.h"
 #include "proxy_cmd.h"
+#include "proxy_wait.h"
 #include "proxy_trans.h"
+#include "proxy_coord.h"
+#include "proxy_epoch.h"
+#include "proxy_stats.h"
 #include "proxy_options.h"
 
 /** Threads for dealing with connected clients. */
 proxy_thread_t *net_threads;
-/** Thread pool for managing connected clients. */
-pool_t *thread_pool;
+/** Thread pools for managing connected clients, one per acceptor. */
+pool_t **thread_pools;
 
 #define STRINGIFY(x) #x
 #define TOSTRING(x) STRINGIFY(x)
@@ -0,0 +1,363 @@
+/******************************************************************************
+ * proxy_admit.c
+ *
+ * Admission control for new client connections. Connections which arrive
+ * while all client threads are occupied wait in a bounded queue and are
+ * rejected if they cannot be serviced within the configured time.
+ *
+ * Copyright (c) 2010, Michael Mior <mmior@cs.toronto.edu>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+ * Place - Suite 330, Boston, MA 02111-1307 USA.
+ *
+ */
+
+#include "proxy.h"
+
+/** Error message sent to rejected clients */
+#define ADMIT_ERROR "Too many connections waiting for " PACKAGE_NAME
+
+/**
+ * Connection waiting for a client thread.
+ **/
+typedef struct {
+    /** Socket descriptor of client. */
+    int clientfd;
+    /** Address of client endpoint. */
+    struct sockaddr_in addr;
+    /** Time the connection was accepted. */
+    struct timeval start;
+} admit_entry_t;
+
+/**
+ * Queue of connections waiting for a
+ * client thread in a single shard.
+ **/
+typedef struct {
+    /** Lock protecting the queue and the
+     *  handoff of threads in the shard. */
+    pthread_mutex_t lock;
+    /** Ring buffer of waiting connections. */
+    admit_entry_t *entries;
+    /** Index of the oldest connection. */
+    int head;
+    /** Number of waiting connections. */
+    int count;
+} admit_queue_t;
+
+/** Queues for each acceptor shard */
+static admit_queue_t *queues = NULL;
+/** Client addresses owned by each client thread */
+static struct sockaddr_in *thread_addrs = NULL;
+
+/** Total microseconds waited by dispatched connections */
+static volatile ulonglong wait_total = 0;
+/** Number of connections dispatched from the queue */
+static volatile ulong wait_num = 0;
+/** Maximum microseconds waited by a dispatched connection */
+static volatile long wait_max = 0;
+/** Number of rejected connections */
+static volatile long rejected = 0;
+
+/**
+ * Get the microseconds elapsed since a given time.
+ *
+ * @param start Starting time.
+ *
+ * @return Microseconds since the starting time.
+ **/
+static inline long admit_elapsed(struct timeval *start) {
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - start->tv_sec) * 1000000L + (now.tv_usec - start->tv_usec);
+}
+
+/**
+ * Give a connection to a client thread and signal it to go.
+ *
+ * @param thread_id Identifier of the client thread.
+ * @param clientfd  Socket descriptor of the client.
+ * @param addr      Address of the client endpoint.
+ **/
+static void admit_dispatch(int thread_id, int clientfd, struct sockaddr_in *addr) {
+    proxy_thread_t *thread = &(net_threads[thread_id]);
+
+    /* Keep a copy of the address since the caller's may be reused */
+    thread_addrs[thread_id] = *addr;
+
+    proxy_mutex_lock(&thread->lock);
+    thread->data.work.clientfd = clientfd;
+    thread->data.work.addr = &thread_addrs[thread_id];
+    thread->data.work.proxy = NULL;
+    thread->data.work.event = NULL;
+    proxy_cond_signal(&thread->cv);
+    proxy_mutex_unlock(&thread->lock);
+}
+
+/**
+ * Reject a connection which cannot be serviced.
+ *
+ * @param clientfd Socket descriptor of the client.
+ **/
+static void admit_reject(int clientfd) {
+    (void) __sync_fetch_and_add(&rejected, 1);
+    proxy_net_reject(clientfd, ER_CON_COUNT_ERROR, ADMIT_ERROR);
+}
+
+/**
+ * Reject a connection which cannot be serviced. This
+ * is used by event loops, which keep their own queues.
+ *
+ * @param clientfd Socket descriptor of the client.
+ **/
+void proxy_admit_reject(int clientfd) {
+    admit_reject(clientfd);
+}
+
+/**
+ * Record the time a connection spent in the queue.
+ *
+ * @param wait Microseconds spent waiting.
+ **/
+static void admit_record_wait(long wait) {
+    long max;
+
+    (void) __sync_fetch_and_add(&wait_total, wait);
+    (void) __sync_fetch_and_add(&wait_num, 1);
+
+    while ((max = wait_max) < wait)
+        if (__sync_bool_compare_and_swap(&wait_max, max, wait))
+            break;
+}
+
+/**
+ * Record the time a connection spent waiting for a client
+ * thread in the queue of an event loop.
+ *
+ * @param start Time the connection started waiting.
+ **/
+void proxy_admit_waited(struct timeval *start) {
+    admit_record_wait(admit_elapsed(start));
+}
+
+/**
+ * Initialize admission queues.
+ *
+ * @return TRUE on error, FALSE otherwise.
+ **/
+my_bool proxy_admit_init() {
+    int i;
+
+    thread_addrs = (struct sockaddr_in*) calloc(options.client_threads, sizeof(struct sockaddr_in));
+    if (!thread_addrs)
+        return TRUE;
+
+    /* Nothing more to do without queueing */
+    if (options.queue_depth <= 0)
+        return FALSE;
+
+    queues = (admit_queue_t*) calloc(options.acceptors, sizeof(admit_queue_t));
+    if (!queues)
+        return TRUE;
+
+    for (i=0; i<options.acceptors; i++) {
+        proxy_mutex_init(&queues[i].lock);
+        queues[i].entries = (admit_entry_t*) calloc(options.queue_depth, sizeof(admit_entry_t));
+        if (!queues[i].entries)
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+/**
+ * Reject any queued connections and free admission queues.
+ **/
+void proxy_admit_end() {
+    admit_queue_t *queue;
+    int i;
+
+    if (queues) {
+        for (i=0; i<options.acceptors; i++) {
+            queue = &queues[i];
+
+            /* Turn away anyone still waiting */
+            while (queue->count) {
+                admit_reject(queue->entries[queue->head].clientfd);
+                queue->head = (queue->head + 1) % options.queue_depth;
+                queue->count--;
+            }
+
+            proxy_mutex_destroy(&queue->lock);
+            free(queue->entries);
+        }
+
+        free(queues);
+        queues = NULL;
+    }
+
+    free(thread_addrs);
+    thread_addrs = NULL;
+}
+
+/**
+ * Admit a newly accepted connection. The connection is given to
+ * a free client thread if possible, otherwise it is queued. If the
+ * queue is full or the oldest connection has already waited longer
+ * than allowed, the connection is rejected immediately.
+ *
+ * @param shard    Index of the shard of the accepting socket.
+ * @param clientfd Socket descriptor of the client.
+ * @param addr     Address of the client endpoint.
+ **/
+void proxy_admit_add(int shard, int clientfd, struct sockaddr_in *addr) {
+    admit_queue_t *queue;
+    admit_entry_t *entry;
+    my_bool reject = FALSE;
+    int thread_id;
+
+    /* Without a queue, wait for a thread to become available */
+    if (options.queue_depth <= 0) {
+        admit_dispatch(proxy_net_get_thread(shard), clientfd, addr);
+        return;
+    }
+
+    queue = &queues[shard];
+    proxy_mutex_lock(&queue->lock);
+
+    if (queue->count && admit_elapsed(&queue->entries[queue->head].start) > options.queue_wait * 1000L) {
+        /* The queue is not draining fast enough, so shed load */
+        reject = TRUE;
+    } else if (!queue->count && (thread_id = proxy_net_try_get_thread(shard)) >= 0) {
+        admit_dispatch(thread_id, clientfd, addr);
+    } else if (queue->count >= options.queue_depth) {
+        reject = TRUE;
+    } else {
+        /* Wait for a thread to be released */
+        entry = &queue->entries[(queue->head + queue->count) % options.queue_depth];
+        entry->clientfd = clientfd;
+        entry->addr = *addr;
+        gettimeofday(&entry->start, NULL);
+        queue->count++;
+    }
+
+    proxy_mutex_unlock(&queue->lock);
+
+    if (reject) {
+        proxy_vdebug("Rejecting client connection on shard %d", shard);
+        admit_reject(clientfd);
+    }
+}
+
+/**
+ * Release a client thread once its connection has closed. If any
+ * connections are queued, the oldest is given to the thread instead
+ * of returning the thread to its pool.
+ *
+ * @param thread_id Identifier of the client thread.
+ **/
+void proxy_admit_release(int thread_id) {
+    admit_queue_t *queue;
+    admit_entry_t entry;
+    long wait;
+
+    if (options.queue_depth <= 0) {
+        proxy_net_return_thread(thread_id);
+        return;
+    }
+
+    queue = &queues[proxy_net_thread_shard(thread_id)];
+
+    while (1) {
+        proxy_mutex_lock(&queue->lock);
+
+        /* Return the thread while holding the lock so
+         * new connections will see it as available */
+        if (!queue->count) {
+            proxy_net_return_thread(thread_id);
+            proxy_mutex_unlock(&queue->lock);
+            return;
+        }
+
+        entry = queue->entries[queue->head];
+        queue->head = (queue->head + 1) % options.queue_depth;
+        queue->count--;
+
+        wait = admit_elapsed(&entry.start);
+        if (wait <= options.queue_wait * 1000L) {
+            admit_record_wait(wait);
+            admit_dispatch(thread_id, entry.clientfd, &entry.addr);
+            proxy_mutex_unlock(&queue->lock);
+            return;
+        }
+
+        proxy_mutex_unlock(&queue->lock);
+
+        /* Waited too long, so try the next connection */
+        admit_reject(entry.clientfd);
+    }
+}
+
+/**
+ * Reject all queued connections which have waited too long.
+ *
+ * @param shard Index of the shard to check.
+ **/
+void proxy_admit_expire(int shard) {
+    admit_queue_t *queue;
+    int clientfd;
+
+    if (options.queue_depth <= 0)
+        return;
+
+    queue = &queues[shard];
+
+    while (1) {
+        proxy_mutex_lock(&queue->lock);
+
+        /* Connections are ordered, so stop at the first one still waiting */
+        if (!queue->count || admit_elapsed(&queue->entries[queue->head].start) <= options.queue_wait * 1000L) {
+            proxy_mutex_unlock(&queue->lock);
+            return;
+        }
+
+        clientfd = queue->entries[queue->head].clientfd;
+        queue->head = (queue->head + 1) % options.queue_depth;
+        queue->count--;
+
+        proxy_mutex_unlock(&queue->lock);
+
+        admit_reject(clientfd);
+    }
+}
+
+/**
+ * Get statistics on the admission queues.
+ *
+ * @param[out] stats Storage for queue statistics.
+ **/
+void proxy_admit_stats(admit_stats_t *stats) {
+    int i;
+
+    stats->depth = 0;
+    if (queues)
+        for (i=0; i<options.acceptors; i++)
+            stats->depth += queues[i].count;
+    if (options.event_threads)
+        stats->depth += proxy_event_queued();
+
+    stats->wait_avg = wait_num ? (long) (wait_total / wait_num) : 0;
+    stats->wait_max = wait_max;
+    stats->rejected = rejected;
+}
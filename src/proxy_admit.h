@@ -0,0 +1,40 @@
+/*
+ * proxy_admit.h
+ *
+ * Admission control for new client connections.
+ *
+ * This file is subject to the terms and conditions of the GNU General
+ * Public License.  See the file "COPYING" in the main directory of
+ * this archive for more details.
+ *
+ * Copyright (C) 2010 by Michael Mior <mmior@cs.toronto.edu>
+ *
+ */
+
+#ifndef _proxy_admit_h
+#define _proxy_admit_h
+
+/**
+ * Statistics on connections waiting for a client thread.
+ **/
+typedef struct {
+    /** Number of connections currently queued. */
+    long depth;
+    /** Average microseconds spent waiting in the queue. */
+    long wait_avg;
+    /** Maximum microseconds spent waiting in the queue. */
+    long wait_max;
+    /** Number of connections rejected. */
+    long rejected;
+} admit_stats_t;
+
+my_bool proxy_admit_init();
+void proxy_admit_end();
+void proxy_admit_add(int shard, int clientfd, struct sockaddr_in *addr);
+void proxy_admit_release(int thread_id);
+void proxy_admit_expire(int shard);
+void proxy_admit_reject(int clientfd);
+void proxy_admit_waited(struct timeval *start);
+void proxy_admit_stats(admit_stats_t *stats);
+
+#endif /* _proxy_admit_h */
@@ -26,58 +26,335 @@
 #include <sql_common.h>
 #include <time.h>
 #include <unistd.h>
+#include <poll.h>
 #include <ltdl.h>
 
 /** Maximum TCP packet length (from sql/net_serv.cc) */
 #define MAX_PACKET_LENGTH (256L*256L*256L-1)
+/** Weight of backends which do not specify one */
+#define BACKEND_WEIGHT 1
+/** Each latency sample contributes 1/2^LATENCY_SHIFT
+ *  of the moving average */
+#define LATENCY_SHIFT 3
+/** Maximum SET statements saved for replay, after
+ *  which a session keeps its backend connection */
+#define SESSION_SETS_MAX 32
+/** Microseconds to wait before the first retry of a
+ *  failed connection, doubled for each later retry */
+#define CONNECT_BACKOFF 100000
+/** Weights are multiplied by this while backends ramp up,
+ *  so a backend can be given a fraction of its share */
+#define RAMP_SCALE 100
+/** Milliseconds to wait for clones to acknowledge
+ *  the outcome of a transaction */
+#define CLONE_ACK_TIMEOUT 30000
+/** Milliseconds a joining clone waits for
+ *  writes to be logged before giving up */
+#define EPOCH_OPEN_TIMEOUT 30000
+/** Milliseconds to wait for a backend to respond
+ *  during a fan-out before it is given up on */
+#define FANOUT_TIMEOUT 300000
+/** Logged writes a backend may fall behind before it is
+ *  given up on, so the log can't grow without bound */
+#ifndef REPLOG_MAX
+#define REPLOG_MAX 10000
+#endif
+/** Seconds log appliers wait for a backend to answer
+ *  a write before the connection is dropped */
+#define REPLOG_TIMEOUT 60
 
-/** Array of backends currently available */
-static proxy_host_t **backends = NULL;
-/** Backend MySQL connections */
-static proxy_backend_conn_t ***backend_conns;
-/** Lock pool for controlling backend access */
-static pool_t **backend_pools = NULL;
-/** Total number of backends */
-static int backend_num;
+/**
+ * Backends and their connections. A topology is never changed once
+ * published, so queries read it without locking. Updates publish a
+ * copy and free the old topology once no query can still be using it.
+ **/
+typedef struct {
+    /** Total number of backends. */
+    int num;
+    /** Array of backends currently available. */
+    proxy_host_t **backends;
+    /** Backend MySQL connections. */
+    proxy_backend_conn_t ***conns;
+    /** Lock pool for controlling backend access, or NULL if unused. */
+    pool_t **pools;
+    /** Thread data structures for backend query threads, or NULL if unused. */
+    proxy_thread_t **threads;
+    /** Backend index of each clone ID, or -1 if the clone has no backend. */
+    int *clones;
+    /** Number of clone IDs which fit in the map. */
+    int clones_size;
+    /** Number of topologies published before this one. */
+    ulong version;
+} backend_topo_t;
+
+/** Topology currently used by queries */
+static backend_topo_t * volatile backend_topo = NULL;
+/** Number of queries using the topology, by the phase they started in */
+static volatile long topo_readers[2] = { 0, 0 };
+/** Phase of queries starting to use the topology */
+static volatile int topo_phase = 0;
 /** Query mapper for selecting backends */
 static proxy_map_query_t backend_mapper = NULL;
 /** ltdl handle to the mapper library */
 static lt_dlhandle backend_mapper_handle = NULL;
-/** Thread data structures for backend query threads */
-static proxy_thread_t **backend_threads = NULL;
 /** Pool for locking access to backend threads */
 static pool_t *backend_thread_pool = NULL;
 
-/** Mutex for protecting addition of new backends */
+/** Mutex for protecting changes to the topology */
 static pthread_mutex_t add_mutex;
+/** Position of the next weighted round-robin selection */
+static volatile ulong balance_next = 0;
+/** Identifier of the next client session */
+static volatile ulong session_next = 1;
+/** Number of backends whose share of clients is ramping up */
+static volatile int backend_ramping = 0;
+/** Identifier of the next backend host */
+static volatile ulong host_next = 1;
+/** Number of client queries forwarded to backends */
+static volatile ulong backend_queries = 0;
 
 /** Signify that a backend is currently querying */
 volatile sig_atomic_t querying   = 0;
 /** Signify that a backend is currently in commit phase */
 volatile sig_atomic_t committing = 0;
 
+/**
+ * Replicated write waiting to be applied by backends.
+ **/
+typedef struct backend_replog_entry {
+    /** Position of the write in the log. */
+    ulong seq;
+    /** Query string to execute. */
+    char *query;
+    /** Length of the query. */
+    ulong length;
+    /** Command used to send the query. */
+    enum enum_server_command command;
+    /** ID of the transaction sent with COM_PROXY_QUERY. */
+    ulong trans_id;
+    /** Number of backends which have yet to apply the write. */
+    int applying;
+    /** Number of clients waiting on the write. */
+    int refs;
+    /** Number of backends which applied the write successfully. */
+    int acks;
+    /** Number of backends which failed to apply the write. */
+    int fails;
+    /** Number of backends which were given up on and skipped it. */
+    int skips;
+    /** Number of backends when the write was logged. */
+    int backends;
+    /** Bitmap of backends which applied the write successfully. */
+    ulonglong results;
+    /** TRUE once enough backends have answered to reply. */
+    my_bool done;
+    /** TRUE if the write reached a quorum of backends. */
+    my_bool success;
+    /** Result from the first backend to answer. */
+    backend_result_t result;
+    /** Next write in the log. */
+    struct backend_replog_entry *next;
+} backend_replog_entry_t;
+
+/** Oldest write still held in the log */
+static backend_replog_entry_t *replog_head = NULL;
+/** Most recent write in the log */
+static backend_replog_entry_t *replog_tail = NULL;
+/** Sequence number of the last logged write */
+static ulong replog_seq = 0;
+/** Lock protecting the log and backend positions */
+static pthread_mutex_t replog_lock;
+/** Signalled when new writes are logged */
+static pthread_cond_t replog_apply_cv;
+/** Signalled when writes have been acknowledged */
+static pthread_cond_t replog_done_cv;
+/** Number of sessions waiting for their backend to catch up */
+static int replog_waiters = 0;
+
+/**
+ * Replicated write waiting to be sent in a batch.
+ **/
+typedef struct backend_batch_item {
+    /** Query string to execute. */
+    const char *query;
+    /** Length of the query. */
+    ulong length;
+    /** Bitmap of backends which executed the write successfully. */
+    ulonglong results;
+    /** Number of backends the write was sent to. */
+    int backends;
+    /** Result of the write on the backend replying to the client. */
+    backend_result_t result;
+    /** TRUE once the batch containing the write has been sent. */
+    my_bool done;
+    /** Next write in the batch. */
+    struct backend_batch_item *next;
+} backend_batch_item_t;
+
+/** First write in the batch being collected */
+static backend_batch_item_t *batch_head = NULL;
+/** Last write in the batch being collected */
+static backend_batch_item_t *batch_tail = NULL;
+/** Number of writes in the batch being collected */
+static int batch_count = 0;
+/** TRUE if a thread is waiting to send the batch being collected */
+static my_bool batch_leader = FALSE;
+/** Lock protecting the batch being collected */
+static pthread_mutex_t batch_lock;
+/** Signalled when the batch being collected is full */
+static pthread_cond_t batch_cv;
+/** Signalled when batches have been sent */
+static pthread_cond_t batch_done_cv;
+
+/**
+ * Backend connection to be opened.
+ **/
+typedef struct backend_connect_job {
+    /** Backend to connect to. */
+    proxy_host_t *backend;
+    /** Connection where the MySQL object should be stored. */
+    proxy_backend_conn_t *conn;
+    /** TRUE to use the bypass port if specified. */
+    my_bool bypass;
+} backend_connect_job_t;
+
+/**
+ * Connections shared by threads opening them in parallel.
+ **/
+typedef struct backend_connect_work {
+    /** Connections to open. */
+    backend_connect_job_t *jobs;
+    /** Number of connections to open. */
+    int num;
+    /** Index of the next connection to take. */
+    volatile int next;
+    /** Number of connections which could not be opened. */
+    volatile int failed;
+} backend_connect_work_t;
+
 static my_bool backend_read_rows(MYSQL *backend, MYSQL *proxy, uint fields, status_t *status);
 static my_bool backend_proxy_write(MYSQL* __restrict backend, MYSQL* __restrict proxy, ulong pkt_len, status_t *status);
 static ulong backend_read_to_proxy(MYSQL* __restrict backend, MYSQL* __restrict proxy, status_t *status);
 
-static inline my_bool backend_query_idx(int bi, int ci, MYSQL *proxy, const char *query, ulong length, my_bool replicated, status_t *status);
-static my_bool backend_query(proxy_backend_conn_t *conn, MYSQL *proxy, const char *query, ulong length, my_bool replicated, int bi, commitdata_t *commit, status_t *status);
+static inline my_bool backend_query_idx(backend_topo_t *topo, int bi, int ci, MYSQL *proxy, const char *query, ulong length, my_bool replicated, ulong trans_id, status_t *status);
+static my_bool backend_query_balanced(backend_topo_t *topo, proxy_conn_idx_t *conn_idx, MYSQL *proxy, const char *query, ulong length, status_t *status);
+static my_bool backend_query_pooled(backend_topo_t *topo, proxy_conn_idx_t *conn_idx, MYSQL *proxy, const char *query, ulong length, my_bool replicated, ulong trans_id, status_t *status);
+static ulonglong backend_query_fanout(MYSQL *proxy, const char *query, ulong length, my_bool replicated, ulong trans_id, int *backends, status_t *status);
+static my_bool backend_fanout_read(proxy_backend_conn_t *conn, MYSQL *proxy, backend_result_t *result, status_t *status);
+static my_bool backend_send_command(MYSQL *mysql, enum enum_server_command command, ulong trans_id, const char *query, ulong length);
+static my_bool backend_query_quorum(proxy_conn_idx_t *conn_idx, MYSQL *proxy, const char *query, ulong length, my_bool replicated, ulong trans_id, status_t *status);
+static my_bool backend_query_single(const char *query, ulong length);
+static my_bool backend_query_batchable(const char *query, ulong length);
+static my_bool backend_query_readonly(const char *query);
+static my_bool backend_query_begins(const char *query);
+static my_bool backend_query_ends(const char *query, my_bool *commit);
+static my_bool backend_query_trans(proxy_conn_idx_t *conn_idx, MYSQL *proxy, const char *query, ulong length, proxy_query_map_t map, status_t *status);
+static my_bool backend_trans_end(proxy_conn_idx_t *conn_idx, MYSQL *proxy, my_bool commit, status_t *status);
+static my_bool backend_query_batched(MYSQL *proxy, const char *query, ulong length, status_t *status);
+
+/* Replicated write log */
+static void backend_replog_trim();
+static void backend_replog_finish(backend_replog_entry_t *entry);
+static void backend_replog_release(proxy_host_t *host);
+static void backend_replog_start(int bi);
+static void* backend_replog_thread(void *ptr);
+
+/* Session connection management */
+static void backend_conn_take(backend_topo_t *topo, proxy_conn_idx_t *conn_idx, int thread_id);
+static void backend_conn_assign(backend_topo_t *topo, proxy_conn_idx_t *conn_idx, int bi, int thread_id);
+static my_bool backend_conn_fresh(backend_topo_t *topo, proxy_conn_idx_t *conn_idx);
+static void backend_conn_return(backend_topo_t *topo, proxy_conn_idx_t *conn_idx);
+static my_bool backend_conn_restore(backend_topo_t *topo, proxy_conn_idx_t *conn_idx);
+static my_bool backend_conn_lost(backend_topo_t *topo, proxy_conn_idx_t *conn_idx);
+static my_bool backend_query(proxy_backend_conn_t *conn, proxy_host_t *host, MYSQL *proxy, const char *query, ulong length, my_bool replicated, ulong trans_id, int bi, commitdata_t *commit, status_t *status);
 
 /* Data structure allocation functions */
 static void conn_free(proxy_backend_conn_t *conn);
 static void backend_free(proxy_host_t *backend);
 static void backends_free(proxy_host_t **backends, int num);
-//static void backend_conns_free(int bi); /* see comment before function body */
-static my_bool backends_alloc(int num_backends);
+static void backend_conns_free(proxy_backend_conn_t **conns, pool_t *pool, proxy_thread_t *threads);
+static my_bool backends_alloc(proxy_host_t **hosts, int num_backends);
 
 static my_bool backend_connect(proxy_host_t *backend, proxy_backend_conn_t *conn, my_bool bypass);
-static void backend_new_threads(int bi);
+static my_bool backend_connect_all(backend_connect_job_t *jobs, int num, const char *what);
+static void backend_new_threads(backend_topo_t *topo, int bi);
 static proxy_host_t** backend_read_file(char *filename, int *num) __attribute__((malloc));
+static proxy_host_t* backend_host_new(const char *host, size_t len, int port, int weight) __attribute__((malloc));
+static void backend_ramp_start(backend_topo_t *topo, proxy_host_t *backend);
 
 /* Backend update utility functions */
-static my_bool backend_resize(int num, my_bool before);
-static void backends_new_connect(proxy_backend_conn_t ***conns, pool_t **pools);
-static void backend_new_connect(proxy_backend_conn_t ***conns, pool_t **pools, int bi);
+static backend_topo_t* backend_topo_copy(backend_topo_t *topo, int num);
+static void backend_topo_free(backend_topo_t *topo);
+static inline void backend_topo_publish(backend_topo_t *topo);
+static void backend_topo_retire(backend_topo_t *topo);
+static inline void backend_topo_leave(int phase);
+static my_bool backend_new_connect(backend_topo_t *topo, int bi);
+
+/**
+ * Start using the topology. Topologies which are replaced
+ * are kept until every query using them has finished.
+ *
+ * @return Phase to pass to ::backend_topo_leave.
+ **/
+static inline int backend_topo_enter() {
+    int phase;
+
+    while (1) {
+        phase = topo_phase;
+        (void) __sync_fetch_and_add(&topo_readers[phase], 1);
+
+        /* Retry if an update started waiting for this phase */
+        if (likely(phase == topo_phase))
+            return phase;
+
+        backend_topo_leave(phase);
+    }
+}
+
+/**
+ * Stop using the topology.
+ *
+ * @param phase Value returned by ::backend_topo_enter.
+ **/
+static inline void backend_topo_leave(int phase) {
+    /* The last reader of an old phase wakes the update waiting on it */
+    if (__sync_sub_and_fetch(&topo_readers[phase], 1) == 0 && unlikely(phase != topo_phase))
+        proxy_wait_wake();
+}
+
+/**
+ * Mark the end of a replicated write, waking a clone waiting for it.
+ **/
+static inline void backend_commit_leave() {
+    (void) __sync_fetch_and_sub(&committing, 1);
+    if (cloning)
+        proxy_wait_wake();
+}
+
+/**
+ * Mark the end of a replicated query, waking a clone waiting for it.
+ **/
+static inline void backend_query_leave() {
+    (void) __sync_fetch_and_sub(&querying, 1);
+    if (cloning)
+        proxy_wait_wake();
+}
+
+/**
+ * Mark the start of a replicated write which must complete
+ * before a clone is made, waiting for any clone in progress.
+ **/
+static inline void backend_commit_enter() {
+    while (1) {
+        (void) __sync_fetch_and_add(&committing, 1);
+        if (!cloning)
+            break;
+
+        /* Back off so the clone can go ahead */
+        backend_commit_leave();
+        proxy_wait(WAIT_QUERY_CLONE, !cloning);
+    }
+}
 
 /**
  * Get the current number of backends.
@@ -85,7 +362,82 @@ static void backend_new_connect(proxy_backend_conn_t ***conns, pool_t **pools, i
  * @return Number of backends currently allocated.
  **/
 int proxy_backend_num() {
-    return backend_num;
+    int num, phase;
+
+    phase = backend_topo_enter();
+    num = backend_topo ? backend_topo->num : 0;
+    backend_topo_leave(phase);
+
+    return num;
+}
+
+/**
+ * Get the load on backends for autoscaling.
+ *
+ * @param[out] queries Client queries forwarded to backends so far.
+ * @param[out] latency Average latency of backends serving reads
+ *                     in microseconds, or zero if unknown.
+ * @param[out] clone   ID of the most recently added clone,
+ *                     or zero if there are none.
+ *
+ * @return Number of backends.
+ **/
+int proxy_backend_load(ulong *queries, long *latency, int *clone) {
+    backend_topo_t *topo;
+    long total = 0;
+    int i, n = 0, num, phase;
+
+    *queries = backend_queries;
+    *clone = 0;
+
+    phase = backend_topo_enter();
+    topo = backend_topo;
+    num = topo ? topo->num : 0;
+
+    for (i=0; i<num; i++) {
+        if (!topo->backends[i]->stale && topo->backends[i]->latency) {
+            total += topo->backends[i]->latency;
+            n++;
+        }
+    }
+
+    /* Take clones with higher IDs to be newer */
+    for (i=topo ? topo->clones_size-1 : -1; i>0; i--) {
+        if (topo->clones[i] >= 0) {
+            *clone = i;
+            break;
+        }
+    }
+
+    backend_topo_leave(phase);
+
+    *latency = n ? total / n : 0;
+    return num;
+}
+
+/**
+ * Copy the latency histogram of a backend.
+ *
+ * @param bi         Index of the backend.
+ * @param[out] hist  Storage for the histogram.
+ *
+ * @return TRUE if there is no such backend, FALSE otherwise.
+ **/
+my_bool proxy_backend_latency(int bi, latency_hist_t *hist) {
+    backend_topo_t *topo;
+    my_bool error = TRUE;
+    int phase;
+
+    phase = backend_topo_enter();
+    topo = backend_topo;
+
+    if (topo && bi < topo->num && topo->backends[bi]->hist) {
+        *hist = *topo->backends[bi]->hist;
+        error = FALSE;
+    }
+
+    backend_topo_leave(phase);
+    return error;
 }
 
 /**
@@ -114,6 +466,27 @@ static my_bool backend_proxy_write(MYSQL* __restrict backend, MYSQL* __restrict
         return FALSE;
 }
 
+/**
+ * Record the server status flags from the OK or
+ * EOF packet last read on a backend connection.
+ *
+ * @param conn Connection which received the packet.
+ **/
+static inline void backend_save_status(proxy_backend_conn_t *conn) {
+    uchar *pos = conn->mysql->net.read_pos;
+
+    if (*pos == 0) {
+        /* Skip affected rows and insert ID */
+        pos++;
+        (void) net_field_length_ll(&pos);
+        (void) net_field_length_ll(&pos);
+        conn->server_status = uint2korr(pos);
+    } else if (*pos == 254) {
+        /* Skip the warning count */
+        conn->server_status = uint2korr(pos + 3);
+    }
+}
+
 /**
  * Read a MySQL packet from the backend and forward to the client.
  *
@@ -267,62 +640,86 @@ my_bool proxy_backend_init() {
 /**
  * Allocated data structures for storing backend info.
  *
+ * @param hosts        Backends to use, or NULL to allocate space for them.
  * @param num_backends Number of backends to allocate.
  *
  * @return TRUE on error, FALSE otherwise.
  **/
-static my_bool backends_alloc(int num_backends)  {
+static my_bool backends_alloc(proxy_host_t **hosts, int num_backends)  {
+    backend_topo_t *topo;
     int i, j;
 
-    backend_num = num_backends;
-    
+    /* Nothing reads the topology until we are started,
+     * so the first one is filled in after publishing */
+    topo = (backend_topo_t*) calloc(1, sizeof(backend_topo_t));
+    if (!topo) {
+        backends_free(hosts, num_backends);
+        return TRUE;
+    }
+
+    topo->num = num_backends;
+    topo->backends = hosts;
+    backend_topo = topo;
+
     /* Allocate memory for backends and connections */
     if (num_backends > 0) {
         /* Allocate host information array */
-        if (!backends) {
-            backends = (proxy_host_t**) calloc(backend_num, sizeof(proxy_host_t*));
-            if (!backends)
+        if (!topo->backends) {
+            topo->backends = (proxy_host_t**) calloc(topo->num, sizeof(proxy_host_t*));
+            if (!topo->backends)
                 goto error;
         }
 
-        if (!backend_conns) {
-            /* Allocate read-only connections */
-            backend_conns = (proxy_backend_conn_t***) calloc(backend_num, sizeof(proxy_backend_conn_t**));
-            if (!backend_conns)
+        /* Allocate read-only connections */
+        topo->conns = (proxy_backend_conn_t***) calloc(topo->num, sizeof(proxy_backend_conn_t**));
+        if (!topo->conns)
+            goto error;
+
+        /* Allocate R/W connections for threads */
+        for (i=0; i<topo->num; i++) {
+            topo->conns[i] = (proxy_backend_conn_t**) calloc(options.num_conns, sizeof(proxy_backend_conn_t*));
+            if (!topo->conns[i])
                 goto error;
 
-            /* Allocate R/W connections for threads */
-            for (i=0; i<backend_num; i++) {
-                backend_conns[i] = (proxy_backend_conn_t**) calloc(options.num_conns, sizeof(proxy_backend_conn_t*));
-                if (!backend_conns[i])
+            for (j=0; j<options.num_conns; j++) {
+                topo->conns[i][j] = (proxy_backend_conn_t*) malloc(sizeof(proxy_backend_conn_t));
+                if (!topo->conns[i][j])
                     goto error;
 
-                for (j=0; j<options.num_conns; j++) {
-                    backend_conns[i][j] = (proxy_backend_conn_t*) malloc(sizeof(proxy_backend_conn_t));
-                    if (!backend_conns[i][j])
-                        goto error;
-
-                    backend_conns[i][j]->mysql = NULL;
-                    backend_conns[i][j]->freed = FALSE;
-                }
+                topo->conns[i][j]->mysql = NULL;
+                topo->conns[i][j]->freed = FALSE;
             }
         }
     }
 
     /* Check if we skip threading and pool setup */
-    if (!options.backend_file && !options.coordinator)
+    if (!options.backend_file && !options.coordinator && !options.event_threads)
         return FALSE;
 
     /* Initialize mutex for locking adding */
     proxy_mutex_init(&add_mutex);
 
+    /* Set up the log of replicated writes */
+    if (options.write_quorum) {
+        proxy_mutex_init(&replog_lock);
+        proxy_cond_init(&replog_apply_cv);
+        proxy_cond_init(&replog_done_cv);
+    }
+
+    /* Set up collection of batched writes */
+    if (options.batch_writes > 1) {
+        proxy_mutex_init(&batch_lock);
+        proxy_cond_init(&batch_cv);
+        proxy_cond_init(&batch_done_cv);
+    }
+
     /* Initialize pools for locking backend access */
-    backend_pools = (pool_t**) calloc(backend_num, sizeof(proxy_host_t**));
-    if (!backend_pools)
+    topo->pools = (pool_t**) calloc(topo->num, sizeof(pool_t*));
+    if (!topo->pools)
         goto error;
 
     for (i=0; i<num_backends; i++)
-        backend_pools[i] = proxy_pool_new(options.num_conns);
+        topo->pools[i] = proxy_pool_new(options.num_conns);
 
     /* If we have no mapper, we have no need for
      * backend threads and assume we can send
@@ -334,14 +731,11 @@ static my_bool backends_alloc(int num_backends)  {
     if (!backend_thread_pool)
         backend_thread_pool = proxy_pool_new(options.backend_threads);
 
-    /* Create backend threads */
-    if (!backend_threads) {
-        /* Start backend threads */
-        backend_threads = calloc(backend_num, sizeof(proxy_thread_t));
+    /* Start backend threads */
+    topo->threads = calloc(topo->num, sizeof(proxy_thread_t*));
 
-        for (i=0; i<backend_num; i++)
-            backend_new_threads(i);
-    }
+    for (i=0; i<topo->num; i++)
+        backend_new_threads(topo, i);
 
     return FALSE;
 
@@ -354,9 +748,10 @@ error:
 /**
  * Start new threads for a particular backend.
  *
- * @param bi Index of the backend whose threads should be started.
+ * @param topo Topology containing the backend.
+ * @param bi   Index of the backend whose threads should be started.
  **/
-static void backend_new_threads(int bi) {
+static void backend_new_threads(backend_topo_t *topo, int bi) {
     int i;
     proxy_thread_t *thread;
     pthread_attr_t attr;
@@ -366,10 +761,10 @@ static void backend_new_threads(int bi) {
     pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
 
     /* Allocate space for the new threads */
-    backend_threads[bi] = calloc(options.backend_threads, sizeof(proxy_thread_t));
+    topo->threads[bi] = calloc(options.backend_threads, sizeof(proxy_thread_t));
 
     for (i=0; i<options.backend_threads; i++) {
-        thread = &backend_threads[bi][i];
+        thread = &topo->threads[bi][i];
         thread->id = i;
         proxy_cond_init(&thread->cv);
         proxy_mutex_init(&thread->lock);
@@ -381,6 +776,20 @@ static void backend_new_threads(int bi) {
 
         thread->data.backend.query.query = NULL;
 
+        /* Replicated queries are sent from client threads
+         * with fan-out, so only the connection is needed */
+        if (options.fanout) {
+            thread->exit = 1;
+            continue;
+        }
+
+        /* With a write quorum, the first connection is used
+         * by the log applier started after connecting */
+        if (options.write_quorum) {
+            thread->exit = i > 0;
+            continue;
+        }
+
         /* Start a backend thread */
         proxy_threading_create(&thread->thread, &attr, proxy_backend_new_thread, (void*) thread);
     }
@@ -399,7 +808,10 @@ static void backend_new_threads(int bi) {
 static my_bool backend_connect(proxy_host_t *backend, proxy_backend_conn_t *conn, my_bool bypass) {
     MYSQL *mysql, *ret;
     my_bool reconnect = TRUE;
+    uint timeout = options.connect_timeout, read_timeout = REPLOG_TIMEOUT;
     int port = bypass && (options.bypass_port > 0) ? options.bypass_port : backend->port;
+    /* Backend thread connections carry batched writes */
+    ulong flags = (!bypass && options.batch_writes > 1) ? CLIENT_MULTI_STATEMENTS : 0;
 
     mysql = conn->mysql = NULL;
     mysql = mysql_init(NULL);
@@ -411,16 +823,22 @@ static my_bool backend_connect(proxy_host_t *backend, proxy_backend_conn_t *conn
 
     /* Reconnect if a backend connection is lost */
     mysql_options(mysql, MYSQL_OPT_RECONNECT, &reconnect);
+    mysql_options(mysql, MYSQL_OPT_CONNECT_TIMEOUT, &timeout);
+
+    /* Log appliers use backend thread connections, and
+     * must not wait forever on a backend which hangs */
+    if (!bypass && options.write_quorum)
+        mysql_options(mysql, MYSQL_OPT_READ_TIMEOUT, &read_timeout);
 
     /* Connect to the backend */
     if (options.socket_file) {
         proxy_log(LOG_INFO, "Connecting to %s", options.socket_file);
         ret = mysql_real_connect(mysql, NULL, options.user, options.pass, options.db,
-                0, options.socket_file, 0);
+                0, options.socket_file, flags);
     } else {
         proxy_log(LOG_INFO, "Connecting to %s:%d", backend->host, port);
         ret = mysql_real_connect(mysql, backend->host,
-                options.user, options.pass, options.db, port, NULL, 0);
+                options.user, options.pass, options.db, port, NULL, flags);
     }
 
     if (!ret) {
@@ -435,10 +853,129 @@ static my_bool backend_connect(proxy_host_t *backend, proxy_backend_conn_t *conn
 
     conn->mysql = mysql;
     conn->freed = FALSE;
+    conn->server_status = mysql->server_status;
+    conn->session = 0;
+    conn->nsets = 0;
+    conn->dirty = FALSE;
 
     return FALSE;
 }
 
+/**
+ * Open a backend connection, retrying with
+ * a growing delay if it can't be opened.
+ *
+ * @param job Connection to open.
+ *
+ * @return TRUE on error, FALSE otherwise.
+ **/
+static my_bool backend_connect_retry(backend_connect_job_t *job) {
+    useconds_t delay = CONNECT_BACKOFF;
+    int i;
+
+    for (i=0; ; i++) {
+        if (!backend_connect(job->backend, job->conn, job->bypass))
+            return FALSE;
+
+        if (i >= options.connect_retries)
+            return TRUE;
+
+        proxy_debug("Connection attempt %d to %s:%d failed, retrying",
+            i + 1, job->backend->host, job->backend->port);
+        usleep(delay);
+        delay *= 2;
+    }
+}
+
+/**
+ * Open shared connections until none are left.
+ *
+ * @param work Connections shared by connecting threads.
+ **/
+static void backend_connect_work(backend_connect_work_t *work) {
+    int i;
+
+    while ((i = __sync_fetch_and_add(&work->next, 1)) < work->num) {
+        if (backend_connect_retry(&work->jobs[i]))
+            (void) __sync_fetch_and_add(&work->failed, 1);
+    }
+}
+
+/**
+ * Thread which helps open a set of connections.
+ *
+ * @param ptr Connections shared by connecting threads.
+ *
+ * @return NULL.
+ **/
+static void* backend_connect_thread(void *ptr) {
+    proxy_threading_name("Connect");
+    proxy_threading_mask();
+
+    backend_connect_work((backend_connect_work_t*) ptr);
+
+    mysql_thread_end();
+    return NULL;
+}
+
+/**
+ * Open a set of backend connections in parallel, using at most
+ * ::options.connect_threads threads including the caller.
+ *
+ * @param jobs Connections to open.
+ * @param num  Number of connections to open.
+ * @param what Description of the connections for logging.
+ *
+ * @return TRUE if any connection could not be opened, FALSE otherwise.
+ **/
+static my_bool backend_connect_all(backend_connect_job_t *jobs, int num, const char *what) {
+    backend_connect_work_t work;
+    struct timeval start, end;
+    pthread_attr_t attr;
+    pthread_t *threads;
+    int nthreads = min(options.connect_threads, num), started = 0, i;
+    double time;
+
+    if (num <= 0)
+        return FALSE;
+
+    work.jobs = jobs;
+    work.num = num;
+    work.next = 0;
+    work.failed = 0;
+
+    gettimeofday(&start, NULL);
+
+    /* The calling thread takes its share, so start one less */
+    threads = (pthread_t*) calloc(nthreads, sizeof(pthread_t));
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+
+    for (i=1; i<nthreads; i++) {
+        if (proxy_threading_create(&threads[started], &attr, backend_connect_thread, (void*) &work)) {
+            proxy_log(LOG_ERROR, "Couldn't start connection thread: %s", errstr);
+            break;
+        }
+
+        started++;
+    }
+
+    pthread_attr_destroy(&attr);
+
+    backend_connect_work(&work);
+
+    for (i=0; i<started; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+
+    gettimeofday(&end, NULL);
+    time = end.tv_sec - start.tv_sec + (end.tv_usec - start.tv_usec) / 1000000.0f;
+    proxy_log(LOG_INFO, "Opened %d/%d connections to %s in %.3fs with %d threads",
+        num - work.failed, num, what, time, started + 1);
+
+    return work.failed > 0;
+}
+
 /**
  *  Read a list of backends from file.
  *
@@ -451,9 +988,10 @@ static my_bool backend_connect(proxy_host_t *backend, proxy_backend_conn_t *conn
  **/
 static proxy_host_t** backend_read_file(char *filename, int *num) {
     FILE *f;
-    char *buf, *buf2, *pch;
+    char *buf, *buf2, *pch, *line, *end, *save_line, *save_tok;
     ulong pos;
     uint i, c=0;
+    int weight;
     proxy_host_t **new_backends;
 
     *num = -1;
@@ -512,23 +1050,45 @@ static proxy_host_t** backend_read_file(char *filename, int *num) {
         return NULL;
     }
 
-    /* Allocate and read backends */
+    /* Allocate and read backends, one per line */
     new_backends = (proxy_host_t**) calloc(*num, sizeof(proxy_host_t*));
     i = 0;
-    pch = strtok(buf, " \r\n\t");
-    while (pch != NULL && (int)i<*num) {
-        new_backends[i] = (proxy_host_t*) malloc(sizeof(proxy_host_t));
+    line = strtok_r(buf, "\r\n", &save_line);
+    while (line != NULL && (int)i<*num) {
+        /* Skip lines with only whitespace */
+        pch = strtok_r(line, " \t", &save_tok);
+        if (!pch) {
+            line = strtok_r(NULL, "\r\n", &save_line);
+            continue;
+        }
+
+        /* An optional weight follows the host */
+        weight = BACKEND_WEIGHT;
+        if ((buf2 = strtok_r(NULL, " \t", &save_tok))) {
+            weight = strtol(buf2, &end, 10);
+            if (*end != '\0' || weight < 0) {
+                proxy_log(LOG_ERROR, "Invalid weight %s for backend %s", buf2, pch);
+                backends_free(new_backends, i);
+                free(buf);
+                *num = -1;
+                return NULL;
+            }
+        }
 
         /* If we have a colon, then a port number must have been specified */
-        if ((buf2 = strchr(pch, ':'))) {
-            new_backends[i]->host = strndup(pch, buf2-pch);
-            new_backends[i]->port = atoi(buf2 + 1);
-        } else {
-            new_backends[i]->host = strdup(pch);
-            new_backends[i]->port = 3306;
+        if ((buf2 = strchr(pch, ':')))
+            new_backends[i] = backend_host_new(pch, buf2-pch, atoi(buf2 + 1), weight);
+        else
+            new_backends[i] = backend_host_new(pch, strlen(pch), 3306, weight);
+
+        if (!new_backends[i]) {
+            backends_free(new_backends, i);
+            free(buf);
+            *num = -1;
+            return NULL;
         }
 
-        pch = strtok(NULL, " \r\n\t");
+        line = strtok_r(NULL, "\r\n", &save_line);
         i++;
     }
 
@@ -542,30 +1102,49 @@ static proxy_host_t** backend_read_file(char *filename, int *num) {
  * @return TRUE on error, FALSE otherwise.
  **/
 my_bool proxy_backend_connect() {
-    int i;
+    backend_connect_job_t *jobs;
+    backend_topo_t *topo;
+    int i, num = 0;
+    my_bool error;
+
+    if (backends_alloc(NULL, 1))
+        return TRUE;
 
-    if (backends_alloc(1))
+    topo = backend_topo;
+    topo->backends[0] = backend_host_new(options.backend.host,
+        strlen(options.backend.host), options.backend.port, BACKEND_WEIGHT);
+    if (!topo->backends[0])
         return TRUE;
 
-    backends[0] = (proxy_host_t*) malloc(sizeof(proxy_host_t));
-    backends[0]->host = strdup(options.backend.host);
-    backends[0]->port = options.backend.port;
+    jobs = (backend_connect_job_t*) calloc(options.num_conns + options.backend_threads,
+        sizeof(backend_connect_job_t));
 
     /* Connect to all backends */
-    for (i=0; i<options.num_conns; i++) {
-        if (backend_connect(backends[0], backend_conns[0][i], TRUE))
-            return TRUE;
+    for (i=0; i<options.num_conns; i++, num++) {
+        jobs[num].backend = topo->backends[0];
+        jobs[num].conn = topo->conns[0][i];
+        jobs[num].bypass = TRUE;
     }
 
     /* Start connections in backend threads if we are the
      * coordinator, because more backends will be coming */
     if (options.coordinator) {
-        for (i=0; i<options.backend_threads; i++) {
-            if (backend_connect(backends[0], backend_threads[0][i].data.backend.conn, FALSE))
-                return TRUE;
+        for (i=0; i<options.backend_threads; i++, num++) {
+            jobs[num].backend = topo->backends[0];
+            jobs[num].conn = topo->threads[0][i].data.backend.conn;
+            jobs[num].bypass = FALSE;
         }
     }
 
+    error = backend_connect_all(jobs, num, "backend");
+    free(jobs);
+
+    if (error)
+        return TRUE;
+
+    if (options.coordinator && options.write_quorum)
+        backend_replog_start(0);
+
     return FALSE;
 }
 
@@ -575,105 +1154,131 @@ my_bool proxy_backend_connect() {
  * @return TRUE on error, FALSE otherwise.
  **/
 my_bool proxy_backends_connect() {
-    int num_backends=-1, i, j;
+    backend_connect_job_t *jobs;
+    proxy_host_t **hosts;
+    backend_topo_t *topo;
+    int num_backends=-1, i, j, num = 0;
+    my_bool error;
 
     /* Read the backends from the file */
-    backends = backend_read_file(options.backend_file, &num_backends);
-    if (!backends)
+    hosts = backend_read_file(options.backend_file, &num_backends);
+    if (!hosts)
         return TRUE;
     else
         proxy_debug("Successfully read backends from file");
 
     /* Allocate backend data structures */
-    if (backends_alloc(num_backends))
+    if (backends_alloc(hosts, num_backends))
         return TRUE;
+    topo = backend_topo;
+
+    jobs = (backend_connect_job_t*) calloc(num_backends * (options.num_conns + options.backend_threads),
+        sizeof(backend_connect_job_t));
 
     /* Connect to all backends */
     for (i=0; i<num_backends; i++) {
-        for (j=0; j<options.num_conns; j++) {
-            if (backend_connect(backends[i], backend_conns[i][j], TRUE))
-                return TRUE;
+        for (j=0; j<options.num_conns; j++, num++) {
+            jobs[num].backend = topo->backends[i];
+            jobs[num].conn = topo->conns[i][j];
+            jobs[num].bypass = TRUE;
         }
 
         /* Skip backend thread connections */
         if (!options.mapper)
             continue;
 
-        for (j=0; j<options.backend_threads; j++) {
-            if (backend_connect(backends[i], backend_threads[i][j].data.backend.conn, FALSE))
-                return TRUE;
+        for (j=0; j<options.backend_threads; j++, num++) {
+            jobs[num].backend = topo->backends[i];
+            jobs[num].conn = topo->threads[i][j].data.backend.conn;
+            jobs[num].bypass = FALSE;
         }
     }
 
-     return FALSE;
-}
-
-/**
- * Update data structures with new backend data after update.
- *
- * @param new_num      New number of backends.
- * @param new_backends New backends to use.
- **/
-static inline void backends_switch(int new_num, proxy_host_t **new_backends) {
-    int oldnum;
-    proxy_host_t **old_backends;
-
-    proxy_debug("Switching to new set of backends");
+    error = backend_connect_all(jobs, num, "backends");
+    free(jobs);
 
-    /* Switch to the new set of backends */
-    old_backends = backends;
-    backends = new_backends;
-
-    oldnum = backend_num;
-    backends_free(old_backends, oldnum);
-    backend_num = new_num;
-}
+    if (error)
+        return TRUE;
 
-/**
- * Connect to all new backends after an update.
- *
- * @param conns List of connections to open.
- * @param pools List of pools to initialize.
- **/
-static inline void backends_new_connect(proxy_backend_conn_t ***conns, pool_t **pools) {
-    int bi;
+    if (options.mapper && options.write_quorum) {
+        for (i=0; i<num_backends; i++)
+            backend_replog_start(i);
+    }
 
-    for (bi=0; bi<backend_num; bi++)
-        backend_new_connect(conns, pools, bi);
+    return FALSE;
 }
 
 /**
  * Connect to a new backend after an update.
  *
- * @param conns List of connections to open.
- * @param pools List of pools to initialize.
- * @param bi    Index of backend to connect to.
+ * @param topo Topology containing the backend, not yet published.
+ * @param bi   Index of backend to connect to.
+ *
+ * @return TRUE on error, FALSE otherwise.
  **/
-static void backend_new_connect(proxy_backend_conn_t ***conns, pool_t **pools, int bi) {
-    int ci, i;
-    my_bool error;
+static my_bool backend_new_connect(backend_topo_t *topo, int bi) {
+    proxy_backend_conn_t ***conns = topo->conns;
+    pool_t **pools = topo->pools;
+    backend_connect_job_t *jobs;
+    my_bool error = FALSE;
+    char what[32];
+    int ci, num = 0;
+
+    jobs = (backend_connect_job_t*) calloc(options.num_conns + options.backend_threads,
+        sizeof(backend_connect_job_t));
+    if (!jobs) {
+        proxy_log(LOG_ERROR, "Could not allocate memory to connect to new backend %d", bi);
+        return TRUE;
+    }
 
     if (!conns[bi]) {
         proxy_log(LOG_INFO, "Connecting to new backend %d\n", bi);
         conns[bi] = (proxy_backend_conn_t**) calloc(options.num_conns, sizeof(proxy_backend_conn_t*));
+        if (!conns[bi]) {
+            proxy_log(LOG_ERROR, "Could not allocate connections for new backend %d", bi);
+            free(jobs);
+            return TRUE;
+        }
 
-        for (ci=0; ci<options.num_conns; ci++) {
-            conns[bi][ci] = (proxy_backend_conn_t*) malloc(sizeof(proxy_backend_conn_t));
+        for (ci=0; ci<options.num_conns; ci++, num++) {
+            conns[bi][ci] = (proxy_backend_conn_t*) calloc(1, sizeof(proxy_backend_conn_t));
+            if (!conns[bi][ci]) {
+                proxy_log(LOG_ERROR, "Could not allocate connections for new backend %d", bi);
+                free(jobs);
+                return TRUE;
+            }
+
+            jobs[num].backend = topo->backends[bi];
+            jobs[num].conn = conns[bi][ci];
+            jobs[num].bypass = TRUE;
+        }
+    }
 
-            /* Try a few times to connect */
-            for (i=0; i<10; i++) {
-                proxy_debug("Connection attempt %d on backend %d", i, bi);
-                if (!(error = backend_connect(backends[bi], conns[bi][ci], TRUE)))
-                    break;
+    /* Start new backend threads */
+    if (!topo->threads[bi]) {
+        backend_new_threads(topo, bi);
+        proxy_debug("Threads started for backend %d", bi);
 
-                usleep(SYNC_SLEEP);
-            }
+        /* Open the MySQL connections for each backend thread */
+        for (ci=0; ci<options.backend_threads; ci++) {
+            if (topo->threads[bi][ci].data.backend.conn->mysql)
+                continue;
 
-            if (error)
-                proxy_log(LOG_ERROR, "Failed to connect to new backend %d", bi);
+            jobs[num].backend = topo->backends[bi];
+            jobs[num].conn = topo->threads[bi][ci].data.backend.conn;
+            jobs[num].bypass = FALSE;
+            num++;
         }
     }
 
+    /* Open all connections together */
+    snprintf(what, sizeof(what), "new backend %d", bi);
+    if (backend_connect_all(jobs, num, what)) {
+        proxy_log(LOG_ERROR, "Failed to connect to new backend %d", bi);
+        error = TRUE;
+    }
+    free(jobs);
+
     /* Allocate a new pool if necessary */
     if (!pools[bi]) {
         pools[bi] = proxy_pool_new(options.num_conns);
@@ -682,66 +1287,107 @@ static void backend_new_connect(proxy_backend_conn_t ***conns, pool_t **pools, i
         proxy_pool_unlock(pools[bi]);
     }
 
-    /* Start new backend threads */
-    if (!backend_threads[bi]) {
-        backend_new_threads(bi);
-        proxy_debug("Threads started for backend %d", bi);
+    if (!error)
+        proxy_log(LOG_INFO, "Connected to new backend %d", bi);
+    return error;
+}
 
-        /* Open the MySQL connections for each backend thread */
-        proxy_debug("Opening connections for backend %d", bi);
+/**
+ * Close the connections of a backend which was removed and stop
+ * its threads. No replicated writes can be in progress.
+ *
+ * @param conns   Pooled connections of the backend.
+ * @param pool    Pool for locking the connections.
+ * @param threads Backend threads, or NULL if there are none.
+ **/
+static void backend_conns_free(proxy_backend_conn_t **conns, pool_t *pool, proxy_thread_t *threads) {
+    int i;
 
-        for (ci=0; ci<options.backend_threads; ci++) {
-            if (!backend_threads[bi][ci].data.backend.conn->mysql)
-                backend_connect(backends[bi], backend_threads[bi][ci].data.backend.conn, FALSE);
+    /* Sessions still holding connections notice the
+     * backend is gone and take new ones */
+    for (i=0; i<options.num_conns; i++)
+        conn_free(conns[i]);
+
+    free(conns);
+    proxy_pool_destroy(pool);
+
+    if (!threads)
+        return;
+
+    /* Stop backend threads, which are idle without writes */
+    for (i=0; i<options.backend_threads; i++) {
+        proxy_mutex_lock(&threads[i].lock);
+        conn_free(threads[i].data.backend.conn);
+        threads[i].data.backend.conn = NULL;
+
+        if (!threads[i].exit) {
+            threads[i].exit = 1;
+            proxy_cond_signal(&threads[i].cv);
         }
+        proxy_mutex_unlock(&threads[i].lock);
     }
 
-    proxy_log(LOG_INFO, "Connected to new backend %d", bi);
+    /* Backend threads are not started with fan-out */
+    if (options.fanout)
+        free(threads);
+    else
+        proxy_threading_cleanup(threads, options.backend_threads, NULL);
 }
 
-#if 0
-/*
- * This is currently being commented out during dead code
- * removal for old signal-based cloning. However, we leave
- * this here since it may be useful in the future when
- * merging clones.
- */
-
 /**
- * Free a backend and asociated connections.
+ * Record the backend index of a clone.
  *
- * @param bi Index of the backend to free.
+ * @param topo     Topology to update, which must not be published.
+ * @param clone_id ID of the clone.
+ * @param bi       Index of the backend for the clone.
+ *
+ * @return TRUE on error, FALSE otherwise.
  **/
-static void backend_conns_free(int bi) {
-    int i;
+static my_bool backend_clone_map(backend_topo_t *topo, int clone_id, int bi) {
+    int i, size;
+    int *ptr;
 
-    /* Free connections */
-    for (i=0; i<options.num_conns; i++) {
-        if (proxy_pool_is_free(backend_pools[bi], i))
-            conn_free(backend_conns[bi][i]);
-        else
-            backend_conns[bi][i]->freed = TRUE;
-    }
+    if (clone_id <= 0)
+        return TRUE;
 
-    free(backend_conns[bi]);
-    backend_conns[bi] = NULL;
-    backend_free(backends[bi]);
+    /* Grow the map to hold the clone */
+    if (clone_id >= topo->clones_size) {
+        size = max(clone_id + 1, topo->clones_size * 2);
+        ptr = (int*) realloc(topo->clones, size * sizeof(int));
+        if (!ptr) {
+            proxy_log(LOG_ERROR, "Could not allocate memory for clone %d", clone_id);
+            return TRUE;
+        }
 
-    /* Destroy the pool */
-    proxy_pool_destroy(backend_pools[bi]);
-    backend_pools[bi] = NULL;
+        for (i=topo->clones_size; i<size; i++)
+            ptr[i] = -1;
 
-    /* Stop backend threads */
-    for (i=0; i<options.backend_threads; i++)
-        backend_threads[bi][i].data.backend.conn->freed = TRUE;
+        topo->clones = ptr;
+        topo->clones_size = size;
+    }
 
-    proxy_threading_cancel(backend_threads[bi], options.backend_threads, backend_thread_pool[bi]);
-    proxy_threading_cleanup(backend_threads[bi], options.backend_threads, backend_thread_pool[bi]);
+    topo->clones[clone_id] = bi;
+    return FALSE;
 }
-#endif
 
 /**
- * Complete a transaction on clone backends.
+ * Find the backend index of a clone.
+ *
+ * @param topo     Topology to search.
+ * @param clone_id ID of the clone.
+ *
+ * @return Index of the backend, or -1 if the clone has no backend.
+ **/
+static inline int backend_clone_index(backend_topo_t *topo, int clone_id) {
+    if (clone_id <= 0 || clone_id >= topo->clones_size)
+        return -1;
+
+    return topo->clones[clone_id];
+}
+
+/**
+ * Complete a transaction on clone backends. The decision is
+ * sent to every clone before waiting for any acknowledgement.
  *
  * @param clone_ids      Array of clone IDs which require transaction completion.
  * @param nclones        Number of clone IDs in the array.
@@ -751,146 +1397,582 @@ static void backend_conns_free(int bi) {
  * @return TRUE on error, FALSE otherwise.
  **/
 my_bool proxy_backend_clone_complete(int *clone_ids, int nclones, ulong clone_trans_id, my_bool commit) {
-    int i, bi, ci;
-    proxy_host_t *host;
+    proxy_backend_conn_t *conns[nclones], **lists[nclones];
+    struct pollfd polls[nclones];
+    pool_t *pools[nclones];
+    int bis[nclones], cis[nclones];
+    int i, pending = 0, phase, ret;
+    backend_topo_t *topo;
+    backend_result_t result;
     char query[BUFSIZ];
-    MYSQL *mysql;
-    my_bool found = FALSE, error = FALSE;
+    my_bool error = FALSE;
     ulong query_len;
+    MYSQL *mysql;
+
+    query_len = snprintf(query, BUFSIZ, "PROXY %s %lu",
+        commit ? "COMMIT" : "ROLLBACK", clone_trans_id);
+
+    /* Find the clones without waiting on their pools, which would
+     * hold up topology updates. Pools and connections belong to the
+     * backend, and clones can't be removed meanwhile since local
+     * writers of the transaction stay committing until it completes */
+    phase = backend_topo_enter();
+    topo = backend_topo;
 
     for (i=0; i<nclones; i++) {
-        host = proxy_clone_search(clone_ids[i]);
-        found = FALSE;
-
-        /* Find the clone in the list of backends
-         * and tell it to commit or rollback */
-        for (bi=0; bi<backend_num; bi++) {
-            if (strcmp(host->host, backends[bi]->host) == 0
-                && host->port == backends[bi]->port) {
-                ci = proxy_pool_get(backend_pools[bi]);
-                mysql = backend_conns[bi][ci]->mysql;
-                query_len = snprintf(query, BUFSIZ, "PROXY %s %lu",
-                    commit ? "COMMIT" : "ROLLBACK",
-                    clone_trans_id);
-
-                proxy_debug("Found matching backend %d, sending query %s on connection %d",
-                    bi, query, ci);
-                while (!mysql) { usleep(SYNC_SLEEP); }
-                mysql_real_query(mysql, query, query_len);
-
-                if (mysql_errno(mysql))
-                    proxy_log(LOG_ERROR, "Error completing transaction on clone %d: %s",
-                            clone_ids[i], mysql_error(mysql));
-                else
-                    proxy_debug("Completed transaction %lu on clone %d",
-                        clone_trans_id, clone_ids[i]);
+        if ((bis[i] = backend_clone_index(topo, clone_ids[i])) >= 0) {
+            pools[i] = topo->pools[bis[i]];
+            lists[i] = topo->conns[bis[i]];
+        }
+    }
 
-                proxy_pool_return(backend_pools[bi], ci);
+    backend_topo_leave(phase);
 
-                found = TRUE;
-                break;
+    /* Write the decision to every clone before reading anything */
+    for (i=0; i<nclones; i++) {
+        polls[i].fd = -1;
+        polls[i].events = POLLIN;
+        polls[i].revents = 0;
+
+        if (bis[i] < 0) {
+            proxy_log(LOG_ERROR, "Couldn't find corresponding backend for clone %d", clone_ids[i]);
+            error = TRUE;
+            continue;
+        }
+
+        cis[i] = proxy_pool_get(pools[i]);
+        conns[i] = lists[i][cis[i]];
+        mysql = conns[i]->mysql;
+
+        proxy_debug("Sending query %s to clone %d on backend %d, connection %d",
+            query, clone_ids[i], bis[i], cis[i]);
+
+        if (unlikely(!mysql) || simple_command(mysql, COM_QUERY, (uchar*) query, query_len, 1)) {
+            proxy_log(LOG_ERROR, "Error sending completion of transaction %lu to clone %d",
+                clone_trans_id, clone_ids[i]);
+            proxy_pool_return(pools[i], cis[i]);
+            error = TRUE;
+            continue;
+        }
+
+        polls[i].fd = mysql->net.vio->sd;
+        pending++;
+    }
+
+    /* Collect acknowledgements as clones reply */
+    while (pending > 0) {
+        if ((ret = poll(polls, nclones, CLONE_ACK_TIMEOUT)) <= 0) {
+            if (ret < 0 && errno == EINTR)
+                continue;
+
+            if (ret < 0)
+                proxy_log(LOG_ERROR, "Error waiting for clone acknowledgements:%s", errstr);
+            else
+                proxy_log(LOG_ERROR, "Timed out waiting for clone acknowledgements");
+            error = TRUE;
+            break;
+        }
+
+        for (i=0; i<nclones; i++) {
+            if (polls[i].fd < 0 || !polls[i].revents)
+                continue;
+
+            memset(&result, 0, sizeof(result));
+            if (backend_fanout_read(conns[i], NULL, &result, NULL)) {
+                proxy_debug("Completed transaction %lu on clone %d",
+                    clone_trans_id, clone_ids[i]);
+            } else {
+                proxy_log(LOG_ERROR, "Error completing transaction on clone %d: %s",
+                    clone_ids[i], result.errmsg);
+                error = TRUE;
             }
+
+            proxy_pool_return(pools[i], cis[i]);
+            polls[i].fd = -1;
+            pending--;
+        }
+    }
+
+    /* Connections still waiting for a reply would hand it to the next
+     * query, so drop them and let them reconnect before giving them back */
+    for (i=0; i<nclones; i++) {
+        if (polls[i].fd >= 0) {
+            proxy_log(LOG_ERROR, "Resetting connection %d to clone %d with an unread reply",
+                cis[i], clone_ids[i]);
+
+            end_server(conns[i]->mysql);
+            conns[i]->session = 0;
+            conns[i]->nsets = 0;
+            conns[i]->dirty = FALSE;
+
+            proxy_pool_return(pools[i], cis[i]);
+        }
+    }
+
+    return error;
+}
+
+/**
+ * Bring a clone up to date by replaying writes logged since its
+ * snapshot. Writes are stopped once the end of the log is reached
+ * so none are missed, and on success stay stopped for the caller
+ * to add the clone and then resume them.
+ *
+ * @param host Backend of the clone.
+ *
+ * @return TRUE on error, FALSE otherwise.
+ **/
+static my_bool backend_epoch_replay(proxy_host_t *host) {
+    proxy_epoch_entry_t *entry = NULL, *next;
+    proxy_backend_conn_t conn;
+    backend_connect_job_t job = { host, &conn, FALSE };
+    my_bool stopped = FALSE, error = FALSE;
+    MYSQL_RES *res;
+    ulong count = 0, skipped = 0;
+    MYSQL *mysql;
+    int expired;
+
+    /* A clone may join before the coordinator hears back
+     * from the master and starts logging writes */
+    proxy_wait_timed(WAIT_CLONE_QUERY, proxy_epoch_current(), EPOCH_OPEN_TIMEOUT, expired);
+    if (expired) {
+        proxy_log(LOG_ERROR, "No writes were logged for clone %s:%d to catch up on", host->host, host->port);
+        return TRUE;
+    }
+
+    if (backend_connect_retry(&job)) {
+        proxy_log(LOG_ERROR, "Error connecting to clone %s:%d to replay writes", host->host, host->port);
+        return TRUE;
+    }
+    mysql = conn.mysql;
+
+    while (1) {
+        /* Stop writes when we catch up so none can
+         * slip in before the clone is added */
+        if (!(next = proxy_epoch_next(entry))) {
+            if (stopped)
+                break;
+
+            proxy_epoch_stop();
+            stopped = TRUE;
+            continue;
+        }
+
+        /* Writes are logged before they are sent, so
+         * wait to find out how they went on the backends */
+        entry = next;
+        proxy_wait(WAIT_CLONE_QUERY, entry->state != EPOCH_PENDING);
+
+        if (entry->state == EPOCH_FAILED) {
+            skipped++;
+            continue;
         }
 
-        /* We could just open a new connection to the clone here, but
-         * if it doesn't already exist, something has gone wrong. */
-        if (!found) {
-            proxy_log(LOG_ERROR, "Couldn't find corresponding backend for clone %d with address %s:%d",
-                clone_ids[i], host->host, host->port);
+        if (mysql_real_query(mysql, entry->query, entry->length)
+                || (options.two_pc && mysql_real_query(mysql, "COMMIT", 6))) {
+            /* Backends already disagree on writes which failed on some */
+            if (entry->state == EPOCH_PARTIAL) {
+                proxy_log(LOG_ERROR, "Write which failed on some backends also failed on clone %s:%d: %s",
+                    host->host, host->port, mysql_error(mysql));
+                skipped++;
+                continue;
+            }
+
+            proxy_log(LOG_ERROR, "Error replaying write on clone %s:%d: %s",
+                host->host, host->port, mysql_error(mysql));
             error = TRUE;
+            break;
         }
+
+        /* Discard anything returned by replicated reads */
+        if ((res = mysql_store_result(mysql)))
+            mysql_free_result(res);
+
+        count++;
     }
 
+    proxy_log(LOG_INFO, "Replayed %lu writes on clone %s:%d, skipped %lu which failed",
+        count, host->host, host->port, skipped);
+    mysql_close(mysql);
+
+    if (error && stopped)
+        proxy_epoch_resume();
+
     return error;
 }
 
+/**
+ * Run the statements in ::options.warmup_file on a new clone so
+ * its caches are filled before it serves clients. Failures are
+ * logged but don't stop the clone from being added.
+ *
+ * @param host Host name of the clone.
+ * @param port Port of the clone.
+ **/
+static void backend_warmup(const char *host, int port) {
+    struct timeval start, end;
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t len;
+    MYSQL_RES *res;
+    MYSQL *mysql;
+    int count = 0;
+    FILE *f;
+
+    if (!options.warmup_file)
+        return;
+
+    f = fopen(options.warmup_file, "r");
+    if (!f) {
+        proxy_log(LOG_ERROR, "Couldn't open warm-up file %s:%s", options.warmup_file, errstr);
+        return;
+    }
+
+    mysql = mysql_init(NULL);
+    if (!mysql_real_connect(mysql, host, options.user, options.pass, options.db, port, NULL, 0)) {
+        proxy_log(LOG_ERROR, "Error connecting to clone %s:%d to warm up: %s",
+            host, port, mysql_error(mysql));
+        mysql_close(mysql);
+        fclose(f);
+        return;
+    }
+
+    gettimeofday(&start, NULL);
+
+    while ((len = getline(&line, &size, f)) >= 0) {
+        /* Strip the line ending and skip blank lines and comments */
+        while (len > 0 && (line[len-1] == '\n' || line[len-1] == '\r'))
+            line[--len] = '\0';
+        if (!len || line[0] == '#' || !strncmp(line, "--", 2))
+            continue;
+
+        if (mysql_real_query(mysql, line, len)) {
+            proxy_log(LOG_ERROR, "Error warming up clone %s:%d: %s",
+                host, port, mysql_error(mysql));
+            continue;
+        }
+
+        /* Read everything returned to pull it into the cache */
+        if ((res = mysql_store_result(mysql)))
+            mysql_free_result(res);
+
+        count++;
+    }
+
+    gettimeofday(&end, NULL);
+    proxy_log(LOG_INFO, "Warmed up clone %s:%d with %d statements in %.3fs", host, port, count,
+        end.tv_sec - start.tv_sec + (end.tv_usec - start.tv_usec) / 1000000.0f);
+
+    free(line);
+    mysql_close(mysql);
+    fclose(f);
+}
+
 /**
  * Add and connect to a new backend host.
  *
- * @param host Backend host to connect to.
- * @param port Backend port to connect to.
+ * @param clone_id ID of the clone running on the host.
+ * @param host     Backend host to connect to.
+ * @param port     Backend port to connect to.
  * @return TRUE on success, FALSE on error.
  **/
-my_bool proxy_backend_add(char *host, int port) {
+my_bool proxy_backend_add(int clone_id, char *host, int port) {
+    struct timeval start, end;
+    backend_topo_t *old, *topo;
     my_bool error;
+    int bi;
+
+    gettimeofday(&start, NULL);
+
+    /* Warm up before taking the lock so clones can warm up together */
+    backend_warmup(host, port);
 
     pthread_mutex_lock(&add_mutex);
 
-    proxy_log(LOG_INFO, "Adding new clone %s:%d", host, port);
+    proxy_log(LOG_INFO, "Adding new clone %d at %s:%d", clone_id, host, port);
 
-    /* Allocate space for the new backend */
-    if (backend_resize(backend_num+1, TRUE) ||
-        backend_resize(backend_num+1, FALSE)) {
+    /* Copy the topology with space for the new backend,
+     * which only changes while holding the lock */
+    old = backend_topo;
+    bi = old->num;
+    if (!(topo = backend_topo_copy(old, bi+1)) || backend_clone_map(topo, clone_id, bi)) {
+        backend_topo_free(topo);
         error = TRUE;
         goto out;
     }
 
     /* Add then new host information */
-    backends[backend_num] = (proxy_host_t*) malloc(sizeof(proxy_host_t*));
-    backends[backend_num]->host = strdup(host);
-    backends[backend_num]->port = port;
+    if (!(topo->backends[bi] = backend_host_new(host, strlen(host), port, BACKEND_WEIGHT))) {
+        backend_topo_free(topo);
+        error = TRUE;
+        goto out;
+    }
+
+    /* Connect while writes continue, then catch up on writes made
+     * since the snapshot, which leaves writes stopped until it is added */
+    if (backend_new_connect(topo, bi) || backend_epoch_replay(topo->backends[bi])) {
+        if (topo->conns[bi])
+            backend_conns_free(topo->conns[bi], topo->pools[bi], topo->threads[bi]);
+        backend_free(topo->backends[bi]);
+        backend_topo_free(topo);
+        error = TRUE;
+        goto out;
+    }
+
+    /* Start sending queries to the new backend */
+    backend_ramp_start(topo, topo->backends[bi]);
+    backend_topo_publish(topo);
+
+    if (options.write_quorum)
+        backend_replog_start(bi);
 
-    /* Connect to the new backend */
-    backend_new_connect(backend_conns, backend_pools, backend_num);
-    backend_num++;
+    gettimeofday(&end, NULL);
+    proxy_log(LOG_INFO, "Clone %d joined in %.3fs", clone_id,
+        end.tv_sec - start.tv_sec + (end.tv_usec - start.tv_usec) / 1000000.0f);
 
     proxy_debug("Connected to new backend, notifying coordinator");
     proxy_clone_notify();
     error = FALSE;
 
+    proxy_epoch_resume();
+
+    /* Queries may still be using the old topology */
+    backend_topo_retire(old);
 out:
     proxy_mutex_unlock(&add_mutex);
     return error;
 }
 
 /**
- * Resize the backend pool and connection data structures on update.
+ * Stop logging writes for clones once no more are expected.
+ **/
+void proxy_backend_epoch_close() {
+    /* Wait for any clone still replaying the log */
+    pthread_mutex_lock(&add_mutex);
+    proxy_epoch_close();
+    proxy_mutex_unlock(&add_mutex);
+}
+
+/**
+ * Remove the backend of a clone. Replicated writes pause while the
+ * topology is replaced, and the backend is closed once no query can
+ * still be using it. The last backend moves into its place, and
+ * sessions follow their backend on their next query. Sessions on the
+ * removed backend move to another one, but are told their transaction
+ * was rolled back if they were in one.
  *
- * @param num    Number of backends to allocate in new structure.
- * @param before TRUE if allocation is before reshuffling, FALSE otherwise.
+ * @param clone_id ID of the clone to remove.
  *
  * @return TRUE on error, FALSE otherwise.
  **/
-static my_bool backend_resize(int num, my_bool before) {
-    int i;
-    void *ptr;
+my_bool proxy_backend_remove(int clone_id) {
+    struct timeval start, end;
+    backend_topo_t *old, *topo;
+    proxy_backend_conn_t **conns;
+    proxy_thread_t *threads;
+    proxy_host_t *host;
+    pool_t *pool;
+    int bi, last, i;
+    sig_atomic_t stale;
+
+    /* Log appliers follow each backend through the log */
+    if (options.write_quorum) {
+        proxy_log(LOG_ERROR, "Backends can't be removed with a write quorum");
+        return TRUE;
+    }
 
-    proxy_debug("Resizing backends from %d to %d", backend_num, num);
+    pthread_mutex_lock(&add_mutex);
+    old = backend_topo;
 
-    /* Reallocate memory */
-    if ((before && num > backend_num) || (!before && (uint) num < (uint) backend_num)) {
-        /* XXX: A little ugly below, but it ensures the proxy
-         *      can continue without new backends if realloc fails.
-         *      We should probably allocate more memory in advance. */
+    bi = backend_clone_index(old, clone_id);
+    if (bi < 0 || old->num <= 1 || proxy_epoch_current()) {
+        proxy_log(LOG_ERROR, "Can't remove clone %d: %s", clone_id,
+            bi < 0 ? "no such clone" : old->num <= 1 ? "it is the only backend" : "clones are joining");
+        proxy_mutex_unlock(&add_mutex);
+        return TRUE;
+    }
 
-#define SAFE_REALLOC(mem, size) \
-        ptr = realloc(mem, num * size); \
-        if (!ptr) { \
-            return TRUE; \
-            proxy_log(LOG_ERROR, "Could not allocate new memory for backends"); \
-        } else { \
-            mem = ptr; \
-        }
+    last = old->num - 1;
+    if (!(topo = backend_topo_copy(old, last))) {
+        proxy_mutex_unlock(&add_mutex);
+        return TRUE;
+    }
+
+    host = old->backends[bi];
+    conns = old->conns[bi];
+    pool = old->pools ? old->pools[bi] : NULL;
+    threads = old->threads ? old->threads[bi] : NULL;
+
+    proxy_log(LOG_INFO, "Removing clone %d at %s:%d", clone_id, host->host, host->port);
+    gettimeofday(&start, NULL);
+
+    /* Move the last backend into the free slot */
+    if (bi != last) {
+        topo->backends[bi] = old->backends[last];
+        topo->conns[bi] = old->conns[last];
+        topo->pools[bi] = old->pools ? old->pools[last] : NULL;
+        topo->threads[bi] = old->threads ? old->threads[last] : NULL;
+
+        for (i=0; i<topo->clones_size; i++)
+            if (topo->clones[i] == last)
+                topo->clones[i] = bi;
+    }
+
+    topo->clones[clone_id] = -1;
 
-        SAFE_REALLOC(backend_pools, sizeof(pool_t*));
-        SAFE_REALLOC(backend_conns, sizeof(proxy_backend_conn_t**));
-        SAFE_REALLOC(backend_threads, sizeof(proxy_thread_t*));
+    /* Send no more clients or reads to the backend */
+    stale = host->stale;
+    host->stale = TRUE;
 
-#undef SAFE_REALLOC
+    /* Replicated writes find backend threads by index,
+     * so wait for them and hold off new ones */
+    proxy_epoch_stop();
+
+    /* Clones may have started joining before writes stopped,
+     * and their log is only opened while writes are stopped */
+    if (proxy_epoch_current()) {
+        proxy_log(LOG_ERROR, "Can't remove clone %d: clones are joining", clone_id);
+        host->stale = stale;
+        proxy_epoch_resume();
+        backend_topo_free(topo);
+        proxy_mutex_unlock(&add_mutex);
+        return TRUE;
     }
 
-    /* Set new elements to NULL */
-    if (!before && num > backend_num) {
-        for (i=backend_num; i<num; i++) {
-            backend_pools[i] = NULL;
-            backend_conns[i] = NULL;
-            backend_threads[i] = NULL;
+    cloning = 1;
+    __sync_synchronize();
+    proxy_wait(WAIT_CLONE_COMMIT, !committing);
+
+    if (bi != last && topo->threads[bi]) {
+        for (i=0; i<options.backend_threads; i++) {
+            proxy_mutex_lock(&topo->threads[bi][i].lock);
+            topo->threads[bi][i].data.backend.bi = bi;
+            proxy_mutex_unlock(&topo->threads[bi][i].lock);
         }
     }
 
+    backend_topo_publish(topo);
+
+    /* Writes continue on the remaining backends */
+    cloning = 0;
+    proxy_epoch_resume();
+
+    /* Wait for queries which found the backend in the old topology */
+    backend_topo_retire(old);
+
+    backend_conns_free(conns, pool, threads);
+    backend_free(host);
+
+    gettimeofday(&end, NULL);
+    proxy_log(LOG_INFO, "Clone %d removed in %.3fs", clone_id,
+        end.tv_sec - start.tv_sec + (end.tv_usec - start.tv_usec) / 1000000.0f);
+
+    proxy_mutex_unlock(&add_mutex);
     return FALSE;
 }
 
+/**
+ * Copy the topology so it can be changed before publishing.
+ * Backends and their connections are shared with the original.
+ *
+ * @param topo Topology to copy.
+ * @param num  Number of backends in the copy, where backends
+ *             past the end of the original are set to NULL.
+ *
+ * @return The copy, or NULL on error.
+ **/
+static backend_topo_t* backend_topo_copy(backend_topo_t *topo, int num) {
+    backend_topo_t *copy;
+    int n = min(num, topo->num);
+
+    copy = (backend_topo_t*) calloc(1, sizeof(backend_topo_t));
+    if (!copy)
+        goto error;
+
+    copy->num = num;
+    copy->backends = (proxy_host_t**) calloc(num, sizeof(proxy_host_t*));
+    copy->conns = (proxy_backend_conn_t***) calloc(num, sizeof(proxy_backend_conn_t**));
+    copy->pools = (pool_t**) calloc(num, sizeof(pool_t*));
+    copy->threads = (proxy_thread_t**) calloc(num, sizeof(proxy_thread_t*));
+    copy->clones = (int*) malloc(max(topo->clones_size, 1) * sizeof(int));
+    copy->clones_size = topo->clones_size;
+
+    if (!copy->backends || !copy->conns || !copy->pools || !copy->threads || !copy->clones)
+        goto error;
+
+    memcpy(copy->backends, topo->backends, n * sizeof(proxy_host_t*));
+    memcpy(copy->conns, topo->conns, n * sizeof(proxy_backend_conn_t**));
+    if (topo->pools)
+        memcpy(copy->pools, topo->pools, n * sizeof(pool_t*));
+    if (topo->threads)
+        memcpy(copy->threads, topo->threads, n * sizeof(proxy_thread_t*));
+    if (topo->clones)
+        memcpy(copy->clones, topo->clones, topo->clones_size * sizeof(int));
+
+    return copy;
+
+error:
+    proxy_log(LOG_ERROR, "Could not allocate new memory for backends");
+    backend_topo_free(copy);
+    return NULL;
+}
+
+/**
+ * Free a topology, leaving the backends and connections it refers to.
+ *
+ * @param topo Topology to free, or NULL.
+ **/
+static void backend_topo_free(backend_topo_t *topo) {
+    if (!topo)
+        return;
+
+    free(topo->backends);
+    free(topo->conns);
+    free(topo->pools);
+    free(topo->threads);
+    free(topo->clones);
+    free(topo);
+}
+
+/**
+ * Make a new topology visible to queries.
+ *
+ * @param topo Topology to publish.
+ **/
+static inline void backend_topo_publish(backend_topo_t *topo) {
+    topo->version = backend_topo->version + 1;
+
+    /* Queries must see the contents before the topology itself */
+    __sync_synchronize();
+    backend_topo = topo;
+}
+
+/**
+ * Wait until queries which started before the last published
+ * topology have finished. This must not be called while writes
+ * are stopped, since queries may be waiting for them to resume.
+ **/
+static void backend_topo_sync() {
+    int phase = topo_phase;
+
+    /* Queries from now on start in the other phase
+     * and can only see the newest topology */
+    topo_phase = !phase;
+    __sync_synchronize();
+
+    proxy_wait(WAIT_TOPO, !topo_readers[phase]);
+}
+
+/**
+ * Free a replaced topology once queries are done with it.
+ *
+ * @param topo Topology which was replaced.
+ **/
+static void backend_topo_retire(backend_topo_t *topo) {
+    backend_topo_sync();
+    backend_topo_free(topo);
+}
+
 /**
  * Start a new backend thread.
  *
@@ -921,230 +2003,2164 @@ void* proxy_backend_new_thread(void *ptr) {
         while (!query->query && !thread->exit)
             proxy_cond_wait(&thread->cv, &thread->lock);
 
-        /* Check if we have been signalled to exit*/
-        if (thread->exit) {
-            proxy_mutex_unlock(&thread->lock);
-            break;
-        }
+        /* Check if we have been signalled to exit*/
+        if (thread->exit) {
+            proxy_mutex_unlock(&thread->lock);
+            break;
+        }
+
+        /* Send the query to the backend server */
+        backend_query(thread->data.backend.conn,
+                      query->host, query->proxy,
+                      query->query, *(query->length), TRUE, query->trans_id,
+                      thread->data.backend.bi, thread->commit, thread->status);
+
+        /* Signify thread availability */
+        query->query = NULL;
+    }
+
+    proxy_debug("Exiting loop on backend %d, thread %d", thread->data.backend.bi, thread->id);
+    pthread_exit(NULL);
+}
+
+/**
+ * Get the current time in microseconds.
+ *
+ * @return Microseconds since the epoch.
+ **/
+static inline ulonglong backend_now() {
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return (ulonglong) now.tv_sec * 1000000ULL + now.tv_usec;
+}
+
+/**
+ * Start ramping up the share of clients given to a new backend.
+ * It is considered warm once its latency is no worse than the
+ * average of the other backends.
+ *
+ * @param topo    Topology the backend was added to.
+ * @param backend Backend which was added.
+ **/
+static void backend_ramp_start(backend_topo_t *topo, proxy_host_t *backend) {
+    long total = 0;
+    int i, n = 0;
+
+    if (!options.ramp_time)
+        return;
+
+    for (i=0; i<topo->num; i++) {
+        if (topo->backends[i] != backend && !topo->backends[i]->stale && topo->backends[i]->latency) {
+            total += topo->backends[i]->latency;
+            n++;
+        }
+    }
+
+    backend->ramp_latency = n ? total / n : 0;
+    backend->ramp_start = backend_now();
+    (void) __sync_fetch_and_add(&backend_ramping, 1);
+
+    proxy_log(LOG_INFO, "Ramping up backend %s:%d over %ds", backend->host, backend->port, options.ramp_time);
+}
+
+/**
+ * Get the weight of a backend which is ramping up, scaled by
+ * ::RAMP_SCALE. Ramping ends once the ramp time has passed
+ * or the backend is as fast as the others were when it joined.
+ *
+ * @param backend Backend to check.
+ *
+ * @return Scaled weight of the backend.
+ **/
+static int backend_ramp_weight(proxy_host_t *backend) {
+    ulonglong start = backend->ramp_start, elapsed, period;
+    int weight = backend->weight * RAMP_SCALE;
+
+    if (!start)
+        return weight;
+
+    elapsed = backend_now() - start;
+    period = (ulonglong) options.ramp_time * 1000000ULL;
+
+    if (elapsed >= period || (backend->ramp_latency && backend->latency
+            && backend->latency <= backend->ramp_latency)) {
+        /* Only one caller ends the ramp */
+        if (__sync_bool_compare_and_swap(&backend->ramp_start, start, 0)) {
+            (void) __sync_fetch_and_sub(&backend_ramping, 1);
+            proxy_log(LOG_INFO, "Backend %s:%d ramped up after %.3fs",
+                backend->host, backend->port, elapsed / 1000000.0f);
+        }
+
+        return weight;
+    }
+
+    return max((int) (weight * elapsed / period), 1);
+}
+
+/**
+ * Get the weight of a backend for balancing reads. While any
+ * backend is ramping up, all weights are scaled by ::RAMP_SCALE.
+ *
+ * @param backend Backend to check.
+ *
+ * @return Weight of the backend, or zero if it is stale.
+ **/
+static inline int backend_weight(proxy_host_t *backend) {
+    if (backend->stale)
+        return 0;
+
+    if (unlikely(backend_ramping))
+        return backend_ramp_weight(backend);
+
+    return backend->weight;
+}
+
+/**
+ * Decide whether a randomly chosen backend should take a
+ * client, giving a backend which is ramping up its share.
+ *
+ * @param backend Backend which was chosen.
+ *
+ * @return TRUE if the backend should be used, FALSE otherwise.
+ **/
+static inline my_bool backend_ramp_admit(proxy_host_t *backend) {
+    int weight = backend->weight * RAMP_SCALE;
+
+    if (likely(!backend->ramp_start) || !weight)
+        return TRUE;
+
+    return rand() % weight < backend_ramp_weight(backend);
+}
+
+/**
+ * Compare the load of two backends relative to their weights.
+ *
+ * @param a       First backend to compare.
+ * @param b       Second backend to compare.
+ * @param latency TRUE if load should be scaled by the
+ *                average latency of each backend.
+ *
+ * @return TRUE if backend @p a is less loaded than @p b.
+ **/
+static inline my_bool backend_less_loaded(proxy_host_t *a, proxy_host_t *b, my_bool latency) {
+    long long load_a = a->sessions + a->inflight + 1,
+              load_b = b->sessions + b->inflight + 1;
+
+    if (latency) {
+        load_a *= a->latency + 1;
+        load_b *= b->latency + 1;
+    }
+
+    /* Compare load_a/weight_a with load_b/weight_b */
+    return load_a * backend_weight(b) < load_b * backend_weight(a) ? TRUE : FALSE;
+}
+
+/**
+ * Choose a backend for a new client according
+ * to the configured balancing policy.
+ *
+ * @param topo Topology to choose from.
+ *
+ * @return Index of the selected backend.
+ **/
+static int backend_balance(backend_topo_t *topo) {
+    int num = topo->num, bi, bj, i;
+    long total = 0, n;
+
+    if (num == 1)
+        return 0;
+
+    switch (options.balance) {
+        case BALANCE_LEAST:
+            /* Start at a random backend to break ties */
+            bi = -1;
+            bj = rand() % num;
+            for (i=0; i<num; i++, bj=(bj+1)%num) {
+                if (backend_weight(topo->backends[bj]) && (bi < 0 || backend_less_loaded(topo->backends[bj], topo->backends[bi], FALSE)))
+                    bi = bj;
+            }
+
+            if (bi >= 0)
+                return bi;
+            break;
+
+        case BALANCE_P2C:
+            /* Take the better of two distinct random choices */
+            bi = rand() % num;
+            bj = (bi + 1 + rand() % (num - 1)) % num;
+
+            if (!backend_weight(topo->backends[bi]))
+                bi = bj;
+            else if (backend_weight(topo->backends[bj]) && backend_less_loaded(topo->backends[bj], topo->backends[bi], TRUE))
+                bi = bj;
+
+            if (backend_weight(topo->backends[bi]))
+                return bi;
+            break;
+
+        case BALANCE_WRR:
+            for (i=0; i<num; i++)
+                total += backend_weight(topo->backends[i]);
+            if (!total)
+                break;
+
+            /* Find the backend owning the next slot */
+            n = __sync_fetch_and_add(&balance_next, 1) % total;
+            for (bi=0; bi<num-1 && n >= backend_weight(topo->backends[bi]); bi++)
+                n -= backend_weight(topo->backends[bi]);
+
+            return bi;
+
+        default:
+            break;
+    }
+
+    /* Fall back to random selection, avoiding stale backends
+     * and those ramping up unless there is nothing else */
+    bj = rand() % num;
+    for (i=0; i<num; i++, bj=(bj+1)%num) {
+        if (!topo->backends[bj]->stale && backend_ramp_admit(topo->backends[bj]))
+            break;
+    }
+
+    return bj;
+}
+
+/**
+ * Request a set of connection identifiers which can be passed in
+ * when making future queries to the backend for a connection.
+ *
+ * @param[out] conn_idx Storage for connection identifiers.
+ * @param thread_id     Identifier of the thread requesting the connection.
+ **/
+void proxy_backend_get_connection(proxy_conn_idx_t *conn_idx, int thread_id) {
+    int phase;
+
+    conn_idx->bi = -1;
+    conn_idx->ci = -1;
+    conn_idx->pinned = FALSE;
+    conn_idx->session = __sync_fetch_and_add(&session_next, 1);
+    conn_idx->sets = NULL;
+    conn_idx->nsets = 0;
+    conn_idx->trans_ti = -1;
+    conn_idx->write_seq = 0;
+    conn_idx->in_trans = FALSE;
+
+    /* With transaction pooling, connections
+     * are only taken when a statement arrives */
+    if (!options.transaction_pool) {
+        phase = backend_topo_enter();
+        backend_conn_take(backend_topo, conn_idx, thread_id);
+        backend_topo_leave(phase);
+    }
+}
+
+/**
+ * Release a connection for further use by other backends.
+ *
+ * @param conn_idx Pointer to the connection to be released.
+ **/
+void proxy_backend_release_connection(proxy_conn_idx_t *conn_idx) {
+    backend_topo_t *topo;
+    int i, phase;
+
+    phase = backend_topo_enter();
+    topo = backend_topo;
+
+    /* Roll back a transaction the client left open */
+    if (conn_idx->trans_ti >= 0)
+        backend_trans_end(conn_idx, NULL, FALSE, NULL);
+
+    if (conn_idx->ci >= 0 && !backend_conn_lost(topo, conn_idx))
+        backend_conn_return(topo, conn_idx);
+
+    backend_topo_leave(phase);
+
+    /* Forget session state */
+    for (i=0; i<conn_idx->nsets; i++)
+        free(conn_idx->sets[i]);
+    free(conn_idx->sets);
+    conn_idx->sets = NULL;
+    conn_idx->nsets = 0;
+}
+
+/**
+ * Take a backend connection for a client session.
+ *
+ * @param topo             Topology to take the connection from.
+ * @param[in,out] conn_idx Session which needs a connection.
+ * @param thread_id        Identifier of the thread requesting the connection.
+ **/
+static void backend_conn_take(backend_topo_t *topo, proxy_conn_idx_t *conn_idx, int thread_id) {
+    backend_conn_assign(topo, conn_idx, backend_balance(topo), thread_id);
+}
+
+/**
+ * Take a connection on a given backend for a client session.
+ *
+ * @param topo             Topology to take the connection from.
+ * @param[in,out] conn_idx Session which needs a connection.
+ * @param bi               Index of the backend to use.
+ * @param thread_id        Identifier of the thread requesting the connection.
+ **/
+static void backend_conn_assign(backend_topo_t *topo, proxy_conn_idx_t *conn_idx, int bi, int thread_id) {
+    conn_idx->bi = bi;
+    conn_idx->host_id = topo->backends[conn_idx->bi]->id;
+    (void) __sync_fetch_and_add(&topo->backends[conn_idx->bi]->sessions, 1);
+    conn_idx->ci = topo->pools ?
+        proxy_pool_get(topo->pools[conn_idx->bi]) : thread_id;
+
+    proxy_vdebug("Assigning thread %d connection %d on backend %d",
+        thread_id, conn_idx->ci, conn_idx->bi);
+}
+
+/**
+ * Return the backend connection held by a client session.
+ *
+ * @param topo             Topology the connection was found in.
+ * @param[in,out] conn_idx Session holding the connection.
+ **/
+static void backend_conn_return(backend_topo_t *topo, proxy_conn_idx_t *conn_idx) {
+    proxy_vdebug("Releasing connection %d on backend %d",
+        conn_idx->ci, conn_idx->bi);
+
+    /* Session state must be reset before another session uses the connection */
+    if (conn_idx->nsets || conn_idx->pinned)
+        topo->conns[conn_idx->bi][conn_idx->ci]->dirty = TRUE;
+
+    if (topo->pools)
+        proxy_pool_return(topo->pools[conn_idx->bi], conn_idx->ci);
+    (void) __sync_fetch_and_sub(&topo->backends[conn_idx->bi]->sessions, 1);
+    conn_idx->bi = -1;
+    conn_idx->ci = -1;
+}
+
+/**
+ * Keep the reads of a session off a backend which is stale or has
+ * not yet applied the last logged write of the session. The session
+ * moves to a backend which is up to date, or if its state ties it to
+ * its connection, waits for its backend to catch up.
+ *
+ * @param topo             Topology the connection was found in.
+ * @param[in,out] conn_idx Session holding a connection.
+ *
+ * @return TRUE on error, FALSE otherwise.
+ **/
+static my_bool backend_conn_fresh(backend_topo_t *topo, proxy_conn_idx_t *conn_idx) {
+    proxy_host_t *host = topo->backends[conn_idx->bi];
+    int num = topo->num, bi, bj, i, ti;
+
+    if (likely(!host->stale && host->applied >= conn_idx->write_seq))
+        return FALSE;
+
+    if (conn_idx->pinned) {
+        proxy_mutex_lock(&replog_lock);
+        replog_waiters++;
+        while (host->applied < conn_idx->write_seq && !host->diverged)
+            proxy_cond_wait(&replog_done_cv, &replog_lock);
+        replog_waiters--;
+        proxy_mutex_unlock(&replog_lock);
+        return FALSE;
+    }
+
+    /* Any backend which is not stale and has the write will do,
+     * and one in the quorum for the write always has it */
+    bi = -1;
+    for (i=0, bj=rand() % num; i<num; i++, bj=(bj+1)%num) {
+        if (!topo->backends[bj]->stale && topo->backends[bj]->applied >= conn_idx->write_seq) {
+            bi = bj;
+            break;
+        }
+    }
+
+    if (bi < 0 || bi == conn_idx->bi)
+        return FALSE;
+
+    proxy_vdebug("Moving session %lu from lagging backend %d to backend %d",
+        conn_idx->session, conn_idx->bi, bi);
+
+    /* Connections without a pool belong to the client thread */
+    ti = conn_idx->ci;
+    backend_conn_return(topo, conn_idx);
+    backend_conn_assign(topo, conn_idx, bi, ti);
+
+    return backend_conn_restore(topo, conn_idx);
+}
+
+/**
+ * Find the backend of a session's connection, which moves to a new
+ * index when another backend is removed. If the backend itself was
+ * removed, its connections were closed and the session has none.
+ *
+ * @param topo             Topology to search for the backend.
+ * @param[in,out] conn_idx Session holding a connection.
+ *
+ * @return TRUE if the backend was removed, FALSE otherwise.
+ **/
+static my_bool backend_conn_lost(backend_topo_t *topo, proxy_conn_idx_t *conn_idx) {
+    int bi, num = topo->num;
+
+    if (likely(conn_idx->bi < num && topo->backends[conn_idx->bi]->id == conn_idx->host_id))
+        return FALSE;
+
+    for (bi=0; bi<num; bi++) {
+        if (topo->backends[bi]->id == conn_idx->host_id) {
+            conn_idx->bi = bi;
+            return FALSE;
+        }
+    }
+
+    if (conn_idx->pinned)
+        proxy_log(LOG_ERROR, "Session %lu lost its state when its backend was removed", conn_idx->session);
+
+    conn_idx->bi = -1;
+    conn_idx->ci = -1;
+    conn_idx->pinned = FALSE;
+    return TRUE;
+}
+
+/**
+ * Bring the state of a backend connection in line with a
+ * client session by resetting state left by other sessions
+ * and replaying any SET statements it has not yet seen.
+ *
+ * @param topo     Topology the connection was found in.
+ * @param conn_idx Session holding the connection.
+ *
+ * @return TRUE on error, FALSE otherwise.
+ **/
+static my_bool backend_conn_restore(backend_topo_t *topo, proxy_conn_idx_t *conn_idx) {
+    proxy_backend_conn_t *conn = topo->conns[conn_idx->bi][conn_idx->ci];
+    MYSQL *mysql = conn->mysql;
+    int i = 0;
+
+    if (conn->session == conn_idx->session) {
+        /* Only newer statements are missing */
+        i = conn->nsets;
+    } else if (conn->dirty) {
+        proxy_vdebug("Resetting connection %d on backend %d", conn_idx->ci, conn_idx->bi);
+
+        if (mysql_change_user(mysql, options.user, options.pass, options.db)) {
+            proxy_log(LOG_ERROR, "Couldn't reset backend connection: %s", mysql_error(mysql));
+            return TRUE;
+        }
+
+        mysql_autocommit(mysql, options.autocommit);
+        conn->dirty = FALSE;
+    }
+
+    for (; i<conn_idx->nsets; i++) {
+        if (mysql_real_query(mysql, conn_idx->sets[i], strlen(conn_idx->sets[i]))) {
+            proxy_log(LOG_ERROR, "Couldn't replay session statement %s: %s",
+                conn_idx->sets[i], mysql_error(mysql));
+            conn->dirty = TRUE;
+            return TRUE;
+        }
+    }
+
+    conn->session = conn_idx->session;
+    conn->nsets = conn_idx->nsets;
+    conn->server_status = mysql->server_status;
+
+    return FALSE;
+}
+
+/**
+ * Send a query to the backend and return the results to the client.
+ *
+ * @param proxy          MySQL object corresponding to the client connection.
+ * @param conn_idx       Connection to use for this query if we need a single
+ *                       backend.
+ * @param query          A query string received from the client.
+ * @param length         Length of the query string.
+ * @param replicated     TRUE if the query is replicated across servers,
+ *                       FALSE otherwise.
+ * @param trans_id       ID of the transaction from the coordinator
+ *                       for replicated queries, or zero.
+ * @param commit         Data required for synchronization and
+ *                       two-phase commit.
+ * @param[in,out] status Status information for the connection.
+ *
+ * @return TRUE on error, FALSE otherwise.
+ **/
+my_bool proxy_backend_query(MYSQL *proxy, proxy_conn_idx_t *conn_idx, char *query, ulong length, my_bool replicated, ulong trans_id, commitdata_t *commit, status_t *status) {
+    backend_topo_t *topo;
+    int bi = -1, i, ti, num, epoch = 0, phase;
+    proxy_query_map_t map = QUERY_MAP_ANY;
+    my_bool error = FALSE, logged = FALSE;
+    proxy_epoch_entry_t *entry = NULL;
+    proxy_epoch_state_t outcome = EPOCH_PARTIAL;
+    char *newq = NULL;
+    pthread_barrier_t query_barrier;
+    proxy_backend_query_t *bquery;
+    proxy_thread_t *thread;
+    ulonglong results=0;
+    struct timeval start;
+
+    gettimeofday(&start, NULL);
+    (void) __sync_fetch_and_add(&global_running, 1);
+    (void) __sync_fetch_and_add(&backend_queries, 1);
+    phase = backend_topo_enter();
+
+    /* Get the query map and modified query
+     * if a mapper was specified */
+    if (backend_mapper) {
+        map = (*backend_mapper)(query, &length, &newq);
+
+        /* If the query was modified by the mapper,
+         * switch to the new query string */
+        if (newq) {
+            free(query);
+            query = newq;
+        }
+        proxy_vvdebug("Query %s mapped to %d", query, (int) map);
+    }
+
+    /* With two-phase commit, explicit transactions hold their own
+     * connections and only commit when the client ends them */
+    if (options.two_pc && (conn_idx->trans_ti >= 0 || backend_query_begins(query))) {
+        error = backend_query_trans(conn_idx, proxy, query, length, map, status);
+        goto out;
+    }
+
+    /* Assign an identifier which is sent to backends
+     * ahead of the query if necessary */
+    if (map == QUERY_MAP_ALL && options.add_ids)
+        trans_id = __sync_fetch_and_add(&transaction_id, 1);
+
+    /* If we are coordinating, base replication status
+     * on the query mapper */
+    if (options.coordinator)
+        replicated = (map == QUERY_MAP_ALL) ? TRUE : FALSE;
+
+    /* Replicated writes wait while a clone snapshot is taken,
+     * and are then logged until the new clones have joined */
+    if (options.coordinator && replicated) {
+        epoch = proxy_epoch_enter();
+        logged = TRUE;
+    }
+
+    /* Writes may have waited for the topology to change */
+    topo = backend_topo;
+
+    /* Move to a new backend if ours was removed */
+    if (conn_idx->ci >= 0 && backend_conn_lost(topo, conn_idx)) {
+        backend_conn_take(topo, conn_idx, -1);
+        if (backend_conn_restore(topo, conn_idx)) {
+            proxy_net_send_error(proxy, ER_ERROR_WHEN_EXECUTING_COMMAND, "Couldn't restore session on new backend");
+            error = TRUE;
+            goto out;
+        }
+
+        /* The rest of an open transaction would run outside of it */
+        if (conn_idx->in_trans) {
+            proxy_log(LOG_ERROR, "Session %lu lost its transaction when its backend was removed", conn_idx->session);
+            conn_idx->in_trans = FALSE;
+            proxy_net_send_error(proxy, ER_LOCK_DEADLOCK,
+                "Backend removed during transaction, which was rolled back; try restarting transaction");
+            error = TRUE;
+            goto out;
+        }
+    }
+
+    /* Speed things up with only one backend
+     * by avoiding synchronization */
+    if (topo->num == 1)
+        map = QUERY_MAP_ANY;
+
+    /* Take the next place in the log before any backend is sent
+     * the write, so clones replay writes in the order they ran */
+    if (logged && proxy_epoch_reserve(epoch, query, length, &entry)) {
+        proxy_net_send_error(proxy, ER_OUT_OF_RESOURCES, "Couldn't log write for joining clones");
+        error = TRUE;
+        goto out;
+    }
+
+    switch (map) {
+        case QUERY_MAP_ANY:
+            status->queries_any++;
+
+            /* Reads must see the writes of the session, which
+             * only a quorum of backends may have applied */
+            if (options.write_quorum && !replicated && conn_idx->ci >= 0
+                    && backend_conn_fresh(topo, conn_idx)) {
+                proxy_net_send_error(proxy, ER_ERROR_WHEN_EXECUTING_COMMAND, "Couldn't restore session on new backend");
+                error = TRUE;
+                goto out;
+            }
+
+            /* Connections are only held for the length of a transaction */
+            if (options.transaction_pool) {
+                if (backend_query_pooled(topo, conn_idx, proxy, query, length, replicated, trans_id, status)) {
+                    error = TRUE;
+                    goto out;
+                }
+                break;
+            }
+
+            /* Reads outside of a transaction may go to any backend */
+            if (options.statement_reads && !replicated && topo->num > 1) {
+                if (backend_query_balanced(topo, conn_idx, proxy, query, length, status)) {
+                    error = TRUE;
+                    goto out;
+                }
+                break;
+            }
+
+            if (backend_query_idx(topo, conn_idx->bi, conn_idx->ci, proxy, query, length, replicated, trans_id, status)) {
+                error = TRUE;
+                goto out;
+            }
+            break;
+
+        case QUERY_MAP_ALL:
+            status->queries_all++;
+
+            /* Reply once enough backends have applied the write */
+            if (options.write_quorum) {
+                if (backend_query_quorum(conn_idx, proxy, query, length, replicated, trans_id, status))
+                    error = TRUE;
+                break;
+            }
+
+            /* Share round trips with concurrent writes */
+            if (options.batch_writes > 1 && backend_query_batchable(query, length)) {
+                if (backend_query_batched(proxy, query, length, status))
+                    error = TRUE;
+                break;
+            }
+
+            /* Talk to all backends from this thread */
+            if (options.fanout) {
+                results = backend_query_fanout(proxy, query, length, replicated, trans_id, &num, status);
+                for (i=0; i<num; i++)
+                    if (!(results & ((ulonglong) 1 << i)))
+                        error = TRUE;
+                if (!results)
+                    outcome = EPOCH_FAILED;
+                break;
+            }
+
+            /* Send a query to the other backends and keep only the first result */
+            (void) __sync_fetch_and_add(&querying, 1);
+
+            /* Wait until cloning is done */
+            proxy_wait(WAIT_QUERY_CLONE, !cloning);
+            topo = backend_topo;
+
+            /* Set up synchronization */
+            pthread_barrier_init(&query_barrier, NULL, topo->num + 1);
+
+            bi = rand() % topo->num;
+            ti = proxy_pool_get(backend_thread_pool);
+            for (i=0; i<topo->num; i++) {
+                /* Get the next backend */
+                bi = (bi + 1) % topo->num;
+
+                /* Dispatch threads for backend queries */
+                thread = &(topo->threads[bi][ti]);
+                thread->status = status;
+
+                proxy_mutex_lock(&(thread->lock));
+
+                bquery         = &(thread->data.backend.query);
+                bquery->query  = query;
+                bquery->length = &length;
+                bquery->trans_id = trans_id;
+                bquery->proxy  = (i == 0) ? proxy : NULL;
+                bquery->host   = topo->backends[bi];
+
+                /* Set up commit data */
+                commit->backends   = topo->num;
+                commit->results    = &results;
+                commit->barrier    = &query_barrier;
+                commit->committing = 0;
+                thread->commit     = commit;
+
+                proxy_cond_signal(&thread->cv);
+                proxy_mutex_unlock(&thread->lock);
+            }
+
+            /* Wait until all queries are complete */
+            pthread_barrier_wait(&query_barrier);
+
+            /* Free synchronization primitives */
+            pthread_barrier_destroy(&query_barrier);
+
+            /* Wait for the final commit to be performed */
+            pthread_spin_lock(&commit->committed);
+            pthread_spin_unlock(&commit->committed);
+
+            /* Release the backend threads */
+            proxy_pool_return(backend_thread_pool, ti);
+
+            /* XXX: should do better at handling failures */
+            for (i=0; i<topo->num; i++)
+                if (!(results & (i==0 ? 1 : 2 << (i-1)))) {
+                    error = TRUE;
+                    /* XXX should print a message if failure is not a malformed query */
+                    //proxy_log(LOG_ERROR, "Failure for query on backend %d\n", i);
+                }
+            if (!results)
+                outcome = EPOCH_FAILED;
+
+            backend_query_leave();
+
+            break;
+
+        /* Some unknown value was returned, give up */
+        default:
+            error = TRUE;
+            outcome = EPOCH_FAILED;
+            goto out;
+    }
+
+    /* Sessions can't follow their backend elsewhere mid-transaction */
+    conn_idx->in_trans = conn_idx->ci >= 0
+        && (topo->conns[conn_idx->bi][conn_idx->ci]->server_status & SERVER_STATUS_IN_TRANS);
+
+out:
+    if (logged) {
+        /* Writes which failed on only some backends stay in the
+         * log, since a clone may be a copy of one which applied them */
+        proxy_epoch_finish(epoch, entry, error ? outcome : EPOCH_APPLIED);
+        proxy_epoch_leave();
+    }
+
+    backend_topo_leave(phase);
+
+    if (map == QUERY_MAP_ANY || map == QUERY_MAP_ALL)
+        proxy_latency_record(proxy_latency_site(map == QUERY_MAP_ALL
+            ? LATENCY_QUERY_ALL : LATENCY_QUERY_ANY), &start);
+
+    (void) __sync_fetch_and_sub(&global_running, 1);
+    /* XXX: error reporting should be more verbose */
+    return FALSE;
+}
+
+/**
+ * Forward a query to a specific backend
+ *
+ * @param bi             Index of the backend to send the query to.
+ * @param ci             Index of a connection to use, or negative
+ *                       to use any connection.
+ * @param proxy          MYSQL object to forward results to.
+ * @param query          Query string to execute.
+ * @param length         Length of the query.
+ * @param replicated     TRUE if the query is replicated across servers,
+ *                       FALSE otherwise.
+ * @param trans_id       ID of the transaction, or zero.
+ * @param[in,out] status Status information for the connection.
+ *
+ * @return TRUE on error, FALSE otherwise.
+ **/
+static inline my_bool backend_query_idx(backend_topo_t *topo, int bi, int ci, MYSQL *proxy, const char *query, ulong length, my_bool replicated, ulong trans_id, status_t *status) {
+    proxy_backend_conn_t *conn;
+    my_bool error;
+
+    /* Get a backend to use */
+    conn = topo->conns[bi][ci];
+
+    proxy_vvdebug("Sending read-only query %s to backend %d, connection %d", query, bi, ci);
+
+    /*Send the query */
+    error = backend_query(conn, topo->backends[bi], proxy, query, length, replicated, trans_id, bi, NULL, status);
+
+    return error;
+}
+
+/**
+ * Check if a query contains a keyword, ignoring case.
+ *
+ * @param query Query string to search.
+ * @param word  Keyword to search for.
+ *
+ * @return TRUE if the keyword was found, FALSE otherwise.
+ **/
+static my_bool backend_query_has(const char *query, const char *word) {
+    size_t len = strlen(word);
+
+    for (; *query; query++) {
+        if (!strncasecmp(query, word, len))
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+/**
+ * Check if a statement can be executed on any connection
+ * without depending on or changing session state.
+ *
+ * @param query Query string to check.
+ *
+ * @return TRUE if the statement is a plain read, FALSE otherwise.
+ **/
+static my_bool backend_query_stateless(const char *query) {
+    while (*query == ' ' || *query == '\t' || *query == '\r' || *query == '\n' || *query == '(')
+        query++;
+
+    if (strncasecmp(query, "SELECT", 6))
+        return FALSE;
+
+    /* Locking reads, variables and functions whose
+     * results depend on the session connection */
+    return !(backend_query_has(query, "FOR UPDATE")
+        || backend_query_has(query, "LOCK IN SHARE MODE")
+        || backend_query_has(query, "INTO")
+        || backend_query_has(query, "@")
+        || backend_query_has(query, "GET_LOCK")
+        || backend_query_has(query, "RELEASE_LOCK")
+        || backend_query_has(query, "LAST_INSERT_ID")
+        || backend_query_has(query, "FOUND_ROWS")
+        || backend_query_has(query, "ROW_COUNT")
+        || backend_query_has(query, "CONNECTION_ID"));
+}
+
+/**
+ * Check if a statement creates session state which
+ * later statements on the same connection may rely on.
+ *
+ * @param query Query string to check.
+ *
+ * @return TRUE if the session must stay on its connection, FALSE otherwise.
+ **/
+static my_bool backend_query_pins(const char *query) {
+    while (*query == ' ' || *query == '\t' || *query == '\r' || *query == '\n')
+        query++;
+
+    /* Autocommit changes are tracked by the server status */
+    if (!strncasecmp(query, "SET", 3))
+        return backend_query_has(query, "AUTOCOMMIT") ? FALSE : TRUE;
+
+    return (!strncasecmp(query, "CREATE TEMPORARY", 16)
+        || !strncasecmp(query, "LOCK", 4)
+        || !strncasecmp(query, "PREPARE", 7)
+        || !strncasecmp(query, "HANDLER", 7)
+        || !strncasecmp(query, "USE", 3)) ? TRUE : FALSE;
+}
+
+/**
+ * Check if a statement starts a transaction which the
+ * client declared will only read data.
+ *
+ * @param query Query string to check.
+ *
+ * @return TRUE if the statement is START TRANSACTION READ ONLY, FALSE otherwise.
+ **/
+static my_bool backend_query_readonly(const char *query) {
+    while (*query == ' ' || *query == '\t' || *query == '\r' || *query == '\n')
+        query++;
+
+    return (!strncasecmp(query, "START TRANSACTION", 17)
+        && backend_query_has(query + 17, "READ ONLY")
+        && !backend_query_has(query + 17, "READ WRITE")) ? TRUE : FALSE;
+}
+
+/**
+ * Send a query which does not need replication, using a
+ * connection from any backend if the session has no open
+ * transaction or other state tied to its own connection.
+ *
+ * @param conn_idx       Connection held by the session.
+ * @param proxy          MYSQL object to forward results to.
+ * @param query          Query string to execute.
+ * @param length         Length of the query.
+ * @param[in,out] status Status information for the connection.
+ *
+ * @return TRUE on error, FALSE otherwise.
+ **/
+static my_bool backend_query_balanced(backend_topo_t *topo, proxy_conn_idx_t *conn_idx, MYSQL *proxy, const char *query, ulong length, status_t *status) {
+    uint server_status = topo->conns[conn_idx->bi][conn_idx->ci]->server_status;
+    int bi, ci;
+    my_bool error;
+
+    if (!conn_idx->pinned && backend_query_pins(query))
+        conn_idx->pinned = TRUE;
+
+    /* Anything which may see uncommitted or session
+     * state stays on the session connection */
+    if (conn_idx->pinned || !(server_status & SERVER_STATUS_AUTOCOMMIT)
+            || (server_status & SERVER_STATUS_IN_TRANS)
+            || !backend_query_stateless(query))
+        return backend_query_idx(topo, conn_idx->bi, conn_idx->ci, proxy, query, length, FALSE, 0, status);
+
+    /* Use the session connection if we pick the same
+     * backend or the chosen one has no free connections */
+    bi = backend_balance(topo);
+    if (bi == conn_idx->bi || (ci = proxy_pool_try_get(topo->pools[bi])) < 0)
+        return backend_query_idx(topo, conn_idx->bi, conn_idx->ci, proxy, query, length, FALSE, 0, status);
+
+    proxy_vvdebug("Balancing read to backend %d, connection %d", bi, ci);
+    status->queries_balanced++;
+
+    error = backend_query_idx(topo, bi, ci, proxy, query, length, FALSE, 0, status);
+    proxy_pool_return(topo->pools[bi], ci);
+
+    return error;
+}
+
+/**
+ * Send a query which does not need replication using a pooled
+ * connection which is held only until the end of a transaction.
+ *
+ * @param conn_idx       Session sending the query.
+ * @param proxy          MYSQL object to forward results to.
+ * @param query          Query string to execute.
+ * @param length         Length of the query.
+ * @param replicated     TRUE if the query is replicated across servers,
+ *                       FALSE otherwise.
+ * @param trans_id       ID of the transaction, or zero.
+ * @param[in,out] status Status information for the connection.
+ *
+ * @return TRUE on error, FALSE otherwise.
+ **/
+static my_bool backend_query_pooled(backend_topo_t *topo, proxy_conn_idx_t *conn_idx, MYSQL *proxy, const char *query, ulong length, my_bool replicated, ulong trans_id, status_t *status) {
+    proxy_backend_conn_t *conn;
+    const char *pos = query;
+    my_bool error, set, hold;
+
+    /* Take a connection if we don't have one from an open transaction */
+    if (conn_idx->ci < 0) {
+        backend_conn_take(topo, conn_idx, -1);
+
+        if (backend_conn_restore(topo, conn_idx)) {
+            backend_conn_return(topo, conn_idx);
+            return proxy_net_send_error(proxy, ER_UNKNOWN_ERROR, "Couldn't restore session state");
+        }
+    }
+
+    while (*pos == ' ' || *pos == '\t' || *pos == '\r' || *pos == '\n')
+        pos++;
+
+    /* SET statements are replayed on new connections, but
+     * other session state keeps the connection for good */
+    set = strncasecmp(pos, "SET", 3) ? FALSE : TRUE;
+    if (!set && !conn_idx->pinned && backend_query_pins(query))
+        conn_idx->pinned = TRUE;
+
+    /* SET TRANSACTION applies to the next transaction, which
+     * must then start on the same connection */
+    hold = set && !strncasecmp(pos + 3, " TRANSACTION", 12);
+
+    conn = topo->conns[conn_idx->bi][conn_idx->ci];
+    error = backend_query_idx(topo, conn_idx->bi, conn_idx->ci, proxy, query, length, replicated, trans_id, status);
+
+    /* Save successful SET statements for replay */
+    if (set && !hold && !error && conn->mysql->net.read_pos[0] == 0) {
+        if (conn_idx->nsets < SESSION_SETS_MAX) {
+            conn_idx->sets = (char**) realloc(conn_idx->sets, (conn_idx->nsets + 1) * sizeof(char*));
+            conn_idx->sets[conn_idx->nsets++] = strndup(query, length);
+            conn->nsets = conn_idx->nsets;
+        } else {
+            conn_idx->pinned = TRUE;
+        }
+    }
+
+    /* Give up the connection at a transaction boundary */
+    if (!conn_idx->pinned && !hold && (conn->server_status & SERVER_STATUS_AUTOCOMMIT)
+            && !(conn->server_status & SERVER_STATUS_IN_TRANS))
+        backend_conn_return(topo, conn_idx);
+
+    return error;
+}
+
+/**
+ * Read the response to a query sent as part of a fan-out,
+ * forwarding it to the client if requested.
+ *
+ * @param conn           Backend connection to read from.
+ * @param proxy          Client to forward the response to, or NULL.
+ * @param[out] result    Storage for the outcome of the query, or NULL.
+ * @param[in,out] status Status information for the connection.
+ *
+ * @return TRUE if the backend executed the query successfully, FALSE otherwise.
+ **/
+static my_bool backend_fanout_read(proxy_backend_conn_t *conn, MYSQL *proxy, backend_result_t *result, status_t *status) {
+    MYSQL *mysql = conn->mysql;
+    ulong pkt_len;
+    uchar *pos;
+
+    if ((pkt_len = backend_read_to_proxy(mysql, NULL, status)) == packet_error) {
+        if (proxy)
+            proxy_net_send_error(proxy, ER_ERROR_WHEN_EXECUTING_COMMAND, "Lost connection to backend");
+        if (result) {
+            result->errnum = ER_ERROR_WHEN_EXECUTING_COMMAND;
+            strcpy(result->errmsg, "Lost connection to backend");
+            result->lost = TRUE;
+        }
+        return FALSE;
+    }
+
+    pos = mysql->net.read_pos;
+    if (*pos == 0xFF) {
+        /* Save the error number and message, skipping any SQL state */
+        if (result) {
+            result->errnum = uint2korr(pos + 1);
+            pos += 3;
+            if (*pos == '#')
+                pos += 6;
+            strncpy(result->errmsg, (char*) pos, MYSQL_ERRMSG_SIZE - 1);
+            result->errmsg[MYSQL_ERRMSG_SIZE - 1] = '\0';
+        }
+
+        if (proxy && !backend_proxy_write(mysql, proxy, pkt_len, status))
+            proxy_net_flush(proxy);
+        return FALSE;
+    }
+
+    /* Save data from the OK packet */
+    if (*pos == 0) {
+        backend_save_status(conn);
+
+        if (result) {
+            pos++;
+            result->ok.affected_rows = net_field_length_ll(&pos);
+            result->ok.insert_id = net_field_length_ll(&pos);
+            pos += 2;
+            result->ok.warnings = uint2korr(pos);
+        }
+    }
+
+    if (proxy && backend_proxy_write(mysql, proxy, pkt_len, status))
+        return FALSE;
+    proxy_net_flush(proxy);
+
+    /* Read field info and rows of any result set */
+    pos = mysql->net.read_pos;
+    if (net_field_length(&pos) != 0) {
+        if (backend_read_rows(mysql, proxy, 7, status)
+                || backend_read_rows(mysql, proxy, mysql->field_count, status))
+            return FALSE;
+
+        backend_save_status(conn);
+    }
+
+    return TRUE;
+}
+
+/**
+ * Send a command to a backend without reading the result.
+ * Queries sent with COM_PROXY_QUERY are preceded by the
+ * transaction ID, which the receiving proxy strips
+ * before the query reaches MySQL.
+ *
+ * @param mysql    Backend connection.
+ * @param command  Command to send.
+ * @param trans_id ID of the transaction for COM_PROXY_QUERY.
+ * @param query    Query string to send.
+ * @param length   Length of the query.
+ *
+ * @return TRUE on error, FALSE otherwise.
+ **/
+static my_bool backend_send_command(MYSQL *mysql, enum enum_server_command command, ulong trans_id, const char *query, ulong length) {
+    uchar header[TRANS_ID_SIZE];
+
+    if (command != (enum enum_server_command) COM_PROXY_QUERY)
+        return simple_command(mysql, command, (uchar*) query, length, 1);
+
+    proxy_net_store_id(header, trans_id);
+    return (*mysql->methods->advanced_command)(mysql, command, header, TRANS_ID_SIZE,
+        (uchar*) query, length, 1, NULL);
+}
+
+/**
+ * Send a command to a set of backends, and then read all
+ * responses in the order in which they become available.
+ *
+ * @param hosts          Backends the connections belong to, taken
+ *                       from the caller's topology snapshot.
+ * @param conns          Connections to each backend.
+ * @param num            Number of backends.
+ * @param command        Command to send.
+ * @param trans_id       ID of the transaction for COM_PROXY_QUERY.
+ * @param query          Query string to execute.
+ * @param length         Length of the query.
+ * @param first          Index of the backend whose response is
+ *                       forwarded to the client.
+ * @param proxy          Client to forward the response to, or NULL.
+ * @param[out] result    Storage for the outcome on backend @p first.
+ * @param[in,out] status Status information for the connection.
+ *
+ * @return Bitmap of backends which executed the command successfully.
+ **/
+static ulonglong backend_fanout(proxy_host_t **hosts, proxy_backend_conn_t **conns, int num, enum enum_server_command command,
+        ulong trans_id, const char *query, ulong length, int first, MYSQL *proxy, backend_result_t *result, status_t *status) {
+    struct pollfd polls[num];
+    ulonglong results = 0;
+    int bi, ret, pending = 0;
+    MYSQL *mysql;
+
+    /* Write the command to every backend before reading anything */
+    for (bi=0; bi<num; bi++) {
+        mysql = conns[bi]->mysql;
+        polls[bi].fd = -1;
+        polls[bi].events = POLLIN;
+        polls[bi].revents = 0;
+
+        if (unlikely(!mysql) || backend_send_command(mysql, command, trans_id, query, length)) {
+            proxy_log(LOG_ERROR, "Error sending query to backend %d", bi);
+            if (bi == first && proxy)
+                proxy_net_send_error(proxy, ER_ERROR_WHEN_EXECUTING_COMMAND, "Couldn't send query to backend");
+            continue;
+        }
+
+        (void) __sync_fetch_and_add(&hosts[bi]->inflight, 1);
+
+        polls[bi].fd = mysql->net.vio->sd;
+        pending++;
+    }
+
+    /* Collect responses as backends finish */
+    while (pending > 0) {
+        if ((ret = poll(polls, num, FANOUT_TIMEOUT)) <= 0) {
+            if (ret < 0 && errno == EINTR)
+                continue;
+
+            if (ret < 0)
+                proxy_log(LOG_ERROR, "Error waiting for backend responses:%s", errstr);
+            else
+                proxy_log(LOG_ERROR, "Timed out waiting for backend responses");
+            break;
+        }
+
+        for (bi=0; bi<num; bi++) {
+            if (polls[bi].fd < 0 || !polls[bi].revents)
+                continue;
+
+            if (backend_fanout_read(conns[bi], bi == first ? proxy : NULL, bi == first ? result : NULL, status))
+                results |= (ulonglong) 1 << bi;
+
+            (void) __sync_fetch_and_sub(&hosts[bi]->inflight, 1);
+            polls[bi].fd = -1;
+            pending--;
+        }
+    }
+
+    /* Connections still waiting for a reply would hand it to the next
+     * query, so drop them and let them reconnect before reuse */
+    for (bi=0; bi<num; bi++) {
+        if (polls[bi].fd < 0)
+            continue;
+
+        proxy_log(LOG_ERROR, "Resetting connection to backend %d with an unread reply", bi);
+
+        end_server(conns[bi]->mysql);
+        conns[bi]->session = 0;
+        conns[bi]->nsets = 0;
+        conns[bi]->dirty = FALSE;
+
+        if (bi == first) {
+            if (proxy)
+                proxy_net_send_error(proxy, ER_ERROR_WHEN_EXECUTING_COMMAND, "Backend didn't respond to query");
+            if (result) {
+                result->errnum = ER_ERROR_WHEN_EXECUTING_COMMAND;
+                strcpy(result->errmsg, "Backend didn't respond to query");
+                result->lost = TRUE;
+            }
+        }
+
+        (void) __sync_fetch_and_sub(&hosts[bi]->inflight, 1);
+    }
+
+    return results;
+}
+
+/**
+ * Send a replicated query to all backends from the calling thread.
+ * Backend threads are not involved, and responses are collected as
+ * they arrive. Results are the same as when dispatching the query
+ * with backend threads.
+ *
+ * @param proxy          MYSQL object to forward results to.
+ * @param query          Query string to execute.
+ * @param length         Length of the query.
+ * @param replicated     TRUE if the query is replicated across servers,
+ *                       FALSE otherwise.
+ * @param trans_id       ID of the transaction, or zero.
+ * @param[out] backends  Number of backends the query was sent to.
+ * @param[in,out] status Status information for the connection.
+ *
+ * @return Bitmap of backends which executed the query successfully,
+ *         and also committed it with two-phase commit.
+ **/
+static ulonglong backend_query_fanout(MYSQL *proxy, const char *query, ulong length, my_bool replicated, ulong trans_id, int *backends, status_t *status) {
+    backend_topo_t *topo;
+    int num, bi, ti, first;
+    ulonglong results, all;
+    backend_result_t result;
+    enum enum_server_command command;
+    proxy_backend_conn_t **conns;
+    struct timeval start;
+
+    (void) __sync_fetch_and_add(&querying, 1);
+    ti = proxy_pool_get(backend_thread_pool);
+
+    /* No clone can start during the fan-out */
+    backend_commit_enter();
+    memset(&result, 0, sizeof(result));
+
+    /* Only read the topology once removals are held off */
+    topo = backend_topo;
+    num = *backends = topo->num;
+    conns = (proxy_backend_conn_t**) malloc(num * sizeof(proxy_backend_conn_t*));
+    for (bi=0; bi<num; bi++)
+        conns[bi] = topo->threads[bi][ti].data.backend.conn;
+
+    first = rand() % num;
+    command = (replicated && options.coordinator) ? COM_PROXY_QUERY : COM_QUERY;
+
+    /* With two-phase commit, the client only hears
+     * the outcome once every backend has answered */
+    results = backend_fanout(topo->backends, conns, num, command, trans_id, query, length, first,
+        options.two_pc ? NULL : proxy, &result, status);
+
+    if (options.two_pc) {
+        all = (num >= 64) ? ~0ULL : ((ulonglong) 1 << num) - 1;
+
+        if (results == all) {
+            proxy_vdebug("Committing on %d backends", num);
+            gettimeofday(&start, NULL);
+            results = backend_fanout(topo->backends, conns, num, COM_QUERY, 0, "COMMIT", 6, first, NULL, NULL, status);
+            proxy_latency_record(proxy_latency_site(LATENCY_COMMIT), &start);
+
+            /* Backends missing from the result didn't commit */
+            if (results == all) {
+                proxy_net_send_ok(proxy, result.ok.warnings, result.ok.affected_rows, result.ok.insert_id);
+            } else {
+                proxy_log(LOG_ERROR, "Commit failed on some of %d backends", num);
+                proxy_net_send_error(proxy, ER_ERROR_DURING_COMMIT, "Couldn't commit transaction on all backends");
+            }
+        } else {
+            proxy_vdebug("Rolling back on %d backends", num);
+            backend_fanout(topo->backends, conns, num, COM_QUERY, 0, "ROLLBACK", 8, first, NULL, NULL, status);
+            proxy_net_send_error(proxy, ER_ERROR_DURING_COMMIT, "Couldn't commit transaction");
+        }
+    }
+
+    free(conns);
+    backend_commit_leave();
+    proxy_pool_return(backend_thread_pool, ti);
+    backend_query_leave();
+
+    return results;
+}
+
+/**
+ * Check if a statement starts a transaction.
+ *
+ * @param query Query string to check.
+ *
+ * @return TRUE if the statement is BEGIN or START TRANSACTION, FALSE otherwise.
+ **/
+static my_bool backend_query_begins(const char *query) {
+    while (*query == ' ' || *query == '\t' || *query == '\r' || *query == '\n')
+        query++;
+
+    return (!strncasecmp(query, "BEGIN", 5)
+        || !strncasecmp(query, "START TRANSACTION", 17)) ? TRUE : FALSE;
+}
+
+/**
+ * Check if a statement ends a transaction.
+ *
+ * @param query       Query string to check.
+ * @param[out] commit TRUE if the statement commits, FALSE if it rolls back.
+ *
+ * @return TRUE if the statement is COMMIT or ROLLBACK, FALSE otherwise.
+ **/
+static my_bool backend_query_ends(const char *query, my_bool *commit) {
+    while (*query == ' ' || *query == '\t' || *query == '\r' || *query == '\n')
+        query++;
+
+    *commit = strncasecmp(query, "COMMIT", 6) ? FALSE : TRUE;
+    if (*commit)
+        return TRUE;
+
+    /* Rolling back to a savepoint keeps the transaction open */
+    return (!strncasecmp(query, "ROLLBACK", 8) && !backend_query_has(query + 8, "TO")) ? TRUE : FALSE;
+}
+
+/**
+ * Check if backends were added, removed or cloned since a transaction
+ * started. Backends which join later never saw its statements, so it
+ * can't be committed. Read-only transactions only run on one backend,
+ * so only need the backends to stay in place. Must be called while
+ * counted in ::committing.
+ *
+ * @param topo     Current topology.
+ * @param conn_idx Session running the transaction.
+ *
+ * @return TRUE if the transaction must be rolled back, FALSE otherwise.
+ **/
+static inline my_bool backend_trans_changed(backend_topo_t *topo, proxy_conn_idx_t *conn_idx) {
+    return (topo->version != conn_idx->trans_version
+        || (!conn_idx->trans_readonly && (int) clone_generation != conn_idx->trans_generation)) ? TRUE : FALSE;
+}
+
+/**
+ * Send a statement of a client transaction on the backend thread
+ * connections held by the transaction. Writes go to every backend
+ * without being committed and reads only to the backend answering
+ * the client. Commit happens once, when the client ends the
+ * transaction, so statements may also return result sets.
+ *
+ * Clones are only held off while a statement runs, so an idle client
+ * can't stall them. If backends change in the meantime, the next
+ * statement rolls the transaction back and fails as a deadlock
+ * would, so the client can retry it.
+ *
+ * Transactions started with START TRANSACTION READ ONLY run only on
+ * the first backend, without waiting for clones to join, and writes
+ * the mapper sends to all backends are refused.
+ *
+ * @param conn_idx       Session running the transaction.
+ * @param proxy          MYSQL object to forward results to.
+ * @param query          Query string to execute.
+ * @param length         Length of the query.
+ * @param map            Query map chosen for the statement.
+ * @param[in,out] status Status information for the connection.
+ *
+ * @return TRUE on error, FALSE otherwise.
+ **/
+static my_bool backend_query_trans(proxy_conn_idx_t *conn_idx, MYSQL *proxy, const char *query, ulong length, proxy_query_map_t map, status_t *status) {
+    backend_topo_t *topo;
+    enum enum_server_command command;
+    proxy_backend_conn_t **conns;
+    ulonglong results, all;
+    my_bool error, commit, begins;
+    int num, bi, first;
+
+    if (conn_idx->trans_ti >= 0 && backend_query_ends(query, &commit))
+        return backend_trans_end(conn_idx, proxy, commit, status);
+
+    /* Hold one connection to each backend until the transaction ends */
+    begins = (conn_idx->trans_ti < 0);
+    if (begins) {
+        conn_idx->trans_ti = proxy_pool_get(backend_thread_pool);
+        conn_idx->trans_readonly = backend_query_readonly(query);
+    }
+
+    /* Keep clones from starting during the statement. Transactions
+     * aren't logged for new clones, so new ones which may write
+     * wait for any clones to finish joining. */
+    (void) __sync_fetch_and_add(&querying, 1);
+    while (1) {
+        backend_commit_enter();
+        if (!begins || conn_idx->trans_readonly || !proxy_epoch_current())
+            break;
+
+        backend_commit_leave();
+        proxy_wait(WAIT_QUERY_CLONE, !proxy_epoch_current());
+    }
+
+    topo = backend_topo;
+    if (begins) {
+        conn_idx->trans_first = rand() % topo->num;
+        conn_idx->trans_ok = TRUE;
+        conn_idx->trans_id = options.add_ids ? __sync_fetch_and_add(&transaction_id, 1) : 0;
+        conn_idx->trans_version = topo->version;
+        conn_idx->trans_generation = (int) clone_generation;
+
+        proxy_vdebug("Starting transaction %lu on backend threads %d",
+            conn_idx->trans_id, conn_idx->trans_ti);
+    } else if (backend_trans_changed(topo, conn_idx)) {
+        proxy_log(LOG_ERROR, "Backends changed during transaction %lu, "
+            "which will be rolled back", conn_idx->trans_id);
+        backend_commit_leave();
+        backend_query_leave();
+
+        backend_trans_end(conn_idx, NULL, FALSE, status);
+        return proxy_net_send_error(proxy, ER_LOCK_DEADLOCK,
+            "Backends changed during transaction, which was rolled back; try restarting transaction");
+    }
+
+    num = topo->num;
+    first = conn_idx->trans_first;
+    conns = (proxy_backend_conn_t**) malloc(num * sizeof(proxy_backend_conn_t*));
+    for (bi=0; bi<num; bi++)
+        conns[bi] = topo->threads[bi][conn_idx->trans_ti].data.backend.conn;
+
+    if (conn_idx->trans_readonly && map == QUERY_MAP_ALL && !begins) {
+        /* Only one backend would see the write */
+        proxy_net_send_error(proxy, ER_NOT_ALLOWED_COMMAND, "Cannot execute statement in a READ ONLY transaction");
+        error = TRUE;
+    } else if (!conn_idx->trans_readonly && (map == QUERY_MAP_ALL || backend_query_begins(query))) {
+        status->queries_all++;
+        command = options.coordinator ? COM_PROXY_QUERY : COM_QUERY;
+        results = backend_fanout(topo->backends, conns, num, command, conn_idx->trans_id, query, length, first, proxy, NULL, status);
+
+        /* A statement which fails everywhere has been reported to the
+         * client and leaves backends alike, but partial failures can't
+         * be committed */
+        all = (num >= 64) ? ~0ULL : ((ulonglong) 1 << num) - 1;
+        if (results && results != all && conn_idx->trans_ok) {
+            proxy_log(LOG_ERROR, "Statement failed on some backends in transaction %lu, "
+                "which will be rolled back", conn_idx->trans_id);
+            conn_idx->trans_ok = FALSE;
+        }
+
+        error = (results != all);
+    } else {
+        status->queries_any++;
+        if (conn_idx->trans_readonly)
+            status->queries_readonly++;
+        error = backend_query(conns[first], topo->backends[first], proxy, query, length, FALSE, 0, first, NULL, status);
+    }
+
+    free(conns);
+    backend_commit_leave();
+
+    /* A read-only transaction which failed to start holds nothing */
+    if (begins && error && conn_idx->trans_readonly) {
+        proxy_pool_return(backend_thread_pool, conn_idx->trans_ti);
+        conn_idx->trans_ti = -1;
+    }
+    backend_query_leave();
+
+    return error;
+}
+
+/**
+ * End the open transaction of a session on every backend and
+ * release the connections it holds. The transaction is only
+ * committed if every statement had the same outcome everywhere.
+ * Read-only transactions only end on the backend they ran on.
+ *
+ * @param conn_idx       Session running the transaction.
+ * @param proxy          MYSQL object to send the outcome to, or NULL.
+ * @param commit         TRUE if the client asked to commit,
+ *                       FALSE to roll back.
+ * @param[in,out] status Status information for the connection.
+ *
+ * @return TRUE on error, FALSE otherwise.
+ **/
+static my_bool backend_trans_end(proxy_conn_idx_t *conn_idx, MYSQL *proxy, my_bool commit, status_t *status) {
+    backend_topo_t *topo;
+    proxy_backend_conn_t **conns;
+    my_bool error = FALSE, committed = FALSE, changed;
+    struct timeval start;
+    ulonglong all;
+    int num, bi, first, lo;
+
+    /* Clones are held off only while the outcome is sent */
+    (void) __sync_fetch_and_add(&querying, 1);
+    backend_commit_enter();
+
+    topo = backend_topo;
+    changed = backend_trans_changed(topo, conn_idx);
+    if (changed && commit)
+        proxy_log(LOG_ERROR, "Backends changed during transaction %lu, "
+            "which will be rolled back", conn_idx->trans_id);
+
+    /* A removed backend may have held the first response */
+    num = topo->num;
+    first = conn_idx->trans_first % num;
+    conns = (proxy_backend_conn_t**) malloc(num * sizeof(proxy_backend_conn_t*));
+    for (bi=0; bi<num; bi++)
+        conns[bi] = topo->threads[bi][conn_idx->trans_ti].data.backend.conn;
+
+    /* Only the first backend saw a read-only transaction */
+    lo = 0;
+    if (conn_idx->trans_readonly) {
+        lo = first;
+        first = 0;
+        num = 1;
+    }
+
+    if (commit && conn_idx->trans_ok && !changed) {
+        proxy_vdebug("Committing transaction %lu on %d backends", conn_idx->trans_id, num);
+        all = (num >= 64) ? ~0ULL : ((ulonglong) 1 << num) - 1;
+        gettimeofday(&start, NULL);
+        committed = backend_fanout(topo->backends + lo, conns + lo, num, COM_QUERY, 0, "COMMIT", 6,
+            first, NULL, NULL, status) == all;
+        proxy_latency_record(proxy_latency_site(LATENCY_COMMIT), &start);
+    } else {
+        proxy_vdebug("Rolling back transaction %lu on %d backends", conn_idx->trans_id, num);
+        backend_fanout(topo->backends + lo, conns + lo, num, COM_QUERY, 0, "ROLLBACK", 8, first, NULL, NULL, status);
+    }
+
+    /* A requested commit which didn't happen everywhere is an error */
+    if (proxy) {
+        if (committed || !commit)
+            error = proxy_net_send_ok(proxy, 0, 0, 0);
+        else if (changed)
+            error = proxy_net_send_error(proxy, ER_LOCK_DEADLOCK,
+                "Backends changed during transaction, which was rolled back; try restarting transaction");
+        else
+            error = proxy_net_send_error(proxy, ER_ERROR_DURING_COMMIT, "Couldn't commit transaction");
+    }
+
+    free(conns);
+    backend_commit_leave();
+    proxy_pool_return(backend_thread_pool, conn_idx->trans_ti);
+    conn_idx->trans_ti = -1;
+    backend_query_leave();
+
+    return error;
+}
+
+/**
+ * Check that a query is a single statement which parses the same
+ * when joined with others. Semicolons and comments outside literals
+ * are rejected, as are unterminated literals and any backslash, since
+ * whether a backslash escapes a quote depends on the SQL mode. Only
+ * trailing semicolons and whitespace are allowed.
+ *
+ * @param query  Query string to check.
+ * @param length Length of the query.
+ *
+ * @return TRUE if the query is a single statement, FALSE otherwise.
+ **/
+static my_bool backend_query_single(const char *query, ulong length) {
+    char c, quote = 0;
+    ulong i;
+
+    for (i=0; i<length; i++) {
+        c = query[i];
+
+        if (c == '\0' || c == '\\')
+            return FALSE;
+
+        /* Quotes in literals are escaped by doubling them */
+        if (quote) {
+            if (c == quote) {
+                if (i+1 < length && query[i+1] == quote)
+                    i++;
+                else
+                    quote = 0;
+            }
+            continue;
+        }
+
+        switch (c) {
+            case '\'':
+            case '"':
+            case '`':
+                quote = c;
+                break;
+            case '#':
+                return FALSE;
+            case '-':
+                if (i+1 < length && query[i+1] == '-')
+                    return FALSE;
+                break;
+            case '/':
+                if (i+1 < length && query[i+1] == '*')
+                    return FALSE;
+                break;
+            case ';':
+                for (; i<length; i++) {
+                    c = query[i];
+                    if (c != ';' && c != ' ' && c != '\t' && c != '\r' && c != '\n')
+                        return FALSE;
+                }
+                return TRUE;
+        }
+    }
+
+    return quote ? FALSE : TRUE;
+}
+
+/**
+ * Check if a replicated statement is a single plain write
+ * which can be sent as part of a batch.
+ *
+ * @param query  Query string to check.
+ * @param length Length of the query.
+ *
+ * @return TRUE if the statement can be batched, FALSE otherwise.
+ **/
+static my_bool backend_query_batchable(const char *query, ulong length) {
+    const char *start = query;
+
+    while (*query == ' ' || *query == '\t' || *query == '\r' || *query == '\n')
+        query++;
+
+    if (strncasecmp(query, "INSERT", 6)
+            && strncasecmp(query, "UPDATE", 6)
+            && strncasecmp(query, "DELETE", 6)
+            && strncasecmp(query, "REPLACE", 7))
+        return FALSE;
+
+    return backend_query_single(start, length);
+}
+
+/**
+ * Send a batch of writes to all backends as one multi-statement
+ * query on a backend thread connection, and split the responses
+ * back to each write. A backend stops executing a batch at the
+ * first failed statement, so any remaining writes are sent again.
+ * Nothing is sent again once a connection fails, since the writes
+ * may have been applied before the connection was lost.
+ *
+ * @param items Writes in the batch, which must each be
+ *              a single statement as checked by
+ *              ::backend_query_batchable.
+ * @param count Number of writes in the batch.
+ **/
+static void backend_batch_send(backend_batch_item_t **items, int count) {
+    backend_topo_t *topo;
+    int num, bi, ti, i, first;
+    ulong *offsets, total = 0, len;
+    backend_result_t result;
+    proxy_backend_conn_t *conn;
+    my_bool *sent, inflight;
+    char *buf;
+
+    /* Join the writes, ending each statement on a new line */
+    for (i=0; i<count; i++)
+        total += items[i]->length + 2;
+    buf = (char*) malloc(total);
+    offsets = (ulong*) malloc(count * sizeof(ulong));
+
+    if (!buf || !offsets) {
+        proxy_log(LOG_ERROR, "Couldn't allocate batch of %d writes", count);
+
+        for (i=0; i<count; i++) {
+            items[i]->result.errnum = ER_OUT_OF_RESOURCES;
+            strcpy(items[i]->result.errmsg, "Out of memory sending batch");
+        }
+
+        free(offsets);
+        free(buf);
+        return;
+    }
+
+    for (i=0, total=0; i<count; i++) {
+        len = items[i]->length;
+        while (len > 0 && strchr(" \t\r\n;", items[i]->query[len-1]))
+            len--;
+
+        offsets[i] = total;
+        memcpy(buf + total, items[i]->query, len);
+        total += len;
+
+        if (i < count - 1) {
+            buf[total++] = '\n';
+            buf[total++] = ';';
+        }
+    }
+
+    (void) __sync_fetch_and_add(&querying, 1);
+    ti = proxy_pool_get(backend_thread_pool);
+    backend_commit_enter();
+
+    /* Only read the topology once removals are held off */
+    topo = backend_topo;
+    num = topo->num;
+    first = rand() % num;
+
+    sent = (my_bool*) malloc(num * sizeof(my_bool));
+    if (!sent) {
+        proxy_log(LOG_ERROR, "Couldn't allocate batch of %d writes", count);
+
+        for (i=0; i<count; i++) {
+            items[i]->result.errnum = ER_OUT_OF_RESOURCES;
+            strcpy(items[i]->result.errmsg, "Out of memory sending batch");
+        }
+
+        num = 0;
+    }
+
+    for (i=0; i<count; i++)
+        items[i]->backends = num;
+
+    /* Send the batch to every backend before reading anything */
+    for (bi=0; bi<num; bi++) {
+        conn = topo->threads[bi][ti].data.backend.conn;
+        sent[bi] = conn->mysql && !simple_command(conn->mysql, COM_QUERY, (uchar*) buf, total, 1);
+
+        if (sent[bi])
+            (void) __sync_fetch_and_add(&topo->backends[bi]->inflight, 1);
+        else
+            proxy_log(LOG_ERROR, "Error sending batch to backend %d", bi);
+    }
+
+    /* Read one response for each write */
+    for (bi=0; bi<num; bi++) {
+        conn = topo->threads[bi][ti].data.backend.conn;
+        inflight = sent[bi];
+
+        for (i=0; i<count; i++) {
+            memset(&result, 0, sizeof(result));
+
+            if (sent[bi] && backend_fanout_read(conn, NULL, &result, NULL)) {
+                items[i]->results |= (ulonglong) 1 << bi;
+            } else if (!result.errnum) {
+                result.errnum = ER_ERROR_WHEN_EXECUTING_COMMAND;
+                strcpy(result.errmsg, "Couldn't execute query on backend");
+            }
+
+            if (bi == first)
+                items[i]->result = result;
+
+            /* Fail the rest of the batch on a lost connection */
+            if (result.lost) {
+                sent[bi] = FALSE;
+                continue;
+            }
+
+            /* Resend what follows a write the backend rejected */
+            if (sent[bi] && result.errnum && i < count - 1) {
+                proxy_vdebug("Resending %d writes to backend %d", count - i - 1, bi);
+                sent[bi] = conn->mysql && !simple_command(conn->mysql, COM_QUERY,
+                    (uchar*) buf + offsets[i+1], total - offsets[i+1], 1);
+            }
+        }
+
+        if (inflight)
+            (void) __sync_fetch_and_sub(&topo->backends[bi]->inflight, 1);
+    }
+
+    backend_commit_leave();
+    proxy_pool_return(backend_thread_pool, ti);
+    backend_query_leave();
+
+    free(sent);
+    free(offsets);
+    free(buf);
+}
+
+/**
+ * Send a replicated write as part of a batch with other writes
+ * arriving at the same time. The first write to arrive waits for
+ * the batch to fill or for the batch window to pass, and then sends
+ * the batch on behalf of all writes in it.
+ *
+ * @param proxy          MYSQL object to forward results to.
+ * @param query          Query string to execute.
+ * @param length         Length of the query.
+ * @param[in,out] status Status information for the connection.
+ *
+ * @return TRUE on error, FALSE otherwise.
+ **/
+static my_bool backend_query_batched(MYSQL *proxy, const char *query, ulong length, status_t *status) {
+    backend_batch_item_t item, *next, **items;
+    struct timeval now;
+    struct timespec deadline;
+    ulonglong all;
+    int count, i, wait_errno = 0;
+
+    memset(&item, 0, sizeof(item));
+    item.query = query;
+    item.length = length;
+    status->queries_batched++;
+
+    proxy_mutex_lock(&batch_lock);
+
+    if (batch_tail)
+        batch_tail->next = &item;
+    else
+        batch_head = &item;
+    batch_tail = &item;
+    batch_count++;
+
+    if (batch_leader) {
+        /* Wake the leader if the batch is full */
+        if (batch_count >= options.batch_writes)
+            proxy_cond_signal(&batch_cv);
+
+        while (!item.done)
+            proxy_cond_wait(&batch_done_cv, &batch_lock);
+    } else {
+        batch_leader = TRUE;
+
+        /* Wait for other writes to join the batch */
+        gettimeofday(&now, NULL);
+        now.tv_usec += options.batch_wait;
+        deadline.tv_sec  = now.tv_sec + now.tv_usec / 1000000;
+        deadline.tv_nsec = (now.tv_usec % 1000000) * 1000;
+
+        while (batch_count < options.batch_writes && !wait_errno)
+            wait_errno = pthread_cond_timedwait(&batch_cv, &batch_lock, &deadline);
+
+        /* Take the batch, letting the next write start another */
+        count = batch_count;
+        next = batch_head;
+        batch_head = batch_tail = NULL;
+        batch_count = 0;
+        batch_leader = FALSE;
+        proxy_mutex_unlock(&batch_lock);
+
+        items = (backend_batch_item_t**) malloc(count * sizeof(backend_batch_item_t*));
+        if (!items) {
+            proxy_log(LOG_ERROR, "Couldn't allocate batch of %d writes", count);
+
+            proxy_mutex_lock(&batch_lock);
+            for (; next; next=next->next) {
+                next->result.errnum = ER_OUT_OF_RESOURCES;
+                strcpy(next->result.errmsg, "Out of memory sending batch");
+                next->done = TRUE;
+            }
+            proxy_cond_broadcast(&batch_done_cv);
+        } else {
+            for (i=0; i<count; i++, next=next->next)
+                items[i] = next;
+
+            proxy_vdebug("Sending batch of %d writes", count);
+            backend_batch_send(items, count);
+
+            proxy_mutex_lock(&batch_lock);
+            for (i=0; i<count; i++)
+                items[i]->done = TRUE;
+            proxy_cond_broadcast(&batch_done_cv);
+
+            free(items);
+        }
+    }
+
+    proxy_mutex_unlock(&batch_lock);
+
+    /* Reply with the result from a single backend */
+    if (item.result.errnum)
+        proxy_net_send_error(proxy, item.result.errnum, item.result.errmsg);
+    else
+        proxy_net_send_ok(proxy, item.result.ok.warnings, item.result.ok.affected_rows, item.result.ok.insert_id);
+
+    /* Check against the topology the batch was actually sent with */
+    all = (item.backends >= 64) ? ~0ULL : ((ulonglong) 1 << item.backends) - 1;
+    return !item.backends || (item.results & all) != all;
+}
+
+/**
+ * Free writes at the head of the log which every backend has
+ * applied and no client is waiting on. The log lock must be held.
+ **/
+static void backend_replog_trim() {
+    backend_replog_entry_t *entry;
 
-        /* Send the query to the backend server */
-        backend_query(thread->data.backend.conn, query->proxy,
-                      query->query, *(query->length), TRUE,
-                      thread->data.backend.bi, thread->commit, thread->status);
+    while (replog_head && !replog_head->applying && !replog_head->refs) {
+        entry = replog_head;
+        replog_head = entry->next;
+        if (!replog_head)
+            replog_tail = NULL;
 
-        /* Signify thread availability */
-        query->query = NULL;
+        free(entry->query);
+        free(entry);
     }
-
-    proxy_debug("Exiting loop on backend %d, thread %d", thread->data.backend.bi, thread->id);
-    pthread_exit(NULL);
 }
 
 /**
- * Request a set of connection identifiers which can be passed in
- * when making future queries to the backend for a connection.
+ * Count a backend out of a logged write once it has answered or
+ * skipped it, and reply once a quorum has answered. When the last
+ * backend is done, clones may go ahead and the write may be freed.
+ * The log lock must be held.
  *
- * @param[out] conn_idx Storage for connection identifiers.
- * @param thread_id     Identifier of the thread requesting the connection.
+ * @param entry Write the backend is done with.
  **/
-void proxy_backend_get_connection(proxy_conn_idx_t *conn_idx, int thread_id) {
-    conn_idx->bi = rand() % backend_num;
-    conn_idx->ci = backend_pools ?
-        proxy_pool_get(backend_pools[conn_idx->bi]) : thread_id;
+static void backend_replog_finish(backend_replog_entry_t *entry) {
+    backend_topo_t *topo;
+    int i, need, live, phase;
+
+    /* A write with no quorum size waits for all backends
+     * which have not been given up on */
+    live = entry->backends - entry->skips;
+    need = (options.write_quorum > 0 && options.write_quorum < live)
+        ? options.write_quorum : live;
+
+    if (!entry->done && (entry->acks >= need || entry->fails > live - need)) {
+        entry->success = (entry->acks >= need && need > 0);
+        entry->done = TRUE;
+        proxy_cond_broadcast(&replog_done_cv);
+    }
 
-    proxy_vdebug("Assigning thread %d connection %d on backend %d",
-        thread_id, conn_idx->ci, conn_idx->bi);
+    if (--entry->applying > 0)
+        return;
+
+    /* Once all backends have answered, backends which failed a
+     * write others applied can no longer be read from, and
+     * clones may go ahead since no backend is missing the write */
+    phase = backend_topo_enter();
+    topo = backend_topo;
+
+    for (i=0; i<entry->backends && i<topo->num; i++) {
+        if (entry->acks && !(entry->results & ((ulonglong) 1 << i)) && !topo->backends[i]->diverged) {
+            proxy_log(LOG_ERROR, "Backend %d failed logged write %lu, marking diverged", i, entry->seq);
+            topo->backends[i]->diverged = TRUE;
+            topo->backends[i]->stale = TRUE;
+            backend_replog_release(topo->backends[i]);
+        }
+    }
+
+    backend_topo_leave(phase);
+
+    backend_commit_leave();
+    backend_replog_trim();
 }
 
 /**
- * Release a connection for further use by other backends.
+ * Skip the writes a backend which was given up on has yet to apply,
+ * so a backend which stopped answering doesn't hold up the log. A
+ * write being applied is left to the log applier. The log lock must
+ * be held.
  *
- * @param conn_idx Pointer to the connection to be released.
+ * @param host Backend which was marked diverged.
  **/
-void proxy_backend_release_connection(proxy_conn_idx_t *conn_idx) {
-    proxy_vdebug("Releasing connection %d on backend %d",
-        conn_idx->ci, conn_idx->bi);
+static void backend_replog_release(proxy_host_t *host) {
+    backend_replog_entry_t *entry, *next;
+
+    entry = host->replog_next;
+    if (entry && entry == host->replog_busy)
+        entry = entry->next;
+    host->replog_next = NULL;
+
+    for (; entry; entry=next) {
+        next = entry->next;
+        host->applied = entry->seq;
+        entry->skips++;
+        backend_replog_finish(entry);
+    }
 
-    if (backend_pools)
-        proxy_pool_return(backend_pools[conn_idx->bi], conn_idx->ci);
-    conn_idx->bi = -1;
-    conn_idx->ci = -1;
+    /* Sessions waiting on the backend can now move */
+    proxy_cond_broadcast(&replog_done_cv);
 }
 
 /**
- * Send a query to the backend and return the results to the client.
+ * Send a replicated write to all backends through the write log,
+ * replying to the client once a quorum of backends has applied it.
+ * Remaining backends catch up in the background and are not used
+ * for reads while they lag too far behind. Backends which fall more
+ * than ::REPLOG_MAX writes behind are given up on and marked diverged.
  *
- * @param proxy          MySQL object corresponding to the client connection.
- * @param conn_idx       Connection to use for this query if we need a single
- *                       backend.
- * @param query          A query string received from the client.
- * @param length         Length of the query string.
+ * @param[in,out] conn_idx Session sending the write, which
+ *                       records its position in the log.
+ * @param proxy          MYSQL object to forward results to.
+ * @param query          Query string to execute.
+ * @param length         Length of the query.
  * @param replicated     TRUE if the query is replicated across servers,
  *                       FALSE otherwise.
- * @param commit         Data required for synchronization and
- *                       two-phase commit.
+ * @param trans_id       ID of the transaction, or zero.
  * @param[in,out] status Status information for the connection.
  *
  * @return TRUE on error, FALSE otherwise.
  **/
-my_bool proxy_backend_query(MYSQL *proxy, proxy_conn_idx_t *conn_idx, char *query, ulong length, my_bool replicated, commitdata_t *commit, status_t *status) {
-    int bi = -1, i, ti;
-    proxy_query_map_t map = QUERY_MAP_ANY;
-    my_bool error = FALSE;
-    char *newq = NULL;
-    pthread_barrier_t query_barrier;
-    proxy_backend_query_t *bquery;
-    proxy_thread_t *thread;
-    ulonglong results=0;
+static my_bool backend_query_quorum(proxy_conn_idx_t *conn_idx, MYSQL *proxy, const char *query, ulong length, my_bool replicated, ulong trans_id, __attribute__((unused)) status_t *status) {
+    backend_topo_t *topo = backend_topo;
+    backend_replog_entry_t *entry;
+    backend_result_t result;
+    proxy_host_t *host;
+    my_bool success;
+    int bi;
 
-    (void) __sync_fetch_and_add(&global_running, 1);
+    (void) __sync_fetch_and_add(&querying, 1);
 
-    /* Get the query map and modified query
-     * if a mapper was specified */
-    if (backend_mapper) {
-        map = (*backend_mapper)(query, &length, &newq);
+    /* Clones wait until every backend has applied the
+     * write, which is signalled by the last log applier */
+    backend_commit_enter();
 
-        /* If the query was modified by the mapper,
-         * switch to the new query string */
-        if (newq) {
-            free(query);
-            query = newq;
-        }
-        proxy_vvdebug("Query %s mapped to %d", query, (int) map);
-    }
+    entry = (backend_replog_entry_t*) calloc(1, sizeof(backend_replog_entry_t));
+    if (!entry || !(entry->query = (char*) malloc(length))) {
+        proxy_log(LOG_ERROR, "Couldn't allocate logged write");
+        free(entry);
 
-    /* Add an identifier to the query if necessary */
-    if (map == QUERY_MAP_ALL) {
-        if (options.add_ids)
-            length += sprintf(query + length, "-- %lu",
-                __sync_fetch_and_add(&transaction_id, 1));
+        backend_commit_leave();
+        backend_query_leave();
+        proxy_net_send_error(proxy, ER_OUT_OF_RESOURCES, "Out of memory logging write");
+        return TRUE;
     }
 
-    /* If we are coordinating, base replication status
-     * on the query mapper */
-    if (options.coordinator)
-        replicated = (map == QUERY_MAP_ALL) ? TRUE : FALSE;
+    memcpy(entry->query, query, length);
+    entry->length = length;
+    entry->command = (replicated && options.coordinator) ? COM_PROXY_QUERY : COM_QUERY;
+    entry->trans_id = trans_id;
+    entry->refs = 1;
 
-    /* Speed things up with only one backend
-     * by avoiding synchronization */
-    if (backend_num == 1)
-        map = QUERY_MAP_ANY;
+    proxy_mutex_lock(&replog_lock);
 
-    switch (map) {
-        case QUERY_MAP_ANY:
-            status->queries_any++;
+    entry->seq = ++replog_seq;
+    entry->backends = entry->applying = topo->num;
 
-            if (backend_query_idx(conn_idx->bi, conn_idx->ci, proxy, query, length, replicated, status)) {
-                error = TRUE;
-                goto out;
-            }
-            break;
+    for (bi=0; bi<topo->num; bi++) {
+        host = topo->backends[bi];
 
-        case QUERY_MAP_ALL:
-            status->queries_all++;
+        /* Stop reading from backends which fall too far behind */
+        if (options.stale_lag && !host->stale && entry->seq - host->applied > (ulong) options.stale_lag) {
+            proxy_log(LOG_INFO, "Backend %d is %lu writes behind, marking stale", bi, entry->seq - host->applied);
+            host->stale = TRUE;
+        }
 
-            /* Send a query to the other backends and keep only the first result */
-            (void) __sync_fetch_and_add(&querying, 1);
+        /* Give up on backends which would keep the log growing */
+        if (!host->diverged && entry->seq - host->applied > REPLOG_MAX) {
+            proxy_log(LOG_ERROR, "Backend %d is %lu writes behind, marking diverged", bi, entry->seq - host->applied);
+            host->diverged = TRUE;
+            host->stale = TRUE;
+            backend_replog_release(host);
+        }
 
-            /* Wait until cloning is done */
-            while (cloning) { usleep(SYNC_SLEEP); }
+        /* Backends which were given up on don't hold up the write */
+        if (host->diverged) {
+            host->applied = entry->seq;
+            entry->skips++;
+            backend_replog_finish(entry);
+        } else if (!host->replog_next) {
+            host->replog_next = entry;
+        }
+    }
 
-            /* Set up synchronization */
-            pthread_barrier_init(&query_barrier, NULL, backend_num + 1);
+    /* Append the write to the log */
+    if (replog_tail)
+        replog_tail->next = entry;
+    else
+        replog_head = entry;
+    replog_tail = entry;
 
-            bi = rand() % backend_num;
-            ti = proxy_pool_get(backend_thread_pool);
-            for (i=0; i<backend_num; i++) {
-                /* Get the next backend */
-                bi = (bi + 1) % backend_num;
+    proxy_cond_broadcast(&replog_apply_cv);
 
-                /* Dispatch threads for backend queries */
-                thread = &(backend_threads[bi][ti]);
-                thread->status = status;
+    /* Wait for a quorum of backends to answer */
+    while (!entry->done)
+        proxy_cond_wait(&replog_done_cv, &replog_lock);
 
-                proxy_mutex_lock(&(thread->lock));
+    success = entry->success;
+    result = entry->result;
+    if (conn_idx)
+        conn_idx->write_seq = entry->seq;
 
-                bquery         = &(thread->data.backend.query);
-                bquery->query  = query;
-                bquery->length = &length;
-                bquery->proxy  = (i == 0) ? proxy : NULL;
+    entry->refs--;
+    backend_replog_trim();
+    proxy_mutex_unlock(&replog_lock);
 
-                /* Set up commit data */
-                commit->backends   = backend_num;
-                commit->results    = &results;
-                commit->barrier    = &query_barrier;
-                commit->committing = 0;
-                thread->commit     = commit;
+    if (success)
+        proxy_net_send_ok(proxy, result.ok.warnings, result.ok.affected_rows, result.ok.insert_id);
+    else
+        proxy_net_send_error(proxy, result.errnum, result.errmsg);
 
-                proxy_cond_signal(&thread->cv);
-                proxy_mutex_unlock(&thread->lock);
-            }
+    backend_query_leave();
 
-            /* Wait until all queries are complete */
-            pthread_barrier_wait(&query_barrier);
+    return !success;
+}
 
-            /* Free synchronization primitives */
-            pthread_barrier_destroy(&query_barrier);
+/**
+ * Start applying logged writes to a backend. Writes logged
+ * before this point are assumed to be present on the backend.
+ * The backend must be in the published topology.
+ *
+ * @param bi Index of the backend.
+ **/
+static void backend_replog_start(int bi) {
+    backend_topo_t *topo = backend_topo;
+    proxy_thread_t *thread = &topo->threads[bi][0];
+    pthread_attr_t attr;
 
-            /* Wait for the final commit to be performed */
-            pthread_spin_lock(&commit->committed);
-            pthread_spin_unlock(&commit->committed);
+    proxy_mutex_lock(&replog_lock);
+    topo->backends[bi]->applied = replog_seq;
+    topo->backends[bi]->replog_next = NULL;
+    topo->backends[bi]->replog_busy = NULL;
+    proxy_mutex_unlock(&replog_lock);
 
-            /* Release the backend threads */
-            proxy_pool_return(backend_thread_pool, ti);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+    proxy_threading_create(&thread->thread, &attr, backend_replog_thread, (void*) thread);
+}
 
-            /* XXX: should do better at handling failures */
-            for (i=0; i<backend_num; i++)
-                if (!(results & (i==0 ? 1 : 2 << (i-1)))) {
-                    error = TRUE;
-                    /* XXX should print a message if failure is not a malformed query */
-                    //proxy_log(LOG_ERROR, "Failure for query on backend %d\n", i);
-                }
+/**
+ * Apply logged writes to a single backend in order.
+ *
+ * @param ptr Pointer to the thread object of the backend.
+ *
+ * @return NULL.
+ **/
+static void* backend_replog_thread(void *ptr) {
+    proxy_thread_t *thread = (proxy_thread_t*) ptr;
+    proxy_backend_conn_t *conn = thread->data.backend.conn;
+    int bi = thread->data.backend.bi, phase;
+    backend_replog_entry_t *entry;
+    backend_result_t result;
+    proxy_host_t *host;
+    my_bool success;
+    char name[16];
 
-            (void) __sync_fetch_and_sub(&querying, 1);
+    snprintf(name, 16, "Log%d", bi);
+    proxy_threading_name(name);
+    proxy_threading_mask();
+
+    /* Backends aren't removed with a write quorum, so ours stays put */
+    phase = backend_topo_enter();
+    host = backend_topo->backends[bi];
+    backend_topo_leave(phase);
+
+    proxy_mutex_lock(&replog_lock);
 
+    while (1) {
+        /* Wait for new writes to be logged */
+        while (!host->replog_next && !thread->exit)
+            proxy_cond_wait(&replog_apply_cv, &replog_lock);
+
+        if (thread->exit)
             break;
 
-        /* Some unknown value was returned, give up */
-        default:
-            error = TRUE;
-            goto out;
-    }
+        entry = host->replog_next;
 
-out:
-    (void) __sync_fetch_and_sub(&global_running, 1);
-    /* XXX: error reporting should be more verbose */
-    return FALSE;
-}
+        /* Backends which were given up on only release the log */
+        if (host->diverged) {
+            entry->skips++;
+            goto applied;
+        }
 
-/**
- * Forward a query to a specific backend
- *
- * @param bi             Index of the backend to send the query to.
- * @param ci             Index of a connection to use, or negative
- *                       to use any connection.
- * @param proxy          MYSQL object to forward results to.
- * @param query          Query string to execute.
- * @param length         Length of the query.
- * @param replicated     TRUE if the query is replicated across servers,
- *                       FALSE otherwise.
- * @param[in,out] status Status information for the connection.
- *
- * @return TRUE on error, FALSE otherwise.
- **/
-static inline my_bool backend_query_idx(int bi, int ci, MYSQL *proxy, const char *query, ulong length, my_bool replicated, status_t *status) {
-    proxy_backend_conn_t *conn;
-    my_bool error;
+        host->replog_busy = entry;
+        proxy_mutex_unlock(&replog_lock);
 
-    /* Get a backend to use */
-    conn = backend_conns[bi][ci];
+        /* Apply the write without holding the lock */
+        memset(&result, 0, sizeof(result));
+        success = FALSE;
 
-    proxy_vvdebug("Sending read-only query %s to backend %d, connection %d", query, bi, ci);
+        if (conn->mysql && !backend_send_command(conn->mysql, entry->command, entry->trans_id, entry->query, entry->length)) {
+            (void) __sync_fetch_and_add(&host->inflight, 1);
+            success = backend_fanout_read(conn, NULL, &result, NULL);
+            (void) __sync_fetch_and_sub(&host->inflight, 1);
+        } else {
+            proxy_log(LOG_ERROR, "Error sending logged write %lu to backend %d", entry->seq, bi);
+        }
 
-    /*Send the query */
-    error = backend_query(conn, proxy, query, length, replicated, bi, NULL, status);
+        if (!success && !result.errnum) {
+            result.errnum = ER_ERROR_WHEN_EXECUTING_COMMAND;
+            strcpy(result.errmsg, "Couldn't execute query on backend");
+        }
 
-    return error;
+        proxy_mutex_lock(&replog_lock);
+        host->replog_busy = NULL;
+
+        /* Keep the first success and the first error */
+        if (success) {
+            if (!entry->acks)
+                entry->result.ok = result.ok;
+            entry->acks++;
+            entry->results |= (ulonglong) 1 << bi;
+        } else {
+            if (!entry->fails) {
+                entry->result.errnum = result.errnum;
+                strcpy(entry->result.errmsg, result.errmsg);
+            }
+            entry->fails++;
+        }
+
+applied:
+        if (host->applied < entry->seq)
+            host->applied = entry->seq;
+
+        /* Writes after this one were released if the
+         * backend was given up on while applying it */
+        if (host->replog_next == entry)
+            host->replog_next = entry->next;
+
+        /* Wake sessions waiting for their backend to catch up */
+        if (replog_waiters)
+            proxy_cond_broadcast(&replog_done_cv);
+
+        backend_replog_finish(entry);
+
+        /* Resume reads once the backend has caught up */
+        if (host->stale && !host->diverged && host->applied == replog_seq) {
+            proxy_log(LOG_INFO, "Backend %d has caught up", bi);
+            host->stale = FALSE;
+        }
+    }
+
+    proxy_mutex_unlock(&replog_lock);
+
+    proxy_debug("Exiting log applier on backend %d", bi);
+    pthread_exit(NULL);
 }
 
 /**
@@ -1155,6 +4171,8 @@ static inline my_bool backend_query_idx(int bi, int ci, MYSQL *proxy, const char
  * @param success Whether the query succeeded or failed.
  **/
 static inline void backend_query_wait(commitdata_t *commit, int bi, my_bool success) {
+    struct timeval start;
+
     /* If we're sending to multiple backends, wait
      * until everyone is done before sending results */
     if (commit) {
@@ -1163,52 +4181,23 @@ static inline void backend_query_wait(commitdata_t *commit, int bi, my_bool succ
             (void) __sync_fetch_and_or(commit->results, bi == 0 ? 1 : 2 << (bi-1));
 
         if (commit->barrier) {
+            gettimeofday(&start, NULL);
             pthread_barrier_wait(commit->barrier);
+            proxy_latency_record(proxy_latency_site(LATENCY_BARRIER), &start);
             commit->barrier = NULL;
         }
     }
 }
 
 /**
- * Extract the transaction ID from a query string.
- *
- * @param query Query string to parse.
- *
- * @return ID of the transaction or zero on error;
- **/
-static inline ulong id_from_query(const char *query) {
-    char *tok;
-    ulong query_trans_id = 0;
-
-    /* Get the transaction ID from the clone */
-    tok = strrchr(query, '-');
-    if (!tok)
-        return 0;
-
-    errno = 0;
-    tok++;
-    query_trans_id = strtol(tok, NULL, 10);
-
-    /* Check for a valid transaction ID and notify the coordinator */
-    if (errno)
-        return 0;
-    else
-        return query_trans_id;
-}
-
-/**
- * @param success TRUE if the query succeeded here, FALSE otherwise.
- * @param query   Query string where transaction ID can be parsed from.
- * @param mysql   MYSQL object for backend where commit/rollback message should be sent.
+ * @param success        TRUE if the query succeeded here, FALSE otherwise.
+ * @param clone_trans_id ID of the transaction from the coordinator.
+ * @param mysql          MYSQL object for backend where commit/rollback message should be sent.
  **/
-static void backend_clone_query_wait(my_bool success, char *query, MYSQL *mysql) {
-    char buff[BUFSIZ];
-    ulong clone_trans_id = 0;
-    proxy_trans_t trans;
-    int sql_errno;
+static void backend_clone_query_wait(my_bool success, ulong clone_trans_id, MYSQL *mysql) {
+    proxy_trans_t *trans;
 
-    /* Get the transaction ID */
-    clone_trans_id = id_from_query(query);
+    /* Check that the coordinator sent a transaction ID */
     if (clone_trans_id <= 0) {
         proxy_log(LOG_ERROR, "Invalid transaction ID when attempting to complete transaction on clone");
         return;
@@ -1220,43 +4209,23 @@ static void backend_clone_query_wait(my_bool success, char *query, MYSQL *mysql)
         return;
     }
 
-    pthread_spin_lock(&coordinator_lock);
-
-    snprintf(buff, BUFSIZ, "PROXY %s %d %lu;", success ? "SUCCESS" : "FAILURE", server_id, clone_trans_id);
-    proxy_debug("Sending status message %s to coordinator", buff);
-    mysql_query((MYSQL*) coordinator, buff);
-
-    /* If we failed to communicate to the coordinator, we should roll back */
-    if ((sql_errno = mysql_errno((MYSQL*) coordinator)))
-        proxy_log(LOG_ERROR, "Error notifying coordinator about status of transaction %lu: %s",
-                clone_trans_id, mysql_error((MYSQL*) coordinator));
-
-    pthread_spin_unlock(&coordinator_lock);
-
-    if (sql_errno) {
-        mysql_real_query(mysql, "ROLLBACK", 8);
-        return;
-    }
-
-    proxy_debug("Successfully notified coordinator about status of transaction %lu, adding to hash table",
-            clone_trans_id);
+    /* Add the transaction to the table before reporting
+     * so the decision always finds it */
+    trans = proxy_trans_new();
+    trans->total = 1;
+    trans->success = success;
+    proxy_trans_insert(clone_trans_id, trans);
 
-    /* Initialize transaction commit data and insert into hash table */
-    proxy_cond_init(&trans.cv);
-    proxy_mutex_init(&trans.cv_mutex);
-    trans.num = 0;
-    trans.done = 0;
-    trans.total = 1;
-    trans.clone_ids = NULL;
-    proxy_trans_insert(clone_trans_id, &trans);
+    proxy_debug("Queueing status of transaction %lu for coordinator", clone_trans_id);
+    proxy_coord_send(clone_trans_id, trans);
 
     /* Wait to receive the commit or rollback info */
     proxy_debug("Waiting for decision on transaction %lu", clone_trans_id);
-    proxy_mutex_lock(&trans.cv_mutex);
-    while (!trans.num) { proxy_cond_wait(&trans.cv, &trans.cv_mutex); }
+    proxy_mutex_lock(&trans->cv_mutex);
+    while (!trans->num) { proxy_cond_wait(&trans->cv, &trans->cv_mutex); }
 
     /* Execute the commit or rollback */
-    if (trans.success) {
+    if (trans->success) {
         proxy_debug("Committing transaction %lu on clone", clone_trans_id);
         mysql_real_query(mysql, "COMMIT", 6);
     } else {
@@ -1268,11 +4237,10 @@ static void backend_clone_query_wait(my_bool success, char *query, MYSQL *mysql)
         proxy_log(LOG_ERROR, "Error completing transaction %lu on clone: %s",
             clone_trans_id, mysql_error(mysql));
 
-    /* Destroy synchronization primitives and remove from hash table */
-    proxy_mutex_unlock(&trans.cv_mutex);
-    proxy_mutex_destroy(&trans.cv_mutex);
-    proxy_cond_destroy(&trans.cv);
+    /* Remove from hash table and return to the pool */
+    proxy_mutex_unlock(&trans->cv_mutex);
     proxy_trans_remove(clone_trans_id);
+    proxy_trans_free(trans);
 
     return;
 }
@@ -1286,7 +4254,7 @@ static void backend_clone_query_wait(my_bool success, char *query, MYSQL *mysql)
  * @param start_generation      Clone generation ID at the start of query execution.
  * @param mysql                 MySQL object corresponding to the connection
  *                              where the query should be sent.
- * @param query                 Query string to execute.
+ * @param query_trans_id        ID of the transaction, or zero.
  * @param[in,out] success       TRUE if the query was successful, FALSE otherwise.
  * @param bi                    Index of the backend executing the query.
  * @param commit                Data required for synchronization
@@ -1294,15 +4262,15 @@ static void backend_clone_query_wait(my_bool success, char *query, MYSQL *mysql)
  *
  * @return TRUE on error, FALSE otherwise.
  **/
-static my_bool backend_check_commit(my_bool *needs_commit, int start_server_id, int start_generation, MYSQL *mysql, const char *query, my_bool *success, int bi, commitdata_t *commit) {
+static my_bool backend_check_commit(my_bool *needs_commit, int start_server_id, int start_generation, MYSQL *mysql, ulong query_trans_id, my_bool *success, int bi, commitdata_t *commit) {
+    int num = commit ? commit->backends : 1;
     proxy_trans_t *trans = NULL;
-    ulong query_trans_id = 0;
 
     /* Wait for other backends to finish */
     if (options.cloneable && server_id != start_server_id) {
         proxy_debug("Server ID changed after query execution from %d to %d",
             start_server_id, server_id);
-        backend_clone_query_wait(*success, (char*) query, mysql);
+        backend_clone_query_wait(*success, query_trans_id, mysql);
         return TRUE;
     } else {
         backend_query_wait(commit, bi, *success);
@@ -1310,9 +4278,7 @@ static my_bool backend_check_commit(my_bool *needs_commit, int start_server_id,
 
     /* Check if all transactions succeeded and commit or rollback accordingly */
     if (clone_generation != start_generation) {
-        /* Get the query ID and wait for it to be available in the transaction hash table */
-        query_trans_id = id_from_query(query);
-
+        /* Wait for the transaction to be available in the transaction hash table */
         proxy_debug("Cloning happened during query %lu, waiting", query_trans_id);
 
         /* If we are a clone, insert a new transaction into
@@ -1323,20 +4289,15 @@ static my_bool backend_check_commit(my_bool *needs_commit, int start_server_id,
             proxy_debug("Inserting new transaction %lu into hash table on master",
                 query_trans_id);
 
-            trans = (proxy_trans_t*) malloc(sizeof(proxy_trans_t));
+            trans = proxy_trans_new();
             trans->total = proxy_clone_get_num(clone_generation);
-            trans->num = 0;
-            trans->done = 0;
             trans->success = *success;
-            trans->clone_ids = NULL;
-            proxy_mutex_init(&trans->cv_mutex);
-            proxy_cond_init(&trans->cv);
 
             proxy_trans_insert(query_trans_id, trans);
         } else {
             proxy_debug("Waiting for transaction %lu to appear in hash table", query_trans_id);
-            while (!(trans = proxy_trans_search(query_trans_id))
-                && clone_generation != start_generation) { usleep(SYNC_SLEEP); }
+            proxy_wait(WAIT_TRANS, (trans = proxy_trans_search(query_trans_id)) != NULL
+                || clone_generation == start_generation);
         }
 
         /* Check if all clones failed and we rolled back a generation */
@@ -1357,7 +4318,7 @@ static my_bool backend_check_commit(my_bool *needs_commit, int start_server_id,
              * that it can free the transaction from the hash table */
             if (options.coordinator) {
                 trans->done++;
-                if (trans->done >= backend_num-trans->total)
+                if (trans->done >= num-trans->total)
                     proxy_cond_signal(&trans->cv);
             }
 
@@ -1367,11 +4328,10 @@ static my_bool backend_check_commit(my_bool *needs_commit, int start_server_id,
         }
 
         /* If we are a clone, then we added the transaction
-         * to the hash table and must free it */
+         * to the hash table and must remove and free it */
         if (options.cloneable) {
-            proxy_mutex_destroy(&trans->cv_mutex);
-            proxy_cond_destroy(&trans->cv);
-            free(trans);
+            proxy_trans_remove(query_trans_id);
+            proxy_trans_free(trans);
         }
     }
     if (commit && options.two_pc) {
@@ -1388,11 +4348,13 @@ static my_bool backend_check_commit(my_bool *needs_commit, int start_server_id,
  * Forward a query to a backend connection
  *
  * @param conn           Connection where the query should be sent.
+ * @param host           Backend host of the connection.
  * @param proxy          MYSQL object to forward results to.
  * @param query          Query string to execute.
  * @param length         Length of the query.
  * @param replicated     TRUE if the query is replicated across servers,
  *                       FALSE otherwise.
+ * @param trans_id       ID of the transaction, or zero.
  * @param bi             Index of the backend executing the query.
  * @param commit         Data required for synchronization
  *                       and two-phase commit.
@@ -1400,7 +4362,7 @@ static my_bool backend_check_commit(my_bool *needs_commit, int start_server_id,
  *
  * @return TRUE on error, FALSE otherwise.
  **/
-static my_bool backend_query(proxy_backend_conn_t *conn, MYSQL *proxy, const char *query, ulong length, my_bool replicated, int bi, commitdata_t *commit, status_t *status) {
+static my_bool backend_query(proxy_backend_conn_t *conn, proxy_host_t *host, MYSQL *proxy, const char *query, ulong length, my_bool replicated, ulong trans_id, int bi, commitdata_t *commit, status_t *status) {
     my_bool error = FALSE, success = TRUE, needs_commit = FALSE;
     ulong pkt_len = 8, field_count;
     MYSQL *mysql;
@@ -1408,11 +4370,17 @@ static my_bool backend_query(proxy_backend_conn_t *conn, MYSQL *proxy, const cha
     my_ulonglong insert_id=0;
     uint server_status=0, warnings=0;
     int start_server_id, start_generation;
+    struct timeval start, end, phase;
+    long sample;
 
     /* Save cloning information to detect later changes */
     start_server_id = (int) server_id;
     start_generation = (int) clone_generation;
 
+    /* Track outstanding queries for balancing */
+    (void) __sync_fetch_and_add(&host->inflight, 1);
+    gettimeofday(&start, NULL);
+
     /* Check for a valid MySQL object */
     mysql = conn->mysql;
     if (unlikely(!mysql)) {
@@ -1427,7 +4395,7 @@ static my_bool backend_query(proxy_backend_conn_t *conn, MYSQL *proxy, const cha
     /* If this is a replicated command and we are the coordinator,
      * send the query with the COM_PROXY_QUERY command */
     if (replicated && options.coordinator)
-        simple_command(mysql, COM_PROXY_QUERY, (uchar*) query, length, 1);
+        backend_send_command(mysql, COM_PROXY_QUERY, trans_id, query, length);
     else
         mysql_send_query(mysql, query, length);
 
@@ -1459,6 +4427,10 @@ static my_bool backend_query(proxy_backend_conn_t *conn, MYSQL *proxy, const cha
     /* Check the success of the transaction */
     success = (mysql->net.read_pos[0] != 0xFF) ? TRUE : FALSE;
 
+    /* Save the transaction state from an OK packet */
+    if (mysql->net.read_pos[0] == 0)
+        backend_save_status(conn);
+
     /* Signify that we are in commit phase and wait
      * for any outstanding cloning operations.
      * We must be careful that any exit from the function
@@ -1466,27 +4438,16 @@ static my_bool backend_query(proxy_backend_conn_t *conn, MYSQL *proxy, const cha
      * decrementing committing or else we won't be able
      * to clone later. */
     if (replicated && commit) {
-        my_bool cont = FALSE;
-
         /* If some other backend has already started to commit,
          * we need to go ahead as well to avoid deadlock */
-        if (!commit->committing) {
-            while (cloning && !cont) {
-                /* Check if we need to stop waiting and go ahead */
-                while (committing) {
-                    if (commit->committing) {
-                        cont = TRUE;
-                        break;
-                    }
-                    usleep(SYNC_SLEEP);
-                }
-
-                usleep(SYNC_SLEEP);
-            }
-        }
+        proxy_wait(WAIT_COMMIT_CLONE, !cloning || commit->committing);
 
         (void) __sync_fetch_and_add(&committing, 1);
         commit->committing = 1;
+
+        /* Let other backends for this query go ahead */
+        if (cloning)
+            proxy_wait_wake();
     }
 
     /* If this query is replicated, check if needs to be committed */
@@ -1496,11 +4457,13 @@ static my_bool backend_query(proxy_backend_conn_t *conn, MYSQL *proxy, const cha
         if (proxy && commit)
             pthread_spin_lock(&commit->committed);
 
+        gettimeofday(&phase, NULL);
         if (backend_check_commit(&needs_commit, start_server_id, start_generation,
-                mysql, query, &success, bi, commit)) {
+                mysql, trans_id, &success, bi, commit)) {
             error = TRUE;
             goto out;
         }
+        proxy_latency_record(proxy_latency_site(LATENCY_VOTE), &phase);
     } else {
         /* Check if we have been cloned, if so
          * then we can discard query results */
@@ -1513,14 +4476,17 @@ static my_bool backend_query(proxy_backend_conn_t *conn, MYSQL *proxy, const cha
      * return any results, and thus have a single packet which has already
      * been consumed at this point. This holds for UPDATE, INSERT, and DELETE.
      * If this assumption breaks, subsequent queries will fail, although the
-     * client can then reconnect. */
+     * client can then reconnect. Statements inside explicit transactions
+     * are sent by backend_query_trans() and don't reach this point. */
     if (needs_commit) {
         if (success) {
             if (proxy)
                 error = proxy_net_send_ok(proxy, warnings, affected_rows, insert_id);
 
             proxy_vdebug("Committing on backend %d", bi);
+            gettimeofday(&phase, NULL);
             mysql_real_query(mysql, "COMMIT", 6);
+            proxy_latency_record(proxy_latency_site(LATENCY_COMMIT), &phase);
         } else {
             if (proxy)
                 error = proxy_net_send_error(proxy,
@@ -1565,12 +4531,26 @@ static my_bool backend_query(proxy_backend_conn_t *conn, MYSQL *proxy, const cha
         goto out;
     }
 
+    /* The final EOF packet also carries the server status */
+    backend_save_status(conn);
+
 out:
     /* Signify that we are done committing, and another clone operation may happen */
     if (replicated && commit)
-        (void) __sync_fetch_and_sub(&committing, 1);
+        backend_commit_leave();
 
 out_pre:
+    /* Fold the query time into the latency average */
+    gettimeofday(&end, NULL);
+    sample = (end.tv_sec - start.tv_sec) * 1000000L + (end.tv_usec - start.tv_usec);
+
+    /* The wall clock may have been stepped back */
+    if (unlikely(sample < 0))
+        sample = 0;
+    host->latency = host->latency ? host->latency + (sample - host->latency) / (1 << LATENCY_SHIFT) : sample;
+    proxy_latency_add(host->hist, sample);
+    (void) __sync_fetch_and_sub(&host->inflight, 1);
+
     /* Free connection resources if necessary */
     if (conn->freed)
         conn_free(conn);
@@ -1593,6 +4573,51 @@ static void conn_free(proxy_backend_conn_t *conn) {
     free(conn);
 }
 
+/**
+ * Allocate information for a new backend host.
+ *
+ * @param host   Hostname or IP of the backend.
+ * @param len    Length of the hostname.
+ * @param port   Port number of the backend.
+ * @param weight Relative weight of the backend when balancing.
+ *
+ * @return A new ::proxy_host_t struct, or NULL on error.
+ **/
+static proxy_host_t* backend_host_new(const char *host, size_t len, int port, int weight) {
+    proxy_host_t *backend = (proxy_host_t*) malloc(sizeof(proxy_host_t));
+
+    if (!backend) {
+        proxy_log(LOG_ERROR, "Out of memory when allocating backend");
+        return NULL;
+    }
+
+    backend->host     = strndup(host, len);
+    backend->hist     = (latency_hist_t*) calloc(1, sizeof(latency_hist_t));
+    if (!backend->host || !backend->hist) {
+        proxy_log(LOG_ERROR, "Out of memory when allocating backend");
+        free(backend->hist);
+        free(backend->host);
+        free(backend);
+        return NULL;
+    }
+
+    backend->id       = __sync_fetch_and_add(&host_next, 1);
+    backend->port     = port;
+    backend->weight   = weight;
+    backend->sessions = 0;
+    backend->inflight = 0;
+    backend->latency  = 0;
+    backend->applied  = 0;
+    backend->stale    = FALSE;
+    backend->diverged = FALSE;
+    backend->replog_next = NULL;
+    backend->replog_busy = NULL;
+    backend->ramp_start = 0;
+    backend->ramp_latency = 0;
+
+    return backend;
+}
+
 /**
  * Free resources associated with a backend.
  *
@@ -1602,6 +4627,10 @@ static void backend_free(proxy_host_t *backend) {
     if (!backend)
         return;
 
+    if (backend->ramp_start)
+        (void) __sync_fetch_and_sub(&backend_ramping, 1);
+
+    free(backend->hist);
     free(backend->host);
     free(backend);
 }
@@ -1631,18 +4660,33 @@ static void backends_free(proxy_host_t **backends, int num) {
  * and destroy mutexes.
  **/
 void proxy_backend_close() {
-    int i, j;
+    backend_topo_t *topo = backend_topo;
+    int i, j, num = topo ? topo->num : 0;
+
+    /* Stop log appliers before their backends are freed */
+    if (options.write_quorum && topo && topo->threads) {
+        proxy_mutex_lock(&replog_lock);
+        for (i=0; i<num; i++)
+            if (topo->threads[i])
+                topo->threads[i][0].exit = 1;
+        proxy_cond_broadcast(&replog_apply_cv);
+        proxy_mutex_unlock(&replog_lock);
+
+        for (i=0; i<num; i++)
+            if (topo->threads[i] && topo->threads[i][0].thread)
+                pthread_join(topo->threads[i][0].thread, NULL);
+    }
 
     /* Close connections and destroy lock pools */
-    for (i=0; i<backend_num; i++) {
+    for (i=0; i<num; i++) {
         for (j=0; j<options.num_conns; j++)
-            conn_free(backend_conns[i][j]);
+            conn_free(topo->conns[i][j]);
 
-        free(backend_conns[i]);
-        backend_conns[i] = NULL;
+        free(topo->conns[i]);
+        topo->conns[i] = NULL;
 
-        if (backend_pools)
-            proxy_pool_destroy(backend_pools[i]);
+        if (topo->pools)
+            proxy_pool_destroy(topo->pools[i]);
     }
 
     /* Free ltdl resources associated with
@@ -1653,26 +4697,35 @@ void proxy_backend_close() {
         lt_dlexit();
 
     /* Free allocated memory */
-    free(backend_pools);
-    backends_free(backends, backend_num);
-    free(backend_conns);
+    if (topo) {
+        backends_free(topo->backends, num);
+        topo->backends = NULL;
+    }
 
     /* Free threads */
-    if (backend_threads) {
-        for (i=0; i<backend_num; i++) {
+    if (topo && topo->threads) {
+        for (i=0; i<num; i++) {
             /* Close connections */
             for (j=0; j<options.backend_threads; j++)
-                conn_free(backend_threads[i][j].data.backend.conn);
+                conn_free(topo->threads[i][j].data.backend.conn);
+
+            /* Backend threads are not started with fan-out, and
+             * the log applier has already been stopped */
+            if (options.fanout || options.write_quorum) {
+                free(topo->threads[i]);
+                continue;
+            }
 
             /* Shut down threads */
             proxy_log(LOG_INFO, "Cancelling backend threads...");
-            proxy_threading_cancel(backend_threads[i], options.backend_threads, backend_thread_pool);
-            proxy_threading_cleanup(backend_threads[i], options.backend_threads, backend_thread_pool);
+            proxy_threading_cancel(topo->threads[i], options.backend_threads, backend_thread_pool);
+            proxy_threading_cleanup(topo->threads[i], options.backend_threads, backend_thread_pool);
         }
-
-        free(backend_threads);
     }
 
+    backend_topo_free(topo);
+    backend_topo = NULL;
+
     /* Close any open administrative connections */
     if (master)
         mysql_close(master);
@@ -14,6 +14,8 @@
 #ifndef _proxy_backend_h
 #define _proxy_backend_h
 
+struct backend_replog_entry;
+
 /**
  * Connection indices used during the
  * lifetime of a client connection.
@@ -21,18 +23,99 @@
 typedef struct {
     int bi;
     int ci;
+    /** ID of the backend at index bi when the connection was
+        taken, to follow it if backends are removed. */
+    ulong host_id;
+    /** TRUE if session state on the connection requires
+        all statements to be sent on it. */
+    my_bool pinned;
+    /** Unique identifier of the client session. */
+    ulong session;
+    /** SET statements executed by the session, which are
+        replayed when switching connections. */
+    char **sets;
+    /** Number of saved SET statements. */
+    int nsets;
+    /** Index of the backend threads whose connections hold
+        an open client transaction, or negative if none. */
+    int trans_ti;
+    /** Backend whose responses are sent to the client
+        during the transaction. */
+    int trans_first;
+    /** ID sent with the statements of the transaction. */
+    ulong trans_id;
+    /** FALSE if backends disagreed on the outcome of a
+        statement, so the transaction must roll back. */
+    my_bool trans_ok;
+    /** Version of the topology when the transaction started. */
+    ulong trans_version;
+    /** Clone generation when the transaction started. */
+    int trans_generation;
+    /** TRUE if the transaction was started READ ONLY
+        and only runs on the first backend. */
+    my_bool trans_readonly;
+    /** Position of the last write of the session in the
+        replication log, which its reads must see. */
+    ulong write_seq;
+    /** TRUE if the session's connection had a transaction open
+        after its last statement, including with autocommit off. */
+    my_bool in_trans;
 } proxy_conn_idx_t;
 
 /**
  * Connection information for backends.
  **/
 typedef struct {
+    /** Unique identifier of the host, which stays
+        the same if the host moves to a new index. */
+    ulong id;
     /** Hostname or IP of the backend to connect to. */
     char *host;
     /** Port number of the associated host. */
     int port;
+    /** Relative share of clients assigned to the host,
+        where zero excludes it from balanced selection. */
+    int weight;
+    /** Number of client sessions assigned to the host. */
+    volatile long sessions;
+    /** Number of queries currently executing on the host. */
+    volatile long inflight;
+    /** Moving average of query latency in microseconds. */
+    volatile long latency;
+    /** Sequence number of the last write applied from the replication log. */
+    volatile ulong applied;
+    /** TRUE if the host is too far behind to serve reads. */
+    volatile sig_atomic_t stale;
+    /** TRUE if a write failed on the host but succeeded elsewhere. */
+    volatile sig_atomic_t diverged;
+    /** Next entry in the replication log to apply, or NULL if none. */
+    struct backend_replog_entry *replog_next;
+    /** Entry the log applier is waiting on the host for, or NULL. */
+    struct backend_replog_entry *replog_busy;
+    /** Time in microseconds when the host started taking clients
+        while its share ramps up, or zero once it has its full share. */
+    volatile ulonglong ramp_start;
+    /** Latency in microseconds at which the host is warm
+        and ramping ends early, or zero to ramp for the full time. */
+    long ramp_latency;
+    /** Histogram of query latency on the host. */
+    latency_hist_t *hist;
 } proxy_host_t;
 
+/**
+ * Policies for choosing the backend for a new client.
+ **/
+typedef enum {
+    /** Pick a backend uniformly at random. */
+    BALANCE_RANDOM,
+    /** Pick the backend with the least outstanding work per weight. */
+    BALANCE_LEAST,
+    /** Pick the better of two random backends by load and latency. */
+    BALANCE_P2C,
+    /** Rotate through backends in proportion to their weights. */
+    BALANCE_WRR
+} proxy_balance_t;
+
 /**
  * Backend connection information.
  **/
@@ -43,6 +126,16 @@ typedef struct {
     /** If the connection should be freed when the
         current user is finished. */
     my_bool freed; 
+
+    /** Server status flags from the last response,
+        used to detect open transactions. */
+    uint server_status;
+    /** Session whose state was last applied to the connection. */
+    ulong session;
+    /** Number of SET statements applied for the session. */
+    int nsets;
+    /** TRUE if the connection holds state from a previous session. */
+    my_bool dirty;
                    
 } proxy_backend_conn_t;
 
@@ -54,11 +147,42 @@ typedef struct {
     char *query;
     /** Length of the query string. */
     ulong *length;
+    /** ID of the transaction for replicated queries. */
+    ulong trans_id;
     /** Proxy MySQL object where results
         should be sent, or NULL to discard. */
     MYSQL *proxy;             
+    /** Backend executing the query, from the
+        topology the query was dispatched with. */
+    proxy_host_t *host;
 } proxy_backend_query_t;
 
+/**
+ * Contents of an OK packet returned by a backend.
+ **/
+typedef struct {
+    /** Number of rows affected by the statement. */
+    my_ulonglong affected_rows;
+    /** ID generated for an inserted row. */
+    my_ulonglong insert_id;
+    /** Number of warnings produced by the statement. */
+    uint warnings;
+} backend_ok_t;
+
+/**
+ * Outcome of a statement executed on a backend.
+ **/
+typedef struct {
+    /** Contents of the OK packet on success. */
+    backend_ok_t ok;
+    /** Error number on failure. */
+    uint errnum;
+    /** Error message on failure. */
+    char errmsg[MYSQL_ERRMSG_SIZE];
+    /** TRUE if the connection failed before a response was read. */
+    my_bool lost;
+} backend_result_t;
+
 /** Data required to process a backend query. */
 typedef struct {
     /** Index of the backend being used. */
@@ -70,13 +194,17 @@ typedef struct {
 } proxy_backend_data_t;
 
 int proxy_backend_num();
+int proxy_backend_load(ulong *queries, long *latency, int *clone);
+my_bool proxy_backend_latency(int bi, latency_hist_t *hist);
 my_bool proxy_backend_init();
 my_bool proxy_backend_connect();
 my_bool proxy_backends_connect();
-my_bool proxy_backend_query(MYSQL *proxy, proxy_conn_idx_t *conn_idx, char *query, ulong length, my_bool replicated, commitdata_t *commit, status_t *status);
+my_bool proxy_backend_query(MYSQL *proxy, proxy_conn_idx_t *conn_idx, char *query, ulong length, my_bool replicated, ulong trans_id, commitdata_t *commit, status_t *status);
 void* proxy_backend_new_thread(void *ptr);
 my_bool proxy_backend_clone_complete(int *clone_ids, int nclones, ulong clone_trans_id, my_bool commit);
-my_bool proxy_backend_add(char *host, int port);
+my_bool proxy_backend_add(int clone_id, char *host, int port);
+my_bool proxy_backend_remove(int clone_id);
+void proxy_backend_epoch_close();
 void proxy_backend_get_connection(proxy_conn_idx_t *conn_idx, int thread_id);
 void proxy_backend_release_connection(proxy_conn_idx_t *conn_idx);
 void proxy_backend_close();
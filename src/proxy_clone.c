@@ -29,6 +29,8 @@
 
 /** Maximum amount of time to wait for new clones */
 #define CLONE_TIMEOUT 60
+/** Microseconds a simulated clone takes */
+#define SIM_CLONE_TIME 500000
 
 volatile sig_atomic_t server_id = 0;
 volatile sig_atomic_t cloning  = 0;
@@ -109,9 +111,12 @@ void clone_set_num(int clone_generation, int num) {
 /**
  * Wait for new clones to become live on the coordinator.
  *
+ * @param nclones Number of clones the master reported will
+ *                join, which is zero when cloning is simulated.
+ *
  * @return TRUE on error, FALSE otherwise.
  **/
-my_bool proxy_clone_wait() {
+my_bool proxy_clone_wait(int nclones) {
     struct timespec wait_time;
     struct timeval start, end;
     double time;
@@ -121,6 +126,14 @@ my_bool proxy_clone_wait() {
     /* Store the number of clones for later use */
     clone_set_num(clone_generation, new_clones);
 
+    /* Simulated clones are added by hand, so don't wait for them */
+    if (!nclones) {
+        proxy_log(LOG_INFO, "No clones will join, not waiting");
+        req_clones = 0;
+        return FALSE;
+    }
+    req_clones = nclones;
+
     /* Initialize locking */
     proxy_cond_init(&new_cv);
     proxy_mutex_init(&new_mutex);
@@ -143,8 +156,10 @@ my_bool proxy_clone_wait() {
     /* Check if we timed out waiting */
     if (wait_errno == ETIMEDOUT) {
         /* If no clones came up, then pretend cloning didn't happen */
-        if (new_clones == 0)
+        if (new_clones == 0) {
             (void) __sync_fetch_and_sub(&clone_generation, 1);
+            proxy_wait_wake();
+        }
 
         proxy_log(LOG_ERROR, "Timed out waiting for new clones");
         error = TRUE;
@@ -191,18 +206,19 @@ void proxy_clone_notify() {
  * @return TRUE if ready to clone, FALSE otherwise.
  **/
 my_bool proxy_clone_prepare(int nclones) {
-    if (req_clones) {
+    /* Claim the operation so concurrent requests can't both proceed */
+    if (!__sync_bool_compare_and_swap(&req_clones, 0, nclones)) {
         proxy_log(LOG_ERROR, "Previous cloning operation not yet complete");
         return FALSE;
     }
 
-    req_clones = nclones;
     new_clones = 0;
     return TRUE;
 }
 
 /**
- * Execute a cloning operation.
+ * Execute a cloning operation. Without SnowFlock, cloning
+ * is simulated if ::options.simulate_clones is set.
  *
  * @param nclones  Number of clones to create.
  * @param[out] err Buffer to hold error message
@@ -226,11 +242,11 @@ int proxy_do_clone(int nclones, char **err, int errlen) {
     /* Wait until any outstanding queries have committed */
     cloning = 1;
     __sync_synchronize();
-    while (committing) { usleep(SYNC_SLEEP); }
+    proxy_wait(WAIT_CLONE_COMMIT, !committing);
 
     /* If we need to wait for queries to complete, do so */
     if (options.query_wait)
-        while (querying) { usleep(SYNC_SLEEP); }
+        proxy_wait(WAIT_CLONE_QUERY, !querying);
 
     gettimeofday(&start, NULL);
 
@@ -294,6 +310,7 @@ int proxy_do_clone(int nclones, char **err, int errlen) {
                  * with the load balancer will drop */
                 for (i=0; i<options.client_threads; i++)
                     pthread_kill(net_threads[i].thread, SIGPOLL);
+                proxy_event_close_all();
 
                 /* Wait for IP reconfig */
                 do {
@@ -311,11 +328,36 @@ out:
     return vmid;
 }
 #else
-int proxy_do_clone(
-        __attribute__((unused)) int nclones,
-        __attribute__((unused)) char **err,
-        __attribute__((unused)) int errlen) {
-    return -1;
+int proxy_do_clone(int nclones, char **err, int errlen) {
+    if (!options.simulate_clones) {
+        snprintf(*err, errlen, "Proxy server was built without SnowFlock");
+        return -1;
+    }
+
+    if (!proxy_clone_prepare(nclones)) {
+        snprintf(*err, errlen, "Previous cloning operation not yet complete");
+        return -1;
+    }
+
+    /* Wait until any outstanding queries have committed */
+    cloning = 1;
+    __sync_synchronize();
+    proxy_wait(WAIT_CLONE_COMMIT, !committing);
+
+    if (options.query_wait)
+        proxy_wait(WAIT_CLONE_QUERY, !querying);
+
+    /* Act as the master of a successful clone, but no clones
+     * start, so they must be added with PROXY ADD by hand and
+     * the coordinator is told that none will join */
+    proxy_log(LOG_INFO, "Simulating %d clones", nclones);
+    usleep(SIM_CLONE_TIME);
+
+    new_clones = 0;
+    (void) __sync_fetch_and_add(&clone_generation, 1);
+    clone_set_num(clone_generation, nclones);
+
+    return 0;
 }
 #endif /* HAVE_LIBSF */
 
@@ -327,4 +369,5 @@ void proxy_clone_complete() {
     req_clones = 0;
     new_clones = 0;
     cloning = 0;
+    proxy_wait_wake();
 }
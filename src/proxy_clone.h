@@ -25,13 +25,17 @@ extern volatile sig_atomic_t cloning;
 /** Current generation of clones. */
 extern volatile sig_atomic_t clone_generation;
 
+/** Number of clones which have joined, or will join
+ *  on the master, in the current cloning operation. */
+extern volatile sig_atomic_t new_clones;
+
 void proxy_clone_init();
 void proxy_clone_end();
 my_bool proxy_clone_prepare(int nclones);
 int proxy_do_clone(int nclones, char **err, int errlen);
 int proxy_clone_get_num(int clone_generation);
 void proxy_clone_complete();
-my_bool proxy_clone_wait();
+my_bool proxy_clone_wait(int nclones);
 void proxy_clone_notify();
 
 extern struct hashtable *clone_table;
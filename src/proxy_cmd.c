@@ -35,9 +35,7 @@ static uchar *net_store_data(uchar *to, const uchar *from, size_t length);
 static void send_status_field(MYSQL *mysql, char *name, char *org_name, status_t *status);
 static void add_row(MYSQL *mysql, uchar *buff, char *name, long value, status_t *status);
 static my_bool net_status(MYSQL *mysql, char *query, ulong query_len, status_t *status);
-
-/** Mutex for locking transaction results so we can safely make insertions into the hashtable */
-static pthread_mutex_t result_mutex;
+static my_bool net_latency(MYSQL *mysql, status_t *status);
 
 /* taken from sql/protocol.cc */
 static uchar *net_store_data(uchar *to, const uchar *from, size_t length) {
@@ -49,7 +47,8 @@ static uchar *net_store_data(uchar *to, const uchar *from, size_t length) {
 /**
  * Send information on a SHOW STATUS field to the client.
  *
- * This function is only called twice and exists for convenience.
+ * This function exists for convenience since status
+ * results always have the same two fields.
  *
  * @param mysql          MYSQL object where the field packet should be sent.
  * @param name           Column identifer after AS clause.
@@ -145,7 +144,10 @@ static my_bool net_status(MYSQL *mysql, char *query, ulong query_len, status_t *
     char *pch, *t = NULL;
     my_bool global = FALSE, session = FALSE;
     status_t total_status, *send_status;
-    int i;
+    admit_stats_t admit;
+    wait_stats_t wait;
+    char name[32];
+    int i, j;
 
     /* Get status request type */
     pch = strtok_r(query, " ", &t);
@@ -169,14 +171,8 @@ static my_bool net_status(MYSQL *mysql, char *query, ulong query_len, status_t *
     if (session) {
         send_status = status;
     } else {
-        /* Start with global data */
-        proxy_status_reset(&total_status);
-        proxy_status_add(&global_status, &total_status);
-
         /* Accumulate data from client threads */
-        for (i=0; i<options.client_threads; i++)
-            proxy_status_add(net_threads[i].status, &total_status);
-
+        proxy_stats_total(&total_status);
         send_status = &total_status;
     }
 
@@ -188,16 +184,205 @@ static my_bool net_status(MYSQL *mysql, char *query, ulong query_len, status_t *
     add_row(mysql, buff, "Queries",           send_status->queries, status);
     add_row(mysql, buff, "Queries_any",       send_status->queries_any, status);
     add_row(mysql, buff, "Queries_all",       send_status->queries_all, status);
-    add_row(mysql, buff, "Threads_connected", thread_pool->locked, status);
+    add_row(mysql, buff, "Queries_balanced",  send_status->queries_balanced, status);
+    add_row(mysql, buff, "Queries_batched",   send_status->queries_batched, status);
+    add_row(mysql, buff, "Queries_readonly",  send_status->queries_readonly, status);
+    add_row(mysql, buff, "Threads_connected",
+        options.event_threads ? proxy_event_connections() : proxy_net_threads_locked(), status);
     add_row(mysql, buff, "Threads_running",   global_running, status);
     add_row(mysql, buff, "Uptime",         (long) (time(NULL) - proxy_start_time), status);
 
+    /* Recent rates per second over each window */
+    if (global) {
+        for (i=0; i<STATS_COUNTERS; i++) {
+            for (j=0; j<STATS_WINDOWS; j++) {
+                snprintf(name, sizeof(name), "%s_rate_%ds",
+                    proxy_stats_name(i), proxy_stats_windows[j]);
+                add_row(mysql, buff, name, proxy_stats_rate(i, proxy_stats_windows[j]), status);
+            }
+        }
+    }
+
+    /* Connections waiting for a client thread (wait times in microseconds) */
+    proxy_admit_stats(&admit);
+    add_row(mysql, buff, "Queue_depth",       admit.depth, status);
+    add_row(mysql, buff, "Queue_wait_avg",    admit.wait_avg, status);
+    add_row(mysql, buff, "Queue_wait_max",    admit.wait_max, status);
+    add_row(mysql, buff, "Queue_rejected",    admit.rejected, status);
+
+    /* Time threads spent blocked on each other (in microseconds) */
+    for (i=0; i<WAIT_SITES; i++) {
+        proxy_wait_stats(i, &wait);
+
+        snprintf(name, sizeof(name), "Wait_%s", proxy_wait_name(i));
+        add_row(mysql, buff, name, wait.waits, status);
+        snprintf(name, sizeof(name), "Wait_%s_usec", proxy_wait_name(i));
+        add_row(mysql, buff, name, wait.usec, status);
+        snprintf(name, sizeof(name), "Wait_%s_max", proxy_wait_name(i));
+        add_row(mysql, buff, name, wait.max, status);
+    }
+
+    proxy_net_send_eof(mysql, status);
+    proxy_net_flush(mysql);
+
+    return FALSE;
+}
+
+/**
+ * Send the rows for one latency histogram.
+ *
+ * @param mysql          MYSQL object where rows should be sent.
+ * @param buff           A buffer which can be used to store data.
+ * @param prefix         Prefix for the names of the variables.
+ * @param hist           Histogram to summarize.
+ * @param[in,out] status Status information for the connection.
+ **/
+static void add_latency_rows(MYSQL *mysql, uchar *buff, const char *prefix, latency_hist_t *hist, status_t *status) {
+    char name[64];
+    ulong count = hist->count;
+
+    snprintf(name, sizeof(name), "%s_count", prefix);
+    add_row(mysql, buff, name, count, status);
+    snprintf(name, sizeof(name), "%s_avg", prefix);
+    add_row(mysql, buff, name, count ? (long) (hist->usec / count) : 0, status);
+    snprintf(name, sizeof(name), "%s_p50", prefix);
+    add_row(mysql, buff, name, proxy_latency_percentile(hist, 50), status);
+    snprintf(name, sizeof(name), "%s_p90", prefix);
+    add_row(mysql, buff, name, proxy_latency_percentile(hist, 90), status);
+    snprintf(name, sizeof(name), "%s_p99", prefix);
+    add_row(mysql, buff, name, proxy_latency_percentile(hist, 99), status);
+    snprintf(name, sizeof(name), "%s_p999", prefix);
+    add_row(mysql, buff, name, proxy_latency_percentile(hist, 99.9), status);
+    snprintf(name, sizeof(name), "%s_max", prefix);
+    add_row(mysql, buff, name, hist->max, status);
+}
+
+/**
+ * Respond to a PROXY LATENCY command with percentiles of
+ * query latency by class, by backend and by commit phase.
+ * All values are in microseconds.
+ *
+ * @param mysql          MYSQL object where latencies should be sent.
+ * @param[in,out] status Status information for the connection.
+ *
+ * @return TRUE on error, FALSE otherwise.
+ **/
+static my_bool net_latency(MYSQL *mysql, status_t *status) {
+    uchar buff[BUFSIZ];
+    NET *net = &mysql->net;
+    latency_hist_t hist;
+    char name[32];
+    int i;
+
+    /* Send result header packet specifying two fields */
+    net_result_header(net, buff, 2, status);
+
+    /* Send list of fields */
+    send_status_field(mysql, "Variable_name", "VARIABLE_NAME", status);
+    send_status_field(mysql, "Value", "VARIABLE_VALUE", status);
+    proxy_net_send_eof(mysql, status);
+
+    for (i=0; i<LATENCY_SITES; i++)
+        add_latency_rows(mysql, buff, proxy_latency_name(i), proxy_latency_site(i), status);
+
+    /* Backends are copied since they may be removed meanwhile */
+    for (i=0; !proxy_backend_latency(i, &hist); i++) {
+        snprintf(name, sizeof(name), "Backend_%d", i);
+        add_latency_rows(mysql, buff, name, &hist, status);
+    }
+
     proxy_net_send_eof(mysql, status);
     proxy_net_flush(mysql);
 
     return FALSE;
 }
 
+/**
+ * Have the master create clones and wait for them to join.
+ * Writes are stopped only while the snapshot is taken.
+ *
+ * @param nclones  Number of clones to create.
+ * @param[out] err Buffer to hold an error message.
+ * @param errlen   Length of the error message buffer.
+ *
+ * @return Zero on success, otherwise a MySQL error number.
+ **/
+int proxy_cmd_clone(int nclones, char *err, int errlen) {
+    char buff[BUFSIZ];
+    my_bool error;
+    int sql_errno, joins;
+
+    /* Get ready and make sure no one else is cloning */
+    if (!proxy_clone_prepare(nclones)) {
+        snprintf(err, errlen, "Previous cloning operation not complete");
+        return ER_CANT_LOCK;
+    }
+
+    proxy_log(LOG_INFO, "Cloning, waiting for queries in commit phase");
+
+    /* Writes are only stopped while the snapshot is taken */
+    proxy_epoch_stop();
+    cloning = 1;
+    proxy_wait(WAIT_CLONE_COMMIT, !committing);
+
+    /* Contact the master to perform cloning */
+    proxy_log(LOG_INFO, "Requesting %d clone(s) from master", nclones);
+    snprintf(buff, BUFSIZ, "PROXY CLONE %d;", nclones);
+    mysql_query((MYSQL*) master, buff);
+
+    if ((sql_errno = mysql_errno((MYSQL*) master))) {
+        snprintf(err, errlen, "%s", mysql_error((MYSQL*) master));
+        proxy_clone_complete();
+        proxy_epoch_resume();
+        return sql_errno;
+    }
+
+    /* The master reports how many clones will join */
+    joins = (int) mysql_affected_rows((MYSQL*) master);
+
+    (void) __sync_fetch_and_add(&clone_generation, 1);
+    proxy_debug("Cloning successful, clone generation is %d", clone_generation);
+
+    /* Log writes from now on for clones to replay when they join */
+    proxy_epoch_open(clone_generation);
+    cloning = 0;
+    proxy_epoch_resume();
+
+    /* Wait for clones to finish */
+    error = proxy_clone_wait(joins);
+    proxy_backend_epoch_close();
+
+    if (error) {
+        snprintf(err, errlen, "Error waiting for new clones");
+        return ER_LOCK_WAIT_TIMEOUT;
+    }
+
+    return 0;
+}
+
+/**
+ * Stop sending queries to a clone and forget its address.
+ *
+ * @param clone_id ID of the clone to remove.
+ *
+ * @return TRUE on error, FALSE otherwise.
+ **/
+my_bool proxy_cmd_remove(int clone_id) {
+    proxy_host_t *store_host;
+
+    /* Stop sending queries to the clone and close its connections */
+    if (proxy_backend_remove(clone_id))
+        return TRUE;
+
+    /* Forget the clone's address */
+    if ((store_host = proxy_clone_remove((ulong) clone_id))) {
+        free(store_host->host);
+        free(store_host);
+    }
+
+    return FALSE;
+}
+
 /**
  * Respond to a PROXY CLONE[S] command.
  *
@@ -232,9 +417,11 @@ static my_bool net_clone(MYSQL *mysql, char *query,
             proxy_clone_complete();
             return proxy_net_send_error(mysql, ER_ERROR_WHEN_EXECUTING_COMMAND, buff);
         } else if (ret == 0) {
-            /* This is the master, and cloning succeeded */
+            /* This is the master, and cloning succeeded, so
+             * tell the coordinator how many clones will join */
+            ret = new_clones;
             proxy_clone_complete();
-            return proxy_net_send_ok(mysql, 0, 0, 0);
+            return proxy_net_send_ok(mysql, 0, ret, 0);
         } else {
             /* Reconnect to the coordinator for notification */
             MYSQL *new_coordinator = mysql_init(NULL), *old_coordinator;
@@ -263,16 +450,16 @@ static my_bool net_clone(MYSQL *mysql, char *query,
             /* Switch coordinators and construct the query */
             if (!error) {
                 pthread_spin_lock(&coordinator_lock);
-
                 old_coordinator = (MYSQL*) coordinator;
                 coordinator = new_coordinator;
+                pthread_spin_unlock(&coordinator_lock);
+
                 mysql_close(old_coordinator);
+                proxy_coord_set(new_coordinator->host, new_coordinator->port);
 
                 snprintf(buff, BUFSIZ, "PROXY ADD %d %s:%d;", server_id, options.phost, options.pport);
                 proxy_log(LOG_INFO, "Sending add query %s to coordinator", buff);
-                mysql_query((MYSQL*) coordinator, buff);
-
-                pthread_spin_unlock(&coordinator_lock);
+                mysql_query(new_coordinator, buff);
             } else {
                 proxy_log(LOG_ERROR, "Error reconnecting to coordinator: %s",
                     mysql_error(new_coordinator));
@@ -289,37 +476,10 @@ static my_bool net_clone(MYSQL *mysql, char *query,
             return TRUE;
         }
     } else if (options.coordinator) {
-        proxy_log(LOG_INFO, "Received clone command, waiting for queries in commit phase");
-
-        /* Wait until we can clone */
-        cloning = 1;
-        while (committing) { usleep(SYNC_SLEEP); }
-
-        /* Get ready and make sure no one else is cloning */
-        if (!proxy_clone_prepare(nclones))
-            return proxy_net_send_error(mysql, ER_CANT_LOCK, "Previous cloning operation not complete");
-
-        /* Contact the master to perform cloning */
-        proxy_log(LOG_INFO, "Requesting %d clone(s) from master", nclones);
-        snprintf(buff, BUFSIZ, "PROXY CLONE %d;", nclones);
-        mysql_query((MYSQL*) master, buff);
-
-        if ((sql_errno = mysql_errno((MYSQL*) master))) {
-            return proxy_net_send_error(mysql, sql_errno, mysql_error((MYSQL*) master));
-        } else {
-            (void) __sync_fetch_and_add(&clone_generation, 1);
-            proxy_debug("Cloning successful, clone generation is %d", clone_generation);
-
-            /* Wait for clones to finish */
-            ret = proxy_clone_wait();
-            cloning = 0;
-
-            /* Send result of cloning to clients */
-            if (ret)
-                return proxy_net_send_error(mysql, ER_LOCK_WAIT_TIMEOUT, "Error waiting for new clones");
-            else
-                return proxy_net_send_ok(mysql, 0, 0, 0);
-        }
+        if ((sql_errno = proxy_cmd_clone(nclones, buff, BUFSIZ)))
+            return proxy_net_send_error(mysql, sql_errno, buff);
+        else
+            return proxy_net_send_ok(mysql, 0, 0, 0);
     } else {
         return proxy_net_send_error(mysql, ER_NOT_ALLOWED_COMMAND, "Proxy server can't be cloned");
     }
@@ -479,11 +639,13 @@ static my_bool net_proxy_coordinator(MYSQL *mysql, char *t, status_t *status) {
             /* Swap to the new coordinator */
             old_coordinator = (MYSQL*) coordinator;
             coordinator = new_coordinator;
-            if (old_coordinator)
-                mysql_close(old_coordinator);
 
             pthread_spin_unlock(&coordinator_lock);
 
+            if (old_coordinator)
+                mysql_close(old_coordinator);
+            proxy_coord_set(host ?: ip, port);
+
             return proxy_net_send_ok(mysql, 0, 0, 0);
         }
     } else {
@@ -559,30 +721,23 @@ static my_bool net_add_clone(MYSQL *mysql, char *t,
     proxy_clone_insert((ulong) clone_id, store_host);
 
     /* Attempt to add the new host and report success/failure */
-    if (proxy_backend_add(host, port))
+    if (proxy_backend_add(clone_id, host, port))
         return proxy_net_send_error(mysql, ER_BAD_HOST_ERROR, "Error adding new host");
     else
         return proxy_net_send_ok(mysql, 0, 0, 0);
 }
 
 /**
- * Respond to a PROXY SUCCESS or FAILURE command
- * received from a client.
+ * Respond to a PROXY REMOVE command received from a client.
  *
  * @param mysql   MYSQL object where results should be sent.
  * @param t       Pointer to the next token in the query string.
- * @param success TRUE if the transaction succeeded, FALSE if it failed.
  * @param[in,out] status Status information for the connection.
- *
- * @return TRUE on error, FALSE otherwise.
  **/
-static my_bool net_trans_result(MYSQL *mysql, char *t, my_bool success,
+static my_bool net_remove_clone(MYSQL *mysql, char *t,
         __attribute__((unused)) status_t *status) {
+    int clone_id;
     char *tok;
-    int clone_id, i;
-    ulong transaction_id;
-    proxy_trans_t *trans;
-    my_bool error = FALSE;
 
     /* Ensure that we are the coordinator */
     if (!options.coordinator)
@@ -597,50 +752,53 @@ static my_bool net_trans_result(MYSQL *mysql, char *t, my_bool success,
     if (!tok || errno || clone_id <= 0)
         return proxy_net_send_error(mysql, ER_SYNTAX_ERROR, "Invalid clone ID");
 
-    /* Get the transaction ID */
-    tok = strtok_r(NULL, " ", &t);
-    if (tok) {
-        errno = 0;
-        transaction_id = strtol(tok, NULL, 10);
-    }
-    if (!tok || errno || transaction_id <= 0)
-        return proxy_net_send_error(mysql, ER_SYNTAX_ERROR, "Invalid transaction ID");
+    if (proxy_cmd_remove(clone_id))
+        return proxy_net_send_error(mysql, ER_BAD_HOST_ERROR, "Error removing host");
 
-    /* Message received, clone */
-    error = proxy_net_send_ok(mysql, 0, 0, 0);
+    return proxy_net_send_ok(mysql, 0, 0, 0);
+}
+
+/**
+ * Record the result of a transaction on a clone, and once all
+ * clones have reported, signal them and local threads to complete
+ * the transaction.
+ *
+ * @param clone_id       ID of the clone reporting the result.
+ * @param transaction_id ID of the transaction.
+ * @param success        TRUE if the transaction succeeded, FALSE if it failed.
+ **/
+void proxy_cmd_trans_result(int clone_id, ulong transaction_id, my_bool success) {
+    proxy_trans_t *trans, *cand;
+    my_bool complete;
+    int i;
 
-    /* We lock around this next section so only one message can mess with the hash table */
-    proxy_mutex_lock(&result_mutex);
     proxy_debug("Result of transaction %lu on clone %d is %d", transaction_id, clone_id, success);
 
-    /* Check if we have already received some message about this transaction */
-    if (!(trans = proxy_trans_search(transaction_id))) {
-        proxy_debug("Creating new hash table entry for transaction %lu", transaction_id);
-
-        /* Create a new entry in the transaction hash table */
-        trans = (proxy_trans_t*) malloc(sizeof(proxy_trans_t));
-        trans->total = proxy_clone_get_num(clone_generation);
-        trans->num = 0;
-        trans->done = 0;
-        trans->success = TRUE;
-        proxy_cond_init(&trans->cv);
-        proxy_mutex_init(&trans->cv_mutex);
-
-        /* Create space to store the IDs of clones */
-        trans->clone_ids = malloc(sizeof(int)*trans->total);
-        for (i=0; i<trans->total;i++)
-            trans->clone_ids[i] = -1;
-
-        proxy_trans_insert(transaction_id, trans);
-    }
+    /* Create a new entry in the transaction table
+     * unless another message has already done so */
+    cand = proxy_trans_new();
+    cand->total = proxy_clone_get_num(clone_generation);
+
+    /* Create space to store the IDs of clones */
+    cand->clone_ids = malloc(sizeof(int)*cand->total);
+    for (i=0; i<cand->total;i++)
+        cand->clone_ids[i] = -1;
+
+    if ((trans = proxy_trans_insert(transaction_id, cand)) != cand)
+        proxy_trans_free(cand);
+    else
+        proxy_debug("Created new table entry for transaction %lu", transaction_id);
 
     /* Update the commit data */
+    proxy_mutex_lock(&trans->cv_mutex);
     trans->clone_ids[trans->num] = clone_id;
     trans->num++;
     trans->success = trans->success && success;
+    complete = trans->num == trans->total;
+    proxy_mutex_unlock(&trans->cv_mutex);
 
     /* Check if all responses have been received */
-    if (trans->num == trans->total) {
+    if (complete) {
         proxy_debug("Transaction %lu completed on all clones, signalling %s",
                 transaction_id, trans->success ? "commit" : "rollback");
 
@@ -661,18 +819,60 @@ static my_bool net_trans_result(MYSQL *mysql, char *t, my_bool success,
         proxy_debug("Waiting for local threads to commit before removing transaction");
         proxy_mutex_lock(&trans->cv_mutex);
         while (trans->done < (proxy_backend_num()-trans->total)) { pthread_cond_wait(&trans->cv, &trans->cv_mutex); }
+        proxy_mutex_unlock(&trans->cv_mutex);
 
         if (proxy_trans_remove(transaction_id) != trans)
-            proxy_log(LOG_ERROR, "Transaction %lu changed when removed from hash table",
+            proxy_log(LOG_ERROR, "Transaction %lu changed when removed from table",
                 transaction_id);
 
-        proxy_mutex_unlock(&trans->cv_mutex);
-        proxy_cond_destroy(&trans->cv);
-        proxy_mutex_destroy(&trans->cv_mutex);
-        free(trans);
+        proxy_trans_free(trans);
+    }
+}
+
+/**
+ * Respond to a PROXY SUCCESS or FAILURE command
+ * received from a client.
+ *
+ * @param mysql   MYSQL object where results should be sent.
+ * @param t       Pointer to the next token in the query string.
+ * @param success TRUE if the transaction succeeded, FALSE if it failed.
+ * @param[in,out] status Status information for the connection.
+ *
+ * @return TRUE on error, FALSE otherwise.
+ **/
+static my_bool net_trans_result(MYSQL *mysql, char *t, my_bool success,
+        __attribute__((unused)) status_t *status) {
+    char *tok;
+    int clone_id;
+    ulong transaction_id;
+    my_bool error = FALSE;
+
+    /* Ensure that we are the coordinator */
+    if (!options.coordinator)
+        return proxy_net_send_error(mysql, ER_NOT_ALLOWED_COMMAND, "Proxy server not started as coordinator");
+
+    /* Get the clone ID */
+    tok = strtok_r(NULL, " ", &t);
+    if (tok) {
+        errno = 0;
+        clone_id = strtol(tok, NULL, 10);
     }
+    if (!tok || errno || clone_id <= 0)
+        return proxy_net_send_error(mysql, ER_SYNTAX_ERROR, "Invalid clone ID");
 
-    proxy_mutex_unlock(&result_mutex);
+    /* Get the transaction ID */
+    tok = strtok_r(NULL, " ", &t);
+    if (tok) {
+        errno = 0;
+        transaction_id = strtol(tok, NULL, 10);
+    }
+    if (!tok || errno || transaction_id <= 0)
+        return proxy_net_send_error(mysql, ER_SYNTAX_ERROR, "Invalid transaction ID");
+
+    /* Message received, clone */
+    error = proxy_net_send_ok(mysql, 0, 0, 0);
+
+    proxy_cmd_trans_result(clone_id, transaction_id, success);
 
     return error;
 }
@@ -711,7 +911,7 @@ my_bool net_commit(MYSQL *mysql, char *t, my_bool success,
         success ? "commit" : "rollback", commit_trans_id);
 
     /* Grab the transaction data from the hash table, waiting if necessary */
-    while (!(trans = proxy_trans_search(commit_trans_id))) { usleep(SYNC_SLEEP); }
+    proxy_wait(WAIT_TRANS, (trans = proxy_trans_search(commit_trans_id)) != NULL);
 
     proxy_debug("Found transaction %lu in hash table for completion",
         commit_trans_id);
@@ -765,6 +965,8 @@ my_bool proxy_cmd(MYSQL *mysql, char *query, ulong query_len, status_t *status)
             return net_proxy_coordinator(mysql, t, status);
         } else if (strprefix(tok, "ADD", query_len)) {
             return net_add_clone(mysql, t, status);
+        } else if (strprefix(tok, "REMOVE", query_len)) {
+            return net_remove_clone(mysql, t, status);
         } else if (strprefix(tok, "SUCCESS", query_len)) {
             return net_trans_result(mysql, t, TRUE, status);
         } else if (strprefix(tok, "FAILURE", query_len)) {
@@ -773,6 +975,8 @@ my_bool proxy_cmd(MYSQL *mysql, char *query, ulong query_len, status_t *status)
             return net_commit(mysql, t, TRUE, status);
         } else if (strprefix(tok, "ROLLBACK", query_len)) {
             return net_commit(mysql, t, FALSE, status);
+        } else if (strprefix(tok, "LATENCY", query_len)) {
+            return net_latency(mysql, status);
         }
 
         if (strprefix(last_tok, "STATUS", query_len))
@@ -794,7 +998,7 @@ static void* cmd_admin_new_thread(void *ptr) {
     proxy_thread_t *thread = (proxy_thread_t*) ptr;
 
     /* XXX: nothing is currently done with this status,
-     *      i.e. it is never merged into global_status.
+     *      i.e. it is never added to global statistics.
      *      Perhaps there should be separate admin stats */
     status_t status;
 
@@ -823,11 +1027,6 @@ void* proxy_cmd_admin_start(__attribute__((unused)) void *ptr) {
     proxy_thread_t *thread;
     int thread_id = 0;
 
-    /* Initialize the result mutex. Since it isn't
-     * used until after cloning, this should be a
-     * safe place to do this. */
-    proxy_mutex_init(&result_mutex);
-
     proxy_threading_name("Admin");
     proxy_threading_mask();
 
@@ -836,7 +1035,7 @@ void* proxy_cmd_admin_start(__attribute__((unused)) void *ptr) {
 
     /* Bind the admin socket */
     proxy_log(LOG_INFO, "Opening admin socket on 0.0.0.0:%d", options.admin_port);
-    if ((serverfd = proxy_net_bind_new_socket(NULL, options.admin_port)) < 0)
+    if ((serverfd = proxy_net_bind_new_socket(NULL, options.admin_port, FALSE)) < 0)
         goto out;
 
     /* Update the host address again if we are the
@@ -872,6 +1071,7 @@ void* proxy_cmd_admin_start(__attribute__((unused)) void *ptr) {
         thread->data.work.clientfd = clientfd;
         thread->data.work.addr = &clientaddr.sin;
         thread->data.work.proxy = NULL;
+        thread->data.work.event = NULL;
         thread->id = thread_id++;
 
         proxy_threading_create(&thread->thread, &attr, cmd_admin_new_thread, (void*) thread);
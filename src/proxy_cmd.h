@@ -14,5 +14,8 @@
 
 my_bool proxy_cmd(MYSQL *mysql, char *query, ulong query_len, status_t *status);
 void* proxy_cmd_admin_start(void *ptr);
+void proxy_cmd_trans_result(int clone_id, ulong transaction_id, my_bool success);
+int proxy_cmd_clone(int nclones, char *err, int errlen);
+my_bool proxy_cmd_remove(int clone_id);
 
 #endif /* _proxy_cmd_h */
@@ -0,0 +1,365 @@
+/******************************************************************************
+ * proxy_coord.c
+ *
+ * Channel for reporting transaction results from clones to the coordinator.
+ *
+ * Results are queued by backend threads and sent in batches by a
+ * small set of sender threads, each with its own connection to the
+ * coordinator, so no thread waits on the network to report a result.
+ *
+ * Copyright (c) 2010, Michael Mior <mmior@cs.toronto.edu>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+ * Place - Suite 330, Boston, MA 02111-1307 USA.
+ *
+ */
+
+#include "proxy.h"
+
+#include <sql_common.h>
+
+/** Maximum length of the coordinator host name */
+#define COORD_HOST_LEN 256
+
+static void* coord_thread(void *ptr);
+
+/** Transactions waiting to be reported, linked through their next field */
+static proxy_trans_t *coord_head = NULL, *coord_tail = NULL;
+/** Lock protecting the queue and coordinator address */
+static pthread_mutex_t coord_lock;
+/** Signalled when results are queued */
+static pthread_cond_t coord_cv;
+
+/** Host of the coordinator */
+static char coord_host[COORD_HOST_LEN];
+/** Port of the coordinator */
+static int coord_port = 0;
+/** Incremented each time the coordinator changes so
+ *  senders know to reconnect */
+static int coord_gen = 0;
+
+/** Sender threads */
+static pthread_t *coord_threads = NULL;
+/** Number of sender threads started */
+static int coord_started = 0;
+/** TRUE if sender threads should exit */
+static my_bool coord_exit = FALSE;
+
+/**
+ * Store a transaction result in a batch.
+ *
+ * @param buff    Buffer holding the batch.
+ * @param i       Index of the result in the batch.
+ * @param id      Transaction ID.
+ * @param success TRUE if the transaction succeeded, FALSE otherwise.
+ **/
+static inline void coord_store(uchar *buff, int i, ulong id, my_bool success) {
+    uchar *pos = buff + COORD_HEADER + i * COORD_ENTRY;
+
+    int8store(pos, (ulonglong) id);
+    pos[8] = success ? 1 : 0;
+}
+
+/**
+ * Read a transaction result from a batch.
+ *
+ * @param buff          Buffer holding the batch.
+ * @param i             Index of the result in the batch.
+ * @param[out] id       Transaction ID.
+ * @param[out] success  TRUE if the transaction succeeded, FALSE otherwise.
+ **/
+static inline void coord_load(const uchar *buff, int i, ulong *id, my_bool *success) {
+    const uchar *pos = buff + COORD_HEADER + i * COORD_ENTRY;
+
+    *id = (ulong) uint8korr(pos);
+    *success = pos[8] ? TRUE : FALSE;
+}
+
+/**
+ * Start the threads which send results to the coordinator.
+ *
+ * @return TRUE on error, FALSE otherwise.
+ **/
+my_bool proxy_coord_init() {
+    pthread_attr_t attr;
+    int i;
+
+    proxy_mutex_init(&coord_lock);
+    proxy_cond_init(&coord_cv);
+    coord_exit = FALSE;
+    coord_host[0] = '\0';
+
+    if (!options.cloneable)
+        return FALSE;
+
+    coord_threads = (pthread_t*) calloc(options.coord_conns, sizeof(pthread_t));
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+
+    for (i=0; i<options.coord_conns; i++) {
+        if (proxy_threading_create(&coord_threads[i], &attr, coord_thread, (void*) (long) i)) {
+            proxy_log(LOG_ERROR, "Couldn't start coordinator thread: %s", errstr);
+            pthread_attr_destroy(&attr);
+            return TRUE;
+        }
+
+        coord_started++;
+    }
+
+    pthread_attr_destroy(&attr);
+
+    return FALSE;
+}
+
+/**
+ * Stop the sender threads. Any results still queued are dropped.
+ **/
+void proxy_coord_end() {
+    int i;
+
+    proxy_mutex_lock(&coord_lock);
+    coord_exit = TRUE;
+    proxy_cond_broadcast(&coord_cv);
+    proxy_mutex_unlock(&coord_lock);
+
+    for (i=0; i<coord_started; i++)
+        pthread_join(coord_threads[i], NULL);
+
+    free(coord_threads);
+    coord_threads = NULL;
+    coord_started = 0;
+
+    proxy_cond_destroy(&coord_cv);
+    proxy_mutex_destroy(&coord_lock);
+}
+
+/**
+ * Change the coordinator where results are sent.
+ *
+ * @param host Host name or address of the coordinator.
+ * @param port Port of the coordinator.
+ **/
+void proxy_coord_set(const char *host, int port) {
+    proxy_mutex_lock(&coord_lock);
+    strncpy(coord_host, host, COORD_HOST_LEN - 1);
+    coord_host[COORD_HOST_LEN - 1] = '\0';
+    coord_port = port;
+    coord_gen++;
+    proxy_mutex_unlock(&coord_lock);
+}
+
+/**
+ * Queue the result of a transaction to be sent to the coordinator.
+ * The transaction must already be in the transaction table, and
+ * success must hold the local result. If the result can't be sent,
+ * the transaction is signalled to roll back.
+ *
+ * @param transaction_id ID of the transaction.
+ * @param trans          Transaction data.
+ **/
+void proxy_coord_send(ulong transaction_id, proxy_trans_t *trans) {
+    trans->id = transaction_id;
+    trans->next = NULL;
+
+    proxy_mutex_lock(&coord_lock);
+
+    if (coord_tail)
+        coord_tail->next = trans;
+    else
+        coord_head = trans;
+    coord_tail = trans;
+
+    proxy_cond_signal(&coord_cv);
+    proxy_mutex_unlock(&coord_lock);
+}
+
+/**
+ * Connect to the coordinator.
+ *
+ * @param host Host name or address of the coordinator.
+ * @param port Port of the coordinator.
+ *
+ * @return A new connection, or NULL on error.
+ **/
+static MYSQL* coord_connect(const char *host, int port) {
+    MYSQL *mysql = mysql_init(NULL);
+
+    if (!mysql)
+        return NULL;
+
+    if (!mysql_real_connect(mysql, host, options.user, options.pass, NULL, port, NULL, 0)) {
+        proxy_log(LOG_ERROR, "Error connecting to coordinator %s:%d: %s",
+            host, port, mysql_error(mysql));
+        mysql_close(mysql);
+        return NULL;
+    }
+
+    return mysql;
+}
+
+/**
+ * Roll back transactions in a batch which could not be sent.
+ *
+ * @param buff  Buffer holding the batch.
+ * @param count Number of results in the batch.
+ **/
+static void coord_rollback(const uchar *buff, int count) {
+    proxy_trans_t *trans;
+    my_bool success;
+    ulong id;
+    int i;
+
+    for (i=0; i<count; i++) {
+        coord_load(buff, i, &id, &success);
+
+        if (!(trans = proxy_trans_search(id)))
+            continue;
+
+        proxy_mutex_lock(&trans->cv_mutex);
+        trans->success = FALSE;
+        trans->num = 1;
+        proxy_cond_signal(&trans->cv);
+        proxy_mutex_unlock(&trans->cv_mutex);
+    }
+}
+
+/**
+ * Send batches of queued results to the coordinator.
+ *
+ * @param ptr Index of the sender thread.
+ *
+ * @return NULL.
+ **/
+static void* coord_thread(void *ptr) {
+    uchar buff[COORD_HEADER + COORD_BATCH * COORD_ENTRY];
+    char name[16], host[COORD_HOST_LEN];
+    int gen = -1, port = 0, count;
+    proxy_trans_t *trans;
+    MYSQL *mysql = NULL;
+
+    snprintf(name, 16, "Coord%ld", (long) ptr);
+    proxy_threading_name(name);
+    proxy_threading_mask();
+
+    while (1) {
+        proxy_mutex_lock(&coord_lock);
+
+        while (!coord_head && !coord_exit)
+            proxy_cond_wait(&coord_cv, &coord_lock);
+
+        if (coord_exit) {
+            proxy_mutex_unlock(&coord_lock);
+            break;
+        }
+
+        /* Take as many results as fit in a batch */
+        for (count=0; coord_head && count<COORD_BATCH; count++) {
+            trans = coord_head;
+            coord_head = trans->next;
+            coord_store(buff, count, trans->id, trans->success);
+        }
+
+        if (!coord_head)
+            coord_tail = NULL;
+
+        /* Pick up any change of coordinator */
+        if (gen != coord_gen) {
+            strcpy(host, coord_host);
+            port = coord_port;
+            gen = coord_gen;
+
+            if (mysql) {
+                mysql_close(mysql);
+                mysql = NULL;
+            }
+        }
+
+        proxy_mutex_unlock(&coord_lock);
+
+        int4store(buff, server_id);
+        int2store(buff + 4, count);
+
+        if (!mysql && host[0])
+            mysql = coord_connect(host, port);
+
+        proxy_debug("Sending %d transaction results to coordinator", count);
+
+        /* Roll back anything we can't report, and
+         * reconnect before sending the next batch */
+        if (!mysql || simple_command(mysql, (enum enum_server_command) COM_PROXY_RESULT,
+                buff, COORD_HEADER + count * COORD_ENTRY, 0)) {
+            if (mysql) {
+                proxy_log(LOG_ERROR, "Error sending transaction results to coordinator: %s",
+                    mysql_error(mysql));
+                mysql_close(mysql);
+                mysql = NULL;
+            } else {
+                proxy_log(LOG_ERROR, "No coordinator available for transaction results");
+            }
+
+            coord_rollback(buff, count);
+        }
+    }
+
+    if (mysql)
+        mysql_close(mysql);
+
+    mysql_thread_end();
+    return NULL;
+}
+
+/**
+ * Process a batch of transaction results received from a clone.
+ *
+ * @param mysql          MYSQL object where results should be sent.
+ * @param packet         Batch of results following the command byte.
+ * @param length         Length of the batch.
+ * @param[in,out] status Status information for the connection.
+ *
+ * @return TRUE on error, FALSE otherwise.
+ **/
+my_bool proxy_coord_recv(MYSQL *mysql, uchar *packet, ulong length,
+        __attribute__((unused)) status_t *status) {
+    int clone_id, count, i;
+    my_bool success, error;
+    ulong id;
+
+    /* Ensure that we are the coordinator */
+    if (!options.coordinator)
+        return proxy_net_send_error(mysql, ER_NOT_ALLOWED_COMMAND, "Proxy server not started as coordinator");
+
+    if (length < COORD_HEADER)
+        return proxy_net_send_error(mysql, ER_SYNTAX_ERROR, "Invalid transaction result batch");
+
+    clone_id = (int) uint4korr(packet);
+    count = uint2korr(packet + 4);
+
+    if (clone_id <= 0 || length != (ulong) (COORD_HEADER + count * COORD_ENTRY))
+        return proxy_net_send_error(mysql, ER_SYNTAX_ERROR, "Invalid transaction result batch");
+
+    proxy_debug("Received %d transaction results from clone %d", count, clone_id);
+
+    /* Acknowledge before processing, since completing
+     * a transaction waits on other threads */
+    error = proxy_net_send_ok(mysql, 0, 0, 0);
+
+    for (i=0; i<count; i++) {
+        coord_load(packet, i, &id, &success);
+
+        if (id > 0)
+            proxy_cmd_trans_result(clone_id, id, success);
+    }
+
+    return error;
+}
@@ -0,0 +1,32 @@
+/*
+ * proxy_coord.h
+ *
+ * Channel for reporting transaction results from clones to the coordinator.
+ *
+ * This file is subject to the terms and conditions of the GNU General
+ * Public License.  See the file "COPYING" in the main directory of
+ * this archive for more details.
+ *
+ * Copyright (C) 2010 by Michael Mior <mmior@cs.toronto.edu>
+ *
+ */
+
+#ifndef _proxy_coord_h
+#define _proxy_coord_h
+
+/** Bytes at the start of a result batch holding
+ *  the clone ID and the number of results */
+#define COORD_HEADER    6
+/** Bytes for each result holding the
+ *  transaction ID and the success flag */
+#define COORD_ENTRY     9
+/** Maximum number of results sent in one batch */
+#define COORD_BATCH     512
+
+my_bool proxy_coord_init();
+void proxy_coord_end();
+void proxy_coord_set(const char *host, int port);
+void proxy_coord_send(ulong transaction_id, proxy_trans_t *trans);
+my_bool proxy_coord_recv(MYSQL *mysql, uchar *packet, ulong length, status_t *status);
+
+#endif /* _proxy_coord_h */
@@ -0,0 +1,264 @@
+/******************************************************************************
+ * proxy_epoch.c
+ *
+ * Log writes made after a clone snapshot so new clones can catch up.
+ *
+ * Taking a snapshot only stops replicated writes for as long as the
+ * snapshot itself. Writes which run afterwards are logged under the
+ * new clone generation, and each clone replays the log when it joins
+ * before it starts receiving writes directly.
+ *
+ * Copyright (c) 2010, Michael Mior <mmior@cs.toronto.edu>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+ * Place - Suite 330, Boston, MA 02111-1307 USA.
+ *
+ */
+
+#include "proxy.h"
+
+/** Number of replicated writes in progress */
+static volatile sig_atomic_t epoch_writers = 0;
+/** Set while replicated writes are stopped */
+static volatile sig_atomic_t epoch_stopped = 0;
+/** Held by the thread which stopped writes */
+static pthread_mutex_t epoch_stop_lock;
+
+/** Clone generation whose writes are logged, or zero if none */
+static volatile sig_atomic_t epoch_generation = 0;
+/** Logged writes, oldest first */
+static proxy_epoch_entry_t *epoch_head = NULL, *epoch_tail = NULL;
+/** Number of logged writes */
+static ulong epoch_count = 0;
+/** Lock protecting the log */
+static pthread_mutex_t epoch_lock;
+
+/**
+ * Initialize data structures required for logging.
+ **/
+void proxy_epoch_init() {
+    proxy_mutex_init(&epoch_lock);
+    proxy_mutex_init(&epoch_stop_lock);
+}
+
+/**
+ * Free the log and destroy data structures required for logging.
+ **/
+void proxy_epoch_end() {
+    proxy_epoch_close();
+
+    proxy_mutex_destroy(&epoch_stop_lock);
+    proxy_mutex_destroy(&epoch_lock);
+}
+
+/**
+ * Mark the start of a replicated write, waiting
+ * if writes are currently stopped.
+ *
+ * @return Generation whose writes are being logged, or zero if none.
+ **/
+int proxy_epoch_enter() {
+    while (1) {
+        (void) __sync_fetch_and_add(&epoch_writers, 1);
+        if (!epoch_stopped)
+            break;
+
+        /* Back off until writes are resumed */
+        proxy_epoch_leave();
+        proxy_wait(WAIT_QUERY_CLONE, !epoch_stopped);
+    }
+
+    return epoch_generation;
+}
+
+/**
+ * Mark the end of a replicated write.
+ **/
+void proxy_epoch_leave() {
+    (void) __sync_fetch_and_sub(&epoch_writers, 1);
+    if (epoch_stopped)
+        proxy_wait_wake();
+}
+
+/**
+ * Stop new replicated writes and wait for those in progress.
+ * Writes stay stopped until ::proxy_epoch_resume is called.
+ **/
+void proxy_epoch_stop() {
+    proxy_mutex_lock(&epoch_stop_lock);
+
+    epoch_stopped = 1;
+    __sync_synchronize();
+    proxy_wait(WAIT_CLONE_QUERY, !epoch_writers);
+}
+
+/**
+ * Allow replicated writes to continue after ::proxy_epoch_stop.
+ **/
+void proxy_epoch_resume() {
+    epoch_stopped = 0;
+    proxy_mutex_unlock(&epoch_stop_lock);
+    proxy_wait_wake();
+}
+
+/**
+ * Start logging writes for clones of a new generation. Writes
+ * must be stopped so none is split between the snapshot and the log.
+ *
+ * @param generation Clone generation created by the snapshot.
+ **/
+void proxy_epoch_open(int generation) {
+    proxy_mutex_lock(&epoch_lock);
+    epoch_generation = generation;
+    proxy_mutex_unlock(&epoch_lock);
+    proxy_wait_wake();
+
+    proxy_debug("Logging writes for clone generation %d", generation);
+}
+
+/**
+ * Stop logging writes and free the log. Callers must ensure
+ * nothing is reading the log with ::proxy_epoch_next.
+ **/
+void proxy_epoch_close() {
+    proxy_epoch_entry_t *entry;
+
+    proxy_mutex_lock(&epoch_lock);
+
+    if (epoch_generation)
+        proxy_debug("Freeing %lu logged writes for clone generation %d",
+            epoch_count, epoch_generation);
+
+    while ((entry = epoch_head)) {
+        epoch_head = entry->next;
+        free(entry->query);
+        free(entry);
+    }
+
+    epoch_tail = NULL;
+    epoch_count = 0;
+    epoch_generation = 0;
+
+    proxy_mutex_unlock(&epoch_lock);
+    proxy_wait_wake();
+}
+
+/**
+ * Get the clone generation whose writes are being logged.
+ *
+ * @return Generation of the log, or zero if writes are not logged.
+ **/
+int proxy_epoch_current() {
+    return epoch_generation;
+}
+
+/**
+ * Take the next place in the log for a write before it is sent
+ * to any backend, so the log keeps the order backends were sent
+ * writes in. The entry is pending until ::proxy_epoch_finish.
+ *
+ * @param generation Value returned by ::proxy_epoch_enter for the write.
+ * @param query      Query string of the write.
+ * @param length     Length of the query string.
+ * @param[out] entry Entry for the write, or NULL if it is not logged.
+ *
+ * @return TRUE on error, FALSE otherwise.
+ **/
+my_bool proxy_epoch_reserve(int generation, const char *query, ulong length, proxy_epoch_entry_t **entry) {
+    proxy_epoch_entry_t *new;
+
+    *entry = NULL;
+    if (!generation)
+        return FALSE;
+
+    new = (proxy_epoch_entry_t*) malloc(sizeof(proxy_epoch_entry_t));
+    if (!new || !(new->query = (char*) malloc(length))) {
+        proxy_log(LOG_ERROR, "Couldn't allocate memory to log write for clone generation %d", generation);
+        free(new);
+        return TRUE;
+    }
+
+    memcpy(new->query, query, length);
+    new->length = length;
+    new->state = EPOCH_PENDING;
+    new->next = NULL;
+
+    proxy_mutex_lock(&epoch_lock);
+
+    /* The log may have been closed since the write started */
+    if (generation != epoch_generation) {
+        proxy_mutex_unlock(&epoch_lock);
+        free(new->query);
+        free(new);
+        return FALSE;
+    }
+
+    if (epoch_tail)
+        epoch_tail->next = new;
+    else
+        epoch_head = new;
+    epoch_tail = new;
+    epoch_count++;
+
+    proxy_mutex_unlock(&epoch_lock);
+
+    *entry = new;
+    return FALSE;
+}
+
+/**
+ * Record the outcome of a write in its place in the log.
+ *
+ * @param generation Value returned by ::proxy_epoch_enter for the write.
+ * @param entry      Entry from ::proxy_epoch_reserve, or NULL.
+ * @param state      Outcome of the write on the backends.
+ **/
+void proxy_epoch_finish(int generation, proxy_epoch_entry_t *entry, proxy_epoch_state_t state) {
+    if (!entry)
+        return;
+
+    /* The entry was freed if the log was closed */
+    proxy_mutex_lock(&epoch_lock);
+    if (generation == epoch_generation)
+        entry->state = state;
+    proxy_mutex_unlock(&epoch_lock);
+
+    proxy_wait_wake();
+}
+
+/**
+ * Walk the log in the order writes were sent to backends.
+ * Entries may still be pending when they are returned.
+ *
+ * @param entry Last entry read, or NULL to start at the oldest.
+ *
+ * @return The following entry, or NULL if there are no more yet.
+ **/
+proxy_epoch_entry_t* proxy_epoch_next(proxy_epoch_entry_t *entry) {
+    proxy_epoch_entry_t *next;
+
+    proxy_mutex_lock(&epoch_lock);
+    next = entry ? entry->next : epoch_head;
+    proxy_mutex_unlock(&epoch_lock);
+
+    return next;
+}
+
+/**
+ * Get the number of writes in the log.
+ *
+ * @return Number of logged writes.
+ **/
+ulong proxy_epoch_size() {
+    return epoch_count;
+}
@@ -0,0 +1,59 @@
+/*
+ * proxy_epoch.h
+ *
+ * Log writes made after a clone snapshot so new clones can catch up.
+ *
+ * This file is subject to the terms and conditions of the GNU General
+ * Public License.  See the file "COPYING" in the main directory of
+ * this archive for more details.
+ *
+ * Copyright (C) 2010 by Michael Mior <mmior@cs.toronto.edu>
+ *
+ */
+
+#ifndef _proxy_epoch_h
+#define _proxy_epoch_h
+
+/**
+ * Outcome of a logged write on the backends.
+ **/
+typedef enum {
+    /** The write is still being sent to backends. */
+    EPOCH_PENDING,
+    /** Every backend applied the write. */
+    EPOCH_APPLIED,
+    /** Some backends may have failed the write. */
+    EPOCH_PARTIAL,
+    /** No backend applied the write. */
+    EPOCH_FAILED
+} proxy_epoch_state_t;
+
+/**
+ * Replicated write made after a clone snapshot.
+ **/
+typedef struct proxy_epoch_entry {
+    /** Query string of the write. */
+    char *query;
+    /** Length of the query string. */
+    ulong length;
+    /** Outcome of the write, see ::proxy_epoch_state_t. */
+    volatile sig_atomic_t state;
+    /** Next write in the log. */
+    struct proxy_epoch_entry *next;
+} proxy_epoch_entry_t;
+
+void proxy_epoch_init();
+void proxy_epoch_end();
+int proxy_epoch_enter();
+void proxy_epoch_leave();
+void proxy_epoch_stop();
+void proxy_epoch_resume();
+void proxy_epoch_open(int generation);
+void proxy_epoch_close();
+int proxy_epoch_current();
+my_bool proxy_epoch_reserve(int generation, const char *query, ulong length, proxy_epoch_entry_t **entry);
+void proxy_epoch_finish(int generation, proxy_epoch_entry_t *entry, proxy_epoch_state_t state);
+proxy_epoch_entry_t* proxy_epoch_next(proxy_epoch_entry_t *entry);
+ulong proxy_epoch_size();
+
+#endif /* _proxy_epoch_h */
@@ -0,0 +1,637 @@
+/******************************************************************************
+ * proxy_event.c
+ *
+ * Event-driven handling of idle client connections.
+ *
+ * Copyright (c) 2010, Michael Mior <mmior@cs.toronto.edu>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+ * Place - Suite 330, Boston, MA 02111-1307 USA.
+ *
+ */
+
+#include "proxy.h"
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+/** Maximum number of events returned by a single wait */
+#define EVENT_BATCH   64
+/** Milliseconds between checks for idle connections */
+#define EVENT_TICK    1000
+
+extern volatile sig_atomic_t run;
+
+/**
+ * Event loop which waits for commands
+ * on a set of idle client connections.
+ **/
+typedef struct {
+    /** Index of the loop. */
+    int id;
+    /** pthreads thread identifier. */
+    pthread_t thread;
+    /** epoll descriptor for connections of this loop. */
+    int epfd;
+    /** Event descriptor written to wake the loop. */
+    int wakefd;
+    /** Set to have the loop close all of its idle connections. */
+    volatile sig_atomic_t close_all;
+    /** Lock protecting the connection list. */
+    pthread_mutex_t lock;
+    /** List of connections owned by this loop. */
+    proxy_event_conn_t *conns;
+    /** Number of connections owned by this loop. */
+    long nconns;
+} event_loop_t;
+
+/**
+ * Connections with a pending command which are
+ * waiting for a client thread in a single shard.
+ **/
+typedef struct {
+    /** Lock protecting the queue and the
+     *  handoff of threads in the shard. */
+    pthread_mutex_t lock;
+    /** Oldest waiting connection. */
+    proxy_event_conn_t *head;
+    /** Newest waiting connection. */
+    proxy_event_conn_t *tail;
+    /** Number of waiting connections. */
+    int count;
+} event_queue_t;
+
+/** Event loops handling client connections */
+static event_loop_t *event_loops = NULL;
+/** Connections waiting for a client thread in each shard */
+static event_queue_t *event_queues = NULL;
+/** Next loop to be assigned a new connection */
+static volatile sig_atomic_t next_loop = 0;
+
+static void* event_loop_start(void *ptr);
+static void event_dispatch(proxy_event_conn_t *conn);
+static void event_give(int thread_id, proxy_event_conn_t *conn);
+static my_bool event_admit_full(int shard);
+static void event_conn_close(proxy_event_conn_t *conn);
+static void event_conn_park(proxy_event_conn_t *conn);
+static void event_loop_reap(event_loop_t *loop, my_bool all);
+
+/**
+ * Start the event loop threads.
+ *
+ * @return TRUE on error, FALSE otherwise.
+ **/
+my_bool proxy_event_init() {
+    pthread_attr_t attr;
+    struct epoll_event ev;
+    int i;
+
+    event_loops = (event_loop_t*) calloc(options.event_threads, sizeof(event_loop_t));
+    event_queues = (event_queue_t*) calloc(options.acceptors, sizeof(event_queue_t));
+    if (!event_loops || !event_queues)
+        return TRUE;
+
+    for (i=0; i<options.acceptors; i++)
+        proxy_mutex_init(&event_queues[i].lock);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+
+    for (i=0; i<options.event_threads; i++) {
+        event_loops[i].id = i;
+        event_loops[i].conns = NULL;
+        event_loops[i].nconns = 0;
+        proxy_mutex_init(&event_loops[i].lock);
+
+        event_loops[i].epfd = epoll_create(EVENT_BATCH);
+        event_loops[i].wakefd = eventfd(0, EFD_NONBLOCK);
+        if (event_loops[i].epfd < 0 || event_loops[i].wakefd < 0) {
+            proxy_log(LOG_ERROR, "Error creating event descriptor: %s", errstr);
+            return TRUE;
+        }
+
+        /* Wakeups are the only events without a connection */
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;
+        if (epoll_ctl(event_loops[i].epfd, EPOLL_CTL_ADD, event_loops[i].wakefd, &ev) < 0) {
+            proxy_log(LOG_ERROR, "Error adding wakeup to event loop: %s", errstr);
+            return TRUE;
+        }
+
+        proxy_threading_create(&event_loops[i].thread, &attr, event_loop_start, (void*) &event_loops[i]);
+    }
+
+    pthread_attr_destroy(&attr);
+    return FALSE;
+}
+
+/**
+ * Stop the event loop threads and close all
+ * connections which are still open.
+ **/
+void proxy_event_end() {
+    proxy_event_conn_t *conn;
+    int i;
+
+    if (!event_loops)
+        return;
+
+    /* Loops exit on the next tick after run is cleared */
+    for (i=0; i<options.event_threads; i++)
+        pthread_join(event_loops[i].thread, NULL);
+
+    /* With the loops gone, their connections can be closed here */
+    for (i=0; i<options.acceptors; i++) {
+        while ((conn = event_queues[i].head)) {
+            event_queues[i].head = conn->queued;
+            event_conn_close(conn);
+        }
+        proxy_mutex_destroy(&event_queues[i].lock);
+    }
+
+    for (i=0; i<options.event_threads; i++) {
+        event_loop_reap(&event_loops[i], TRUE);
+        close(event_loops[i].wakefd);
+        close(event_loops[i].epfd);
+        proxy_mutex_destroy(&event_loops[i].lock);
+    }
+
+    free(event_queues);
+    event_queues = NULL;
+    free(event_loops);
+    event_loops = NULL;
+}
+
+/**
+ * Register a newly accepted client connection. The handshake
+ * is immediately handed off to a client thread.
+ *
+ * @param clientfd Socket descriptor of the client.
+ * @param addr     Address of the client endpoint.
+ *
+ * @return TRUE on error, FALSE otherwise.
+ **/
+my_bool proxy_event_add(int clientfd, struct sockaddr_in *addr) {
+    proxy_event_conn_t *conn;
+    event_loop_t *loop;
+
+    conn = (proxy_event_conn_t*) calloc(1, sizeof(proxy_event_conn_t));
+    if (!conn) {
+        proxy_log(LOG_ERROR, "Out of memory when allocating client connection");
+        close(clientfd);
+        return TRUE;
+    }
+
+    /* Initialize connection data */
+    conn->addr = *addr;
+    conn->work.clientfd = clientfd;
+    conn->work.addr = &conn->addr;
+    conn->work.proxy = NULL;
+    conn->work.event = conn;
+    conn->work.conn_idx.bi = -1;
+    conn->work.conn_idx.ci = -1;
+    conn->last_active = time(NULL);
+    conn->ready = FALSE;
+    conn->busy = TRUE;
+    proxy_status_reset(&conn->status);
+
+    /* Assign loops round-robin */
+    conn->loop = __sync_fetch_and_add(&next_loop, 1) % options.event_threads;
+    loop = &event_loops[conn->loop];
+
+    /* Shed load before the handshake if commands can't get a thread */
+    if (event_admit_full(conn->loop % options.acceptors)) {
+        proxy_vdebug("Rejecting client connection on shard %d", conn->loop % options.acceptors);
+        free(conn);
+        proxy_admit_reject(clientfd);
+        return FALSE;
+    }
+
+    proxy_mutex_lock(&loop->lock);
+    conn->prev = NULL;
+    conn->next = loop->conns;
+    if (loop->conns)
+        loop->conns->prev = conn;
+    loop->conns = conn;
+    loop->nconns++;
+    proxy_mutex_unlock(&loop->lock);
+
+    (void) __sync_fetch_and_add(&global_connections, 1);
+
+    /* Perform the handshake on a client thread */
+    event_dispatch(conn);
+
+    return FALSE;
+}
+
+/**
+ * Give a connection to a client thread and signal it to go.
+ *
+ * @param thread_id Identifier of the client thread.
+ * @param conn      Connection to service.
+ **/
+static void event_give(int thread_id, proxy_event_conn_t *conn) {
+    proxy_thread_t *thread = &(net_threads[thread_id]);
+
+    proxy_mutex_lock(&thread->lock);
+    thread->data.work.clientfd = conn->work.clientfd;
+    thread->data.work.event = conn;
+    thread->data.work.addr = &conn->addr;
+    proxy_cond_signal(&thread->cv);
+    proxy_mutex_unlock(&thread->lock);
+}
+
+/**
+ * Check whether new connections should be rejected because the queue
+ * of a shard is full or the oldest waiting connection has waited longer
+ * than allowed, as in proxy_admit_add. Commands on established
+ * connections count towards the queue but are never rejected.
+ *
+ * @param shard Index of the shard to check.
+ *
+ * @return TRUE if new connections should be rejected, FALSE otherwise.
+ **/
+static my_bool event_admit_full(int shard) {
+    event_queue_t *queue = &event_queues[shard];
+    struct timeval now;
+    my_bool full = FALSE;
+
+    if (options.queue_depth <= 0)
+        return FALSE;
+
+    proxy_mutex_lock(&queue->lock);
+    if (queue->count >= options.queue_depth) {
+        full = TRUE;
+    } else if (queue->head) {
+        gettimeofday(&now, NULL);
+        full = (now.tv_sec - queue->head->queued_at.tv_sec) * 1000000L
+            + (now.tv_usec - queue->head->queued_at.tv_usec) > options.queue_wait * 1000L;
+    }
+    proxy_mutex_unlock(&queue->lock);
+
+    return full;
+}
+
+/**
+ * Hand a connection with pending data to an available client
+ * thread. If none are free, the connection waits in the queue
+ * of its shard, so event loops never block on client threads.
+ *
+ * @param conn Connection to dispatch.
+ **/
+static void event_dispatch(proxy_event_conn_t *conn) {
+    event_queue_t *queue = &event_queues[conn->loop % options.acceptors];
+    int thread_id = -1;
+
+    proxy_mutex_lock(&queue->lock);
+
+    /* Earlier connections go first */
+    if (queue->head || (thread_id = proxy_net_try_get_thread(conn->loop % options.acceptors)) < 0) {
+        gettimeofday(&conn->queued_at, NULL);
+        queue->count++;
+        conn->queued = NULL;
+        if (queue->tail)
+            queue->tail->queued = conn;
+        else
+            queue->head = conn;
+        queue->tail = conn;
+    }
+
+    proxy_mutex_unlock(&queue->lock);
+
+    if (thread_id >= 0)
+        event_give(thread_id, conn);
+}
+
+/**
+ * Release a client thread once it has serviced an event. If
+ * connections are waiting, the oldest is given to the thread
+ * instead of returning the thread to its pool.
+ *
+ * @param thread_id Identifier of the client thread.
+ **/
+void proxy_event_release(int thread_id) {
+    event_queue_t *queue = &event_queues[proxy_net_thread_shard(thread_id)];
+    proxy_event_conn_t *conn;
+
+    proxy_mutex_lock(&queue->lock);
+
+    /* Return the thread while holding the lock so
+     * new events will see it as available */
+    if (!(conn = queue->head)) {
+        proxy_net_return_thread(thread_id);
+        proxy_mutex_unlock(&queue->lock);
+        return;
+    }
+
+    queue->head = conn->queued;
+    if (!queue->head)
+        queue->tail = NULL;
+    queue->count--;
+
+    proxy_mutex_unlock(&queue->lock);
+
+    proxy_admit_waited(&conn->queued_at);
+
+    event_give(thread_id, conn);
+}
+
+/**
+ * Service a single event on a connection from a client thread.
+ * This performs the handshake on new connections or executes
+ * one command otherwise, then returns the connection to its
+ * event loop unless it was closed.
+ *
+ * @param conn      Connection to service.
+ * @param thread_id Identifier of the client thread.
+ * @param commit    Commit data owned by the client thread.
+ **/
+void proxy_event_service(proxy_event_conn_t *conn, int thread_id, commitdata_t *commit) {
+    status_t published;
+    conn_error_t error;
+
+    if (!conn->ready) {
+        if (proxy_net_client_start(&conn->work, thread_id)) {
+            event_conn_close(conn);
+            return;
+        }
+
+        /* Backend connections stay with the session */
+        proxy_backend_get_connection(&conn->work.conn_idx, thread_id);
+        conn->ready = TRUE;
+    } else {
+        published = conn->status;
+        error = proxy_net_read_query(&conn->work, thread_id, commit, &conn->status, FALSE);
+        proxy_net_flush(conn->work.proxy);
+
+        /* Count the command on the thread which serviced it */
+        proxy_stats_publish(thread_id, &conn->status, &published);
+
+        if (error != ERROR_OK || conn->work.proxy->net.error || !conn->work.proxy->net.vio) {
+            switch (error) {
+                case ERROR_OK:
+                case ERROR_CLOSE:
+                    break;
+                case ERROR_CLIENT:
+                    proxy_log(LOG_ERROR, "Error from client when processing query");
+                    break;
+                case ERROR_BACKEND:
+                    proxy_log(LOG_ERROR, "Error from backend when processing query");
+                    break;
+                case ERROR_OTHER:
+                default:
+                    proxy_log(LOG_ERROR, "Error in processing query, disconnecting");
+                    break;
+            }
+
+            event_conn_close(conn);
+            return;
+        }
+    }
+
+    conn->last_active = time(NULL);
+    event_conn_park(conn);
+}
+
+/**
+ * Return a connection to its event loop to wait for the next command.
+ *
+ * @param conn Connection to park.
+ **/
+static void event_conn_park(proxy_event_conn_t *conn) {
+    event_loop_t *loop = &event_loops[conn->loop];
+    struct epoll_event ev;
+    int op = EPOLL_CTL_MOD;
+
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    ev.data.ptr = conn;
+
+    proxy_mutex_lock(&loop->lock);
+    conn->busy = FALSE;
+
+    /* The first park after the handshake adds the descriptor */
+    if (epoll_ctl(loop->epfd, op, conn->work.clientfd, &ev) < 0 && errno == ENOENT) {
+        op = EPOLL_CTL_ADD;
+        if (epoll_ctl(loop->epfd, op, conn->work.clientfd, &ev) < 0)
+            proxy_log(LOG_ERROR, "Error adding client to event loop: %s", errstr);
+    }
+    proxy_mutex_unlock(&loop->lock);
+}
+
+/**
+ * Close a connection and free all associated data.
+ *
+ * @param conn Connection to close.
+ **/
+static void event_conn_close(proxy_event_conn_t *conn) {
+    event_loop_t *loop = &event_loops[conn->loop];
+
+    /* Remove the connection from the loop */
+    proxy_mutex_lock(&loop->lock);
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, conn->work.clientfd, NULL);
+
+    if (conn->prev)
+        conn->prev->next = conn->next;
+    else
+        loop->conns = conn->next;
+    if (conn->next)
+        conn->next->prev = conn->prev;
+    loop->nconns--;
+    proxy_mutex_unlock(&loop->lock);
+
+    if (conn->ready)
+        proxy_backend_release_connection(&conn->work.conn_idx);
+
+    /* proxy_net_client_end closes the socket once a MySQL object exists */
+    if (conn->work.proxy)
+        proxy_net_client_end(&conn->work);
+    else
+        close(conn->work.clientfd);
+
+    free(conn);
+}
+
+/**
+ * Close all idle connections, e.g. after cloning
+ * so that clients reconnect to the new address.
+ * Each loop is woken to close its own connections,
+ * since it may still hold them from its last wait.
+ **/
+void proxy_event_close_all() {
+    uint64_t one = 1;
+    int i;
+
+    if (!event_loops)
+        return;
+
+    for (i=0; i<options.event_threads; i++) {
+        event_loops[i].close_all = 1;
+        if (write(event_loops[i].wakefd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+            proxy_log(LOG_ERROR, "Error waking event loop %d: %s", i, errstr);
+    }
+}
+
+/**
+ * Get the number of client connections held by event loops.
+ *
+ * @return Number of open client connections.
+ **/
+long proxy_event_connections() {
+    long num = 0;
+    int i;
+
+    if (!event_loops)
+        return 0;
+
+    for (i=0; i<options.event_threads; i++)
+        num += event_loops[i].nconns;
+
+    return num;
+}
+
+/**
+ * Close idle connections owned by an event loop.
+ *
+ * @param loop Loop whose connections should be checked.
+ * @param all  TRUE to close all idle connections, FALSE to close only
+ *             those idle for longer than the client timeout.
+ **/
+static void event_loop_reap(event_loop_t *loop, my_bool all) {
+    proxy_event_conn_t *conn, *next, *expired = NULL;
+    time_t now = time(NULL);
+
+    if (!all && options.timeout < 0)
+        return;
+
+    /* Collect expired connections while holding the lock */
+    proxy_mutex_lock(&loop->lock);
+    for (conn = loop->conns; conn; conn = next) {
+        next = conn->next;
+
+        if (!conn->busy && (all || now - conn->last_active > options.timeout)) {
+            /* Mark busy so no event can dispatch it */
+            conn->busy = TRUE;
+            epoll_ctl(loop->epfd, EPOLL_CTL_DEL, conn->work.clientfd, NULL);
+
+            conn->prev = expired;
+            expired = conn;
+        }
+    }
+    proxy_mutex_unlock(&loop->lock);
+
+    /* Close them without the lock held */
+    while (expired) {
+        conn = expired;
+        expired = conn->prev;
+
+        proxy_vdebug("Closing idle client connection on loop %d", loop->id);
+        event_conn_close(conn);
+    }
+}
+
+/**
+ * Event loop thread function.
+ *
+ * @param ptr Pointer to the ::event_loop_t for this thread.
+ *
+ * @return NULL.
+ **/
+static void* event_loop_start(void *ptr) {
+    event_loop_t *loop = (event_loop_t*) ptr;
+    struct epoll_event events[EVENT_BATCH];
+    proxy_event_conn_t *conn;
+    time_t last_reap = time(NULL);
+    uint64_t wakeups;
+    my_bool busy;
+    char name[16];
+    int i, n;
+
+    snprintf(name, 16, "Event%d", loop->id);
+    proxy_threading_name(name);
+    proxy_threading_mask();
+
+    /* Wait for the server to be started */
+    while (!run) { usleep(SYNC_SLEEP); }
+
+    while (run) {
+        n = epoll_wait(loop->epfd, events, EVENT_BATCH, EVENT_TICK);
+        if (n < 0 && errno != EINTR)
+            proxy_log(LOG_ERROR, "Error waiting for client events: %s", errstr);
+
+        for (i=0; i<n; i++) {
+            conn = (proxy_event_conn_t*) events[i].data.ptr;
+
+            /* Another thread woke the loop */
+            if (!conn) {
+                if (read(loop->wakefd, &wakeups, sizeof(wakeups)) < 0 && errno != EAGAIN)
+                    proxy_log(LOG_ERROR, "Error reading event loop wakeup: %s", errstr);
+                continue;
+            }
+
+            /* Skip connections which were reaped after the wait
+             * returned, otherwise claim the connection */
+            proxy_mutex_lock(&loop->lock);
+            busy = conn->busy;
+            conn->busy = TRUE;
+            proxy_mutex_unlock(&loop->lock);
+            if (busy)
+                continue;
+
+            /* Check if the client has gone away */
+            if (events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                proxy_vdebug("Lost connection to client");
+                event_conn_close(conn);
+                continue;
+            }
+
+            /* The descriptor stays disarmed until the
+             * client thread parks the connection again */
+            event_dispatch(conn);
+        }
+
+        /* Nothing from the last wait is used after this point,
+         * so connections can be closed and freed */
+        if (loop->close_all) {
+            loop->close_all = 0;
+            event_loop_reap(loop, TRUE);
+        }
+
+        if (time(NULL) != last_reap) {
+            last_reap = time(NULL);
+            event_loop_reap(loop, FALSE);
+        }
+    }
+
+    proxy_debug("Exiting event loop %d", loop->id);
+
+    mysql_thread_end();
+    pthread_exit(NULL);
+}
+
+/**
+ * Get the number of connections waiting for a client thread.
+ *
+ * @return Number of connections in the queues of all shards.
+ **/
+long proxy_event_queued() {
+    long num = 0;
+    int i;
+
+    if (!event_queues)
+        return 0;
+
+    for (i=0; i<options.acceptors; i++)
+        num += event_queues[i].count;
+
+    return num;
+}
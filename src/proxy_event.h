@@ -0,0 +1,56 @@
+/*
+ * proxy_event.h
+ *
+ * Event-driven handling of idle client connections.
+ *
+ * This file is subject to the terms and conditions of the GNU General
+ * Public License.  See the file "COPYING" in the main directory of
+ * this archive for more details.
+ *
+ * Copyright (C) 2010 by Michael Mior <mmior@cs.toronto.edu>
+ *
+ */
+
+#ifndef _proxy_event_h
+#define _proxy_event_h
+
+/**
+ * Client connection which is multiplexed
+ * by an event loop between commands.
+ **/
+typedef struct proxy_event_conn {
+    /** Work data passed to client threads. */
+    proxy_work_t work;
+    /** Copy of the address of the client endpoint. */
+    struct sockaddr_in addr;
+    /** Status information for the connection. */
+    status_t status;
+    /** Index of the event loop which owns this connection. */
+    int loop;
+    /** TRUE once the handshake has been completed. */
+    my_bool ready;
+    /** TRUE while a client thread is servicing the connection. */
+    my_bool busy;
+    /** Time of the last command received on the connection. */
+    time_t last_active;
+    /** Time the connection started waiting for a client thread. */
+    struct timeval queued_at;
+
+    /** Previous connection in the list of the owning loop. */
+    struct proxy_event_conn *prev;
+    /** Next connection in the list of the owning loop. */
+    struct proxy_event_conn *next;
+    /** Next connection waiting for a client thread. */
+    struct proxy_event_conn *queued;
+} proxy_event_conn_t;
+
+my_bool proxy_event_init();
+void proxy_event_end();
+my_bool proxy_event_add(int clientfd, struct sockaddr_in *addr);
+void proxy_event_service(proxy_event_conn_t *conn, int thread_id, commitdata_t *commit);
+void proxy_event_release(int thread_id);
+void proxy_event_close_all();
+long proxy_event_connections();
+long proxy_event_queued();
+
+#endif /* _proxy_event_h */
@@ -0,0 +1,169 @@
+/******************************************************************************
+ * proxy_latency.c
+ *
+ * Latency histograms for query classes, backends and commit phases.
+ *
+ * Samples are counted in log-scaled buckets as in HdrHistogram, so
+ * recording takes a few atomic adds and percentiles can be read at any
+ * time without keeping individual samples.
+ *
+ * Copyright (c) 2010, Michael Mior <mmior@cs.toronto.edu>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+ * Place - Suite 330, Boston, MA 02111-1307 USA.
+ *
+ */
+
+#include "proxy.h"
+
+/** Histograms for each site */
+static latency_hist_t latency_sites[LATENCY_SITES];
+
+/** Names of latency sites, indexed by ::proxy_latency_site_t */
+static const char *latency_names[LATENCY_SITES] = {
+    "Query_any",
+    "Query_all",
+    "Barrier",
+    "Vote",
+    "Commit"
+};
+
+/**
+ * Find the bucket a latency is counted in.
+ *
+ * @param usec Latency in microseconds.
+ *
+ * @return Index of the bucket.
+ **/
+static int latency_bucket(long usec) {
+    int msb;
+
+    if (usec < LATENCY_SUB)
+        return usec < 0 ? 0 : (int) usec;
+
+    msb = 63 - __builtin_clzll((ulonglong) usec);
+    if (msb >= LATENCY_MAX_BITS)
+        return LATENCY_BUCKETS - 1;
+
+    /* Keep the top bits below the most significant one */
+    return (msb - LATENCY_SUB_BITS + 1) * LATENCY_SUB
+        + (int) ((usec >> (msb - LATENCY_SUB_BITS)) - LATENCY_SUB);
+}
+
+/**
+ * Get the largest latency counted in a bucket.
+ *
+ * @param bucket Index of the bucket.
+ *
+ * @return Latency in microseconds.
+ **/
+static long latency_value(int bucket) {
+    int group = bucket / LATENCY_SUB, sub = bucket % LATENCY_SUB;
+
+    if (!group)
+        return bucket;
+
+    return ((long) (LATENCY_SUB + sub + 1) << (group - 1)) - 1;
+}
+
+/**
+ * Add a sample to a histogram. Samples are timed with the wall
+ * clock, which may be stepped back, so negative ones count as zero.
+ *
+ * @param hist Histogram to add to.
+ * @param usec Latency in microseconds.
+ **/
+void proxy_latency_add(latency_hist_t *hist, long usec) {
+    long max;
+
+    if (unlikely(usec < 0))
+        usec = 0;
+
+    (void) __sync_fetch_and_add(&hist->counts[latency_bucket(usec)], 1);
+    (void) __sync_fetch_and_add(&hist->count, 1);
+    (void) __sync_fetch_and_add(&hist->usec, usec);
+
+    while ((max = hist->max) < usec
+            && !__sync_bool_compare_and_swap(&hist->max, max, usec));
+}
+
+/**
+ * Add the time elapsed since some start time to a histogram.
+ *
+ * @param hist  Histogram to add to.
+ * @param start Time when the measured operation started.
+ **/
+void proxy_latency_record(latency_hist_t *hist, struct timeval *start) {
+    struct timeval end;
+
+    gettimeofday(&end, NULL);
+    proxy_latency_add(hist, (end.tv_sec - start->tv_sec) * 1000000L + (end.tv_usec - start->tv_usec));
+}
+
+/**
+ * Get the histogram for a latency site.
+ *
+ * @param site Site to get the histogram of.
+ *
+ * @return Histogram of the site.
+ **/
+latency_hist_t* proxy_latency_site(proxy_latency_site_t site) {
+    return &latency_sites[site];
+}
+
+/**
+ * Get a percentile of the latencies in a histogram. Samples may
+ * be added while reading, so the result is only approximate.
+ *
+ * @param hist       Histogram to read.
+ * @param percentile Percentile to find between 0 and 100.
+ *
+ * @return Latency in microseconds which the given percentage
+ *         of samples did not exceed, or zero if there are none.
+ **/
+long proxy_latency_percentile(latency_hist_t *hist, double percentile) {
+    ulong total = 0, target, seen = 0;
+    long value;
+    int i;
+
+    for (i=0; i<LATENCY_BUCKETS; i++)
+        total += hist->counts[i];
+    if (!total)
+        return 0;
+
+    /* Round to the nearest sample as HdrHistogram does */
+    target = (ulong) (percentile / 100.0 * total + 0.5);
+    if (!target)
+        target = 1;
+
+    for (i=0; i<LATENCY_BUCKETS; i++) {
+        seen += hist->counts[i];
+        if (seen >= target)
+            break;
+    }
+
+    /* Buckets are wider than the samples in them */
+    value = latency_value(i < LATENCY_BUCKETS ? i : LATENCY_BUCKETS - 1);
+    return value > hist->max ? hist->max : value;
+}
+
+/**
+ * Get the name of a latency site.
+ *
+ * @param site Site to get the name of.
+ *
+ * @return Name of the site.
+ **/
+const char* proxy_latency_name(proxy_latency_site_t site) {
+    return latency_names[site];
+}
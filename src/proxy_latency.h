@@ -0,0 +1,68 @@
+/*
+ * proxy_latency.h
+ *
+ * Latency histograms for query classes, backends and commit phases.
+ *
+ * This file is subject to the terms and conditions of the GNU General
+ * Public License.  See the file "COPYING" in the main directory of
+ * this archive for more details.
+ *
+ * Copyright (C) 2010 by Michael Mior <mmior@cs.toronto.edu>
+ *
+ */
+
+#ifndef _proxy_latency_h
+#define _proxy_latency_h
+
+#include <sys/time.h>
+
+/** Bits of precision kept for each power of two */
+#define LATENCY_SUB_BITS 4
+/** Buckets for each power of two */
+#define LATENCY_SUB (1 << LATENCY_SUB_BITS)
+/** Latencies of 2^LATENCY_MAX_BITS microseconds or more share the last bucket */
+#define LATENCY_MAX_BITS 32
+/** Number of buckets in a histogram */
+#define LATENCY_BUCKETS ((LATENCY_MAX_BITS - LATENCY_SUB_BITS + 1) * LATENCY_SUB)
+
+/**
+ * Places where latency is recorded, other than backends.
+ **/
+typedef enum {
+    /** Non-replicated queries from start to finish. */
+    LATENCY_QUERY_ANY,
+    /** Replicated queries from start to finish. */
+    LATENCY_QUERY_ALL,
+    /** Backend threads waiting on each other at the query barrier. */
+    LATENCY_BARRIER,
+    /** Backends waiting for the outcome on every backend before commit. */
+    LATENCY_VOTE,
+    /** Round trip of the final COMMIT to backends. */
+    LATENCY_COMMIT,
+    /** Number of latency sites. */
+    LATENCY_SITES
+} proxy_latency_site_t;
+
+/**
+ * Histogram of latencies in microseconds. Buckets are exact below
+ * 2^(LATENCY_SUB_BITS+1) and grow with each power of two above, so
+ * values are kept to within about 6%.
+ **/
+typedef struct {
+    /** Number of samples in each bucket. */
+    volatile ulong counts[LATENCY_BUCKETS];
+    /** Total number of samples. */
+    volatile ulong count;
+    /** Total microseconds of all samples. */
+    volatile ulong usec;
+    /** Largest sample in microseconds. */
+    volatile long max;
+} latency_hist_t;
+
+void proxy_latency_add(latency_hist_t *hist, long usec);
+void proxy_latency_record(latency_hist_t *hist, struct timeval *start);
+latency_hist_t* proxy_latency_site(proxy_latency_site_t site);
+long proxy_latency_percentile(latency_hist_t *hist, double percentile);
+const char* proxy_latency_name(proxy_latency_site_t site);
+
+#endif /* _proxy_latency_h */
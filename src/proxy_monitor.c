@@ -3,6 +3,13 @@
  *
  * Monitor the load on the proxy server and perform cloning as necessary.
  *
+ * Statistics are sampled each second so rates can be reported over
+ * recent windows. On the coordinator, an autoscaler also samples query
+ * throughput, backend latency and the client queue each second. A clone
+ * is added when any rule stays above its upper threshold, and the newest
+ * clone is removed when all rules stay below their lower thresholds, with
+ * a cooldown after each action so its effect shows before the next.
+ *
  * Copyright (c) 2010, Michael Mior <mmior@cs.toronto.edu>
  *
  * This program is free software; you can redistribute it and/or modify it
@@ -24,8 +31,14 @@
 
 #include <netdb.h>
 
+/** Samples load must stay high before a clone is added */
+#define SCALE_OUT_SAMPLES 3
+/** Samples load must stay low before a clone is removed */
+#define SCALE_IN_SAMPLES  10
+
 static my_bool monitor_master_connect();
 static void *monitor_thread_start(void *ptr);
+static void monitor_scale();
 
 extern volatile sig_atomic_t run;
 
@@ -35,6 +48,56 @@ static pthread_t monitor_thread;
  *  started in this session */
 static my_bool monitor_started = FALSE;
 
+/** Consecutive samples above and below scaling thresholds */
+static int scale_high = 0, scale_low = 0;
+/** Time when the last scaling action finished */
+static volatile time_t scale_last = 0;
+/** Set while a scaling action is in progress */
+static volatile sig_atomic_t scaling = 0;
+/** Query count and time of the previous sample */
+static ulong scale_queries = 0;
+static struct timeval scale_time = { 0, 0 };
+
+/**
+ * Get the load on each backend in queries per second.
+ *
+ * @param sample Load sample.
+ *
+ * @return Queries per second for each backend.
+ **/
+static long scale_metric_qps(const proxy_scale_sample_t *sample) {
+    return sample->backends ? sample->qps / sample->backends : sample->qps;
+}
+
+/**
+ * Get the average latency of backends.
+ *
+ * @param sample Load sample.
+ *
+ * @return Latency in microseconds.
+ **/
+static long scale_metric_latency(const proxy_scale_sample_t *sample) {
+    return sample->latency;
+}
+
+/**
+ * Get the number of connections waiting for a client thread.
+ *
+ * @param sample Load sample.
+ *
+ * @return Number of queued connections.
+ **/
+static long scale_metric_queue(const proxy_scale_sample_t *sample) {
+    return sample->queue;
+}
+
+/** Functions computing each load signal, indexed by ::proxy_scale_metric_t */
+static long (* const scale_metrics[])(const proxy_scale_sample_t*) = {
+    scale_metric_qps,
+    scale_metric_latency,
+    scale_metric_queue
+};
+
 /**
  * Monitor thread function.
  *
@@ -43,8 +106,9 @@ static my_bool monitor_started = FALSE;
  * @return NULL.
  **/
 static void* monitor_thread_start(__attribute__((unused)) void *ptr) {
-    FILE *stat_file;
+    FILE *stat_file = NULL;
     struct timeval tv;
+    status_t status;
 
     proxy_threading_name("Monitor");
 
@@ -57,38 +121,186 @@ static void* monitor_thread_start(__attribute__((unused)) void *ptr) {
 
     /* Check if we are dumping QPS statistics and
      * try to open the statistics file */
-    if (!options.stat_file)
-        goto out;
-
-    stat_file = fopen(options.stat_file, "w");
-    if (!stat_file) {
-        proxy_log(LOG_ERROR, "Error opening statistics file");
-        goto out;
+    if (options.stat_file) {
+        stat_file = fopen(options.stat_file, "w");
+        if (!stat_file)
+            proxy_log(LOG_ERROR, "Error opening statistics file");
+        else
+            proxy_log(LOG_INFO, "Statistics file %s opened for output", options.stat_file);
     }
-    proxy_log(LOG_INFO, "Statistics file %s opened for output", options.stat_file);
-
-    /* Loop while the proxy is running and dump
-     * total number of executed queries */
-    /* XXX: global_status is currently updated
-     *      only when a connection is killed,
-     *      so statistics will be stale if
-     *      connections are long-lived */
+
+    if (options.scale_rules_num)
+        proxy_log(LOG_INFO, "Autoscaling with %d rule(s)%s", options.scale_rules_num,
+            options.scale_dry_run ? " in dry-run mode" : "");
+
+    /* Loop while the proxy is running, sampling statistics
+     * for rates and dumping total number of executed queries */
     while (run) {
-        gettimeofday(&tv, NULL);
-        fprintf(stat_file, "%ld.%06ld,%ld\n", tv.tv_sec, tv.tv_usec, global_status.queries);
+        proxy_stats_sample();
+
+        if (stat_file) {
+            proxy_stats_total(&status);
+            gettimeofday(&tv, NULL);
+            fprintf(stat_file, "%ld.%06ld,%ld\n", tv.tv_sec, tv.tv_usec, status.queries);
 #ifdef DEBUG
-        fflush(stat_file);
-        fsync(fileno(stat_file));
+            fflush(stat_file);
+            fsync(fileno(stat_file));
 #endif
+        }
+
+        if (options.scale_rules_num)
+            monitor_scale();
+
         sleep(1);
     }
-    fclose(stat_file);
 
-out:
+    if (stat_file)
+        fclose(stat_file);
+
+    /* Don't leave a clone half added or removed */
+    proxy_wait(WAIT_TOPO, !scaling);
+
     mysql_thread_end();
     pthread_exit(NULL);
 }
 
+/**
+ * Decide whether to add or remove a clone given the current load.
+ * Clones are added when any rule is above its upper threshold and
+ * removed when all are below their lower thresholds, in both cases
+ * only once load has stayed there for a number of samples.
+ *
+ * @param sample Current load.
+ * @param now    Time of the sample in seconds.
+ *
+ * @return 1 to add a clone, -1 to remove one, or 0 to do nothing.
+ **/
+static int monitor_scale_decide(const proxy_scale_sample_t *sample, time_t now) {
+    my_bool high = FALSE, low = TRUE;
+    proxy_scale_rule_t *rule;
+    long value;
+    int i;
+
+    for (i=0; i<options.scale_rules_num; i++) {
+        rule = &options.scale_rules[i];
+        value = scale_metrics[rule->metric](sample);
+
+        if (value > rule->out)
+            high = TRUE;
+        if (value >= rule->in)
+            low = FALSE;
+    }
+
+    /* Ignore brief spikes and lulls */
+    scale_high = high ? scale_high + 1 : 0;
+    scale_low  = low  ? scale_low  + 1 : 0;
+
+    /* Give the last action time to take effect */
+    if (scale_last && now - scale_last < options.scale_cooldown)
+        return 0;
+
+    if (scale_high >= SCALE_OUT_SAMPLES && sample->backends < options.scale_max)
+        return 1;
+    if (scale_low >= SCALE_IN_SAMPLES && sample->clone > 0)
+        return -1;
+
+    return 0;
+}
+
+/**
+ * Add or remove a clone without holding up the monitor.
+ *
+ * @param ptr ID of the clone to remove, or zero to add one.
+ *
+ * @return NULL.
+ **/
+static void* monitor_scale_thread(void *ptr) {
+    int clone_id = (int) (long) ptr;
+    char err[BUFSIZ];
+
+    proxy_threading_name("Scale");
+
+    if (clone_id) {
+        if (proxy_cmd_remove(clone_id))
+            proxy_log(LOG_ERROR, "Autoscaler couldn't remove clone %d", clone_id);
+    } else if (proxy_cmd_clone(1, err, BUFSIZ)) {
+        proxy_log(LOG_ERROR, "Autoscaler couldn't add a clone: %s", err);
+    }
+
+    scale_last = time(NULL);
+    scaling = 0;
+    proxy_wait_wake();
+
+    mysql_thread_end();
+    return NULL;
+}
+
+/**
+ * Sample the load and add or remove a clone if needed.
+ **/
+static void monitor_scale() {
+    proxy_scale_sample_t sample;
+    admit_stats_t admit;
+    struct timeval now;
+    pthread_attr_t attr;
+    pthread_t thread;
+    double elapsed;
+    my_bool first;
+    ulong queries;
+    int action;
+
+    gettimeofday(&now, NULL);
+    sample.backends = proxy_backend_load(&queries, &sample.latency, &sample.clone);
+    proxy_admit_stats(&admit);
+    sample.queue = admit.depth;
+
+    /* Rates need a previous sample */
+    first = !scale_time.tv_sec;
+    elapsed = now.tv_sec - scale_time.tv_sec + (now.tv_usec - scale_time.tv_usec) / 1000000.0;
+    sample.qps = elapsed > 0 ? (long) ((queries - scale_queries) / elapsed) : 0;
+    scale_queries = queries;
+    scale_time = now;
+
+    if (first)
+        return;
+
+    /* Load is in flux while a clone joins or leaves */
+    if (scaling) {
+        scale_high = scale_low = 0;
+        return;
+    }
+
+    if (!(action = monitor_scale_decide(&sample, now.tv_sec)))
+        return;
+
+    scale_high = scale_low = 0;
+    scale_last = now.tv_sec;
+
+    if (action > 0)
+        proxy_log(LOG_INFO, "%s clone at %ld qps, %ldus latency and %ld queued on %d backends",
+            options.scale_dry_run ? "Would add a" : "Adding a", sample.qps,
+            sample.latency, sample.queue, sample.backends);
+    else
+        proxy_log(LOG_INFO, "%s clone %d at %ld qps, %ldus latency and %ld queued on %d backends",
+            options.scale_dry_run ? "Would remove" : "Removing", sample.clone, sample.qps,
+            sample.latency, sample.queue, sample.backends);
+
+    if (options.scale_dry_run)
+        return;
+
+    scaling = 1;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    if (proxy_threading_create(&thread, &attr, monitor_scale_thread,
+            (void*) (long) (action > 0 ? 0 : sample.clone))) {
+        proxy_log(LOG_ERROR, "Couldn't start autoscaling thread: %s", errstr);
+        scaling = 0;
+    }
+
+    pthread_attr_destroy(&attr);
+}
+
 /**
  * Prepare monitoring and start the monitor thread.
  *
@@ -14,6 +14,49 @@
 #ifndef _proxy_monitor_h
 #define _proxy_monitor_h
 
+/** Maximum number of autoscaling rules */
+#define SCALE_RULES 4
+
+/**
+ * Load signals which can drive autoscaling.
+ **/
+typedef enum {
+    /** Queries per second for each backend. */
+    SCALE_QPS,
+    /** Average query latency of backends in microseconds. */
+    SCALE_LATENCY,
+    /** Connections waiting for a client thread. */
+    SCALE_QUEUE
+} proxy_scale_metric_t;
+
+/**
+ * Thresholds on a load signal for adding and removing clones.
+ **/
+typedef struct {
+    /** Load signal the rule applies to. */
+    proxy_scale_metric_t metric;
+    /** Value above which a clone is added. */
+    long out;
+    /** Value below which a clone may be removed. */
+    long in;
+} proxy_scale_rule_t;
+
+/**
+ * Load sampled by the monitor for autoscaling.
+ **/
+typedef struct {
+    /** Queries per second forwarded to backends. */
+    long qps;
+    /** Average query latency of backends in microseconds. */
+    long latency;
+    /** Connections waiting for a client thread. */
+    long queue;
+    /** Number of backends. */
+    int backends;
+    /** ID of the newest clone, or zero if there are none. */
+    int clone;
+} proxy_scale_sample_t;
+
 my_bool proxy_monitor_init();
 void proxy_monitor_end();
 
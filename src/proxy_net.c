@@ -26,10 +26,6 @@
 
 /** Minimum size of a handshake from a client (from sql/sql_connect.cc) */
 #define MIN_HANDSHAKE_SIZE 6
-/** Number of client connections waiting in
- *  queue to be accepted when client threads
- *  are all occupied. */
-#define QUEUE_LENGTH  10
 
 /** Exposes the default charset in the client library */
 extern CHARSET_INFO *default_charset_info;
@@ -43,8 +39,18 @@ void net_thread_destroy(void *ptr);
 static inline MYSQL* client_init(int clientfd);
 static my_bool check_user(char *user, uint user_len, char *passwd, uint passwd_len, char *db, uint db_len);
 
-int proxy_net_bind_new_socket(char *host, int port) {
-    int serverfd;
+/**
+ * Create a new listening socket.
+ *
+ * @param host   Address to bind to, or NULL for any address.
+ * @param port   Port to listen on.
+ * @param client TRUE if the socket accepts client connections, in which
+ *               case the backlog and port sharing options apply.
+ *
+ * @return Descriptor of the new socket, or negative on error.
+ **/
+int proxy_net_bind_new_socket(char *host, int port, my_bool client) {
+    int serverfd, optval;
     union sockaddr_union serveraddr;
     struct hostent *hostinfo;
 
@@ -52,12 +58,24 @@ int proxy_net_bind_new_socket(char *host, int port) {
 
     /* If we're debugging, allow reuse of the socket */
 #ifdef DEBUG
-    {
-        int optval = 1;
-        setsockopt(serverfd, SOL_SOCKET, SO_REUSEADDR, (const void*) &optval, sizeof(int));
-    }
+    optval = 1;
+    setsockopt(serverfd, SOL_SOCKET, SO_REUSEADDR, (const void*) &optval, sizeof(int));
 #endif
 
+    /* Allow each acceptor to bind its own socket to the port */
+    if (client && options.acceptors > 1) {
+#ifdef SO_REUSEPORT
+        optval = 1;
+        if (setsockopt(serverfd, SOL_SOCKET, SO_REUSEPORT, (const void*) &optval, sizeof(int)) < 0) {
+            proxy_log(LOG_ERROR, "Error sharing server socket: %s", errstr);
+            return -1;
+        }
+#else
+        proxy_log(LOG_ERROR, "Multiple acceptors are not supported on this system");
+        return -1;
+#endif
+    }
+
     /* Initialize the server address */
     memset(&serveraddr, 0, sizeof(serveraddr));
     serveraddr.sin.sin_family = AF_INET;
@@ -83,7 +101,7 @@ int proxy_net_bind_new_socket(char *host, int port) {
         return -1;
     }
 
-    if (listen(serverfd, QUEUE_LENGTH) < 0) {
+    if (listen(serverfd, client ? options.backlog : QUEUE_LENGTH) < 0) {
         proxy_log(LOG_ERROR, "Error listening on server socket: %s", errstr);
         return -1;
     }
@@ -298,7 +316,6 @@ MYSQL* client_init(int clientfd) {
 
     /* Initialize the client network structure */
     net = &(mysql->net);
-    net->max_packet += ID_SIZE;
     my_net_init(net, vio_tmp);
     my_net_set_write_timeout(net, NET_WRITE_TIMEOUT);
     my_net_set_read_timeout(net, NET_READ_TIMEOUT);
@@ -307,34 +324,81 @@ MYSQL* client_init(int clientfd) {
 }
 
 /**
- * Destroy all data structures associated with a thread.
+ * Initialize a new client connection and perform the handshake.
  *
- * @param thread Thread to destroy.
+ * @param work      Work data associated with the client.
+ * @param thread_id Identifier of the thread handling the connection.
+ *
+ * @return TRUE on error, FALSE otherwise.
  **/
-void client_destroy(proxy_thread_t *thread) {
+my_bool proxy_net_client_start(proxy_work_t *work, int thread_id) {
+    work->proxy = client_init(work->clientfd);
+    if (work->proxy == NULL)
+        return TRUE;
+
+    /* Perform "authentication" (credentials not checked) */
+    return proxy_net_handshake(work->proxy, work->addr, thread_id);
+}
+
+/**
+ * Close a client connection and free the associated MySQL object.
+ *
+ * @param work Work data associated with the client.
+ **/
+void proxy_net_client_end(proxy_work_t *work) {
     MYSQL *mysql;
     int ret;
 
-    proxy_vdebug("Called client_destroy on thread %d", thread->id);
-
     /* Clean up connection if still live */
-    if (thread->data.work.proxy) {
-        if ((mysql = thread->data.work.proxy)) {
-            /* XXX: may need to send error before closing connection */
-            /* derived from sql/sql_mysqld.cc:close_connection */
-            ret = vio_close(mysql->net.vio);
-            if (ret < 0 && ret != ENOTCONN)
-                proxy_log(LOG_ERROR, "Error closing client connection: %s", errstr);
-
-            /* Clean up data structures */
-            vio_delete(mysql->net.vio);
-            mysql->net.vio = 0;
-            net_end(&(mysql->net));
-            mysql_close(mysql);
-        }
+    if ((mysql = work->proxy)) {
+        /* XXX: may need to send error before closing connection */
+        /* derived from sql/sql_mysqld.cc:close_connection */
+        ret = vio_close(mysql->net.vio);
+        if (ret < 0 && ret != ENOTCONN)
+            proxy_log(LOG_ERROR, "Error closing client connection: %s", errstr);
+
+        /* Clean up data structures */
+        vio_delete(mysql->net.vio);
+        mysql->net.vio = 0;
+        net_end(&(mysql->net));
+        mysql_close(mysql);
+    }
+
+    work->proxy = NULL;
+}
+
+/**
+ * Send an error to a newly connected client and close the connection.
+ *
+ * @param clientfd  Socket descriptor of the client.
+ * @param sql_errno MySQL error code.
+ * @param err       Error message string.
+ **/
+void proxy_net_reject(int clientfd, int sql_errno, const char *err) {
+    proxy_work_t work;
 
-        thread->data.work.proxy = NULL;
+    work.proxy = client_init(clientfd);
+    if (!work.proxy) {
+        close(clientfd);
+        return;
     }
+
+    proxy_net_send_error(work.proxy, sql_errno, err);
+    proxy_net_flush(work.proxy);
+    proxy_net_client_end(&work);
+}
+
+/**
+ * Destroy all data structures associated with a thread.
+ *
+ * @param thread Thread to destroy.
+ **/
+void client_destroy(proxy_thread_t *thread) {
+    proxy_vdebug("Called client_destroy on thread %d", thread->id);
+
+    /* Connections owned by an event loop are closed by the loop */
+    if (!thread->data.work.event)
+        proxy_net_client_end(&thread->data.work);
 }
 
 /**
@@ -356,6 +420,85 @@ void net_thread_destroy(void *ptr) {
     free(thread->status);
 }
 
+/**
+ * Get the number of client threads in a shard.
+ *
+ * @param shard Index of the shard.
+ *
+ * @return Number of client threads in the shard.
+ **/
+int proxy_net_shard_size(int shard) {
+    int size = options.client_threads / options.acceptors;
+
+    /* The last shard picks up any remaining threads */
+    if (shard == options.acceptors - 1)
+        size += options.client_threads % options.acceptors;
+
+    return size;
+}
+
+/**
+ * Wait for a free client thread in a shard and claim it.
+ *
+ * @param shard Index of the shard to take a thread from.
+ *
+ * @return Identifier of the claimed client thread.
+ **/
+int proxy_net_get_thread(int shard) {
+    int base = shard * (options.client_threads / options.acceptors);
+    return base + proxy_pool_get(thread_pools[shard]);
+}
+
+/**
+ * Claim a free client thread in a shard without waiting.
+ *
+ * @param shard Index of the shard to take a thread from.
+ *
+ * @return Identifier of the claimed client thread, or -1 if none are free.
+ **/
+int proxy_net_try_get_thread(int shard) {
+    int idx = proxy_pool_try_get(thread_pools[shard]);
+    return idx < 0 ? -1 : shard * (options.client_threads / options.acceptors) + idx;
+}
+
+/**
+ * Get the shard a client thread belongs to.
+ *
+ * @param thread_id Identifier of the thread.
+ *
+ * @return Index of the shard.
+ **/
+int proxy_net_thread_shard(int thread_id) {
+    return min(thread_id / (options.client_threads / options.acceptors), options.acceptors - 1);
+}
+
+/**
+ * Return a client thread to the pool of its shard.
+ *
+ * @param thread_id Identifier of the thread to be returned.
+ **/
+void proxy_net_return_thread(int thread_id) {
+    int shard = proxy_net_thread_shard(thread_id);
+
+    proxy_pool_return(thread_pools[shard],
+        thread_id - shard * (options.client_threads / options.acceptors));
+}
+
+/**
+ * Get the number of client threads which are currently occupied.
+ *
+ * @return Number of occupied client threads.
+ **/
+long proxy_net_threads_locked() {
+    long locked = 0;
+    int i;
+
+    for (i=0; i<options.acceptors; i++)
+        locked += thread_pools[i]->locked;
+
+    return locked;
+}
+
 /**
  * Create a new thread to service client requests
  *
@@ -401,6 +544,20 @@ void* proxy_net_new_thread(void *ptr) {
         if (thread->exit)
             break;
 
+        /* Service a single event on a connection owned by an event loop */
+        if (thread->data.work.event) {
+            proxy_event_service(thread->data.work.event, thread->id, &commit);
+
+            proxy_mutex_lock(&(thread->lock));
+            thread->data.work.event = NULL;
+            thread->data.work.addr = NULL;
+            proxy_mutex_unlock(&(thread->lock));
+
+            /* Take the next waiting connection if there is one */
+            proxy_event_release(thread->id);
+            continue;
+        }
+
         /* Handle client requests */
         (void) __sync_fetch_and_add(&global_connections, 1);
 
@@ -411,12 +568,11 @@ void* proxy_net_new_thread(void *ptr) {
         client_destroy(thread);
         thread->data.work.addr = NULL;
 
-        /* Update global statistics */
-        proxy_status_add(thread->status, &global_status);
+        /* Statistics were published after each query */
         proxy_status_reset(thread->status);
 
         /* Signify that we are available for work again */
-        proxy_pool_return(thread_pool, thread->id);
+        proxy_admit_release(thread->id);
     }
 
     proxy_debug("Exiting loop on client thead %d", thread->id);
@@ -438,17 +594,13 @@ void* proxy_net_new_thread(void *ptr) {
  * @param[in,out] status    Status information for the connection.
  **/
 void proxy_net_client_do_work(proxy_work_t *work, int thread_id, commitdata_t *commit, status_t *status, my_bool proxy_only) {
+    status_t published = *status;
     int error;
 
     if (unlikely(!work))
         return;
 
-    work->proxy = client_init(work->clientfd);
-    if (work->proxy == NULL)
-        return;
-
-    /* Perform "authentication" (credentials not checked) */
-    if (proxy_net_handshake(work->proxy, work->addr, thread_id))
+    if (proxy_net_client_start(work, thread_id))
         return;
 
     /* from sql/sql_connect.cc:handle_one_connection */
@@ -463,6 +615,10 @@ void proxy_net_client_do_work(proxy_work_t *work, int thread_id, commitdata_t *c
          * sure client has everything */
         proxy_net_flush(work->proxy);
 
+        /* Admin connections are not counted in global statistics */
+        if (!proxy_only)
+            proxy_stats_publish(thread_id, status, &published);
+
         if (error != ERROR_OK) {
             switch (error) {
                 case ERROR_CLOSE:
@@ -505,7 +661,7 @@ void proxy_net_client_do_work(proxy_work_t *work, int thread_id, commitdata_t *c
 conn_error_t proxy_net_read_query(proxy_work_t *work, __attribute__((unused)) int thread_id, commitdata_t *commit, status_t *status, my_bool proxy_only) {
     MYSQL *mysql = work->proxy;
     NET *net = &(mysql->net);
-    ulong pkt_len;
+    ulong pkt_len, trans_id;
     char *packet = 0;
     enum enum_server_command command;
     struct pollfd polls[1];
@@ -565,8 +721,14 @@ conn_error_t proxy_net_read_query(proxy_work_t *work, __attribute__((unused)) in
         case COM_PROXY_QUERY:
             /* Here we skip parsing of proxy queries and also
              * specify that this query has been replicated */
+            if (proxy_net_read_id(&packet, &pkt_len, &trans_id))
+                return proxy_net_send_error(mysql, ER_SYNTAX_ERROR, "Missing transaction ID") ? ERROR_CLIENT : ERROR_OK;
+
             status->queries++;
-            return proxy_backend_query(mysql, &work->conn_idx, packet, pkt_len, TRUE, commit, status) ? ERROR_BACKEND : ERROR_OK;
+            return proxy_backend_query(mysql, &work->conn_idx, packet, pkt_len, TRUE, trans_id, commit, status) ? ERROR_BACKEND : ERROR_OK;
+        case COM_PROXY_RESULT:
+            /* Batch of transaction results from a clone */
+            return proxy_coord_recv(mysql, (uchar*) packet, pkt_len, status) ? ERROR_CLIENT : ERROR_OK;
         case COM_QUERY:
             status->queries++;
 
@@ -575,7 +737,7 @@ conn_error_t proxy_net_read_query(proxy_work_t *work, __attribute__((unused)) in
                     return proxy_net_send_error(mysql, ER_NOT_ALLOWED_COMMAND, "Only PROXY commands may be executed on this connection");
                 } else {
                     /* pass the query to the backend */
-                    return proxy_backend_query(mysql, &work->conn_idx, packet, pkt_len, FALSE, commit, status) ? ERROR_BACKEND : ERROR_OK;
+                    return proxy_backend_query(mysql, &work->conn_idx, packet, pkt_len, FALSE, 0, commit, status) ? ERROR_BACKEND : ERROR_OK;
                 }
             } else {
                 /* Execute the proxy command */
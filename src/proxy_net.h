@@ -23,11 +23,9 @@
 #define LONG_LEN 10
 #endif
 
-/* Define the size of the ID string added to queries
- * which is 3 for the comment specifier plus the
- * length of the maximum length of a long converted
- * to a string */
-#define ID_SIZE 3 + LONG_LEN
+/** Size of the transaction ID which precedes
+ *  the query string in COM_PROXY_QUERY */
+#define TRANS_ID_SIZE 8
 
 /** Current transaction identifier */
 extern ulong transaction_id;
@@ -42,6 +40,8 @@ MYSQL *master;
 /* This will break if COM_END is equal to the size
  * of an enum, but this will never happen */
 #define COM_PROXY_QUERY COM_END+1
+/** Command carrying a batch of transaction results from a clone */
+#define COM_PROXY_RESULT COM_END+2
 
 /**
  * All information needed by threads
@@ -56,6 +56,8 @@ typedef struct {
     MYSQL *proxy;
     /** Indices for the connection used by this client. */
     proxy_conn_idx_t conn_idx;
+    /** Event loop connection being serviced, if any. */
+    struct proxy_event_conn *event;
 } proxy_work_t;
 
 /**
@@ -85,20 +87,58 @@ union sockaddr_union {
 /** Total number of connections. */
 long global_connections;
 int global_running;
-/** Globally accumulated status. */
-status_t global_status;
 /** Start time of the proxy server. */
 time_t proxy_start_time;
 
+my_bool proxy_net_client_start(proxy_work_t *work, int thread_id);
+void proxy_net_client_end(proxy_work_t *work);
+void proxy_net_reject(int clientfd, int sql_errno, const char *err);
 void proxy_net_client_do_work(proxy_work_t *work, int thread_id, commitdata_t *commit, status_t *status, my_bool proxy_only);
-int proxy_net_bind_new_socket(char *host, int port);
+int proxy_net_bind_new_socket(char *host, int port, my_bool client);
 my_bool proxy_net_handshake(MYSQL *mysql, struct sockaddr_in *clientaddr, int thread_id);
+int proxy_net_shard_size(int shard);
+int proxy_net_get_thread(int shard);
+int proxy_net_try_get_thread(int shard);
+int proxy_net_thread_shard(int thread_id);
+void proxy_net_return_thread(int thread_id);
+long proxy_net_threads_locked();
 void* proxy_net_new_thread(void *ptr);
 conn_error_t proxy_net_read_query(proxy_work_t *work, int thread_id, commitdata_t *commit, status_t *status, my_bool proxy_only);
 my_bool proxy_net_send_ok(MYSQL *mysql, uint warnings, ulong affected_rows, ulonglong last_insert_id);
 my_bool proxy_net_send_error(MYSQL *mysql, int sql_errno, const char *err);
 void proxy_net_send_eof(MYSQL *mysql, status_t *status);
 
+/**
+ * Store a transaction ID in the header of a COM_PROXY_QUERY command.
+ *
+ * @param header Buffer of at least TRANS_ID_SIZE bytes.
+ * @param id     Transaction ID to store.
+ **/
+static inline void proxy_net_store_id(uchar *header, ulong id) {
+    int8store(header, (ulonglong) id);
+}
+
+/**
+ * Strip the transaction ID from the start of a COM_PROXY_QUERY
+ * command, leaving the query string.
+ *
+ * @param[in,out] packet Contents of the command.
+ * @param[in,out] length Length of the command.
+ * @param[out] id        Transaction ID.
+ *
+ * @return TRUE on error, FALSE otherwise.
+ **/
+static inline my_bool proxy_net_read_id(char **packet, ulong *length, ulong *id) {
+    if (*length < TRANS_ID_SIZE)
+        return TRUE;
+
+    *id = (ulong) uint8korr((uchar*) *packet);
+    *packet += TRANS_ID_SIZE;
+    *length -= TRANS_ID_SIZE;
+
+    return FALSE;
+}
+
 /**
  * Flush the write buffer of the proxy MySQL object
  *
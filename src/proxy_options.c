@@ -49,7 +49,22 @@ static void usage() {
             "\t--cloneable,        -c\tProxy should execute cloning when signalled\n"
             "\t--stat-file,        -q\tFile where statistics on queries per second should be dumped\n"
             "\t--admin-port,       -A\tBinding port for admin connections which can only execute PROXY commands\n"
-            "\t--query-wait,       -w\tWait for any replicated queries to fully complete before cloning\n\n"
+            "\t--query-wait,       -w\tWait for any replicated queries to fully complete before cloning\n"
+            "\t--coord-conns,      -G\tConnections a clone uses to send transaction results\n"
+            "\t                      \tto the coordinator (default: 2)\n"
+            "\t--simulate-clones,  -r\tPretend to clone when built without SnowFlock,\n"
+            "\t                      \twhere clones must be started and added separately\n\n"
+
+            "Autoscaling options:\n"
+            "\t--autoscale,       -o\tAdd a clone when a load signal stays above OUT and\n"
+            "\t                     \tremove one when all stay below IN, given as\n"
+            "\t                     \tSIGNAL:OUT:IN where SIGNAL is qps (per backend),\n"
+            "\t                     \tlatency (microseconds) or queue (waiting connections)\n"
+            "\t                     \t(may be given up to 4 times, requires -C)\n"
+            "\t--scale-cooldown,  -Z\tSeconds to wait after scaling before scaling again\n"
+            "\t                     \t(default: 30)\n"
+            "\t--scale-max,       -M\tMaximum number of backends to scale out to (default: 8)\n"
+            "\t--scale-dry-run,   -z\tLog scaling decisions without acting on them\n\n"
 
             "Backend options:\n"
             "\t--backend-host,    -h\tHost to forward queries to (default: 127.0.0.1)\n"
@@ -63,16 +78,50 @@ static void usage() {
             "\t--backend-file,    -f\tFile listing available backends\n"
             "\t                     \t(cannot be specified with above options)\n\n"
             "\t--num-conns,       -N\tNumber connections per backend\n"
+            "\t--balance,         -g\tPolicy for choosing a backend for each client: random,\n"
+            "\t                     \tleast (outstanding), p2c (power of two choices)\n"
+            "\t                     \tor wrr (weighted round-robin) (default: random)\n"
+            "\t--statement-reads, -R\tBalance each read outside a transaction across\n"
+            "\t                     \tbackends instead of using the client's backend\n"
+            "\t--transaction-pool,-O\tReturn backend connections to the pool after each\n"
+            "\t                     \ttransaction, replaying SET statements on the next one\n"
             "\t                   -a\tDisable autocommit (default is enabled)\n"
             "\t--add-ids,         -i\tTag transactions with unique identifiers\n"
-            "\t--two-pc,          -2\tUse two-phase commit to ensure consistency across backends\n\n"
+            "\t--two-pc,          -2\tUse two-phase commit to ensure consistency across backends\n"
+            "\t--write-quorum,    -k\tReply to replicated writes once this many backends have\n"
+            "\t                     \tapplied them, while the rest catch up from a log\n"
+            "\t                     \t(default is 0 to wait for all backends)\n"
+            "\t--stale-lag,       -l\tLogged writes a backend may fall behind before reads\n"
+            "\t                     \tavoid it, or 0 for no limit (default: 100)\n"
+            "\t--batch-writes,    -j\tSend up to this many concurrent autocommit writes to\n"
+            "\t                     \tbackends as one batch (default is 0 to disable)\n"
+            "\t--batch-wait,      -J\tMicroseconds to wait for writes to join a batch\n"
+            "\t                     \t(default: 500)\n"
+            "\t--connect-threads, -K\tBackend connections opened at once (default: 16)\n"
+            "\t--connect-timeout, -H\tSeconds to wait for each connection attempt (default: 5)\n"
+            "\t--connect-retries, -U\tTimes a failed backend connection is retried (default: 3)\n"
+            "\t--warmup-file,     -E\tFile of statements, one per line, run on each new clone\n"
+            "\t                     \tbefore it is added\n"
+            "\t--ramp-time,       -V\tSeconds over which a new clone's share of clients grows\n"
+            "\t                     \tto its weight, ending early once its latency matches\n"
+            "\t                     \tthe other backends (default is 0 to disable)\n\n"
 
             "Proxy options:\n"
             "\t--proxy-host,      -b\tBinding address (default is 0.0.0.0)\n"
             "\t--interface,       -I\tInterface to bind to, or 'any' for all interfaces (default is eth0)\n"
             "\t--proxy-port,      -L\tPort for the proxy server to listen on (default: 4040)\n"
             "\t--timeout,         -n\tSeconds to wait wihout data before disconnecting clients,\n"
-            "\t                     \tnegative to wait forever (default: 5)\n\n"
+            "\t                     \tnegative to wait forever (default: 5)\n"
+            "\t--acceptors,       -S\tNumber of SO_REUSEPORT listeners, each with an accept\n"
+            "\t                     \tthread and a share of client threads, or 0 for one\n"
+            "\t                     \tper online CPU (default: 1)\n"
+            "\t--backlog,         -B\tLength of the queue of pending connections (default: 10)\n"
+            "\t--queue-depth,     -Q\tConnections per acceptor which may wait for a client thread\n"
+            "\t                     \tbefore being rejected (default is 0 to wait without limit);\n"
+            "\t                     \twith -e, commands waiting count but only new connections\n"
+            "\t                     \tare rejected\n"
+            "\t--queue-wait,      -W\tMilliseconds a queued connection may wait before being\n"
+            "\t                     \trejected (default: 1000)\n\n"
 
             "Mapper options:\n"   
             "\t--mapper,          -m\tMapper to use for mapping queries to backends\n"
@@ -80,7 +129,13 @@ static void usage() {
 
             "Thread options:\n"
             "\t--client-threads,  -t\tNumber of threads to handle client connections\n"
-            "\t--backend-threads, -T\tNumber of threads to dispatch backend queries\n\n"
+            "\t--backend-threads, -T\tNumber of threads to dispatch backend queries\n"
+            "\t--fanout,          -x\tSend replicated queries to all backends from the client\n"
+            "\t                     \tthread instead of backend threads, where -T limits\n"
+            "\t                     \tthe number of concurrent replicated queries\n"
+            "\t--event-threads,   -e\tNumber of event loops holding idle client connections,\n"
+            "\t                     \tso client threads are only used while executing commands\n"
+            "\t                     \t(default is 0, one client thread per connection)\n\n"
     );
 }
 
@@ -120,10 +175,28 @@ static void set_option_defaults() {
     options.stat_file       = NULL;
     options.admin_port      = ADMIN_PORT;
     options.query_wait      = FALSE;
+    options.coord_conns     = COORD_CONNS;
+    options.scale_rules_num = 0;
+    options.scale_cooldown  = SCALE_COOLDOWN;
+    options.scale_max       = SCALE_MAX;
+    options.scale_dry_run   = FALSE;
+    options.simulate_clones = FALSE;
 
     options.num_conns       = -1;
+    options.balance         = BALANCE_RANDOM;
+    options.statement_reads = FALSE;
+    options.transaction_pool = FALSE;
     options.add_ids         = FALSE;
     options.two_pc          = FALSE;
+    options.write_quorum    = 0;
+    options.stale_lag       = STALE_LAG;
+    options.batch_writes    = 0;
+    options.batch_wait      = BATCH_WAIT;
+    options.connect_threads = CONNECT_THREADS;
+    options.connect_timeout = CONNECT_TIMEOUT;
+    options.connect_retries = CONNECT_RETRIES;
+    options.warmup_file     = NULL;
+    options.ramp_time       = 0;
     options.autocommit      = TRUE;
     options.backend.host    = NULL;
     options.backend.port    = 0;
@@ -137,9 +210,59 @@ static void set_option_defaults() {
     options.iface           = NULL;
     options.pport           = PROXY_PORT;
     options.timeout         = CLIENT_TIMEOUT;
+    options.acceptors       = ACCEPTORS;
+    options.backlog         = QUEUE_LENGTH;
+    options.queue_depth     = 0;
+    options.queue_wait      = QUEUE_WAIT;
     options.mapper          = NULL;
     options.client_threads  = CLIENT_THREADS;
     options.backend_threads = -1;
+    options.fanout          = FALSE;
+    options.event_threads   = EVENT_THREADS;
+}
+
+/**
+ * Parse an autoscaling rule of the form SIGNAL:OUT:IN
+ * and add it to ::options.scale_rules.
+ *
+ * @param arg Rule given on the command line.
+ *
+ * @return TRUE on error, FALSE otherwise.
+ **/
+static my_bool parse_scale_rule(const char *arg) {
+    proxy_scale_rule_t *rule;
+    char metric[16];
+
+    if (options.scale_rules_num >= SCALE_RULES) {
+        fprintf(stderr, "At most %d autoscaling rules may be given\n", SCALE_RULES);
+        return TRUE;
+    }
+
+    rule = &options.scale_rules[options.scale_rules_num];
+    if (sscanf(arg, "%15[^:]:%ld:%ld", metric, &rule->out, &rule->in) != 3) {
+        fprintf(stderr, "Invalid autoscaling rule %s\n", arg);
+        return TRUE;
+    }
+
+    if (!strcasecmp(metric, "qps"))
+        rule->metric = SCALE_QPS;
+    else if (!strcasecmp(metric, "latency"))
+        rule->metric = SCALE_LATENCY;
+    else if (!strcasecmp(metric, "queue"))
+        rule->metric = SCALE_QUEUE;
+    else {
+        fprintf(stderr, "Unknown autoscaling signal %s\n", metric);
+        return TRUE;
+    }
+
+    /* Leave a gap so one clone doesn't bring load back over */
+    if (rule->in < 0 || rule->out <= rule->in) {
+        fprintf(stderr, "Autoscaling rule %s must have OUT above IN\n", arg);
+        return TRUE;
+    }
+
+    options.scale_rules_num++;
+    return FALSE;
 }
 
 /**
@@ -159,6 +282,12 @@ int proxy_options_parse(int argc, char *argv[]) {
         {"stat-file",       required_argument, 0, 'q'},
         {"admin-port",      required_argument, 0, 'A'},
         {"query-wait",      no_argument,       0, 'w'},
+        {"coord-conns",     required_argument, 0, 'G'},
+        {"simulate-clones", no_argument,       0, 'r'},
+        {"autoscale",       required_argument, 0, 'o'},
+        {"scale-cooldown",  required_argument, 0, 'Z'},
+        {"scale-max",       required_argument, 0, 'M'},
+        {"scale-dry-run",   no_argument,       0, 'z'},
         {"backend-host",    required_argument, 0, 'h'},
         {"backend-port",    required_argument, 0, 'P'},
         {"bypass-port",     required_argument, 0, 'y'},
@@ -168,22 +297,40 @@ int proxy_options_parse(int argc, char *argv[]) {
         {"backend-pass",    required_argument, 0, 'p'},
         {"backend-file",    required_argument, 0, 'f'},
         {"num-conns",       required_argument, 0, 'N'},
+        {"balance",         required_argument, 0, 'g'},
+        {"statement-reads", no_argument,       0, 'R'},
+        {"transaction-pool", no_argument,      0, 'O'},
         {"add-ids",         no_argument,       0, 'i'},
         {"two-pc",          no_argument,       0, '2'},
+        {"write-quorum",    required_argument, 0, 'k'},
+        {"stale-lag",       required_argument, 0, 'l'},
+        {"batch-writes",    required_argument, 0, 'j'},
+        {"batch-wait",      required_argument, 0, 'J'},
+        {"connect-threads", required_argument, 0, 'K'},
+        {"connect-timeout", required_argument, 0, 'H'},
+        {"connect-retries", required_argument, 0, 'U'},
+        {"warmup-file",     required_argument, 0, 'E'},
+        {"ramp-time",       required_argument, 0, 'V'},
         {"proxy-host",      required_argument, 0, 'b'},
         {"interface" ,      required_argument, 0, 'I'},
         {"proxy-port",      required_argument, 0, 'L'},
         {"timeout",         required_argument, 0, 'n'},
+        {"acceptors",       required_argument, 0, 'S'},
+        {"backlog",         required_argument, 0, 'B'},
+        {"queue-depth",     required_argument, 0, 'Q'},
+        {"queue-wait",      required_argument, 0, 'W'},
         {"mapper",          required_argument, 0, 'm'},
         {"client-threads",  required_argument, 0, 't'},
         {"backend-threads", required_argument, 0, 'T'},
+        {"fanout",          no_argument,       0, 'x'},
+        {"event-threads",   required_argument, 0, 'e'},
         {0, 0, 0, 0}
     };
 
     set_option_defaults();
 
     /* Parse command-line options */
-    while((c = getopt_long(argc, argv, "?vdCcq:A:wh:P:y:s::n:D:u:p:f:N:i2aAb:I:L:m:t:T:", long_options, &opt)) != -1) {
+    while((c = getopt_long(argc, argv, "?vdCcq:A:wG:ro:Z:M:zh:P:y:s::n:D:u:p:f:N:g:ROi2k:l:j:J:K:H:U:E:V:aAb:I:L:m:t:T:xe:S:B:Q:W:", long_options, &opt)) != -1) {
         switch(c) {
             case '?':
                 usage();
@@ -209,6 +356,22 @@ int proxy_options_parse(int argc, char *argv[]) {
             case 'w':
                 options.query_wait = TRUE;
                 break;
+            case 'r':
+                options.simulate_clones = TRUE;
+                break;
+            case 'o':
+                if (parse_scale_rule(optarg))
+                    return EX_USAGE;
+                break;
+            case 'Z':
+                options.scale_cooldown = atoi(optarg);
+                break;
+            case 'M':
+                options.scale_max = atoi(optarg);
+                break;
+            case 'z':
+                options.scale_dry_run = TRUE;
+                break;
             case 'h':
                 options.backend.host = optarg;
                 break;
@@ -242,12 +405,62 @@ int proxy_options_parse(int argc, char *argv[]) {
             case 'N':
                 options.num_conns = atoi(optarg);
                 break;
+            case 'g':
+                if (!strcasecmp(optarg, "random"))
+                    options.balance = BALANCE_RANDOM;
+                else if (!strcasecmp(optarg, "least"))
+                    options.balance = BALANCE_LEAST;
+                else if (!strcasecmp(optarg, "p2c"))
+                    options.balance = BALANCE_P2C;
+                else if (!strcasecmp(optarg, "wrr"))
+                    options.balance = BALANCE_WRR;
+                else {
+                    fprintf(stderr, "Unknown balancing policy %s\n", optarg);
+                    return EX_USAGE;
+                }
+                break;
+            case 'R':
+                options.statement_reads = TRUE;
+                break;
+            case 'O':
+                options.transaction_pool = TRUE;
+                break;
             case 'i':
                 options.add_ids = TRUE;
                 break;
             case '2':
                 options.two_pc = TRUE;
                 break;
+            case 'G':
+                options.coord_conns = atoi(optarg);
+                break;
+            case 'k':
+                options.write_quorum = atoi(optarg);
+                break;
+            case 'l':
+                options.stale_lag = atoi(optarg);
+                break;
+            case 'j':
+                options.batch_writes = atoi(optarg);
+                break;
+            case 'J':
+                options.batch_wait = atoi(optarg);
+                break;
+            case 'K':
+                options.connect_threads = atoi(optarg);
+                break;
+            case 'H':
+                options.connect_timeout = atoi(optarg);
+                break;
+            case 'U':
+                options.connect_retries = atoi(optarg);
+                break;
+            case 'E':
+                options.warmup_file = optarg;
+                break;
+            case 'V':
+                options.ramp_time = atoi(optarg);
+                break;
             case 'a':
                 options.autocommit = FALSE;
                 break;
@@ -269,6 +482,24 @@ int proxy_options_parse(int argc, char *argv[]) {
             case 'T':
                 options.backend_threads = atoi(optarg);
                 break;
+            case 'x':
+                options.fanout = TRUE;
+                break;
+            case 'e':
+                options.event_threads = atoi(optarg);
+                break;
+            case 'S':
+                options.acceptors = atoi(optarg);
+                break;
+            case 'B':
+                options.backlog = atoi(optarg);
+                break;
+            case 'Q':
+                options.queue_depth = atoi(optarg);
+                break;
+            case 'W':
+                options.queue_wait = atoi(optarg);
+                break;
             default:
                 usage();
                 return EX_USAGE;
@@ -295,6 +526,87 @@ int proxy_options_parse(int argc, char *argv[]) {
     options.pass = options.pass ?: BACKEND_PASS;
     options.db   = options.db   ?: BACKEND_DB;
 
+    if (options.event_threads < 0) {
+        fprintf(stderr, "Number of event threads cannot be negative\n");
+        return EX_USAGE;
+    }
+
+    /* Use one acceptor per CPU if requested */
+    if (options.acceptors == 0)
+        options.acceptors = min(sysconf(_SC_NPROCESSORS_ONLN), options.client_threads);
+
+    if (options.acceptors < 1 || options.acceptors > options.client_threads) {
+        fprintf(stderr, "Number of acceptors must be between 1 and the number of client threads\n");
+        return EX_USAGE;
+    }
+
+    if (options.backlog <= 0 || options.queue_depth < 0 || options.queue_wait <= 0) {
+        usage();
+        return EX_USAGE;
+    }
+
+    /* Transaction boundaries are only visible with autocommit */
+    if (options.transaction_pool && (options.two_pc || !options.autocommit)) {
+        fprintf(stderr, "Transaction pooling requires autocommit without two-phase commit\n");
+        return EX_USAGE;
+    }
+
+    if (options.coord_conns < 1) {
+        usage();
+        return EX_USAGE;
+    }
+
+    /* Only the coordinator can add and remove clones */
+    if (options.scale_rules_num && !options.coordinator) {
+        fprintf(stderr, "Autoscaling requires a coordinator\n");
+        return EX_USAGE;
+    }
+
+    if (options.scale_cooldown < 0 || options.scale_max < 1) {
+        usage();
+        return EX_USAGE;
+    }
+
+    if (options.write_quorum < 0 || options.stale_lag < 0) {
+        usage();
+        return EX_USAGE;
+    }
+
+    /* Logged writes are applied independently on each backend */
+    if (options.write_quorum && (options.two_pc || options.fanout)) {
+        fprintf(stderr, "Write quorums can't be used with two-phase commit or fan-out\n");
+        return EX_USAGE;
+    }
+
+    if (options.connect_threads < 1 || options.connect_timeout <= 0 || options.connect_retries < 0) {
+        usage();
+        return EX_USAGE;
+    }
+
+    if (options.ramp_time < 0) {
+        usage();
+        return EX_USAGE;
+    }
+
+    if (options.warmup_file && access(options.warmup_file, R_OK)) {
+        fprintf(stderr, "Error accessing warm-up file %s:%s\n", options.warmup_file, strerror(errno));
+        return EX_NOINPUT;
+    }
+
+    if (options.batch_writes < 0 || options.batch_wait <= 0) {
+        usage();
+        return EX_USAGE;
+    }
+
+    /* Batches are only split correctly for autocommit writes
+     * sent directly to backends which all execute them */
+    if (options.batch_writes > 1 && (options.two_pc || !options.autocommit
+            || options.write_quorum || options.coordinator)) {
+        fprintf(stderr, "Write batching requires autocommit without two-phase commit, "
+            "write quorums or a coordinator\n");
+        return EX_USAGE;
+    }
+
     if (!options.mapper && options.backend_threads > 0) {
         fprintf(stderr, "Cannot specify number of backend threads with no query mapper\n");
         return EX_USAGE;
@@ -313,8 +625,25 @@ int proxy_options_parse(int argc, char *argv[]) {
         options.backend_threads = options.backend_threads > 0 ? options.backend_threads : BACKEND_THREADS;
         options.num_conns = options.num_conns > 0 ? options.num_conns : NUM_CONNS;
     } else {
-        if ((options.backend_threads > 0 || options.num_conns > 0) && !options.coordinator) {
-            fprintf(stderr, "Can't specify backend threads or connections with only one backend\n");
+        if (options.backend_threads > 0 && !options.coordinator) {
+            fprintf(stderr, "Can't specify backend threads with only one backend\n");
+            return EX_USAGE;
+        }
+
+        if (options.statement_reads) {
+            fprintf(stderr, "Can't balance statements with only one backend\n");
+            return EX_USAGE;
+        }
+
+        /* Connections are only pooled in these cases */
+        if (options.transaction_pool && !options.coordinator && !options.event_threads) {
+            fprintf(stderr, "Transaction pooling requires a backend file or event threads\n");
+            return EX_USAGE;
+        }
+
+        /* Connections are pooled when clients are not tied to threads */
+        if (options.num_conns > 0 && !options.coordinator && !options.event_threads) {
+            fprintf(stderr, "Can't specify backend connections with only one backend\n");
             return EX_USAGE;
         }
 
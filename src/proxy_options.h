@@ -30,6 +30,17 @@
 #define BACKEND_THREADS 10
 /** Default number of connections per backend. */
 #define NUM_CONNS       10
+/** Default number of logged writes a backend may fall
+ *  behind before reads are no longer sent to it. */
+#define STALE_LAG       100
+/** Default microseconds to wait for writes to join a batch. */
+#define BATCH_WAIT      500
+/** Default number of backend connections opened at once. */
+#define CONNECT_THREADS 16
+/** Default seconds to wait for each backend connection attempt. */
+#define CONNECT_TIMEOUT 5
+/** Default number of times a failed backend connection is retried. */
+#define CONNECT_RETRIES 3
 
 /** Default binding interface */
 #define PROXY_IFACE     "eth0"
@@ -37,10 +48,27 @@
 #define PROXY_PORT      4040
 /** Default port to listen on for admin connections. */
 #define ADMIN_PORT      4041
+/** Default number of connections used to send
+ *  transaction results to the coordinator. */
+#define COORD_CONNS     2
+/** Default seconds to wait after a scaling action before the next. */
+#define SCALE_COOLDOWN  30
+/** Default maximum number of backends the autoscaler may add up to. */
+#define SCALE_MAX       8
 /** Default number of threads started to do client work. */
 #define CLIENT_THREADS  10
 /** Default seconds to wait before disconnecting client. */
 #define CLIENT_TIMEOUT  5*60
+/** Default number of event loops for idle clients (0 disables). */
+#define EVENT_THREADS   0
+/** Default number of threads accepting client connections. */
+#define ACCEPTORS       1
+/** Default number of client connections waiting in
+ *  queue to be accepted when client threads
+ *  are all occupied. */
+#define QUEUE_LENGTH    10
+/** Default milliseconds a connection may wait for a client thread. */
+#define QUEUE_WAIT      1000
 
 void proxy_options_update_host();
 int proxy_options_parse(int argc, char *argv[]);
@@ -59,6 +87,20 @@ struct {
     int admin_port;
     /** Wait for all replicated queries before cloning. */
     my_bool query_wait;
+    /** Connections used to send transaction results to the coordinator. */
+    int coord_conns;
+    /** Rules for adding and removing clones as load changes. */
+    proxy_scale_rule_t scale_rules[SCALE_RULES];
+    /** Number of autoscaling rules, or 0 to disable autoscaling. */
+    int scale_rules_num;
+    /** Seconds to wait after a scaling action before the next. */
+    int scale_cooldown;
+    /** Maximum number of backends the autoscaler may add up to. */
+    int scale_max;
+    /** Log scaling decisions without acting on them. */
+    my_bool scale_dry_run;
+    /** Pretend to clone when built without SnowFlock. */
+    my_bool simulate_clones;
 
     /** Backend address info. */
     proxy_host_t backend;
@@ -77,12 +119,37 @@ struct {
     char *backend_file;
     /** Number of connections per backend. */
     int num_conns;
+    /** Policy for choosing the backend of a new client. */
+    proxy_balance_t balance;
+    /** Balance reads outside transactions across backends. */
+    my_bool statement_reads;
+    /** Hold backend connections only for the length of a transaction. */
+    my_bool transaction_pool;
     /** Autocommit option for backends. */
     my_bool autocommit;
     /** Whether an identifier should be added. */
     my_bool add_ids;
     /** Whether or not to use two-phase commit. */
     my_bool two_pc;
+    /** Backends which must apply a replicated write before
+     *  replying, or 0 to wait for all backends. */
+    int write_quorum;
+    /** Writes a backend may fall behind before it is stale. */
+    int stale_lag;
+    /** Maximum concurrent writes sent together, or 0 to disable. */
+    int batch_writes;
+    /** Microseconds to wait for writes to join a batch. */
+    int batch_wait;
+    /** Backend connections opened at once. */
+    int connect_threads;
+    /** Seconds to wait for each backend connection attempt. */
+    int connect_timeout;
+    /** Times a failed backend connection is retried. */
+    int connect_retries;
+    /** File of statements run on a new clone before it serves clients. */
+    char *warmup_file;
+    /** Seconds over which a new clone's share of clients grows to its weight. */
+    int ramp_time;
 
     /** Host for proxy to bind to. */
     char phost[INET6_ADDRSTRLEN];
@@ -92,6 +159,14 @@ struct {
     int pport;
     /** Seconds to wait before disconnecting client. */
     int timeout;
+    /** Number of listening sockets with separate accept threads. */
+    int acceptors;
+    /** Length of the queue of pending client connections. */
+    int backlog;
+    /** Connections which may wait for a client thread in each shard. */
+    int queue_depth;
+    /** Milliseconds a connection may wait for a client thread. */
+    int queue_wait;
 
     /** Name of the query mapper to use. */
     char *mapper;
@@ -100,6 +175,10 @@ struct {
     int client_threads;
     /** Number of backend threads. */
     int backend_threads;
+    /** Send replicated queries from client threads. */
+    my_bool fanout;
+    /** Number of event loops for idle client connections. */
+    int event_threads;
 
     /** Enable verbose debugging. */
     my_bool verbose;
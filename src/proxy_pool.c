@@ -22,8 +22,54 @@
 
 #include "proxy.h"
 
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+/** Word of the bitmap holding an item */
+#define POOL_WORD(idx) ((idx) / POOL_BITS)
+/** Mask for an item within its word */
+#define POOL_MASK(idx) (1UL << ((idx) % POOL_BITS))
+
+/** Starting point for searching pools, which
+ *  spreads threads over different items */
+static __thread unsigned int pool_hint = 0;
+
 static int pool_try_locks(pool_t *pool);
 
+/**
+ * Sleep until woken, unless the value at an address
+ * has already changed from what the caller last saw.
+ *
+ * @param addr Address to wait on.
+ * @param val  Value last seen at the address.
+ **/
+static inline void pool_futex_wait(volatile int *addr, int val) {
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+/**
+ * Wake threads sleeping on an address.
+ *
+ * @param addr Address threads are waiting on.
+ * @param num  Maximum number of threads to wake.
+ **/
+static inline void pool_futex_wake(volatile int *addr, int num) {
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, num, NULL, NULL, 0);
+}
+
+/* Mark items as available or unavailable. These are only used
+ * while resizing, where the pool must not be in use. */
+static inline void pool_set_avail(pool_t *pool, int idx, my_bool avail) {
+    if (avail)
+        pool->avail[POOL_WORD(idx)] |= POOL_MASK(idx);
+    else
+        pool->avail[POOL_WORD(idx)] &= ~POOL_MASK(idx);
+}
+
+static inline my_bool pool_get_avail(pool_t *pool, int idx) {
+    return (pool->avail[POOL_WORD(idx)] & POOL_MASK(idx)) ? TRUE : FALSE;
+}
+
 /**
  * Create a new lock pool with a specified size.
  *
@@ -32,30 +78,30 @@ static int pool_try_locks(pool_t *pool);
  * @return Newly created pool.
  **/
 pool_t* proxy_pool_new(int size) {
-    int i, alloc=1;
+    int i, alloc=POOL_BITS;
     pool_t *new_pool;
     pthread_mutexattr_t attr;
 
     if (size <= 0)
         return NULL;
 
-    srand(time(NULL));
-
     new_pool = (pool_t *) malloc(sizeof(pool_t));
 
     /* Allocate memory for the lock pool */
     new_pool->size = size;
     new_pool->locked = 0;
+    new_pool->returns = 0;
+    new_pool->waiters = 0;
 
     /* Find the nearest power of two */
     while (alloc < size)
         alloc <<= 1;
 
-    new_pool->avail = (my_bool*) calloc(alloc, sizeof(my_bool));
+    new_pool->avail = (unsigned long*) calloc(alloc / POOL_BITS, sizeof(unsigned long));
 
     /* Set up availability */
-    for (i=0; i<alloc; i++)
-        new_pool->avail[i] = TRUE;
+    for (i=0; i<size; i++)
+        pool_set_avail(new_pool, i, TRUE);
 
     new_pool->__alloc = alloc;
 
@@ -64,9 +110,6 @@ pool_t* proxy_pool_new(int size) {
     pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
     pthread_mutex_init(&new_pool->lock, &attr);
 
-    proxy_cond_init(&new_pool->avail_cv);
-    proxy_mutex_init(&new_pool->avail_mutex);
-
     return new_pool;
 }
 
@@ -90,13 +133,15 @@ void proxy_pool_unlock(pool_t *pool) {
 
 /**
  * Modify the size of an existing pool, allocating memory as necessary.
+ * Items can be taken and returned without locking, so the caller
+ * must ensure the pool is not in use while resizing.
  *
  * @param pool Pool to resize.
  * @param size New size of the pool.
  **/
 void proxy_pool_set_size(pool_t *pool, int size) {
-    int alloc=1, i;
-    my_bool *avail;
+    int alloc=POOL_BITS, i;
+    unsigned long *avail;
 
     if (size == pool->size)
         return;
@@ -107,27 +152,29 @@ void proxy_pool_set_size(pool_t *pool, int size) {
     while (alloc < size)
         alloc <<= 1;
 
-    /* Allocate a new array and copy old availability */
+    /* Allocate a new bitmap and copy old availability */
     if (alloc != pool->__alloc) {
-        avail = (my_bool*) calloc(alloc, sizeof(my_bool));
+        avail = (unsigned long*) calloc(alloc / POOL_BITS, sizeof(unsigned long));
 
         /* Check if we are shrinking */
         if (pool->size > alloc)
             pool->size = alloc;
 
         /* Copy old availability */
-        for (i=0; i<pool->size; i++)
+        for (i=0; i<(pool->size + (int) POOL_BITS - 1) / (int) POOL_BITS; i++)
             avail[i] = pool->avail[i];
 
-        /* Set new resources to be available */
-        for (i=pool->size; i<alloc; i++)
-            avail[i] = TRUE;
-
-        free(pool->avail);
+        free((void*) pool->avail);
         pool->avail = avail;
         pool->__alloc = alloc;
     }
 
+    /* Set new resources to be available and remove old ones */
+    for (i=pool->size; i<size; i++)
+        pool_set_avail(pool, i, TRUE);
+    for (i=size; i<pool->size; i++)
+        pool_set_avail(pool, i, FALSE);
+
     pool->size = size;
 
     pthread_mutex_unlock(&pool->lock);
@@ -145,11 +192,15 @@ void proxy_pool_remove(pool_t *pool, int idx) {
     if (idx >= pool->size)
         return;
 
-    proxy_pool_set_size(pool, pool->size-1);
+    pthread_mutex_lock(&pool->lock);
 
     /* Shift all elements */
     for (i=idx; i<pool->size-1; i++)
-        pool->avail[i] = pool->avail[i+1];
+        pool_set_avail(pool, i, pool_get_avail(pool, i+1));
+
+    proxy_pool_set_size(pool, pool->size-1);
+
+    pthread_mutex_unlock(&pool->lock);
 }
 
 /**
@@ -160,29 +211,37 @@ void proxy_pool_remove(pool_t *pool, int idx) {
  * @return Index of an available item, or negative if no items are available.
  **/
 static int pool_try_locks(pool_t *pool) {
-    int i, pi;
+    int i, w, words, bit;
+    unsigned long old, mask;
+    unsigned int start = pool_hint++;
 
-    pthread_mutex_lock(&pool->lock);
+    words = (pool->size + POOL_BITS - 1) / POOL_BITS;
 
     /* Check availability of items in the pool */
-    pi = rand() % pool->size;
-    for (i=0; i<pool->size; i++) {
-        pi = (pi + 1) % pool->size;
-
-        if (pool->avail[pi]) {
-            pool->avail[pi] = FALSE;
-            pool->locked++;
-            pthread_mutex_unlock(&pool->lock);
-            return pi;
+    for (i=0; i<words; i++) {
+        w = (start + i) % words;
+
+        while ((old = pool->avail[w])) {
+            /* Prefer items past a per-thread offset so
+             * threads don't all contend on the same bit */
+            mask = old & (~0UL << (start % POOL_BITS));
+            bit = __builtin_ctzl(mask ? mask : old);
+
+            if (__sync_bool_compare_and_swap(&pool->avail[w], old, old & ~(1UL << bit))) {
+                (void) __sync_fetch_and_add(&pool->locked, 1);
+                return w * POOL_BITS + bit;
+            }
         }
     }
 
-    pthread_mutex_unlock(&pool->lock);
     return -1;
 }
 
 /**
  * Get an available item from a pool, waiting if necessary.
+ * Waiters sleep on a futex over the count of returned items,
+ * so a return between checking the pool and going to sleep
+ * changes the count and the wait falls through at once.
  *
  * @callergraph
  *
@@ -191,25 +250,39 @@ static int pool_try_locks(pool_t *pool) {
  * @return Index of an available item in the pool.
  **/
 int proxy_pool_get(pool_t *pool) {
-    int idx;
+    int idx, returns;
 
     if ((idx = pool_try_locks(pool)) >= 0)
         return idx;
 
     /* Wait for something to become available */
     while (1) {
-        proxy_mutex_lock(&pool->avail_mutex);
-        proxy_cond_wait(&pool->avail_cv, &pool->avail_mutex);
+        /* Register as a waiter before checking again so
+         * any item returned after the check wakes us */
+        returns = pool->returns;
+        (void) __sync_fetch_and_add(&pool->waiters, 1);
 
-        idx = pool_try_locks(pool);
+        if ((idx = pool_try_locks(pool)) < 0)
+            pool_futex_wait(&pool->returns, returns);
 
-        proxy_mutex_unlock(&pool->avail_mutex);
+        (void) __sync_fetch_and_sub(&pool->waiters, 1);
 
-        if (idx >= 0)
+        if (idx >= 0 || (idx = pool_try_locks(pool)) >= 0)
             return idx;
     }
 }
 
+/**
+ * Get an available item from a pool without waiting.
+ *
+ * @param pool Pool to check.
+ *
+ * @return Index of an available item, or negative if no items are available.
+ **/
+int proxy_pool_try_get(pool_t *pool) {
+    return pool_try_locks(pool);
+}
+
 /**
  * Check if an item in the pool is free.
  *
@@ -219,16 +292,10 @@ int proxy_pool_get(pool_t *pool) {
  * @return TRUE if the item is free, FALSE otherwise.
  **/
 my_bool proxy_pool_is_free(pool_t *pool, int idx) {
-    my_bool ret;
-
-    if (idx > pool->size)
+    if (idx >= pool->size)
         return FALSE;
 
-    pthread_mutex_lock(&pool->lock);
-    ret = pool->avail[idx];
-    pthread_mutex_unlock(&pool->lock);
-
-    return ret;
+    return pool_get_avail(pool, idx);
 }
 
 /**
@@ -241,21 +308,17 @@ my_bool proxy_pool_is_free(pool_t *pool, int idx) {
 int proxy_pool_get_locked(pool_t *pool) {
     int i;
 
-    pthread_mutex_lock(&pool->lock);
-
     for (i=0; i<pool->size; i++) {
-        if (!(pool->avail[i])) {
-            pthread_mutex_unlock(&pool->lock);
+        if (!pool_get_avail(pool, i))
             return i;
-        }
     }
 
-    pthread_mutex_unlock(&pool->lock);
     return -1;
 }
 
 /**
- * Return a locked item to the pool.
+ * Return a locked item to the pool. Sleeping threads are
+ * only woken through the futex when some are waiting.
  *
  * @callergraph
  *
@@ -263,20 +326,24 @@ int proxy_pool_get_locked(pool_t *pool) {
  * @param idx  Index of the item to return
  **/
 void proxy_pool_return(pool_t *pool, int idx) {
-    /* Update the item availability */
-    pthread_mutex_lock(&pool->lock);
-    if (pool->avail[idx]) {
-        proxy_log(LOG_ERROR, "Trying to free lock from already free pool");
+    unsigned long old;
+
+    /* Update the item availability, dropping items
+     * which were removed while they were locked */
+    if (idx >= pool->size) {
+        (void) __sync_fetch_and_sub(&pool->locked, 1);
     } else {
-        pool->locked--;
-        pool->avail[idx] = TRUE;
+        old = __sync_fetch_and_or(&pool->avail[POOL_WORD(idx)], POOL_MASK(idx));
+        if (old & POOL_MASK(idx))
+            proxy_log(LOG_ERROR, "Trying to free lock from already free pool");
+        else
+            (void) __sync_fetch_and_sub(&pool->locked, 1);
     }
-    pthread_mutex_unlock(&pool->lock);
 
     /* Signify availability in case someone is waiting */
-    proxy_mutex_lock(&pool->avail_mutex);
-    proxy_cond_signal(&pool->avail_cv);
-    proxy_mutex_unlock(&pool->avail_mutex);
+    (void) __sync_fetch_and_add(&pool->returns, 1);
+    if (pool->waiters)
+        pool_futex_wake(&pool->returns, 1);
 }
 
 /**
@@ -293,10 +360,7 @@ void proxy_pool_destroy(pool_t *pool) {
     pthread_mutex_unlock(&pool->lock);
     pthread_mutex_destroy(&pool->lock);
 
-    free(pool->avail);
-
-    proxy_cond_destroy(&pool->avail_cv);
-    proxy_mutex_destroy(&pool->avail_mutex);
+    free((void*) pool->avail);
 
     /* Finally, free the pool itself */
     free(pool);
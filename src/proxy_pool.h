@@ -14,24 +14,29 @@
 #ifndef _proxy_pool_h
 #define _proxy_pool_h
 
+/** Number of items tracked by each word of a pool bitmap */
+#define POOL_BITS (sizeof(unsigned long) * 8)
+
 /**
  * Data structure for lock pool implemenation
- * with list of availability of a set of items. */
+ * with a bitmap of availability of a set of items. */
 typedef struct {
     /** Current size of the pool. */
     int size;
     /** Currently allocated size of the pool. */
     int __alloc;
     /** Number of items currently locked in the pool. */
-    int locked;
-    /** List of availabilities of items in the pool. */
-    my_bool *avail;
-    /** Lock to block pool access. */
+    volatile int locked;
+    /** Bitmap of availabilities of items in the pool,
+     *  where a set bit marks an available item. */
+    volatile unsigned long *avail;
+    /** Count of returned items, also used as a
+     *  futex word for threads waiting on the pool. */
+    volatile int returns;
+    /** Number of threads waiting for an item. */
+    volatile int waiters;
+    /** Lock to block resizing of the pool. */
     pthread_mutex_t lock;
-    /** Condition variable for signifying new availability. */
-    pthread_cond_t avail_cv;
-    /** Lock assocated with condition variable. */
-    pthread_mutex_t avail_mutex;
 } pool_t;
 
 pool_t* proxy_pool_new(int size)
@@ -41,6 +46,7 @@ void proxy_pool_unlock(pool_t *pool);
 void proxy_pool_set_size(pool_t *pool, int size);
 void proxy_pool_remove(pool_t *pool, int idx);
 int proxy_pool_get(pool_t *pool);
+int proxy_pool_try_get(pool_t *pool);
 void proxy_pool_return(pool_t *pool, int idx);
 my_bool proxy_pool_is_free(pool_t *pool, int idx);
 int proxy_pool_get_locked(pool_t *pool);
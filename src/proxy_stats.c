@@ -0,0 +1,229 @@
+/******************************************************************************
+ * proxy_stats.c
+ *
+ * Per-thread query statistics and windowed rates.
+ *
+ * Each client thread owns a shard of the global statistics which only it
+ * writes, so counters can be updated with plain stores after each command
+ * and are summed when read. The monitor samples the totals each second so
+ * rates can be reported over the last 1, 10 and 60 seconds.
+ *
+ * Copyright (c) 2010, Michael Mior <mmior@cs.toronto.edu>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+ * Place - Suite 330, Boston, MA 02111-1307 USA.
+ *
+ */
+
+#include "proxy.h"
+
+/** Number of samples kept to cover the longest window */
+#define STATS_SAMPLES (STATS_WINDOW_MAX+1)
+
+/**
+ * Totals of the counters which rates are computed for.
+ **/
+typedef struct {
+    /** Time the sample was taken. */
+    struct timeval time;
+    /** Value of each counter. */
+    ulong counts[STATS_COUNTERS];
+} stats_sample_t;
+
+const int proxy_stats_windows[STATS_WINDOWS] = { 1, 10, 60 };
+
+/** Names of counters, indexed by ::proxy_stats_counter_t */
+static const char *stats_names[STATS_COUNTERS] = {
+    "Queries",
+    "Bytes",
+    "Queries_any",
+    "Queries_all"
+};
+
+/** Statistics for each client thread */
+static proxy_stats_shard_t *stats_shards = NULL;
+static int stats_nshards = 0;
+
+/** Ring of samples taken by the monitor, oldest first from ::stats_next */
+static stats_sample_t stats_samples[STATS_SAMPLES];
+/** Index where the next sample will be stored */
+static int stats_next = 0;
+/** Number of samples taken, up to ::STATS_SAMPLES */
+static int stats_nsamples = 0;
+/** Lock protecting samples */
+static pthread_mutex_t stats_lock;
+
+/**
+ * Allocate statistics for client threads.
+ *
+ * @param nshards Number of client threads.
+ *
+ * @return TRUE on error, FALSE otherwise.
+ **/
+my_bool proxy_stats_init(int nshards) {
+    void *shards;
+
+    if (posix_memalign(&shards, STATS_CACHE_LINE, nshards * sizeof(proxy_stats_shard_t))) {
+        proxy_log(LOG_ERROR, "Couldn't allocate thread statistics");
+        return TRUE;
+    }
+
+    memset(shards, 0, nshards * sizeof(proxy_stats_shard_t));
+    stats_shards = (proxy_stats_shard_t*) shards;
+    stats_nshards = nshards;
+
+    stats_next = 0;
+    stats_nsamples = 0;
+    proxy_mutex_init(&stats_lock);
+
+    return FALSE;
+}
+
+/**
+ * Free statistics for client threads.
+ **/
+void proxy_stats_end() {
+    if (!stats_shards)
+        return;
+
+    free(stats_shards);
+    stats_shards = NULL;
+    stats_nshards = 0;
+
+    proxy_mutex_destroy(&stats_lock);
+}
+
+/**
+ * Add what a connection has done since it was last published
+ * to the statistics of a client thread. Only the thread owning
+ * the shard may call this, so no atomic operations are needed.
+ *
+ * @param shard              Identifier of the client thread.
+ * @param status             Status information for the connection.
+ * @param[in,out] published  Status when last published, which
+ *                           is updated to match the connection.
+ **/
+void proxy_stats_publish(int shard, status_t *status, status_t *published) {
+    volatile status_t *total;
+
+    if (unlikely(shard < 0 || shard >= stats_nshards))
+        return;
+
+    total = &stats_shards[shard].status;
+    total->bytes_recv       += status->bytes_recv - published->bytes_recv;
+    total->bytes_sent       += status->bytes_sent - published->bytes_sent;
+    total->queries          += status->queries - published->queries;
+    total->queries_any      += status->queries_any - published->queries_any;
+    total->queries_all      += status->queries_all - published->queries_all;
+    total->queries_balanced += status->queries_balanced - published->queries_balanced;
+    total->queries_batched  += status->queries_batched - published->queries_batched;
+    total->queries_readonly += status->queries_readonly - published->queries_readonly;
+
+    *published = *status;
+}
+
+/**
+ * Sum the statistics of all client threads. Counters are read
+ * while threads update them, so totals may be slightly behind.
+ *
+ * @param[out] total Status to store the totals in.
+ **/
+void proxy_stats_total(status_t *total) {
+    volatile status_t *shard;
+    int i;
+
+    proxy_status_reset(total);
+
+    for (i=0; i<stats_nshards; i++) {
+        shard = &stats_shards[i].status;
+        total->bytes_recv       += shard->bytes_recv;
+        total->bytes_sent       += shard->bytes_sent;
+        total->queries          += shard->queries;
+        total->queries_any      += shard->queries_any;
+        total->queries_all      += shard->queries_all;
+        total->queries_balanced += shard->queries_balanced;
+        total->queries_batched  += shard->queries_batched;
+        total->queries_readonly += shard->queries_readonly;
+    }
+}
+
+/**
+ * Record the current totals so rates can be computed.
+ * This is called by the monitor about once per second.
+ **/
+void proxy_stats_sample() {
+    stats_sample_t *sample;
+    status_t total;
+
+    proxy_stats_total(&total);
+
+    proxy_mutex_lock(&stats_lock);
+
+    sample = &stats_samples[stats_next];
+    gettimeofday(&sample->time, NULL);
+    sample->counts[STATS_QUERIES]     = total.queries;
+    sample->counts[STATS_BYTES]       = total.bytes_recv + total.bytes_sent;
+    sample->counts[STATS_QUERIES_ANY] = total.queries_any;
+    sample->counts[STATS_QUERIES_ALL] = total.queries_all;
+
+    stats_next = (stats_next + 1) % STATS_SAMPLES;
+    if (stats_nsamples < STATS_SAMPLES)
+        stats_nsamples++;
+
+    proxy_mutex_unlock(&stats_lock);
+}
+
+/**
+ * Get the rate of a counter over a recent window. Windows
+ * are shorter until enough samples have been taken.
+ *
+ * @param counter Counter to get the rate of.
+ * @param window  Length of the window in seconds.
+ *
+ * @return Average increase per second, or zero
+ *         if fewer than two samples were taken.
+ **/
+long proxy_stats_rate(proxy_stats_counter_t counter, int window) {
+    stats_sample_t *newest, *oldest;
+    double elapsed;
+    long rate = 0;
+    int back;
+
+    proxy_mutex_lock(&stats_lock);
+
+    if (stats_nsamples > 1) {
+        back = window < stats_nsamples - 1 ? window : stats_nsamples - 1;
+        newest = &stats_samples[(stats_next + STATS_SAMPLES - 1) % STATS_SAMPLES];
+        oldest = &stats_samples[(stats_next + STATS_SAMPLES - 1 - back) % STATS_SAMPLES];
+
+        elapsed = newest->time.tv_sec - oldest->time.tv_sec
+            + (newest->time.tv_usec - oldest->time.tv_usec) / 1000000.0;
+        if (elapsed > 0)
+            rate = (long) ((newest->counts[counter] - oldest->counts[counter]) / elapsed);
+    }
+
+    proxy_mutex_unlock(&stats_lock);
+
+    return rate;
+}
+
+/**
+ * Get the name of a counter for reporting.
+ *
+ * @param counter Counter to name.
+ *
+ * @return Name of the counter.
+ **/
+const char* proxy_stats_name(proxy_stats_counter_t counter) {
+    return stats_names[counter];
+}
@@ -0,0 +1,61 @@
+/*
+ * proxy_stats.h
+ *
+ * Per-thread query statistics and windowed rates.
+ *
+ * This file is subject to the terms and conditions of the GNU General
+ * Public License.  See the file "COPYING" in the main directory of
+ * this archive for more details.
+ *
+ * Copyright (C) 2010 by Michael Mior <mmior@cs.toronto.edu>
+ *
+ */
+
+#ifndef _proxy_stats_h
+#define _proxy_stats_h
+
+/** Size of a cache line in bytes */
+#define STATS_CACHE_LINE 64
+
+/** Number of windows rates are computed over */
+#define STATS_WINDOWS 3
+/** Longest window in seconds */
+#define STATS_WINDOW_MAX 60
+
+/**
+ * Counters which rates are computed for.
+ **/
+typedef enum {
+    /** Queries received by the proxy. */
+    STATS_QUERIES,
+    /** Bytes received from and sent to clients. */
+    STATS_BYTES,
+    /** Non-replicated queries. */
+    STATS_QUERIES_ANY,
+    /** Replicated queries. */
+    STATS_QUERIES_ALL,
+    /** Number of counters. */
+    STATS_COUNTERS
+} proxy_stats_counter_t;
+
+/**
+ * Statistics for a single client thread, padded
+ * so threads never write to the same cache line.
+ **/
+typedef struct {
+    /** Totals for all queries serviced by the thread. */
+    status_t status;
+} __attribute__((aligned(STATS_CACHE_LINE))) proxy_stats_shard_t;
+
+/** Length of each window in seconds */
+extern const int proxy_stats_windows[STATS_WINDOWS];
+
+my_bool proxy_stats_init(int nshards);
+void proxy_stats_end();
+void proxy_stats_publish(int shard, status_t *status, status_t *published);
+void proxy_stats_total(status_t *total);
+void proxy_stats_sample();
+long proxy_stats_rate(proxy_stats_counter_t counter, int window);
+const char* proxy_stats_name(proxy_stats_counter_t counter);
+
+#endif /* _proxy_stats_h */
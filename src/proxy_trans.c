@@ -1,7 +1,7 @@
 /******************************************************************************
  * proxy_trans.c
  *
- * Manage a hash table for transactions so we can do lookups
+ * Manage a lock-striped table of transactions so we can do lookups
  * upon receiving messages for two-phase commit.
  *
  * Copyright (c) 2010, Michael Mior <mmior@cs.toronto.edu>
@@ -23,19 +23,342 @@
 
 #include "proxy.h"
 
-struct hashtable *trans_table = NULL;
+/** Number of independently locked parts of the table */
+#define TRANS_STRIPES   64
+/** Initial number of slots in each stripe */
+#define TRANS_SLOTS     16
+/** Maximum number of free transactions kept for reuse */
+#define TRANS_POOL_MAX  256
+
+/**
+ * Slot in the transaction table.
+ **/
+typedef struct {
+    /** Transaction ID, or zero if the slot is empty. */
+    ulong key;
+    /** Transaction data. */
+    proxy_trans_t *trans;
+} trans_slot_t;
+
+/**
+ * Part of the transaction table with its own lock, using
+ * open addressing with linear probing within the stripe.
+ **/
+typedef struct {
+    /** Lock protecting the stripe. */
+    pthread_mutex_t lock;
+    /** Number of slots, always a power of two. */
+    int size;
+    /** Number of occupied slots. */
+    int count;
+    /** Slots holding transactions. */
+    trans_slot_t *slots;
+} __attribute__((aligned(64))) trans_stripe_t;
+
+/** Stripes of the transaction table */
+static trans_stripe_t trans_stripes[TRANS_STRIPES];
+/** Free transactions available for reuse */
+static proxy_trans_t *trans_pool = NULL;
+/** Number of transactions in the pool */
+static int trans_pool_size = 0;
+/** Lock protecting the pool of free transactions */
+static pthread_spinlock_t trans_pool_lock;
+
+/**
+ * Mix the bits of a transaction ID, since IDs are sequential.
+ *
+ * @param key Transaction ID.
+ *
+ * @return Hash of the ID.
+ **/
+static inline ulong trans_hash(ulong key) {
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdUL;
+    key ^= key >> 33;
+    return key;
+}
+
+/**
+ * Get the stripe holding a transaction.
+ *
+ * @param key Transaction ID.
+ *
+ * @return Stripe for the ID.
+ **/
+static inline trans_stripe_t* trans_stripe(ulong key) {
+    return &trans_stripes[trans_hash(key) % TRANS_STRIPES];
+}
+
+/**
+ * Find the slot for a transaction in a stripe,
+ * which is empty if the transaction is not present.
+ * The stripe lock must be held.
+ *
+ * @param stripe Stripe to search.
+ * @param key    Transaction ID.
+ *
+ * @return Index of the slot.
+ **/
+static inline int trans_find(trans_stripe_t *stripe, ulong key) {
+    int i = (trans_hash(key) / TRANS_STRIPES) & (stripe->size - 1);
+
+    while (stripe->slots[i].key && stripe->slots[i].key != key)
+        i = (i + 1) & (stripe->size - 1);
+
+    return i;
+}
+
+/**
+ * Double the number of slots in a stripe.
+ * The stripe lock must be held.
+ *
+ * @param stripe Stripe to grow.
+ **/
+static void trans_grow(trans_stripe_t *stripe) {
+    trans_slot_t *old = stripe->slots;
+    int i, j, size = stripe->size;
+
+    stripe->size = size ? size * 2 : TRANS_SLOTS;
+    stripe->slots = (trans_slot_t*) calloc(stripe->size, sizeof(trans_slot_t));
+
+    for (i=0; i<size; i++) {
+        if (!old[i].key)
+            continue;
+
+        j = trans_find(stripe, old[i].key);
+        stripe->slots[j] = old[i];
+    }
+
+    free(old);
+}
 
 void proxy_trans_init() {
-    /* Initialize the transaction hash table */
-    if (options.two_pc &&
-            ((options.coordinator && options.add_ids) || options.cloneable))
-        trans_table = create_hashtable(16);
-    else
-        proxy_log(LOG_INFO, "Skipping transaction hash table initialization");
+    int i;
+
+    /* Slots are allocated when a stripe is first used */
+    for (i=0; i<TRANS_STRIPES; i++) {
+        proxy_mutex_init(&trans_stripes[i].lock);
+        trans_stripes[i].size = 0;
+        trans_stripes[i].count = 0;
+        trans_stripes[i].slots = NULL;
+    }
+
+    pthread_spin_init(&trans_pool_lock, PTHREAD_PROCESS_PRIVATE);
 }
 
 void proxy_trans_end() {
-    /* Delete the hash table and all values */
-    if (trans_table)
-        hashtable_destroy(trans_table, 1);
+    proxy_trans_t *trans;
+    int i, j;
+
+    /* Free the table and any transactions left in it */
+    for (i=0; i<TRANS_STRIPES; i++) {
+        for (j=0; j<trans_stripes[i].size; j++) {
+            if (trans_stripes[i].slots[j].key)
+                free(trans_stripes[i].slots[j].trans);
+        }
+
+        free(trans_stripes[i].slots);
+        trans_stripes[i].slots = NULL;
+        trans_stripes[i].size = trans_stripes[i].count = 0;
+        proxy_mutex_destroy(&trans_stripes[i].lock);
+    }
+
+    /* Empty the pool */
+    while ((trans = trans_pool)) {
+        trans_pool = trans->next;
+        proxy_cond_destroy(&trans->cv);
+        proxy_mutex_destroy(&trans->cv_mutex);
+        free(trans);
+    }
+    trans_pool_size = 0;
+
+    pthread_spin_destroy(&trans_pool_lock);
+}
+
+/**
+ * Get a transaction from the pool, or allocate a new one.
+ * Synchronization primitives are kept initialized in the pool.
+ *
+ * @return A cleared transaction.
+ **/
+proxy_trans_t* proxy_trans_new() {
+    proxy_trans_t *trans;
+
+    pthread_spin_lock(&trans_pool_lock);
+    if ((trans = trans_pool)) {
+        trans_pool = trans->next;
+        trans_pool_size--;
+    }
+    pthread_spin_unlock(&trans_pool_lock);
+
+    if (!trans) {
+        trans = (proxy_trans_t*) malloc(sizeof(proxy_trans_t));
+        proxy_cond_init(&trans->cv);
+        proxy_mutex_init(&trans->cv_mutex);
+    }
+
+    trans->num = 0;
+    trans->total = 0;
+    trans->done = 0;
+    trans->backends = 0;
+    trans->success = TRUE;
+    trans->clone_ids = NULL;
+    trans->id = 0;
+    trans->next = NULL;
+
+    return trans;
+}
+
+/**
+ * Return a transaction to the pool once it is no
+ * longer in the table and no thread is waiting on it.
+ *
+ * @param trans Transaction to free.
+ **/
+void proxy_trans_free(proxy_trans_t *trans) {
+    free(trans->clone_ids);
+    trans->clone_ids = NULL;
+
+    pthread_spin_lock(&trans_pool_lock);
+    if (trans_pool_size < TRANS_POOL_MAX) {
+        trans->next = trans_pool;
+        trans_pool = trans;
+        trans_pool_size++;
+        trans = NULL;
+    }
+    pthread_spin_unlock(&trans_pool_lock);
+
+    /* The pool is full */
+    if (trans) {
+        proxy_cond_destroy(&trans->cv);
+        proxy_mutex_destroy(&trans->cv_mutex);
+        free(trans);
+    }
+}
+
+/**
+ * Insert a transaction in the table unless one already exists with the same ID.
+ *
+ * @param transaction_id Transaction ID to use as key.
+ * @param trans          Transaction to store.
+ *
+ * @return The transaction now stored with the ID, which
+ *         is @p trans unless one was already present.
+ **/
+proxy_trans_t* proxy_trans_insert(ulong transaction_id, proxy_trans_t *trans) {
+    trans_stripe_t *stripe = trans_stripe(transaction_id);
+    int i;
+
+    proxy_debug("Adding transaction %lu to table", transaction_id);
+
+    proxy_mutex_lock(&stripe->lock);
+
+    /* Keep the load factor under one half */
+    if ((stripe->count + 1) * 2 > stripe->size)
+        trans_grow(stripe);
+
+    i = trans_find(stripe, transaction_id);
+    if (stripe->slots[i].key) {
+        trans = stripe->slots[i].trans;
+    } else {
+        stripe->slots[i].key = transaction_id;
+        stripe->slots[i].trans = trans;
+        stripe->count++;
+    }
+
+    proxy_mutex_unlock(&stripe->lock);
+
+    /* Wake anyone waiting for the transaction */
+    proxy_wait_wake();
+    return trans;
+}
+
+/**
+ * Find a transaction in the table.
+ *
+ * @param transaction_id Transaction ID to use as key.
+ *
+ * @return The found transaction, or NULL if the transaction
+ * could not be found.
+ **/
+proxy_trans_t* proxy_trans_search(ulong transaction_id) {
+    trans_stripe_t *stripe = trans_stripe(transaction_id);
+    proxy_trans_t *trans = NULL;
+    int i;
+
+    proxy_mutex_lock(&stripe->lock);
+    if (stripe->count) {
+        i = trans_find(stripe, transaction_id);
+        trans = stripe->slots[i].trans;
+    }
+    proxy_mutex_unlock(&stripe->lock);
+
+    return trans;
+}
+
+/**
+ * Remove a transaction from the table.
+ *
+ * @param transaction_id Transaction ID to use as key.
+ *
+ * @return The removed transaction, or NULL if no transaction
+ *         exists with the specified key.
+ **/
+proxy_trans_t* proxy_trans_remove(ulong transaction_id) {
+    trans_stripe_t *stripe = trans_stripe(transaction_id);
+    proxy_trans_t *trans = NULL;
+    int i, j, k;
+
+    proxy_debug("Removing transaction %lu from table", transaction_id);
+
+    proxy_mutex_lock(&stripe->lock);
+    if (!stripe->count)
+        goto out;
+
+    i = trans_find(stripe, transaction_id);
+    if (!stripe->slots[i].key)
+        goto out;
+
+    trans = stripe->slots[i].trans;
+    stripe->count--;
+
+    /* Shift back any later entries in the same probe
+     * sequence so lookups never stop at the hole */
+    j = i;
+    while (1) {
+        stripe->slots[i].key = 0;
+        stripe->slots[i].trans = NULL;
+
+        do {
+            j = (j + 1) & (stripe->size - 1);
+            if (!stripe->slots[j].key)
+                goto out;
+
+            k = (trans_hash(stripe->slots[j].key) / TRANS_STRIPES) & (stripe->size - 1);
+        } while (i <= j ? (i < k && k <= j) : (i < k || k <= j));
+
+        stripe->slots[i] = stripe->slots[j];
+        i = j;
+    }
+
+out:
+    proxy_mutex_unlock(&stripe->lock);
+    return trans;
+}
+
+/**
+ * Get the number of transactions in the table.
+ *
+ * @return Number of transactions.
+ **/
+int proxy_trans_count() {
+    int i, count = 0;
+
+    for (i=0; i<TRANS_STRIPES; i++) {
+        proxy_mutex_lock(&trans_stripes[i].lock);
+        count += trans_stripes[i].count;
+        proxy_mutex_unlock(&trans_stripes[i].lock);
+    }
+
+    return count;
 }
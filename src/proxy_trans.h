@@ -1,7 +1,7 @@
 /*
  * proxy_trans.h
  *
- * Manage a hash table for transactions so we can do lookups
+ * Manage a lock-striped table of transactions so we can do lookups
  * upon receiving messages for two-phase commit.
  *
  * This file is subject to the terms and conditions of the GNU General
@@ -15,16 +15,11 @@
 #ifndef _proxy_trans_h
 #define _proxy_trans_h
 
-#include "hashtable/hashtable.h"
-
-/** Hashtable to hold transactions */
-extern struct hashtable *trans_table;
-
 /**
  * Holds data required for the decision to
  * commit or roll back a transaction.
  **/
-typedef struct {
+typedef struct proxy_trans {
     /** Number of clones which have agreed to commit. */
     volatile sig_atomic_t num;
     /** Total number which must agree to commit. */
@@ -47,51 +42,23 @@ typedef struct {
     pthread_cond_t cv;
     /** Mutex for locking access to condition variable. */
     pthread_mutex_t cv_mutex;
+
+    /** Transaction ID while waiting to be reported to the coordinator. */
+    ulong id;
+    /** Next free transaction in the pool, or the next
+     *  transaction waiting to be reported. */
+    struct proxy_trans *next;
 } proxy_trans_t;
 
 void proxy_trans_init();
 void proxy_trans_end();
 
-DEFINE_HASHTABLE_INSERT(_proxy_trans_insert, proxy_trans_t);
-DEFINE_HASHTABLE_SEARCH(_proxy_trans_search, proxy_trans_t);
-DEFINE_HASHTABLE_REMOVE(_proxy_trans_remove, proxy_trans_t);
+proxy_trans_t* proxy_trans_new();
+void proxy_trans_free(proxy_trans_t *trans);
 
-/**
- * Insert a new transaction in the transaction hashtable.
- *
- * @param transaction_id Pointer to the transaction ID to use as key.
- * @param trans          Pointer to a transaction struct to store.
- *
- * @return Zero on success, anything else on failure.
- **/
-inline __attribute__((always_inline)) int proxy_trans_insert(ulong transaction_id, proxy_trans_t *trans) {
-    proxy_debug("Adding transaction %lu to hashtable", transaction_id);
-    return _proxy_trans_insert(trans_table, transaction_id, trans);
-}
-
-/**
- * Find a transaction in the transaction hashtable.
- *
- * @param transaction_id Pointer to the transaction ID to use as key.
- *
- * @return The found transaction, or NULL if the transaction
- * could not be found.
- **/
-inline __attribute__((always_inline)) proxy_trans_t* proxy_trans_search(ulong transaction_id) {
-    return _proxy_trans_search(trans_table, transaction_id);
-}
-
-/**
- * Remove a transaction from the transaction hashtable.
- *
- * @param transaction_id Pointer to the transaction ID to use as key.
- *
- * @return The removed transaction, or NULL if no transaction
- *         exists with the specified key.
- **/
-inline __attribute__((always_inline)) proxy_trans_t* proxy_trans_remove(ulong transaction_id) {
-    proxy_debug("Removing transaction %lu from hashtable", transaction_id);
-    return _proxy_trans_remove(trans_table, transaction_id);
-}
+proxy_trans_t* proxy_trans_insert(ulong transaction_id, proxy_trans_t *trans);
+proxy_trans_t* proxy_trans_search(ulong transaction_id);
+proxy_trans_t* proxy_trans_remove(ulong transaction_id);
+int proxy_trans_count();
 
 #endif /* _proxy_trans_h */
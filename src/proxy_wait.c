@@ -0,0 +1,144 @@
+/******************************************************************************
+ * proxy_wait.c
+ *
+ * Block threads until shared state changes and record time spent waiting.
+ * All waiters share a single event count, which is incremented whenever
+ * some state which may be waited on changes. Waits are rare, so waking
+ * every waiter to recheck its condition is cheaper than tracking them.
+ *
+ * Copyright (c) 2010, Michael Mior <mmior@cs.toronto.edu>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+ * Place - Suite 330, Boston, MA 02111-1307 USA.
+ *
+ */
+
+#include "proxy.h"
+
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+/** Count of state changes, also used as a futex word */
+static volatile int wait_seq = 0;
+/** Number of threads currently waiting */
+static volatile int wait_waiters = 0;
+/** Statistics for each wait site */
+static wait_stats_t wait_stats[WAIT_SITES];
+
+/** Names of wait sites for reporting */
+static const char *wait_names[WAIT_SITES] = {
+    "query_clone",
+    "commit_clone",
+    "clone_commit",
+    "clone_query",
+    "trans",
+    "topo"
+};
+
+/**
+ * Register as a waiter before checking a condition,
+ * so any change after the check will wake us.
+ *
+ * @return Event count to pass to ::proxy_wait_block.
+ **/
+int proxy_wait_prepare() {
+    (void) __sync_fetch_and_add(&wait_waiters, 1);
+    return wait_seq;
+}
+
+/**
+ * Stop waiting after the condition was found to hold.
+ **/
+void proxy_wait_cancel() {
+    (void) __sync_fetch_and_sub(&wait_waiters, 1);
+}
+
+/**
+ * Sleep until the event count changes.
+ *
+ * @param seq Event count from ::proxy_wait_prepare.
+ **/
+void proxy_wait_block(int seq) {
+    syscall(SYS_futex, &wait_seq, FUTEX_WAIT_PRIVATE, seq, NULL, NULL, 0);
+    (void) __sync_fetch_and_sub(&wait_waiters, 1);
+}
+
+/**
+ * Sleep until the event count changes or some time passes.
+ *
+ * @param seq  Event count from ::proxy_wait_prepare.
+ * @param msec Maximum milliseconds to sleep.
+ **/
+void proxy_wait_block_timed(int seq, long msec) {
+    struct timespec timeout;
+
+    timeout.tv_sec  = msec / 1000;
+    timeout.tv_nsec = (msec % 1000) * 1000000L;
+
+    syscall(SYS_futex, &wait_seq, FUTEX_WAIT_PRIVATE, seq, &timeout, NULL, 0);
+    (void) __sync_fetch_and_sub(&wait_waiters, 1);
+}
+
+/**
+ * Record the time spent at a wait site.
+ *
+ * @param site  Site where the thread waited.
+ * @param start Time when waiting started.
+ **/
+void proxy_wait_record(proxy_wait_site_t site, struct timeval *start) {
+    struct timeval end;
+    long usec, max;
+
+    gettimeofday(&end, NULL);
+    usec = (end.tv_sec - start->tv_sec) * 1000000L + (end.tv_usec - start->tv_usec);
+
+    (void) __sync_fetch_and_add(&wait_stats[site].waits, 1);
+    (void) __sync_fetch_and_add(&wait_stats[site].usec, usec);
+
+    while ((max = wait_stats[site].max) < usec
+            && !__sync_bool_compare_and_swap(&wait_stats[site].max, max, usec));
+}
+
+/**
+ * Wake all waiting threads to recheck their conditions.
+ **/
+void proxy_wait_wake() {
+    (void) __sync_fetch_and_add(&wait_seq, 1);
+
+    if (wait_waiters)
+        syscall(SYS_futex, &wait_seq, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+/**
+ * Get statistics for a wait site.
+ *
+ * @param site       Site to get statistics for.
+ * @param[out] stats Storage for the statistics.
+ **/
+void proxy_wait_stats(proxy_wait_site_t site, wait_stats_t *stats) {
+    stats->waits = wait_stats[site].waits;
+    stats->usec  = wait_stats[site].usec;
+    stats->max   = wait_stats[site].max;
+}
+
+/**
+ * Get the name of a wait site.
+ *
+ * @param site Site to get the name of.
+ *
+ * @return Name of the site.
+ **/
+const char* proxy_wait_name(proxy_wait_site_t site) {
+    return wait_names[site];
+}
@@ -0,0 +1,124 @@
+/*
+ * proxy_wait.h
+ *
+ * Block threads until shared state changes and record time spent waiting.
+ *
+ * This file is subject to the terms and conditions of the GNU General
+ * Public License.  See the file "COPYING" in the main directory of
+ * this archive for more details.
+ *
+ * Copyright (C) 2010 by Michael Mior <mmior@cs.toronto.edu>
+ *
+ */
+
+#ifndef _proxy_wait_h
+#define _proxy_wait_h
+
+#include <sys/time.h>
+
+/**
+ * Places where threads wait on each other.
+ **/
+typedef enum {
+    /** Replicated queries waiting for a clone to finish. */
+    WAIT_QUERY_CLONE,
+    /** Commits waiting for a clone to finish. */
+    WAIT_COMMIT_CLONE,
+    /** Clones waiting for commits to finish. */
+    WAIT_CLONE_COMMIT,
+    /** Clones waiting for replicated queries to finish. */
+    WAIT_CLONE_QUERY,
+    /** Commit messages waiting for their transaction. */
+    WAIT_TRANS,
+    /** Topology changes waiting for queries or other changes to finish. */
+    WAIT_TOPO,
+    /** Number of wait sites. */
+    WAIT_SITES
+} proxy_wait_site_t;
+
+/**
+ * Statistics on time blocked at a wait site.
+ **/
+typedef struct {
+    /** Number of times a thread blocked. */
+    long waits;
+    /** Total microseconds spent blocked. */
+    long usec;
+    /** Maximum microseconds spent blocked at once. */
+    long max;
+} wait_stats_t;
+
+int proxy_wait_prepare();
+void proxy_wait_cancel();
+void proxy_wait_block(int seq);
+void proxy_wait_block_timed(int seq, long msec);
+void proxy_wait_record(proxy_wait_site_t site, struct timeval *start);
+void proxy_wait_wake();
+void proxy_wait_stats(proxy_wait_site_t site, wait_stats_t *stats);
+const char* proxy_wait_name(proxy_wait_site_t site);
+
+/**
+ * Block until a condition holds. Any thread changing state the
+ * condition depends on must call ::proxy_wait_wake afterwards.
+ *
+ * @param site Wait site used for statistics.
+ * @param cond Condition to wait for, which may be evaluated many times.
+ **/
+#define proxy_wait(site, cond) \
+    do { \
+        struct timeval __wait_start; \
+        int __wait_seq; \
+        if (!(cond)) { \
+            gettimeofday(&__wait_start, NULL); \
+            while (1) { \
+                __wait_seq = proxy_wait_prepare(); \
+                if (cond) { \
+                    proxy_wait_cancel(); \
+                    break; \
+                } \
+                proxy_wait_block(__wait_seq); \
+            } \
+            proxy_wait_record(site, &__wait_start); \
+        } \
+    } while (0)
+
+/**
+ * Block until a condition holds or some time passes. Any thread
+ * changing state the condition depends on must call
+ * ::proxy_wait_wake afterwards.
+ *
+ * @param site         Site used for statistics.
+ * @param cond         Condition to wait for, which may be evaluated many times.
+ * @param msec         Maximum milliseconds to wait.
+ * @param[out] expired Set to 1 if time ran out before the condition held,
+ *                     or 0 otherwise.
+ **/
+#define proxy_wait_timed(site, cond, msec, expired) \
+    do { \
+        struct timeval __wait_start, __wait_now; \
+        long __wait_left; \
+        int __wait_seq; \
+        (expired) = 0; \
+        if (!(cond)) { \
+            gettimeofday(&__wait_start, NULL); \
+            while (1) { \
+                __wait_seq = proxy_wait_prepare(); \
+                if (cond) { \
+                    proxy_wait_cancel(); \
+                    break; \
+                } \
+                gettimeofday(&__wait_now, NULL); \
+                __wait_left = (msec) - ((__wait_now.tv_sec - __wait_start.tv_sec) * 1000L \
+                    + (__wait_now.tv_usec - __wait_start.tv_usec) / 1000); \
+                if (__wait_left <= 0) { \
+                    proxy_wait_cancel(); \
+                    (expired) = 1; \
+                    break; \
+                } \
+                proxy_wait_block_timed(__wait_seq, __wait_left); \
+            } \
+            proxy_wait_record(site, &__wait_start); \
+        } \
+    } while (0)
+
+#endif /* _proxy_wait_h */
@@ -0,0 +1,94 @@
+/******************************************************************************
+ * bench_pool.c
+ *
+ * Microbenchmark of contended access to a lock pool
+ *
+ * Copyright (c) 2010, Michael Mior <mmior@cs.toronto.edu>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+ * Place - Suite 330, Boston, MA 02111-1307 USA.
+ *
+ */
+
+#include "../src/proxy_pool.c"
+
+/** Default number of items in the pool */
+#define BENCH_POOL_SIZE 16
+/** Default maximum number of contending threads */
+#define BENCH_THREADS   64
+/** Default number of get/return pairs per thread */
+#define BENCH_ITERS     200000
+
+static pool_t *pool;
+static int iters;
+static volatile sig_atomic_t start = 0;
+
+/** Repeatedly take and return items from the pool */
+static void* bench_thread(__attribute__((unused)) void *ptr) {
+    int i, idx;
+
+    while (!start) { sched_yield(); }
+
+    for (i=0; i<iters; i++) {
+        idx = proxy_pool_get(pool);
+        proxy_pool_return(pool, idx);
+    }
+
+    return NULL;
+}
+
+/**
+ * Run get/return cycles with increasing numbers of threads and
+ * print the throughput for each. Usage:
+ *
+ *     bench_pool [pool size] [max threads] [iterations]
+ **/
+int main(int argc, char *argv[]) {
+    int size = argc > 1 ? atoi(argv[1]) : BENCH_POOL_SIZE;
+    int max_threads = argc > 2 ? atoi(argv[2]) : BENCH_THREADS;
+    pthread_t *threads;
+    struct timeval tv_start, tv_end;
+    double secs;
+    int nthreads, i;
+
+    iters = argc > 3 ? atoi(argv[3]) : BENCH_ITERS;
+    threads = (pthread_t*) calloc(max_threads, sizeof(pthread_t));
+
+    printf("Pool size %d, %d iterations per thread\n", size, iters);
+    printf("%8s %12s %14s\n", "threads", "seconds", "ops/sec");
+
+    for (nthreads=1; nthreads<=max_threads; nthreads<<=1) {
+        pool = proxy_pool_new(size);
+        start = 0;
+
+        for (i=0; i<nthreads; i++)
+            pthread_create(&threads[i], NULL, bench_thread, NULL);
+
+        gettimeofday(&tv_start, NULL);
+        start = 1;
+
+        for (i=0; i<nthreads; i++)
+            pthread_join(threads[i], NULL);
+        gettimeofday(&tv_end, NULL);
+
+        secs = tv_end.tv_sec - tv_start.tv_sec + (tv_end.tv_usec - tv_start.tv_usec) / 1000000.0;
+        printf("%8d %12.3f %14.0f\n", nthreads, secs, (double) nthreads * iters / secs);
+
+        if (pool->locked != 0)
+            fprintf(stderr, "Pool has %d items still locked\n", pool->locked);
+        proxy_pool_destroy(pool);
+    }
+
+    free(threads);
+    return EXIT_SUCCESS;
+}
@@ -20,6 +20,9 @@
  *
  */
 
+/* Give up on lagging backends quickly */
+#define REPLOG_MAX 4
+
 #include "../src/proxy_backend.c"
 
 #include <check.h>
@@ -27,7 +30,6 @@
 
 /* Externs */
 ulong transaction_id;
-struct hashtable *trans_table;
 struct hashtable *clone_table;
 volatile sig_atomic_t server_id;
 volatile sig_atomic_t clone_generation;
@@ -44,16 +46,25 @@ void __wrap_proxy_threading_cleanup(
 void __wrap_proxy_threading_mask() {}
 void __wrap_proxy_threading_name(__attribute__((unused)) char *name) {}
 
+/* Last outcome sent to the client, zero for OK */
+static int client_errno = -1;
+
 /* Dummy network functions */
 my_bool __wrap_proxy_net_send_ok(
         __attribute__((unused)) MYSQL *mysql,
         __attribute__((unused)) uint warnings,
         __attribute__((unused)) ulong affected_rows,
-        __attribute__((unused)) ulonglong last_insert_id) { return FALSE; }
+        __attribute__((unused)) ulonglong last_insert_id) {
+    client_errno = 0;
+    return FALSE;
+}
 my_bool __wrap_proxy_net_send_error(
         __attribute__((unused))MYSQL *mysql,
-        __attribute__((unused))int sql_errno,
-        __attribute__((unused))const char *err) { return FALSE; }
+        int sql_errno,
+        __attribute__((unused))const char *err) {
+    client_errno = sql_errno;
+    return FALSE;
+}
 
 /* Dummy hash functions */
 int hashtable_insert(
@@ -68,9 +79,295 @@ void* hashtable_search(
     __attribute__((unused)) unsigned long k) { return NULL; }
 
 void proxy_clone_notify() {}
+void proxy_coord_send(
+    __attribute__((unused)) ulong transaction_id,
+    __attribute__((unused)) proxy_trans_t *trans) {}
 
 volatile sig_atomic_t cloning = 0;
 
+/* Topology for tests which need backends */
+static backend_topo_t topo;
+
+/* Fake backends for tests which send queries. Each connection
+ * queues replies to the statements it receives on a pipe, so
+ * poll() finds them ready in the same way as a real backend. */
+
+/** Number of fake backends */
+#define FAKE_BACKENDS 2
+/** Number of backend threads connected to each fake backend */
+#define FAKE_THREADS 2
+/** Space for statements and replies on a connection */
+#define FAKE_BUF 4096
+
+/** Connection to a fake backend. */
+typedef struct {
+    /** Client object, which must come first. */
+    MYSQL mysql;
+    /** Socket information read by poll(). */
+    Vio vio;
+    /** Pipe written with a byte for each queued reply. */
+    int pipe[2];
+    /** Statements received, each followed by a semicolon. */
+    char log[FAKE_BUF];
+    /** Packets waiting to be read, with their headers. */
+    uchar replies[FAKE_BUF];
+    /** Start and end of the unread packets. */
+    ulong read, write;
+    /** Statements starting with this fail, or NULL. */
+    const char *fail;
+    /** TRUE while a transaction is open on the connection. */
+    my_bool in_trans;
+    /** Rows returned for SELECT statements, or NULL. */
+    const char **rows;
+    /** Number of rows returned for SELECT statements. */
+    int nrows;
+    /** TRUE if replies are held back until released. */
+    my_bool slow;
+    /** Number of replies held back. */
+    int held;
+} fake_conn_t;
+
+/** Lock protecting replies held back by slow backends */
+static pthread_mutex_t fake_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static fake_conn_t fake_conns[FAKE_BACKENDS][FAKE_THREADS];
+static proxy_backend_conn_t fake_backend_conns[FAKE_BACKENDS][FAKE_THREADS];
+static proxy_thread_t fake_threads[FAKE_BACKENDS][FAKE_THREADS];
+static MYSQL fake_client;
+
+/** Packets sent to the client by the proxy */
+static uchar client_buf[FAKE_BUF];
+static ulong client_len;
+static int client_packets;
+
+/**
+ * Queue a reply packet on a fake backend connection.
+ **/
+static void fake_reply(fake_conn_t *fake, const uchar *packet, ulong length) {
+    uchar *pos = fake->replies + fake->write;
+
+    int3store(pos, length);
+    pos[3] = 1;
+    memcpy(pos + 4, packet, length);
+    fake->write += length + 4;
+
+    fail_unless(fake->write <= FAKE_BUF);
+
+    /* Slow backends answer once released */
+    pthread_mutex_lock(&fake_lock);
+    if (fake->slow)
+        fake->held++;
+    else
+        fail_unless(write(fake->pipe[1], "", 1) == 1);
+    pthread_mutex_unlock(&fake_lock);
+}
+
+/**
+ * Send the replies held back by a slow fake backend
+ * and let it answer normally from now on.
+ **/
+static void fake_release(fake_conn_t *fake) {
+    pthread_mutex_lock(&fake_lock);
+    for (; fake->held; fake->held--)
+        fail_unless(write(fake->pipe[1], "", 1) == 1);
+    fake->slow = FALSE;
+    pthread_mutex_unlock(&fake_lock);
+}
+
+/**
+ * Queue an OK packet on a fake backend connection.
+ **/
+static void fake_reply_ok(fake_conn_t *fake) {
+    uchar ok[] = { 0, 0, 0, SERVER_STATUS_AUTOCOMMIT, 0, 0, 0 };
+
+    if (fake->in_trans)
+        ok[3] |= SERVER_STATUS_IN_TRANS;
+
+    fake_reply(fake, ok, sizeof(ok));
+}
+
+/**
+ * Queue a result set of one column and the given
+ * rows of short strings on a fake backend connection.
+ **/
+static void fake_reply_rows(fake_conn_t *fake, const char **rows, int nrows) {
+    static const uchar count[] = { 1 };
+    static const uchar field[] = { 3, 'd', 'e', 'f', 0, 0, 0, 1, 'a', 1, 'a', 0x0c,
+        8, 0, 255, 0, 0, 0, MYSQL_TYPE_VAR_STRING, 0, 0, 0, 0, 0 };
+    static const uchar eof[] = { 254, 0, 0, SERVER_STATUS_AUTOCOMMIT, 0 };
+    uchar row[252];
+    int i;
+
+    fake_reply(fake, count, sizeof(count));
+    fake_reply(fake, field, sizeof(field));
+    fake_reply(fake, eof, sizeof(eof));
+
+    for (i=0; i<nrows; i++) {
+        row[0] = strlen(rows[i]);
+        memcpy(row + 1, rows[i], row[0]);
+        fake_reply(fake, row, row[0] + 1);
+    }
+
+    fake_reply(fake, eof, sizeof(eof));
+}
+
+/**
+ * Receive a command on a fake backend, which answers
+ * with an error for failing statements or else an OK.
+ **/
+static my_bool fake_command(MYSQL *mysql,
+        __attribute__((unused)) enum enum_server_command command,
+        __attribute__((unused)) const uchar *header,
+        __attribute__((unused)) ulong header_length,
+        const uchar *arg, ulong arg_length,
+        __attribute__((unused)) my_bool skip_check,
+        __attribute__((unused)) MYSQL_STMT *stmt) {
+    static const uchar error[] = { 255, 0x7a, 0x04, 'F', 'a', 'i', 'l', 'e', 'd' };
+    fake_conn_t *fake = (fake_conn_t*) mysql;
+
+    strncat(fake->log, (const char*) arg, arg_length);
+    strcat(fake->log, ";");
+
+    /* Track transactions so the server status is reported as MySQL does */
+    if (backend_query_begins((const char*) arg))
+        fake->in_trans = TRUE;
+    else if (!strncmp((const char*) arg, "COMMIT", 6) || !strncmp((const char*) arg, "ROLLBACK", 8))
+        fake->in_trans = FALSE;
+
+    if (fake->fail && !strncmp((const char*) arg, fake->fail, strlen(fake->fail)))
+        fake_reply(fake, error, sizeof(error));
+    else if (fake->rows && !strncmp((const char*) arg, "SELECT", 6))
+        fake_reply_rows(fake, fake->rows, fake->nrows);
+    else
+        fake_reply_ok(fake);
+
+    return FALSE;
+}
+
+static const MYSQL_METHODS fake_methods = { .advanced_command = fake_command };
+
+/* Queries and replies go through the fake backends */
+int __wrap_mysql_send_query(MYSQL *mysql, const char *query, ulong length) {
+    return fake_command(mysql, COM_QUERY, NULL, 0, (const uchar*) query, length, TRUE, NULL);
+}
+
+ulong __wrap_my_net_read(NET *net) {
+    fake_conn_t *fake = (fake_conn_t*) net;
+    ulong length;
+    char c;
+
+    if (fake->read >= fake->write || read(fake->pipe[0], &c, 1) != 1)
+        return packet_error;
+
+    length = uint3korr(fake->replies + fake->read);
+    net->read_pos = fake->replies + fake->read + 4;
+    fake->read += length + 4;
+
+    return length;
+}
+
+my_bool __wrap_my_net_write(__attribute__((unused)) NET *net, const uchar *packet, size_t len) {
+    if (client_len + len <= FAKE_BUF) {
+        memcpy(client_buf + client_len, packet, len);
+        client_len += len;
+    }
+
+    client_packets++;
+    return FALSE;
+}
+
+my_bool __wrap_net_flush(__attribute__((unused)) NET *net) { return FALSE; }
+
+/**
+ * Count how many times a statement was received by a fake backend.
+ **/
+static int fake_count(int bi, int ti, const char *query) {
+    char *pos = fake_conns[bi][ti].log;
+    int count = 0;
+
+    while ((pos = strstr(pos, query))) {
+        pos += strlen(query);
+        count++;
+    }
+
+    return count;
+}
+
+/**
+ * Publish a topology of fake backends and reset what they received.
+ **/
+static void fake_setup() {
+    static proxy_thread_t *threads[FAKE_BACKENDS];
+    static proxy_host_t *hosts[FAKE_BACKENDS];
+    fake_conn_t *fake;
+    int bi, ti;
+
+    memset(&topo, 0, sizeof(topo));
+    topo.num = FAKE_BACKENDS;
+    topo.backends = hosts;
+    topo.threads = threads;
+
+    for (bi=0; bi<FAKE_BACKENDS; bi++) {
+        hosts[bi] = backend_host_new("127.0.0.1", 9, 3306 + bi, BACKEND_WEIGHT);
+        threads[bi] = fake_threads[bi];
+
+        for (ti=0; ti<FAKE_THREADS; ti++) {
+            fake = &fake_conns[bi][ti];
+            memset(fake, 0, sizeof(*fake));
+            fail_unless(!pipe(fake->pipe));
+
+            fake->vio.sd = fake->pipe[0];
+            fake->mysql.net.vio = &fake->vio;
+            fake->mysql.methods = &fake_methods;
+
+            memset(&fake_backend_conns[bi][ti], 0, sizeof(proxy_backend_conn_t));
+            fake_backend_conns[bi][ti].mysql = &fake->mysql;
+            fake_threads[bi][ti].data.backend.bi = bi;
+            fake_threads[bi][ti].data.backend.conn = &fake_backend_conns[bi][ti];
+        }
+    }
+
+    backend_topo = &topo;
+    backend_thread_pool = proxy_pool_new(FAKE_THREADS);
+
+    client_errno = -1;
+    client_len = 0;
+    client_packets = 0;
+}
+
+/**
+ * Free the fake backends.
+ **/
+static void fake_teardown() {
+    int bi, ti;
+
+    for (bi=0; bi<FAKE_BACKENDS; bi++) {
+        for (ti=0; ti<FAKE_THREADS; ti++) {
+            close(fake_conns[bi][ti].pipe[0]);
+            close(fake_conns[bi][ti].pipe[1]);
+        }
+
+        backend_free(topo.backends[bi]);
+    }
+
+    proxy_pool_destroy(backend_thread_pool);
+    backend_thread_pool = NULL;
+    backend_topo = NULL;
+    memset(&topo, 0, sizeof(topo));
+}
+
+/**
+ * Send a statement from a client session through the proxy.
+ **/
+static my_bool fake_query(proxy_conn_idx_t *conn_idx, const char *query, proxy_query_map_t map) {
+    status_t status;
+
+    proxy_status_reset(&status);
+    client_errno = -1;
+
+    return backend_query_trans(conn_idx, &fake_client, query, strlen(query), map, &status);
+}
+
 /** @test Error when trying to read backend with no filename */
 START_TEST (test_backend_read_no_filename) {
     int num;
@@ -140,19 +437,742 @@ START_TEST (test_backend_read_file_noport) {
     free(backends);
 } END_TEST
 
-/** @test Correct parsing of valid IDs */
+/** @test Correct parsing of backend file with weights */
+START_TEST (test_backend_read_file_weights) {
+    int num;
+    proxy_host_t **backends;
+
+    backends = backend_read_file(TESTS_DIR "backend/backends-weights.txt", &num);
+
+    fail_unless(num == 3);
+
+    fail_unless(strcmp(backends[0]->host, "127.0.0.1") == 0);
+    fail_unless(backends[0]->port == 3306);
+    fail_unless(backends[0]->weight == 3);
+    fail_unless(backends[1]->port == 3307);
+    fail_unless(backends[1]->weight == BACKEND_WEIGHT);
+    fail_unless(backends[2]->port == 3306);
+    fail_unless(backends[2]->weight == 0);
+
+    backends_free(backends, num);
+} END_TEST
+
+/** @test Weighted round-robin follows backend weights */
+START_TEST (test_backend_balance_wrr) {
+    int i, counts[3] = { 0, 0, 0 };
+
+    topo.backends = backend_read_file(TESTS_DIR "backend/backends-weights.txt", &topo.num);
+    options.balance = BALANCE_WRR;
+
+    for (i=0; i<8; i++)
+        counts[backend_balance(&topo)]++;
+
+    fail_unless(counts[0] == 6);
+    fail_unless(counts[1] == 2);
+    fail_unless(counts[2] == 0);
+
+    backends_free(topo.backends, topo.num);
+} END_TEST
+
+/** @test Least outstanding selection avoids loaded backends */
+START_TEST (test_backend_balance_least) {
+    topo.backends = backend_read_file(TESTS_DIR "backend/backends-weights.txt", &topo.num);
+    options.balance = BALANCE_LEAST;
+
+    /* Three sessions on the first backend match its weight */
+    topo.backends[0]->sessions = 3;
+    topo.backends[1]->sessions = 1;
+    fail_unless(backend_balance(&topo) == 0);
+
+    topo.backends[0]->inflight = 3;
+    fail_unless(backend_balance(&topo) == 1);
+
+    backends_free(topo.backends, topo.num);
+} END_TEST
+
+/** @test New backends get a growing share of clients while ramping up */
+START_TEST (test_backend_balance_ramp) {
+    topo.backends = backend_read_file(TESTS_DIR "backend/backends-weights.txt", &topo.num);
+    options.ramp_time = 10;
+
+    /* Halfway through ramping, the new backend has half its share */
+    topo.backends[0]->latency = 1000;
+    backend_ramp_start(&topo, topo.backends[1]);
+    fail_unless(topo.backends[1]->ramp_latency == 1000);
+    topo.backends[1]->ramp_start -= 5000000ULL;
+    fail_unless(backend_weight(topo.backends[0]) == 3 * RAMP_SCALE);
+    fail_unless(abs(backend_weight(topo.backends[1]) - RAMP_SCALE / 2) <= 1);
+
+    /* Ramping ends once the backend is as fast as the others */
+    topo.backends[1]->latency = 900;
+    fail_unless(backend_weight(topo.backends[1]) == RAMP_SCALE);
+    fail_unless(!topo.backends[1]->ramp_start);
+    fail_unless(!backend_ramping);
+    fail_unless(backend_weight(topo.backends[0]) == 3);
+
+    /* Ramping also ends once the ramp time has passed */
+    backend_ramp_start(&topo, topo.backends[1]);
+    topo.backends[1]->latency = 0;
+    topo.backends[1]->ramp_start -= 10000000ULL;
+    fail_unless(backend_weight(topo.backends[1]) == RAMP_SCALE);
+    fail_unless(!backend_ramping);
+
+    backends_free(topo.backends, topo.num);
+} END_TEST
+
+/** @test Sessions follow their backend when another is removed */
+START_TEST (test_backend_conn_lost) {
+    proxy_conn_idx_t conn_idx;
+    proxy_host_t *removed;
+    int num;
+
+    topo.backends = backend_read_file(TESTS_DIR "backend/backends-weights.txt", &num);
+    topo.num = num;
+    fail_unless(topo.backends[0]->id != topo.backends[1]->id);
+
+    conn_idx.bi = 2;
+    conn_idx.ci = 0;
+    conn_idx.host_id = topo.backends[2]->id;
+    conn_idx.pinned = FALSE;
+
+    /* The last backend moves into the place of a removed one */
+    removed = topo.backends[1];
+    topo.backends[1] = topo.backends[2];
+    topo.backends[2] = removed;
+    topo.num = 2;
+    fail_unless(!backend_conn_lost(&topo, &conn_idx));
+    fail_unless(conn_idx.bi == 1 && conn_idx.ci == 0);
+
+    /* The session has no connection once its backend is gone */
+    topo.num = 1;
+    fail_unless(backend_conn_lost(&topo, &conn_idx));
+    fail_unless(conn_idx.bi == -1 && conn_idx.ci == -1);
+
+    backends_free(topo.backends, num);
+} END_TEST
+
+/** @test Only plain reads are sent outside the session connection */
+START_TEST (test_backend_query_stateless) {
+    fail_unless(backend_query_stateless("SELECT * FROM t"));
+    fail_unless(backend_query_stateless("  (select a FROM t) UNION (SELECT b FROM u)"));
+    fail_unless(!backend_query_stateless("UPDATE t SET a=1"));
+    fail_unless(!backend_query_stateless("SELECT * FROM t FOR UPDATE"));
+    fail_unless(!backend_query_stateless("SELECT @a"));
+    fail_unless(!backend_query_stateless("SELECT last_insert_id()"));
+    fail_unless(!backend_query_stateless("SELECT a INTO OUTFILE '/tmp/a' FROM t"));
+} END_TEST
+
+/** @test Statements creating session state pin the session */
+START_TEST (test_backend_query_pins) {
+    fail_unless(backend_query_pins("SET @a = 1"));
+    fail_unless(backend_query_pins("SET NAMES utf8"));
+    fail_unless(backend_query_pins("create temporary table t (a int)"));
+    fail_unless(backend_query_pins("LOCK TABLES t READ"));
+    fail_unless(!backend_query_pins("SET autocommit=0"));
+    fail_unless(!backend_query_pins("SELECT 1"));
+    fail_unless(!backend_query_pins("BEGIN"));
+} END_TEST
+
+/** Check if a query string can be batched */
+#define batchable(query) backend_query_batchable(query, strlen(query))
+
+/** @test Only plain writes are sent in batches */
+START_TEST (test_backend_query_batchable) {
+    fail_unless(batchable("INSERT INTO t VALUES (1)"));
+    fail_unless(batchable("  update t SET a=1"));
+    fail_unless(batchable("DELETE FROM t"));
+    fail_unless(batchable("REPLACE INTO t VALUES (1)"));
+    fail_unless(!batchable("BEGIN"));
+    fail_unless(!batchable("SET @a = 1"));
+    fail_unless(!batchable("CREATE TABLE t (a int)"));
+} END_TEST
+
+/** @test Writes which would change how a batch parses are sent alone */
+START_TEST (test_backend_query_batchable_single) {
+    /* Trailing semicolons are dropped when joining */
+    fail_unless(batchable("DELETE FROM t;"));
+    fail_unless(batchable("DELETE FROM t ; ;\n"));
+
+    /* Separators and comment markers in literals are harmless */
+    fail_unless(batchable("INSERT INTO t VALUES ('a;b', \"/*\", '#', '--')"));
+    fail_unless(batchable("UPDATE t SET a='it''s' WHERE `b;c`=1"));
+
+    /* More than one statement */
+    fail_unless(!batchable("UPDATE t SET a=1; DELETE FROM u"));
+    fail_unless(!batchable("UPDATE t SET a='x';DELETE FROM u"));
+
+    /* Comments which could swallow what follows */
+    fail_unless(!batchable("DELETE FROM t /* unterminated"));
+    fail_unless(!batchable("DELETE FROM t /* done */"));
+    fail_unless(!batchable("DELETE FROM t -- comment"));
+    fail_unless(!batchable("DELETE FROM t # comment"));
+    fail_unless(!batchable("INSERT INTO t VALUES (1) /*!; DELETE FROM u */"));
+
+    /* Literals which could run into the next statement */
+    fail_unless(!batchable("INSERT INTO t VALUES ('unterminated)"));
+    fail_unless(!batchable("INSERT INTO t VALUES ('a\\'); DELETE FROM u; '')"));
+    fail_unless(!batchable("UPDATE t SET a=\"x"));
+} END_TEST
+
+/** @test Read-only transactions are recognized so they can skip two-phase commit */
+START_TEST (test_backend_query_readonly) {
+    fail_unless(backend_query_readonly("START TRANSACTION READ ONLY"));
+    fail_unless(backend_query_readonly("  start transaction with consistent snapshot, read only"));
+    fail_unless(!backend_query_readonly("START TRANSACTION"));
+    fail_unless(!backend_query_readonly("START TRANSACTION READ WRITE"));
+    fail_unless(!backend_query_readonly("BEGIN"));
+    fail_unless(!backend_query_readonly("SELECT * FROM t"));
+} END_TEST
+
+/** @test Transaction boundaries are recognized */
+START_TEST (test_backend_query_trans) {
+    my_bool commit;
+
+    fail_unless(backend_query_begins("BEGIN"));
+    fail_unless(backend_query_begins("  start transaction"));
+    fail_unless(!backend_query_begins("COMMIT"));
+
+    fail_unless(backend_query_ends("COMMIT", &commit) && commit);
+    fail_unless(backend_query_ends(" rollback", &commit) && !commit);
+    fail_unless(!backend_query_ends("ROLLBACK TO SAVEPOINT a", &commit));
+    fail_unless(!backend_query_ends("UPDATE t SET a=1", &commit));
+} END_TEST
+
+/** Statements each fake backend receives for a committed transaction */
+#define TRANS_WRITES "BEGIN;INSERT INTO t VALUES (1);"
+
+/** @test Statements in a transaction are committed once at COMMIT */
+START_TEST (test_backend_trans_commit) {
+    proxy_conn_idx_t conn_idx;
+    int bi, ti, first;
+
+    conn_idx.trans_ti = -1;
+    fail_unless(!fake_query(&conn_idx, "BEGIN", QUERY_MAP_ANY));
+    fail_unless(conn_idx.trans_ti >= 0);
+    ti = conn_idx.trans_ti;
+    first = conn_idx.trans_first;
+
+    fail_unless(!fake_query(&conn_idx, "INSERT INTO t VALUES (1)", QUERY_MAP_ALL));
+    fail_unless(!fake_query(&conn_idx, "SELECT a FROM t", QUERY_MAP_ANY));
+
+    /* Nothing holds off clones while the client is idle */
+    fail_unless(!committing && !querying);
+
+    fail_unless(!fake_query(&conn_idx, "COMMIT", QUERY_MAP_ALL));
+    fail_unless(client_errno == 0);
+    fail_unless(conn_idx.trans_ti < 0);
+    fail_unless(!committing && !querying);
+
+    /* Writes go everywhere, reads only to the first backend */
+    for (bi=0; bi<FAKE_BACKENDS; bi++)
+        fail_unless(!strcmp(fake_conns[bi][ti].log, bi == first
+            ? TRANS_WRITES "SELECT a FROM t;COMMIT;" : TRANS_WRITES "COMMIT;"));
+} END_TEST
+
+/** @test A transaction the client rolls back is rolled back everywhere */
+START_TEST (test_backend_trans_rollback) {
+    proxy_conn_idx_t conn_idx;
+    int bi, ti;
+
+    conn_idx.trans_ti = -1;
+    fail_unless(!fake_query(&conn_idx, "BEGIN", QUERY_MAP_ANY));
+    ti = conn_idx.trans_ti;
+    fail_unless(!fake_query(&conn_idx, "INSERT INTO t VALUES (1)", QUERY_MAP_ALL));
+    fail_unless(!fake_query(&conn_idx, "ROLLBACK", QUERY_MAP_ALL));
+
+    fail_unless(client_errno == 0);
+    fail_unless(conn_idx.trans_ti < 0);
+    for (bi=0; bi<FAKE_BACKENDS; bi++)
+        fail_unless(!strcmp(fake_conns[bi][ti].log, TRANS_WRITES "ROLLBACK;"));
+} END_TEST
+
+/** @test A write which fails on some backends can't be committed */
+START_TEST (test_backend_trans_partial) {
+    proxy_conn_idx_t conn_idx;
+    int bi, ti;
+
+    for (ti=0; ti<FAKE_THREADS; ti++)
+        fake_conns[1][ti].fail = "INSERT";
+
+    conn_idx.trans_ti = -1;
+    fail_unless(!fake_query(&conn_idx, "BEGIN", QUERY_MAP_ANY));
+    ti = conn_idx.trans_ti;
+    fail_unless(fake_query(&conn_idx, "INSERT INTO t VALUES (1)", QUERY_MAP_ALL));
+    fail_unless(!fake_query(&conn_idx, "COMMIT", QUERY_MAP_ALL));
+
+    fail_unless(client_errno == ER_ERROR_DURING_COMMIT);
+    for (bi=0; bi<FAKE_BACKENDS; bi++) {
+        fail_unless(fake_count(bi, ti, "COMMIT") == 0);
+        fail_unless(fake_count(bi, ti, "ROLLBACK") == 1);
+    }
+} END_TEST
+
+/**
+ * Take a clone snapshot as ::proxy_do_clone does, which
+ * must not wait for transactions which are not running
+ * a statement.
+ **/
+static void fake_clone() {
+    cloning = 1;
+    __sync_synchronize();
+    proxy_wait(WAIT_CLONE_COMMIT, !committing);
+
+    (void) __sync_fetch_and_add(&clone_generation, 1);
+    cloning = 0;
+    proxy_wait_wake();
+}
+
+/** @test A clone made during a transaction rolls it back */
+START_TEST (test_backend_trans_clone) {
+    proxy_conn_idx_t conn_idx;
+    int bi, ti;
+
+    conn_idx.trans_ti = -1;
+    fail_unless(!fake_query(&conn_idx, "BEGIN", QUERY_MAP_ANY));
+    ti = conn_idx.trans_ti;
+    fail_unless(!fake_query(&conn_idx, "INSERT INTO t VALUES (1)", QUERY_MAP_ALL));
+
+    /* The clone doesn't wait for the open transaction */
+    fake_clone();
+
+    /* The clone never saw the write, so the transaction can't go on */
+    fail_unless(!fake_query(&conn_idx, "INSERT INTO t VALUES (2)", QUERY_MAP_ALL));
+    fail_unless(client_errno == ER_LOCK_DEADLOCK);
+    fail_unless(conn_idx.trans_ti < 0);
+    fail_unless(!committing && !querying);
+
+    for (bi=0; bi<FAKE_BACKENDS; bi++)
+        fail_unless(!strcmp(fake_conns[bi][ti].log, TRANS_WRITES "ROLLBACK;"));
+
+    /* Later transactions see the new clone */
+    fail_unless(!fake_query(&conn_idx, "BEGIN", QUERY_MAP_ANY));
+    fail_unless(!fake_query(&conn_idx, "COMMIT", QUERY_MAP_ALL));
+    fail_unless(client_errno == 0);
+} END_TEST
+
+/** @test Asking to commit after backends change rolls back */
+START_TEST (test_backend_trans_changed) {
+    proxy_conn_idx_t conn_idx;
+    int bi, ti;
+
+    conn_idx.trans_ti = -1;
+    fail_unless(!fake_query(&conn_idx, "BEGIN", QUERY_MAP_ANY));
+    ti = conn_idx.trans_ti;
+    fail_unless(!fake_query(&conn_idx, "INSERT INTO t VALUES (1)", QUERY_MAP_ALL));
+
+    /* A backend was added or removed */
+    topo.version++;
+
+    fail_unless(!fake_query(&conn_idx, "COMMIT", QUERY_MAP_ALL));
+    fail_unless(client_errno == ER_LOCK_DEADLOCK);
+    fail_unless(conn_idx.trans_ti < 0);
+
+    for (bi=0; bi<FAKE_BACKENDS; bi++)
+        fail_unless(!strcmp(fake_conns[bi][ti].log, TRANS_WRITES "ROLLBACK;"));
+} END_TEST
+
+/** @test Read-only transactions run on one backend and refuse writes */
+START_TEST (test_backend_trans_readonly) {
+    proxy_conn_idx_t conn_idx;
+    int bi, ti, first;
+
+    conn_idx.trans_ti = -1;
+    fail_unless(!fake_query(&conn_idx, "START TRANSACTION READ ONLY", QUERY_MAP_ALL));
+    ti = conn_idx.trans_ti;
+    first = conn_idx.trans_first;
+    fail_unless(!fake_query(&conn_idx, "SELECT a FROM t", QUERY_MAP_ANY));
+
+    /* A write would only reach one backend */
+    fail_unless(fake_query(&conn_idx, "INSERT INTO t VALUES (1)", QUERY_MAP_ALL));
+    fail_unless(client_errno == ER_NOT_ALLOWED_COMMAND);
+
+    /* Clones don't disturb reads */
+    fake_clone();
+    fail_unless(!fake_query(&conn_idx, "SELECT b FROM t", QUERY_MAP_ANY));
+    fail_unless(!fake_query(&conn_idx, "COMMIT", QUERY_MAP_ALL));
+    fail_unless(client_errno == 0);
+    fail_unless(conn_idx.trans_ti < 0);
+    fail_unless(!committing && !querying);
+
+    for (bi=0; bi<FAKE_BACKENDS; bi++)
+        fail_unless(!strcmp(fake_conns[bi][ti].log, bi == first
+            ? "START TRANSACTION READ ONLY;SELECT a FROM t;SELECT b FROM t;COMMIT;" : ""));
+} END_TEST
+
+/** @test Result sets spanning several packets are read in full by a fan-out */
+START_TEST (test_backend_fanout_rows) {
+    static const char *rows[] = { "a", "bb", "ccc" };
+    status_t status;
+    int bi, ti, num;
+
+    for (bi=0; bi<FAKE_BACKENDS; bi++) {
+        for (ti=0; ti<FAKE_THREADS; ti++) {
+            fake_conns[bi][ti].rows = rows;
+            fake_conns[bi][ti].nrows = 3;
+        }
+    }
+
+    proxy_status_reset(&status);
+    fail_unless(backend_query_fanout(&fake_client, "SELECT a FROM t", 15, FALSE, 0, &num, &status) == 3);
+    fail_unless(num == FAKE_BACKENDS);
+
+    /* The client gets one result set: column count, field, EOF, rows and EOF */
+    fail_unless(client_packets == 7);
+    fail_unless(status.bytes_sent > 0);
+
+    /* Every packet was consumed, so the next reply isn't mistaken for a row */
+    for (bi=0; bi<FAKE_BACKENDS; bi++)
+        for (ti=0; ti<FAKE_THREADS; ti++)
+            fail_unless(fake_conns[bi][ti].read == fake_conns[bi][ti].write);
+
+    fail_unless(backend_query_fanout(&fake_client, "INSERT INTO t VALUES (1)", 24, FALSE, 0, &num, &status) == 3);
+    fail_unless(client_packets == 8);
+    fail_unless(!querying && !committing);
+} END_TEST
+
+/** @test A commit failing on one backend is reported to the client */
+START_TEST (test_backend_fanout_commit) {
+    status_t status;
+    int ti, num;
+
+    for (ti=0; ti<FAKE_THREADS; ti++)
+        fake_conns[1][ti].fail = "COMMIT";
+
+    options.two_pc = TRUE;
+    proxy_status_reset(&status);
+    fail_unless(backend_query_fanout(&fake_client, "INSERT INTO t VALUES (1)", 24, FALSE, 0, &num, &status) == 1);
+    options.two_pc = FALSE;
+
+    fail_unless(num == FAKE_BACKENDS);
+    fail_unless(client_errno == ER_ERROR_DURING_COMMIT);
+    fail_unless(!querying && !committing);
+} END_TEST
+
+/** Connections of the fake backends shared by client sessions */
+static proxy_backend_conn_t *pooled_conns[FAKE_BACKENDS][FAKE_THREADS];
+static proxy_backend_conn_t **pooled_conn_lists[FAKE_BACKENDS];
+static pool_t *pooled_pools[FAKE_BACKENDS];
+
+/**
+ * Give client sessions a pool of fake connections on each
+ * backend, which they only hold for the length of a transaction.
+ **/
+static void pooled_setup() {
+    int bi, ti;
+
+    fake_setup();
+    options.transaction_pool = TRUE;
+    options.autocommit = TRUE;
+
+    for (bi=0; bi<FAKE_BACKENDS; bi++) {
+        for (ti=0; ti<FAKE_THREADS; ti++)
+            pooled_conns[bi][ti] = &fake_backend_conns[bi][ti];
+        pooled_conn_lists[bi] = pooled_conns[bi];
+        pooled_pools[bi] = proxy_pool_new(FAKE_THREADS);
+    }
+    topo.conns = pooled_conn_lists;
+    topo.pools = pooled_pools;
+}
+
+/**
+ * Free the pools and the fake backends.
+ **/
+static void pooled_teardown() {
+    int bi;
+
+    for (bi=0; bi<FAKE_BACKENDS; bi++)
+        proxy_pool_destroy(pooled_pools[bi]);
+
+    fake_teardown();
+}
+
+/**
+ * Send a statement from a pooled client session through the proxy.
+ **/
+static my_bool pooled_query(proxy_conn_idx_t *conn_idx, const char *query) {
+    status_t status;
+
+    proxy_status_reset(&status);
+    client_errno = -1;
+
+    return backend_query_pooled(&topo, conn_idx, &fake_client, query, strlen(query), FALSE, 0, &status);
+}
+
+/**
+ * Get the fake backend a session is holding a connection to.
+ **/
+static fake_conn_t* pooled_fake(proxy_conn_idx_t *conn_idx) {
+    fail_unless(conn_idx->ci >= 0);
+    return (fake_conn_t*) topo.conns[conn_idx->bi][conn_idx->ci]->mysql;
+}
+
+/** @test A transaction keeps its pooled connection until it ends */
+START_TEST (test_backend_pool_trans) {
+    proxy_conn_idx_t a, b;
+    fake_conn_t *fake;
+    int bi;
+
+    proxy_backend_get_connection(&a, 0);
+    proxy_backend_get_connection(&b, 1);
+    fail_unless(a.ci < 0 && b.ci < 0);
+
+    /* The transaction holds its connection between statements */
+    fail_unless(!pooled_query(&a, "BEGIN"));
+    fake = pooled_fake(&a);
+    fail_unless(!pooled_query(&a, "UPDATE t SET x=1"));
+    fail_unless(pooled_fake(&a) == fake);
+
+    /* Other sessions can't use it meanwhile, and give theirs back */
+    fail_unless(!pooled_query(&b, "SELECT 1"));
+    fail_unless(b.ci < 0);
+    fail_unless(strstr(fake->log, "SELECT 1") == NULL);
+
+    /* The connection is released once the transaction ends */
+    fail_unless(!pooled_query(&a, "COMMIT"));
+    fail_unless(a.ci < 0);
+    fail_unless(!strcmp(fake->log, "BEGIN;UPDATE t SET x=1;COMMIT;"));
+
+    for (bi=0; bi<FAKE_BACKENDS; bi++) {
+        fail_unless(topo.pools[bi]->locked == 0);
+        fail_unless(topo.backends[bi]->sessions == 0);
+    }
+} END_TEST
+
+/** @test A transaction isn't moved off a removed backend */
+START_TEST (test_backend_pool_removed) {
+    char begin[] = "BEGIN", update[] = "UPDATE t SET x=1", select[] = "SELECT 1";
+    proxy_conn_idx_t a;
+    status_t status;
+
+    proxy_status_reset(&status);
+    proxy_backend_get_connection(&a, 0);
+    proxy_backend_query(&fake_client, &a, begin, strlen(begin), FALSE, 0, NULL, &status);
+    fail_unless(client_errno == -1 && a.in_trans);
+
+    /* The session's backend disappears from the topology */
+    a.host_id = ~0UL;
+    proxy_backend_query(&fake_client, &a, update, strlen(update), FALSE, 0, NULL, &status);
+    fail_unless(client_errno == ER_LOCK_DEADLOCK);
+    fail_unless(!a.in_trans);
+    fail_unless(strstr(pooled_fake(&a)->log, "UPDATE") == NULL);
+
+    /* Statements after the error run as usual */
+    client_errno = -1;
+    proxy_backend_query(&fake_client, &a, select, strlen(select), FALSE, 0, NULL, &status);
+    fail_unless(client_errno == -1);
+    fail_unless(a.ci < 0);
+} END_TEST
+
+/** Pooled connections of the fake backends */
+static proxy_backend_conn_t *quorum_conns[FAKE_BACKENDS][1];
+static proxy_backend_conn_t **quorum_conn_lists[FAKE_BACKENDS];
+static pool_t *quorum_pools[FAKE_BACKENDS];
+
+/**
+ * Start log appliers on the fake backends, which use the first
+ * backend thread connection, and give each backend one pooled
+ * connection on the second for sessions.
+ **/
+static void quorum_setup() {
+    int bi;
+
+    fake_setup();
+    options.write_quorum = 1;
+    options.stale_lag = 1;
+
+    proxy_mutex_init(&replog_lock);
+    proxy_cond_init(&replog_apply_cv);
+    proxy_cond_init(&replog_done_cv);
+
+    for (bi=0; bi<FAKE_BACKENDS; bi++) {
+        quorum_conns[bi][0] = &fake_backend_conns[bi][1];
+        quorum_conn_lists[bi] = quorum_conns[bi];
+        quorum_pools[bi] = proxy_pool_new(1);
+    }
+    topo.conns = quorum_conn_lists;
+    topo.pools = quorum_pools;
+
+    for (bi=0; bi<FAKE_BACKENDS; bi++)
+        backend_replog_start(bi);
+}
+
+/**
+ * Stop the log appliers and free the fake backends.
+ **/
+static void quorum_teardown() {
+    int bi;
+
+    proxy_mutex_lock(&replog_lock);
+    for (bi=0; bi<FAKE_BACKENDS; bi++)
+        fake_threads[bi][0].exit = 1;
+    proxy_cond_broadcast(&replog_apply_cv);
+    proxy_mutex_unlock(&replog_lock);
+
+    for (bi=0; bi<FAKE_BACKENDS; bi++) {
+        fake_release(&fake_conns[bi][0]);
+        pthread_join(fake_threads[bi][0].thread, NULL);
+        proxy_pool_destroy(quorum_pools[bi]);
+    }
+
+    fake_teardown();
+}
+
+/**
+ * Send a write from a client session through the log.
+ **/
+static my_bool quorum_write(proxy_conn_idx_t *conn_idx, const char *query) {
+    status_t status;
+
+    proxy_status_reset(&status);
+    client_errno = -1;
+
+    return backend_query_quorum(conn_idx, &fake_client, query, strlen(query), FALSE, 0, &status);
+}
+
+/**
+ * Wait for a backend to apply the log up to a given write.
+ **/
+static void quorum_wait(int bi, ulong seq) {
+    int i;
+
+    for (i=0; i<1000 && topo.backends[bi]->applied < seq; i++)
+        usleep(1000);
+    fail_unless(topo.backends[bi]->applied >= seq);
+}
+
+/** @test Writes are acknowledged once a quorum applies them */
+START_TEST (test_backend_quorum_ack) {
+    proxy_conn_idx_t conn_idx;
+
+    memset(&conn_idx, 0, sizeof(conn_idx));
+    fake_conns[1][0].slow = TRUE;
+
+    /* The client hears back before the slow backend answers */
+    fail_unless(!quorum_write(&conn_idx, "INSERT INTO t VALUES (1)"));
+    fail_unless(client_errno == 0);
+    fail_unless(conn_idx.write_seq == 1);
+    fail_unless(topo.backends[0]->applied == 1);
+    fail_unless(topo.backends[1]->applied == 0);
+
+    /* The slow backend catches up in the background */
+    fake_release(&fake_conns[1][0]);
+    quorum_wait(1, 1);
+    fail_unless(fake_count(1, 0, "INSERT INTO t VALUES (1)") == 1);
+    fail_unless(!committing && !querying);
+} END_TEST
+
+/** @test Sessions move off a lagging backend to read their writes */
+START_TEST (test_backend_quorum_lag) {
+    proxy_conn_idx_t conn_idx;
+
+    memset(&conn_idx, 0, sizeof(conn_idx));
+    conn_idx.session = 1;
+    backend_conn_assign(&topo, &conn_idx, 1, 0);
+    fake_conns[1][0].slow = TRUE;
+
+    fail_unless(!quorum_write(&conn_idx, "INSERT INTO t VALUES (1)"));
+    fail_unless(!topo.backends[1]->stale);
+
+    /* Reads can't be sent where the write isn't applied */
+    fail_unless(!backend_conn_fresh(&topo, &conn_idx));
+    fail_unless(conn_idx.bi == 0);
+    fail_unless(topo.backends[0]->sessions == 1 && topo.backends[1]->sessions == 0);
+
+    /* Falling too far behind keeps new sessions away */
+    fail_unless(!quorum_write(&conn_idx, "INSERT INTO t VALUES (2)"));
+    fail_unless(topo.backends[1]->stale);
+    fail_unless(backend_balance(&topo) == 0);
+
+    /* Reads return once the backend has caught up */
+    fake_release(&fake_conns[1][0]);
+    quorum_wait(1, 2);
+    usleep(10000);
+    fail_unless(!topo.backends[1]->stale);
+    fail_unless(!topo.backends[1]->diverged);
+} END_TEST
+
+/** @test Backends too far behind are given up on so the log stays bounded */
+START_TEST (test_backend_quorum_diverged) {
+    proxy_conn_idx_t conn_idx;
+    char query[32];
+    int i;
+
+    memset(&conn_idx, 0, sizeof(conn_idx));
+    fake_conns[1][0].slow = TRUE;
+
+    for (i=1; i<=REPLOG_MAX+2; i++) {
+        snprintf(query, sizeof(query), "INSERT INTO t VALUES (%d)", i);
+        fail_unless(!quorum_write(&conn_idx, query));
+        fail_unless(client_errno == 0);
+    }
+    fail_unless(topo.backends[1]->diverged && topo.backends[1]->stale);
+
+    /* Clones only wait for the write the hung backend holds */
+    quorum_wait(0, REPLOG_MAX+2);
+    fail_unless(committing == 1);
+
+    /* Only the write in progress is applied, and the rest of the log is freed */
+    fake_release(&fake_conns[1][0]);
+    quorum_wait(1, REPLOG_MAX+2);
+    fail_unless(fake_count(1, 0, "INSERT") == 1);
+
+    proxy_mutex_lock(&replog_lock);
+    fail_unless(replog_head == NULL);
+    proxy_mutex_unlock(&replog_lock);
+} END_TEST
+
+/** @test Clones are mapped to their backend index */
+START_TEST (test_backend_clone_map) {
+    fail_unless(backend_clone_index(&topo, 1) == -1);
+    fail_unless(backend_clone_map(&topo, 0, 0));
+
+    fail_unless(!backend_clone_map(&topo, 3, 1));
+    fail_unless(!backend_clone_map(&topo, 40, 2));
+    fail_unless(backend_clone_index(&topo, 3) == 1);
+    fail_unless(backend_clone_index(&topo, 40) == 2);
+    fail_unless(backend_clone_index(&topo, 4) == -1);
+    fail_unless(backend_clone_index(&topo, 41) == -1);
+
+    free(topo.clones);
+    topo.clones = NULL;
+    topo.clones_size = 0;
+} END_TEST
+
+/** @test Transaction IDs survive the COM_PROXY_QUERY header */
 START_TEST (test_backend_valid_id) {
-    fail_unless(id_from_query("SELECT 1; -- 123456") == 123456);
+    char packet[TRANS_ID_SIZE + 9], *pos = packet;
+    ulong length = sizeof(packet), id = 0;
+
+    proxy_net_store_id((uchar*) packet, 123456);
+    memcpy(packet + TRANS_ID_SIZE, "SELECT 1;", 9);
+
+    fail_unless(!proxy_net_read_id(&pos, &length, &id));
+    fail_unless(id == 123456);
+    fail_unless(length == 9);
+    fail_unless(pos == packet + TRANS_ID_SIZE);
 } END_TEST
 
-/** @test Correct parsing of invaldi IDs */
-START_TEST (test_backend_invalid_id) {
-    fail_unless(id_from_query("SELECT 1; -- asdf") == 0);
+/** @test Large IDs are not truncated */
+START_TEST (test_backend_large_id) {
+    uchar packet[TRANS_ID_SIZE];
+    char *pos = (char*) packet;
+    ulong length = TRANS_ID_SIZE, id = 0;
+
+    proxy_net_store_id(packet, ULONG_MAX);
+
+    fail_unless(!proxy_net_read_id(&pos, &length, &id));
+    fail_unless(id == ULONG_MAX);
+    fail_unless(length == 0);
 } END_TEST
 
-/** @test Error returned when no ID specified */
+/** @test Error returned when the header is truncated */
 START_TEST (test_backend_no_id) {
-    fail_unless(id_from_query("SELECT 1;") == 0);
+    char packet[TRANS_ID_SIZE], *pos = packet;
+    ulong length = TRANS_ID_SIZE - 1, id = 0;
+
+    fail_unless(proxy_net_read_id(&pos, &length, &id));
+    fail_unless(pos == packet);
+    fail_unless(length == TRANS_ID_SIZE - 1);
 } END_TEST
 
 Suite *backend_suite(void) {
@@ -164,11 +1184,58 @@ Suite *backend_suite(void) {
     tcase_add_test(tc_file, test_backend_read_empty_file);
     tcase_add_test(tc_file, test_backend_read_file);
     tcase_add_test(tc_file, test_backend_read_file_noport);
+    tcase_add_test(tc_file, test_backend_read_file_weights);
     suite_add_tcase(s, tc_file);
 
-    TCase *tc_id = tcase_create("Transaction ID parsing");
+    TCase *tc_balance = tcase_create("Balancing");
+    tcase_add_test(tc_balance, test_backend_balance_wrr);
+    tcase_add_test(tc_balance, test_backend_balance_least);
+    tcase_add_test(tc_balance, test_backend_balance_ramp);
+    suite_add_tcase(s, tc_balance);
+
+    TCase *tc_state = tcase_create("Session state");
+    tcase_add_test(tc_state, test_backend_query_stateless);
+    tcase_add_test(tc_state, test_backend_query_pins);
+    tcase_add_test(tc_state, test_backend_query_batchable);
+    tcase_add_test(tc_state, test_backend_query_batchable_single);
+    tcase_add_test(tc_state, test_backend_query_readonly);
+    tcase_add_test(tc_state, test_backend_query_trans);
+    tcase_add_test(tc_state, test_backend_clone_map);
+    tcase_add_test(tc_state, test_backend_conn_lost);
+    suite_add_tcase(s, tc_state);
+
+    TCase *tc_trans = tcase_create("Transactions");
+    tcase_add_checked_fixture(tc_trans, fake_setup, fake_teardown);
+    tcase_add_test(tc_trans, test_backend_trans_commit);
+    tcase_add_test(tc_trans, test_backend_trans_rollback);
+    tcase_add_test(tc_trans, test_backend_trans_partial);
+    tcase_add_test(tc_trans, test_backend_trans_clone);
+    tcase_add_test(tc_trans, test_backend_trans_changed);
+    tcase_add_test(tc_trans, test_backend_trans_readonly);
+    suite_add_tcase(s, tc_trans);
+
+    TCase *tc_fanout = tcase_create("Fan-out");
+    tcase_add_checked_fixture(tc_fanout, fake_setup, fake_teardown);
+    tcase_add_test(tc_fanout, test_backend_fanout_rows);
+    tcase_add_test(tc_fanout, test_backend_fanout_commit);
+    suite_add_tcase(s, tc_fanout);
+
+    TCase *tc_pool = tcase_create("Transaction pooling");
+    tcase_add_checked_fixture(tc_pool, pooled_setup, pooled_teardown);
+    tcase_add_test(tc_pool, test_backend_pool_trans);
+    tcase_add_test(tc_pool, test_backend_pool_removed);
+    suite_add_tcase(s, tc_pool);
+
+    TCase *tc_quorum = tcase_create("Write quorum");
+    tcase_add_checked_fixture(tc_quorum, quorum_setup, quorum_teardown);
+    tcase_add_test(tc_quorum, test_backend_quorum_ack);
+    tcase_add_test(tc_quorum, test_backend_quorum_lag);
+    tcase_add_test(tc_quorum, test_backend_quorum_diverged);
+    suite_add_tcase(s, tc_quorum);
+
+    TCase *tc_id = tcase_create("Transaction ID header");
     tcase_add_test(tc_id, test_backend_valid_id);
-    tcase_add_test(tc_id, test_backend_invalid_id);
+    tcase_add_test(tc_id, test_backend_large_id);
     tcase_add_test(tc_id, test_backend_no_id);
     suite_add_tcase(s, tc_id);
 
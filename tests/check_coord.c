@@ -0,0 +1,182 @@
+/******************************************************************************
+ * check_coord.c
+ *
+ * Coordinator channel tests
+ *
+ * Copyright (c) 2010, Michael Mior <mmior@cs.toronto.edu>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+ * Place - Suite 330, Boston, MA 02111-1307 USA.
+ *
+ */
+
+#include "../src/proxy_coord.c"
+
+#include <check.h>
+
+/* Externs */
+volatile sig_atomic_t server_id;
+
+/* Results passed on by the channel */
+static int results, result_clone;
+static ulong result_ids[COORD_BATCH];
+static my_bool result_success[COORD_BATCH];
+static my_bool sent_error;
+
+/* Dummy threading functions */
+void proxy_threading_mask() {}
+void proxy_threading_name(__attribute__((unused)) char *name) {}
+
+/* Dummy network functions */
+my_bool proxy_net_send_ok(
+        __attribute__((unused)) MYSQL *mysql,
+        __attribute__((unused)) uint warnings,
+        __attribute__((unused)) ulong affected_rows,
+        __attribute__((unused)) ulonglong last_insert_id) { return FALSE; }
+my_bool proxy_net_send_error(
+        __attribute__((unused)) MYSQL *mysql,
+        __attribute__((unused)) int sql_errno,
+        __attribute__((unused)) const char *err) { sent_error = TRUE; return FALSE; }
+
+/* Record results instead of completing transactions */
+void proxy_cmd_trans_result(int clone_id, ulong transaction_id, my_bool success) {
+    result_clone = clone_id;
+    result_ids[results] = transaction_id;
+    result_success[results] = success;
+    results++;
+}
+
+/** Fixture to set up the channel without starting senders. */
+static void setup() {
+    options.coordinator = TRUE;
+    options.cloneable = FALSE;
+    results = 0;
+    sent_error = FALSE;
+    proxy_trans_init();
+    proxy_coord_init();
+}
+
+/** Fixture to stop the channel after tests. */
+static void teardown() {
+    proxy_coord_end();
+    proxy_trans_end();
+}
+
+/** @test Results are read back as they were stored */
+START_TEST (test_coord_store_load) {
+    uchar buff[COORD_HEADER + 2 * COORD_ENTRY];
+    my_bool success;
+    ulong id;
+
+    coord_store(buff, 0, 42, TRUE);
+    coord_store(buff, 1, 1UL << 40, FALSE);
+
+    coord_load(buff, 0, &id, &success);
+    fail_unless(id == 42 && success);
+    coord_load(buff, 1, &id, &success);
+    fail_unless(id == 1UL << 40 && !success);
+} END_TEST
+
+/** @test Transactions are queued in order */
+START_TEST (test_coord_send_order) {
+    proxy_trans_t *trans1 = proxy_trans_new(), *trans2 = proxy_trans_new();
+
+    proxy_coord_send(1, trans1);
+    proxy_coord_send(2, trans2);
+
+    fail_unless(coord_head == trans1);
+    fail_unless(trans1->next == trans2);
+    fail_unless(coord_tail == trans2);
+    fail_unless(trans1->id == 1 && trans2->id == 2);
+
+    coord_head = coord_tail = NULL;
+    proxy_trans_free(trans1);
+    proxy_trans_free(trans2);
+} END_TEST
+
+/** @test Each result in a batch is passed on */
+START_TEST (test_coord_recv) {
+    uchar buff[COORD_HEADER + 3 * COORD_ENTRY];
+
+    int4store(buff, 7);
+    int2store(buff + 4, 3);
+    coord_store(buff, 0, 10, TRUE);
+    coord_store(buff, 1, 11, FALSE);
+    coord_store(buff, 2, 12, TRUE);
+
+    fail_unless(!proxy_coord_recv(NULL, buff, sizeof(buff), NULL));
+    fail_unless(!sent_error);
+    fail_unless(results == 3);
+    fail_unless(result_clone == 7);
+    fail_unless(result_ids[0] == 10 && result_success[0]);
+    fail_unless(result_ids[1] == 11 && !result_success[1]);
+    fail_unless(result_ids[2] == 12 && result_success[2]);
+} END_TEST
+
+/** @test Batches with the wrong length are rejected */
+START_TEST (test_coord_recv_invalid) {
+    uchar buff[COORD_HEADER + 2 * COORD_ENTRY];
+
+    int4store(buff, 7);
+    int2store(buff + 4, 3);
+    coord_store(buff, 0, 10, TRUE);
+    coord_store(buff, 1, 11, TRUE);
+
+    proxy_coord_recv(NULL, buff, sizeof(buff), NULL);
+    fail_unless(sent_error);
+    fail_unless(results == 0);
+
+    sent_error = FALSE;
+    proxy_coord_recv(NULL, buff, COORD_HEADER - 1, NULL);
+    fail_unless(sent_error);
+} END_TEST
+
+/** @test Transactions in a batch which can't be sent roll back */
+START_TEST (test_coord_rollback) {
+    uchar buff[COORD_HEADER + COORD_ENTRY];
+    proxy_trans_t *trans = proxy_trans_new();
+
+    trans->success = TRUE;
+    proxy_trans_insert(5, trans);
+    coord_store(buff, 0, 5, TRUE);
+
+    coord_rollback(buff, 1);
+    fail_unless(trans->num == 1);
+    fail_unless(!trans->success);
+} END_TEST
+
+Suite *coord_suite(void) {
+    Suite *s = suite_create("Coordinator");
+
+    TCase *tc_batch = tcase_create("Batches");
+    tcase_add_checked_fixture(tc_batch, setup, teardown);
+    tcase_add_test(tc_batch, test_coord_store_load);
+    tcase_add_test(tc_batch, test_coord_send_order);
+    tcase_add_test(tc_batch, test_coord_recv);
+    tcase_add_test(tc_batch, test_coord_recv_invalid);
+    tcase_add_test(tc_batch, test_coord_rollback);
+    suite_add_tcase(s, tc_batch);
+
+    return s;
+}
+
+int main(void) {
+    int failed;
+    Suite *s = coord_suite();
+    SRunner *sr = srunner_create(s);
+
+    srunner_run_all(sr, CK_ENV);
+    failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return (failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,175 @@
+/******************************************************************************
+ * check_epoch.c
+ *
+ * Clone write log tests
+ *
+ * Copyright (c) 2010, Michael Mior <mmior@cs.toronto.edu>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+ * Place - Suite 330, Boston, MA 02111-1307 USA.
+ *
+ */
+
+#include "../src/proxy_epoch.c"
+
+#include <check.h>
+
+/** Set once the writer thread has entered */
+static volatile int writer_entered;
+
+/** Write started while writes are stopped */
+static void* epoch_writer(__attribute__((unused)) void *ptr) {
+    proxy_epoch_enter();
+    writer_entered = 1;
+    proxy_epoch_leave();
+
+    return NULL;
+}
+
+/** Fixture to set up the log. */
+static void setup() {
+    writer_entered = 0;
+    proxy_epoch_init();
+}
+
+/** Fixture to free the log after tests. */
+static void teardown() {
+    proxy_epoch_end();
+}
+
+/** Log a write and record its outcome */
+static void epoch_log(int gen, const char *query, proxy_epoch_state_t state) {
+    proxy_epoch_entry_t *entry;
+
+    fail_unless(!proxy_epoch_reserve(gen, query, strlen(query), &entry));
+    proxy_epoch_finish(gen, entry, state);
+}
+
+/** @test Writes are read back in the order they were logged */
+START_TEST (test_epoch_order) {
+    proxy_epoch_entry_t *entry;
+    int gen;
+
+    proxy_epoch_open(3);
+    gen = proxy_epoch_enter();
+    fail_unless(gen == 3);
+
+    epoch_log(gen, "INSERT 1", EPOCH_APPLIED);
+    epoch_log(gen, "INSERT 2", EPOCH_APPLIED);
+    proxy_epoch_leave();
+    fail_unless(proxy_epoch_size() == 2);
+
+    entry = proxy_epoch_next(NULL);
+    fail_unless(entry && !memcmp(entry->query, "INSERT 1", 8));
+    entry = proxy_epoch_next(entry);
+    fail_unless(entry && !memcmp(entry->query, "INSERT 2", 8));
+    fail_unless(proxy_epoch_next(entry) == NULL);
+} END_TEST
+
+/** @test Writes keep the order they were sent in, not the order they finished */
+START_TEST (test_epoch_reserve) {
+    proxy_epoch_entry_t *first, *second, *entry;
+
+    proxy_epoch_open(1);
+    fail_unless(!proxy_epoch_reserve(1, "INSERT 1", 8, &first));
+    fail_unless(!proxy_epoch_reserve(1, "INSERT 2", 8, &second));
+    fail_unless(first && second);
+
+    /* Entries are pending until they finish */
+    entry = proxy_epoch_next(NULL);
+    fail_unless(entry == first && entry->state == EPOCH_PENDING);
+
+    proxy_epoch_finish(1, second, EPOCH_APPLIED);
+    proxy_epoch_finish(1, first, EPOCH_PARTIAL);
+
+    fail_unless(entry->state == EPOCH_PARTIAL);
+    entry = proxy_epoch_next(entry);
+    fail_unless(entry == second && entry->state == EPOCH_APPLIED);
+} END_TEST
+
+/** @test Writes are not logged when no log is open */
+START_TEST (test_epoch_not_open) {
+    proxy_epoch_entry_t *entry;
+    int gen = proxy_epoch_enter();
+
+    fail_unless(gen == 0);
+    fail_unless(!proxy_epoch_reserve(gen, "INSERT 1", 8, &entry));
+    fail_unless(entry == NULL);
+    proxy_epoch_finish(gen, entry, EPOCH_APPLIED);
+    proxy_epoch_leave();
+
+    fail_unless(proxy_epoch_size() == 0);
+    fail_unless(proxy_epoch_next(NULL) == NULL);
+} END_TEST
+
+/** @test Writes from an older generation are dropped */
+START_TEST (test_epoch_generation) {
+    proxy_epoch_open(1);
+    proxy_epoch_close();
+    proxy_epoch_open(2);
+
+    epoch_log(1, "INSERT 1", EPOCH_APPLIED);
+    fail_unless(proxy_epoch_size() == 0);
+} END_TEST
+
+/** @test Closing the log frees writes and stops logging */
+START_TEST (test_epoch_close) {
+    proxy_epoch_open(1);
+    epoch_log(1, "INSERT 1", EPOCH_APPLIED);
+    proxy_epoch_close();
+
+    fail_unless(proxy_epoch_current() == 0);
+    fail_unless(proxy_epoch_size() == 0);
+    fail_unless(proxy_epoch_next(NULL) == NULL);
+} END_TEST
+
+/** @test Writes wait while stopped and continue once resumed */
+START_TEST (test_epoch_stop) {
+    pthread_t thread;
+
+    proxy_epoch_stop();
+    pthread_create(&thread, NULL, epoch_writer, NULL);
+    usleep(10000);
+    fail_unless(!writer_entered);
+
+    proxy_epoch_resume();
+    pthread_join(thread, NULL);
+    fail_unless(writer_entered);
+} END_TEST
+
+Suite *epoch_suite(void) {
+    Suite *s = suite_create("Epoch");
+
+    TCase *tc_log = tcase_create("Log");
+    tcase_add_checked_fixture(tc_log, setup, teardown);
+    tcase_add_test(tc_log, test_epoch_order);
+    tcase_add_test(tc_log, test_epoch_reserve);
+    tcase_add_test(tc_log, test_epoch_not_open);
+    tcase_add_test(tc_log, test_epoch_generation);
+    tcase_add_test(tc_log, test_epoch_close);
+    tcase_add_test(tc_log, test_epoch_stop);
+    suite_add_tcase(s, tc_log);
+
+    return s;
+}
+
+int main(void) {
+    int failed;
+    Suite *s = epoch_suite();
+    SRunner *sr = srunner_create(s);
+
+    srunner_run_all(sr, CK_ENV);
+    failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return (failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
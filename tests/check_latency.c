@@ -0,0 +1,129 @@
+/******************************************************************************
+ * check_latency.c
+ *
+ * Latency histogram tests
+ *
+ * Copyright (c) 2010, Michael Mior <mmior@cs.toronto.edu>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+ * Place - Suite 330, Boston, MA 02111-1307 USA.
+ *
+ */
+
+#include "../src/proxy_latency.c"
+
+#include <check.h>
+
+static latency_hist_t hist;
+
+static void setup() {
+    memset(&hist, 0, sizeof(hist));
+}
+
+/** @test Small latencies are kept exactly */
+START_TEST (test_latency_exact) {
+    long usec;
+
+    for (usec=0; usec<2*LATENCY_SUB; usec++)
+        fail_unless(latency_value(latency_bucket(usec)) == usec);
+} END_TEST
+
+/** @test Larger latencies are kept to within a bucket width */
+START_TEST (test_latency_buckets) {
+    int bucket, last = 0;
+    long usec, value;
+
+    for (usec=1; usec < (1L << LATENCY_MAX_BITS); usec += usec / 7 + 1) {
+        bucket = latency_bucket(usec);
+        value = latency_value(bucket);
+
+        fail_unless(bucket >= last);
+        fail_unless(value >= usec);
+        fail_unless(value - usec <= usec / LATENCY_SUB);
+        last = bucket;
+    }
+
+    fail_unless(latency_bucket(1L << LATENCY_MAX_BITS) == LATENCY_BUCKETS - 1);
+    fail_unless(latency_bucket((1L << LATENCY_MAX_BITS) - 1) == LATENCY_BUCKETS - 1);
+} END_TEST
+
+/** @test Percentiles fall within a bucket of the true values */
+START_TEST (test_latency_percentile) {
+    long usec;
+
+    fail_unless(proxy_latency_percentile(&hist, 50) == 0);
+
+    for (usec=1; usec<=1000; usec++)
+        proxy_latency_add(&hist, usec);
+
+    fail_unless(hist.count == 1000);
+    fail_unless(hist.max == 1000);
+    fail_unless(hist.usec == 500500);
+
+    usec = proxy_latency_percentile(&hist, 50);
+    fail_unless(usec >= 500 && usec <= 500 + 500 / LATENCY_SUB);
+    usec = proxy_latency_percentile(&hist, 99);
+    fail_unless(usec >= 990 && usec <= 1000);
+    fail_unless(proxy_latency_percentile(&hist, 100) == 1000);
+} END_TEST
+
+/** @test A single slow sample shows in the tail only */
+START_TEST (test_latency_tail) {
+    int i;
+
+    for (i=0; i<999; i++)
+        proxy_latency_add(&hist, 100);
+    proxy_latency_add(&hist, 1000000);
+
+    /* Percentiles report the top of the bucket */
+    fail_unless(proxy_latency_percentile(&hist, 99) == latency_value(latency_bucket(100)));
+    fail_unless(proxy_latency_percentile(&hist, 99.9) == latency_value(latency_bucket(100)));
+    fail_unless(proxy_latency_percentile(&hist, 99.99) == 1000000);
+} END_TEST
+
+/** @test Samples from a clock stepped back count as zero */
+START_TEST (test_latency_negative) {
+    proxy_latency_add(&hist, -5000);
+    proxy_latency_add(&hist, 100);
+
+    fail_unless(hist.count == 2);
+    fail_unless(hist.usec == 100);
+    fail_unless(hist.counts[0] == 1);
+    fail_unless(proxy_latency_percentile(&hist, 50) == 0);
+} END_TEST
+
+Suite *latency_suite(void) {
+    Suite *s = suite_create("Latency");
+
+    TCase *tc_hist = tcase_create("Histogram");
+    tcase_add_checked_fixture(tc_hist, setup, NULL);
+    tcase_add_test(tc_hist, test_latency_exact);
+    tcase_add_test(tc_hist, test_latency_buckets);
+    tcase_add_test(tc_hist, test_latency_percentile);
+    tcase_add_test(tc_hist, test_latency_tail);
+    tcase_add_test(tc_hist, test_latency_negative);
+    suite_add_tcase(s, tc_hist);
+
+    return s;
+}
+
+int main(void) {
+    int failed;
+    Suite *s = latency_suite();
+    SRunner *sr = srunner_create(s);
+
+    srunner_run_all(sr, CK_ENV);
+    failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return (failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,210 @@
+/******************************************************************************
+ * check_monitor.c
+ *
+ * Autoscaling tests
+ *
+ * Copyright (c) 2010, Michael Mior <mmior@cs.toronto.edu>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+ * Place - Suite 330, Boston, MA 02111-1307 USA.
+ *
+ */
+
+#include "../src/proxy_monitor.c"
+
+#include <check.h>
+
+/* Externs */
+volatile sig_atomic_t run = 0;
+
+/** Number of clients waiting to be reported by the admission stub */
+static long queue_depth;
+/** Number of clones added and removed by the command stubs */
+static volatile int clones_added, clones_removed;
+
+/* Dummy threading functions */
+void __wrap_proxy_threading_name(__attribute__((unused)) char *name) {}
+
+/* Dummy backend and admission functions */
+int proxy_backend_load(ulong *queries, long *latency, int *clone) {
+    *queries = 0;
+    *latency = 0;
+    *clone = 2;
+    return 2;
+}
+void proxy_admit_stats(admit_stats_t *stats) {
+    stats->depth = queue_depth;
+}
+
+/* Dummy statistics functions */
+void proxy_stats_sample() {}
+void proxy_stats_total(status_t *total) {
+    proxy_status_reset(total);
+}
+
+/* Dummy cloning functions */
+int proxy_cmd_clone(
+        __attribute__((unused)) int nclones,
+        __attribute__((unused)) char *err,
+        __attribute__((unused)) int errlen) {
+    clones_added++;
+    return 0;
+}
+my_bool proxy_cmd_remove(__attribute__((unused)) int clone_id) {
+    clones_removed++;
+    return FALSE;
+}
+
+/** Fixture to reset the autoscaler with a single rule. */
+static void setup() {
+    options.scale_rules[0].metric = SCALE_QPS;
+    options.scale_rules[0].out = 100;
+    options.scale_rules[0].in = 10;
+    options.scale_rules_num = 1;
+    options.scale_cooldown = 30;
+    options.scale_max = 4;
+    options.scale_dry_run = FALSE;
+
+    scale_high = scale_low = 0;
+    scale_last = 0;
+    scale_time.tv_sec = 0;
+    queue_depth = 0;
+    clones_added = clones_removed = 0;
+}
+
+/** Sample with the given total QPS on two backends */
+static proxy_scale_sample_t sample_qps(long qps) {
+    proxy_scale_sample_t sample = { qps, 1000, 0, 2, 2 };
+    return sample;
+}
+
+/** @test Clones are added once load stays high */
+START_TEST (test_monitor_scale_out) {
+    proxy_scale_sample_t high = sample_qps(400), low = sample_qps(100);
+    int i;
+
+    for (i=1; i<SCALE_OUT_SAMPLES; i++)
+        fail_unless(monitor_scale_decide(&high, 100) == 0);
+
+    /* A dip starts the count over */
+    fail_unless(monitor_scale_decide(&low, 100) == 0);
+    for (i=1; i<SCALE_OUT_SAMPLES; i++)
+        fail_unless(monitor_scale_decide(&high, 100) == 0);
+    fail_unless(monitor_scale_decide(&high, 100) == 1);
+} END_TEST
+
+/** @test Clones are removed once load stays low, only if there are any */
+START_TEST (test_monitor_scale_in) {
+    proxy_scale_sample_t low = sample_qps(10);
+    int i;
+
+    for (i=1; i<SCALE_IN_SAMPLES; i++)
+        fail_unless(monitor_scale_decide(&low, 100) == 0);
+    fail_unless(monitor_scale_decide(&low, 100) == -1);
+
+    low.clone = 0;
+    fail_unless(monitor_scale_decide(&low, 100) == 0);
+} END_TEST
+
+/** @test Any rule can add clones but all must agree to remove them */
+START_TEST (test_monitor_scale_rules) {
+    proxy_scale_sample_t sample = sample_qps(10);
+    int i;
+
+    options.scale_rules[1].metric = SCALE_LATENCY;
+    options.scale_rules[1].out = 5000;
+    options.scale_rules[1].in = 500;
+    options.scale_rules_num = 2;
+
+    /* Throughput is low but latency is in between */
+    for (i=0; i<SCALE_IN_SAMPLES; i++)
+        fail_unless(monitor_scale_decide(&sample, 100) == 0);
+
+    sample.latency = 10000;
+    for (i=1; i<SCALE_OUT_SAMPLES; i++)
+        fail_unless(monitor_scale_decide(&sample, 100) == 0);
+    fail_unless(monitor_scale_decide(&sample, 100) == 1);
+} END_TEST
+
+/** @test No action is taken during the cooldown or past the maximum */
+START_TEST (test_monitor_scale_limits) {
+    proxy_scale_sample_t high = sample_qps(400);
+    int i;
+
+    scale_last = 100;
+    for (i=0; i<SCALE_OUT_SAMPLES; i++)
+        fail_unless(monitor_scale_decide(&high, 110) == 0);
+    fail_unless(monitor_scale_decide(&high, 130) == 1);
+
+    high.backends = options.scale_max;
+    fail_unless(monitor_scale_decide(&high, 130) == 0);
+} END_TEST
+
+/** @test Decisions are only logged in dry-run mode */
+START_TEST (test_monitor_scale_dry_run) {
+    int i;
+
+    options.scale_rules[0].metric = SCALE_QUEUE;
+    options.scale_dry_run = TRUE;
+    queue_depth = 500;
+
+    /* The first sample only sets the baseline */
+    for (i=0; i<=SCALE_OUT_SAMPLES; i++)
+        monitor_scale();
+
+    fail_unless(scale_last != 0);
+    fail_unless(!scaling);
+    fail_unless(clones_added == 0);
+} END_TEST
+
+/** @test Clones are added from a separate thread */
+START_TEST (test_monitor_scale_thread) {
+    int i;
+
+    options.scale_rules[0].metric = SCALE_QUEUE;
+    queue_depth = 500;
+
+    for (i=0; i<=SCALE_OUT_SAMPLES; i++)
+        monitor_scale();
+
+    while (scaling) { usleep(SYNC_SLEEP); }
+    fail_unless(clones_added == 1);
+    fail_unless(clones_removed == 0);
+} END_TEST
+
+Suite *monitor_suite(void) {
+    Suite *s = suite_create("Monitor");
+
+    TCase *tc_scale = tcase_create("Autoscaling");
+    tcase_add_checked_fixture(tc_scale, setup, NULL);
+    tcase_add_test(tc_scale, test_monitor_scale_out);
+    tcase_add_test(tc_scale, test_monitor_scale_in);
+    tcase_add_test(tc_scale, test_monitor_scale_rules);
+    tcase_add_test(tc_scale, test_monitor_scale_limits);
+    tcase_add_test(tc_scale, test_monitor_scale_dry_run);
+    tcase_add_test(tc_scale, test_monitor_scale_thread);
+    suite_add_tcase(s, tc_scale);
+
+    return s;
+}
+
+int main(void) {
+    int failed;
+    Suite *s = monitor_suite();
+    SRunner *sr = srunner_create(s);
+
+    srunner_run_all(sr, CK_ENV);
+    failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return (failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -37,10 +37,25 @@
 #define TEST_PROXY_HOST      "127.0.0.3"
 #define TEST_PROXY_PORT      "3040"
 #define TEST_ADMIN_PORT      "3041"
+#define TEST_COORD_CONNS     "4"
 #define TEST_MAPPER          "dummy"
 #define TEST_CLIENT_THREADS  "5"
 #define TEST_CLIENT_TIMEOUT  "600"
 #define TEST_BACKEND_THREADS "5"
+#define TEST_EVENT_THREADS   "2"
+#define TEST_ACCEPTORS       "2"
+#define TEST_BACKLOG         "128"
+#define TEST_QUEUE_DEPTH     "50"
+#define TEST_QUEUE_WAIT      "200"
+#define TEST_BALANCE         "p2c"
+#define TEST_WRITE_QUORUM    "2"
+#define TEST_STALE_LAG       "50"
+#define TEST_BATCH_WRITES    "16"
+#define TEST_BATCH_WAIT      "100"
+#define TEST_CONNECT_THREADS "4"
+#define TEST_CONNECT_TIMEOUT "2"
+#define TEST_CONNECT_RETRIES "1"
+#define TEST_RAMP_TIME       "30"
 
 /** @test Confirm that testing options are not the same as defaults */
 START_TEST (test_options_test) {
@@ -54,10 +69,20 @@ START_TEST (test_options_test) {
     fail_unless(TEST_PROXY_HOST != NULL);
     fail_unless(atoi(TEST_PROXY_PORT) != PROXY_PORT);
     fail_unless(atoi(TEST_ADMIN_PORT) != ADMIN_PORT);
+    fail_unless(atoi(TEST_COORD_CONNS) != COORD_CONNS);
     fail_unless(atoi(TEST_CLIENT_TIMEOUT) != CLIENT_TIMEOUT);
     fail_unless(TEST_MAPPER != NULL);
     fail_unless(atoi(TEST_CLIENT_THREADS) != CLIENT_THREADS);
     fail_unless(atoi(TEST_BACKEND_THREADS) != BACKEND_THREADS);
+    fail_unless(atoi(TEST_EVENT_THREADS) != EVENT_THREADS);
+    fail_unless(atoi(TEST_ACCEPTORS) != ACCEPTORS);
+    fail_unless(atoi(TEST_BACKLOG) != QUEUE_LENGTH);
+    fail_unless(atoi(TEST_QUEUE_WAIT) != QUEUE_WAIT);
+    fail_unless(atoi(TEST_STALE_LAG) != STALE_LAG);
+    fail_unless(atoi(TEST_BATCH_WAIT) != BATCH_WAIT);
+    fail_unless(atoi(TEST_CONNECT_THREADS) != CONNECT_THREADS);
+    fail_unless(atoi(TEST_CONNECT_TIMEOUT) != CONNECT_TIMEOUT);
+    fail_unless(atoi(TEST_CONNECT_RETRIES) != CONNECT_RETRIES);
 } END_TEST
 
 /** @test Short option parsing */
@@ -70,10 +95,22 @@ START_TEST (test_options_short) {
         "-q" TEST_STAT_FILE,
         "-A" TEST_ADMIN_PORT,
         "-w",
+        "-G" TEST_COORD_CONNS,
         "-h" TEST_HOST,
         "-P" TEST_PORT,
         "-y" TEST_BYPASS_PORT,
         "-n" TEST_CLIENT_TIMEOUT,
+        "-S" TEST_ACCEPTORS,
+        "-B" TEST_BACKLOG,
+        "-Q" TEST_QUEUE_DEPTH,
+        "-W" TEST_QUEUE_WAIT,
+        "-g" TEST_BALANCE,
+        "-l" TEST_STALE_LAG,
+        "-K" TEST_CONNECT_THREADS,
+        "-H" TEST_CONNECT_TIMEOUT,
+        "-U" TEST_CONNECT_RETRIES,
+        "-E" TESTS_DIR "backend/backends.txt",
+        "-V" TEST_RAMP_TIME,
         "-D" TEST_DB,
         "-u" TEST_USER,
         "-p" TEST_PASS,
@@ -83,7 +120,8 @@ START_TEST (test_options_short) {
         "-b" TEST_PROXY_HOST,
         "-L" TEST_PROXY_PORT,
         "-m" TEST_MAPPER,
-        "-t" TEST_CLIENT_THREADS };
+        "-t" TEST_CLIENT_THREADS,
+        "-e" TEST_EVENT_THREADS };
 
     fail_unless(proxy_options_parse(sizeof(argv)/sizeof(*argv), argv) == EXIT_SUCCESS);
 
@@ -94,6 +132,7 @@ START_TEST (test_options_short) {
     fail_unless(strcmp(options.stat_file, TEST_STAT_FILE) == 0);
     fail_unless(options.admin_port == atoi(TEST_ADMIN_PORT));
     fail_unless(options.query_wait);
+    fail_unless(options.coord_conns == atoi(TEST_COORD_CONNS));
     fail_unless(strcmp(options.backend.host, TEST_HOST) == 0);
     fail_unless(options.backend.port == atoi(TEST_PORT));
     fail_unless(options.bypass_port == atoi(TEST_BYPASS_PORT));
@@ -106,8 +145,20 @@ START_TEST (test_options_short) {
     fail_unless(strcmp(options.phost, TEST_PROXY_HOST) == 0);
     fail_unless(options.pport == atoi(TEST_PROXY_PORT));
     fail_unless(options.timeout == atoi(TEST_CLIENT_TIMEOUT));
+    fail_unless(options.acceptors == atoi(TEST_ACCEPTORS));
+    fail_unless(options.backlog == atoi(TEST_BACKLOG));
+    fail_unless(options.queue_depth == atoi(TEST_QUEUE_DEPTH));
+    fail_unless(options.queue_wait == atoi(TEST_QUEUE_WAIT));
+    fail_unless(options.balance == BALANCE_P2C);
+    fail_unless(options.stale_lag == atoi(TEST_STALE_LAG));
+    fail_unless(options.connect_threads == atoi(TEST_CONNECT_THREADS));
+    fail_unless(options.connect_timeout == atoi(TEST_CONNECT_TIMEOUT));
+    fail_unless(options.connect_retries == atoi(TEST_CONNECT_RETRIES));
+    fail_unless(strcmp(options.warmup_file, TESTS_DIR "backend/backends.txt") == 0);
+    fail_unless(options.ramp_time == atoi(TEST_RAMP_TIME));
     fail_unless(strcmp(options.mapper, TEST_MAPPER) == 0);
     fail_unless(options.client_threads == atoi(TEST_CLIENT_THREADS));
+    fail_unless(options.event_threads == atoi(TEST_EVENT_THREADS));
 } END_TEST
 
 /** @test Long option parsing */
@@ -120,6 +171,7 @@ START_TEST (test_options_long) {
         "--stat-file="       TEST_STAT_FILE,
         "--admin-port="      TEST_ADMIN_PORT,
         "--query-wait",
+        "--coord-conns="     TEST_COORD_CONNS,
         "--backend-host="    TEST_HOST,
         "--backend-port="    TEST_PORT,
         "--bypass-port="     TEST_BYPASS_PORT,
@@ -131,8 +183,20 @@ START_TEST (test_options_long) {
         "--proxy-host="      TEST_PROXY_HOST,
         "--proxy-port="      TEST_PROXY_PORT,
         "--timeout="         TEST_CLIENT_TIMEOUT,
+        "--acceptors="       TEST_ACCEPTORS,
+        "--backlog="         TEST_BACKLOG,
+        "--queue-depth="     TEST_QUEUE_DEPTH,
+        "--queue-wait="      TEST_QUEUE_WAIT,
+        "--balance="         TEST_BALANCE,
+        "--stale-lag="       TEST_STALE_LAG,
+        "--connect-threads=" TEST_CONNECT_THREADS,
+        "--connect-timeout=" TEST_CONNECT_TIMEOUT,
+        "--connect-retries=" TEST_CONNECT_RETRIES,
+        "--warmup-file="     TESTS_DIR "backend/backends.txt",
+        "--ramp-time="       TEST_RAMP_TIME,
         "--mapper="          TEST_MAPPER,
-        "--client-threads="  TEST_CLIENT_THREADS };
+        "--client-threads="  TEST_CLIENT_THREADS,
+        "--event-threads="   TEST_EVENT_THREADS };
 
     fail_unless(proxy_options_parse(sizeof(argv)/sizeof(*argv), argv) == EXIT_SUCCESS);
 
@@ -143,6 +207,7 @@ START_TEST (test_options_long) {
     fail_unless(strcmp(options.stat_file, TEST_STAT_FILE) == 0);
     fail_unless(options.admin_port == atoi(TEST_ADMIN_PORT));
     fail_unless(options.query_wait);
+    fail_unless(options.coord_conns == atoi(TEST_COORD_CONNS));
     fail_unless(strcmp(options.backend.host, TEST_HOST) == 0);
     fail_unless(options.backend.port == atoi(TEST_PORT));
     fail_unless(options.bypass_port == atoi(TEST_BYPASS_PORT));
@@ -154,8 +219,20 @@ START_TEST (test_options_long) {
     fail_unless(strcmp(options.phost, TEST_PROXY_HOST) == 0);
     fail_unless(options.pport == atoi(TEST_PROXY_PORT));
     fail_unless(options.timeout == atoi(TEST_CLIENT_TIMEOUT));
+    fail_unless(options.acceptors == atoi(TEST_ACCEPTORS));
+    fail_unless(options.backlog == atoi(TEST_BACKLOG));
+    fail_unless(options.queue_depth == atoi(TEST_QUEUE_DEPTH));
+    fail_unless(options.queue_wait == atoi(TEST_QUEUE_WAIT));
+    fail_unless(options.balance == BALANCE_P2C);
+    fail_unless(options.stale_lag == atoi(TEST_STALE_LAG));
+    fail_unless(options.connect_threads == atoi(TEST_CONNECT_THREADS));
+    fail_unless(options.connect_timeout == atoi(TEST_CONNECT_TIMEOUT));
+    fail_unless(options.connect_retries == atoi(TEST_CONNECT_RETRIES));
+    fail_unless(strcmp(options.warmup_file, TESTS_DIR "backend/backends.txt") == 0);
+    fail_unless(options.ramp_time == atoi(TEST_RAMP_TIME));
     fail_unless(strcmp(options.mapper, TEST_MAPPER) == 0);
     fail_unless(options.client_threads == atoi(TEST_CLIENT_THREADS));
+    fail_unless(options.event_threads == atoi(TEST_EVENT_THREADS));
 } END_TEST
 
 /** @test Assignment of default options */
@@ -170,8 +247,23 @@ START_TEST (test_options_defaults) {
     fail_unless(!options.cloneable);
     fail_unless(options.admin_port == ADMIN_PORT);
     fail_unless(!options.query_wait);
+    fail_unless(options.coord_conns == COORD_CONNS);
+    fail_unless(options.scale_rules_num == 0);
+    fail_unless(options.scale_cooldown == SCALE_COOLDOWN);
+    fail_unless(options.scale_max == SCALE_MAX);
+    fail_unless(!options.scale_dry_run);
+    fail_unless(!options.simulate_clones);
     fail_unless(!options.add_ids);
     fail_unless(!options.two_pc);
+    fail_unless(options.write_quorum == 0);
+    fail_unless(options.stale_lag == STALE_LAG);
+    fail_unless(options.batch_writes == 0);
+    fail_unless(options.batch_wait == BATCH_WAIT);
+    fail_unless(options.connect_threads == CONNECT_THREADS);
+    fail_unless(options.connect_timeout == CONNECT_TIMEOUT);
+    fail_unless(options.connect_retries == CONNECT_RETRIES);
+    fail_unless(options.warmup_file == NULL);
+    fail_unless(options.ramp_time == 0);
     fail_unless(options.autocommit);
     fail_unless(strcmp(options.backend.host, BACKEND_HOST) == 0);
     fail_unless(options.bypass_port < 0);
@@ -182,10 +274,19 @@ START_TEST (test_options_defaults) {
     fail_unless(strcmp(options.db, BACKEND_DB) == 0);
     fail_unless(options.backend_file == NULL);
     fail_unless(options.num_conns = NUM_CONNS);
+    fail_unless(options.balance == BALANCE_RANDOM);
+    fail_unless(!options.statement_reads);
+    fail_unless(!options.transaction_pool);
+    fail_unless(!options.fanout);
     fail_unless(options.pport == PROXY_PORT);
     fail_unless(options.timeout == CLIENT_TIMEOUT);
+    fail_unless(options.acceptors == ACCEPTORS);
+    fail_unless(options.backlog == QUEUE_LENGTH);
+    fail_unless(options.queue_depth == 0);
+    fail_unless(options.queue_wait == QUEUE_WAIT);
     fail_unless(options.mapper == NULL);
     fail_unless(options.client_threads == CLIENT_THREADS);
+    fail_unless(options.event_threads == EVENT_THREADS);
 } END_TEST
 
 /** @test Specification of invalid file */
@@ -249,6 +350,9 @@ START_TEST (test_options_no_file) {
     char *argv2[] = { "./sfsql-proxy",
         "-T" TEST_BACKEND_THREADS };
 
+    char *argv3[] = { "./sfsql-proxy",
+        "-R" };
+
     FILE *null = fopen("/dev/null", "w");
     if (null) { fclose(stderr); stderr = null; }
 
@@ -256,6 +360,9 @@ START_TEST (test_options_no_file) {
 
     optind = 0;
     fail_unless(proxy_options_parse(sizeof(argv2)/sizeof(*argv2), argv2) == EX_USAGE);
+
+    optind = 0;
+    fail_unless(proxy_options_parse(sizeof(argv3)/sizeof(*argv3), argv3) == EX_USAGE);
 } END_TEST;
 
 /** @test Backend threads and number of connections can be specified for one backend
@@ -270,15 +377,261 @@ START_TEST (test_options_coordinator) {
     fail_unless(proxy_options_parse(sizeof(argv)/sizeof(*argv), argv) == EXIT_SUCCESS);
 } END_TEST;
 
+/** @test Number of connections can be specified for one backend
+ *        if clients are handled by event loops */
+START_TEST (test_options_event_conns) {
+    char *argv[] = { "./sfsql-proxy",
+        "-e" TEST_EVENT_THREADS,
+        "-N" TEST_NUM_CONNS };
+
+    fail_unless(proxy_options_parse(sizeof(argv)/sizeof(*argv), argv) == EXIT_SUCCESS);
+    fail_unless(options.num_conns == atoi(TEST_NUM_CONNS));
+} END_TEST;
+
+/** @test Transaction pooling with a single backend needs event loops
+ *        and cannot be combined with two-phase commit */
+START_TEST (test_options_transaction_pool) {
+    char *argv1[] = { "./sfsql-proxy",
+        "-e" TEST_EVENT_THREADS,
+        "--transaction-pool" };
+
+    extern int optind;
+    char *argv2[] = { "./sfsql-proxy",
+        "-O" };
+
+    char *argv3[] = { "./sfsql-proxy",
+        "-e" TEST_EVENT_THREADS,
+        "-O",
+        "-2" };
+
+    FILE *null = fopen("/dev/null", "w");
+    if (null) { fclose(stderr); stderr = null; }
+
+    fail_unless(proxy_options_parse(sizeof(argv1)/sizeof(*argv1), argv1) == EXIT_SUCCESS);
+    fail_unless(options.transaction_pool);
+
+    optind = 0;
+    fail_unless(proxy_options_parse(sizeof(argv2)/sizeof(*argv2), argv2) == EX_USAGE);
+
+    optind = 0;
+    fail_unless(proxy_options_parse(sizeof(argv3)/sizeof(*argv3), argv3) == EX_USAGE);
+} END_TEST;
+
+/** @test Cannot have more acceptors than client threads */
+START_TEST (test_options_acceptors) {
+    char *argv[] = { "./sfsql-proxy",
+        "-t" TEST_CLIENT_THREADS,
+        "-S" "6" };
+
+    FILE *null = fopen("/dev/null", "w");
+    if (null) { fclose(stderr); stderr = null; }
+
+    fail_unless(proxy_options_parse(sizeof(argv)/sizeof(*argv), argv) == EX_USAGE);
+} END_TEST;
+
+/** @test Unknown balancing policies are rejected */
+START_TEST (test_options_balance) {
+    char *argv[] = { "./sfsql-proxy",
+        "-gnothing" };
+
+    FILE *null = fopen("/dev/null", "w");
+    if (null) { fclose(stderr); stderr = null; }
+
+    fail_unless(proxy_options_parse(sizeof(argv)/sizeof(*argv), argv) == EX_USAGE);
+} END_TEST;
+
+/** @test Autoscaling rules are parsed and validated */
+START_TEST (test_options_autoscale) {
+    char *argv1[] = { "./sfsql-proxy",
+        "-C",
+        "-oqps:500:100",
+        "--autoscale=latency:20000:2000",
+        "-Z10",
+        "-M4",
+        "-z",
+        "-r" };
+
+    extern int optind;
+    char *argv2[] = { "./sfsql-proxy",
+        "-oqps:500:100" };
+
+    char *argv3[] = { "./sfsql-proxy",
+        "-C",
+        "-oqps:100:500" };
+
+    char *argv4[] = { "./sfsql-proxy",
+        "-C",
+        "-onothing:500:100" };
+
+    char *argv5[] = { "./sfsql-proxy",
+        "-C",
+        "-oqueue:10" };
+
+    FILE *null = fopen("/dev/null", "w");
+    if (null) { fclose(stderr); stderr = null; }
+
+    fail_unless(proxy_options_parse(sizeof(argv1)/sizeof(*argv1), argv1) == EXIT_SUCCESS);
+    fail_unless(options.scale_rules_num == 2);
+    fail_unless(options.scale_rules[0].metric == SCALE_QPS);
+    fail_unless(options.scale_rules[0].out == 500);
+    fail_unless(options.scale_rules[0].in == 100);
+    fail_unless(options.scale_rules[1].metric == SCALE_LATENCY);
+    fail_unless(options.scale_cooldown == 10);
+    fail_unless(options.scale_max == 4);
+    fail_unless(options.scale_dry_run);
+    fail_unless(options.simulate_clones);
+
+    /* Only the coordinator may scale */
+    optind = 0;
+    fail_unless(proxy_options_parse(sizeof(argv2)/sizeof(*argv2), argv2) == EX_USAGE);
+
+    optind = 0;
+    fail_unless(proxy_options_parse(sizeof(argv3)/sizeof(*argv3), argv3) == EX_USAGE);
+
+    optind = 0;
+    fail_unless(proxy_options_parse(sizeof(argv4)/sizeof(*argv4), argv4) == EX_USAGE);
+
+    optind = 0;
+    fail_unless(proxy_options_parse(sizeof(argv5)/sizeof(*argv5), argv5) == EX_USAGE);
+} END_TEST;
+
+/** @test Connection and ramp options must be valid */
+START_TEST (test_options_connect) {
+    char *argv1[] = { "./sfsql-proxy",
+        "-K0" };
+
+    extern int optind;
+    char *argv2[] = { "./sfsql-proxy",
+        "--connect-timeout=0" };
+
+    char *argv3[] = { "./sfsql-proxy",
+        "-U-1" };
+
+    char *argv4[] = { "./sfsql-proxy",
+        "-V-1" };
+
+    char *argv5[] = { "./sfsql-proxy",
+        "-E" TESTS_DIR "backend/NOTHING.txt" };
+
+    FILE *null = fopen("/dev/null", "w");
+    if (null) { fclose(stderr); stderr = null; }
+    if (null) { fclose(stdout); stdout = null; }
+
+    fail_unless(proxy_options_parse(sizeof(argv1)/sizeof(*argv1), argv1) == EX_USAGE);
+
+    optind = 0;
+    fail_unless(proxy_options_parse(sizeof(argv2)/sizeof(*argv2), argv2) == EX_USAGE);
+
+    optind = 0;
+    fail_unless(proxy_options_parse(sizeof(argv3)/sizeof(*argv3), argv3) == EX_USAGE);
+
+    optind = 0;
+    fail_unless(proxy_options_parse(sizeof(argv4)/sizeof(*argv4), argv4) == EX_USAGE);
+
+    optind = 0;
+    fail_unless(proxy_options_parse(sizeof(argv5)/sizeof(*argv5), argv5) == EX_NOINPUT);
+} END_TEST
+
+/** @test Write quorums are incompatible with two-phase commit and fan-out */
+START_TEST (test_options_write_quorum) {
+    char *argv1[] = { "./sfsql-proxy",
+        "-f" TESTS_DIR "backend/backends.txt",
+        "-m" TEST_MAPPER,
+        "-k" TEST_WRITE_QUORUM };
+
+    extern int optind;
+    char *argv2[] = { "./sfsql-proxy",
+        "-f" TESTS_DIR "backend/backends.txt",
+        "-m" TEST_MAPPER,
+        "--write-quorum=" TEST_WRITE_QUORUM,
+        "--two-pc" };
+
+    char *argv3[] = { "./sfsql-proxy",
+        "-f" TESTS_DIR "backend/backends.txt",
+        "-m" TEST_MAPPER,
+        "-k" TEST_WRITE_QUORUM,
+        "-x" };
+
+    char *argv4[] = { "./sfsql-proxy",
+        "-k-1" };
+
+    FILE *null = fopen("/dev/null", "w");
+    if (null) { fclose(stderr); stderr = null; }
+    if (null) { fclose(stdout); stdout = null; }
+
+    fail_unless(proxy_options_parse(sizeof(argv1)/sizeof(*argv1), argv1) == EXIT_SUCCESS);
+    fail_unless(options.write_quorum == atoi(TEST_WRITE_QUORUM));
+
+    optind = 0;
+    fail_unless(proxy_options_parse(sizeof(argv2)/sizeof(*argv2), argv2) == EX_USAGE);
+
+    optind = 0;
+    fail_unless(proxy_options_parse(sizeof(argv3)/sizeof(*argv3), argv3) == EX_USAGE);
+
+    optind = 0;
+    fail_unless(proxy_options_parse(sizeof(argv4)/sizeof(*argv4), argv4) == EX_USAGE);
+} END_TEST
+
+/** @test Write batching requires plain autocommit writes */
+START_TEST (test_options_batch_writes) {
+    char *argv1[] = { "./sfsql-proxy",
+        "-f" TESTS_DIR "backend/backends.txt",
+        "-m" TEST_MAPPER,
+        "-j" TEST_BATCH_WRITES,
+        "-J" TEST_BATCH_WAIT };
+
+    extern int optind;
+    char *argv2[] = { "./sfsql-proxy",
+        "-f" TESTS_DIR "backend/backends.txt",
+        "-m" TEST_MAPPER,
+        "--batch-writes=" TEST_BATCH_WRITES,
+        "--batch-wait="   TEST_BATCH_WAIT };
+
+    char *argv3[] = { "./sfsql-proxy",
+        "-f" TESTS_DIR "backend/backends.txt",
+        "-m" TEST_MAPPER,
+        "-j" TEST_BATCH_WRITES,
+        "-2" };
+
+    char *argv4[] = { "./sfsql-proxy",
+        "-f" TESTS_DIR "backend/backends.txt",
+        "-m" TEST_MAPPER,
+        "-j" TEST_BATCH_WRITES,
+        "-J0" };
+
+    FILE *null = fopen("/dev/null", "w");
+    if (null) { fclose(stderr); stderr = null; }
+    if (null) { fclose(stdout); stdout = null; }
+
+    fail_unless(proxy_options_parse(sizeof(argv1)/sizeof(*argv1), argv1) == EXIT_SUCCESS);
+    fail_unless(options.batch_writes == atoi(TEST_BATCH_WRITES));
+    fail_unless(options.batch_wait == atoi(TEST_BATCH_WAIT));
+
+    optind = 0;
+    fail_unless(proxy_options_parse(sizeof(argv2)/sizeof(*argv2), argv2) == EXIT_SUCCESS);
+    fail_unless(options.batch_writes == atoi(TEST_BATCH_WRITES));
+    fail_unless(options.batch_wait == atoi(TEST_BATCH_WAIT));
+
+    optind = 0;
+    fail_unless(proxy_options_parse(sizeof(argv3)/sizeof(*argv3), argv3) == EX_USAGE);
+
+    optind = 0;
+    fail_unless(proxy_options_parse(sizeof(argv4)/sizeof(*argv4), argv4) == EX_USAGE);
+} END_TEST
+
 /** @test Short options only valid with file specified */
 START_TEST (test_options_file_short) {
     char *argv[] = { "./sfsql-proxy",
         "-f" TESTS_DIR "backend/backends.txt",
         "-N" TEST_NUM_CONNS,
         "-T" TEST_BACKEND_THREADS,
+        "-R",
+        "-x",
         "-m" TEST_MAPPER };
 
     fail_unless(proxy_options_parse(sizeof(argv)/sizeof(*argv), argv) == EXIT_SUCCESS);
+    fail_unless(options.statement_reads);
+    fail_unless(options.fanout);
 
     fail_unless(options.num_conns = atoi(TEST_NUM_CONNS));
     fail_unless(options.backend_threads = atoi(TEST_BACKEND_THREADS));
@@ -290,9 +643,13 @@ START_TEST (test_options_file_long) {
         "-f" TESTS_DIR "backend/backends.txt",
         "--num-conns="       TEST_NUM_CONNS,
         "--backend-threads=" TEST_BACKEND_THREADS,
+        "--statement-reads",
+        "--fanout",
         "-m" TEST_MAPPER };
 
     fail_unless(proxy_options_parse(sizeof(argv)/sizeof(*argv), argv) == EXIT_SUCCESS);
+    fail_unless(options.statement_reads);
+    fail_unless(options.fanout);
 
     fail_unless(options.num_conns = atoi(TEST_NUM_CONNS));
     fail_unless(options.backend_threads = atoi(TEST_BACKEND_THREADS));
@@ -342,6 +699,10 @@ Suite *options_suite(void) {
     tcase_add_test(tc_cli, test_options_short);
     tcase_add_test(tc_cli, test_options_long);
     tcase_add_test(tc_cli, test_options_defaults);
+    tcase_add_test(tc_cli, test_options_acceptors);
+    tcase_add_test(tc_cli, test_options_balance);
+    tcase_add_test(tc_cli, test_options_connect);
+    tcase_add_test(tc_cli, test_options_autoscale);
     suite_add_tcase(s, tc_cli);
 
     TCase *tc_file = tcase_create("File and socket parsing");
@@ -352,6 +713,10 @@ Suite *options_suite(void) {
     tcase_add_test(tc_file, test_options_socket_default);
     tcase_add_test(tc_file, test_options_no_file);
     tcase_add_test(tc_file, test_options_coordinator);
+    tcase_add_test(tc_file, test_options_event_conns);
+    tcase_add_test(tc_file, test_options_transaction_pool);
+    tcase_add_test(tc_file, test_options_write_quorum);
+    tcase_add_test(tc_file, test_options_batch_writes);
     tcase_add_test(tc_file, test_options_file_short);
     tcase_add_test(tc_file, test_options_file_long);
     tcase_add_test(tc_file, test_options_file_default);
@@ -42,7 +42,7 @@ START_TEST (test_pool_new) {
     fail_unless(pool->__alloc >= 1);
     fail_unless(pool->size == 1);
     fail_unless(pool->locked == 0);
-    fail_unless(pool->avail[0] == TRUE);
+    fail_unless(proxy_pool_is_free(pool, 0));
 } END_TEST
 
 /** @test Passing NULL when destroying pool does nothing */
@@ -68,7 +68,7 @@ START_TEST (test_pool_grow) {
     fail_unless(pool->__alloc >= 10);
 
     for (i=1; i<10; i++)
-        fail_unless(pool->avail[i] == TRUE);
+        fail_unless(proxy_pool_is_free(pool, i));
 } END_TEST
 
 /** @test Pool can be successfully shrunk */
@@ -104,7 +104,37 @@ START_TEST (test_pool_get) {
 
     fail_unless(i == 0);
     fail_unless(pool->locked == 1);
-    fail_unless(pool->avail[0] == FALSE);
+    fail_unless(!proxy_pool_is_free(pool, 0));
+} END_TEST
+
+/** @test Fetching from an exhausted pool fails without waiting */
+START_TEST (test_pool_try_get) {
+    fail_unless(proxy_pool_try_get(pool) == 0);
+    fail_unless(proxy_pool_try_get(pool) < 0);
+    fail_unless(pool->locked == 1);
+} END_TEST
+
+/** @test Objects past the first word of the pool can be fetched */
+START_TEST (test_pool_get_many) {
+    pool_t *pool;
+    int i, n = POOL_BITS * 2 + 1;
+    my_bool *seen;
+
+    pool = proxy_pool_new(n);
+    seen = (my_bool*) calloc(n, sizeof(my_bool));
+
+    for (i=0; i<n; i++) {
+        int idx = proxy_pool_get(pool);
+        fail_unless(idx >= 0 && idx < n);
+        fail_unless(!seen[idx]);
+        seen[idx] = TRUE;
+    }
+
+    fail_unless(pool->locked == n);
+    fail_unless(proxy_pool_try_get(pool) < 0);
+
+    free(seen);
+    proxy_pool_destroy(pool);
 } END_TEST
 
 /** @test List of locked objects can be fetched */
@@ -141,7 +171,7 @@ START_TEST (test_pool_return) {
     proxy_pool_return(pool, i);
 
     fail_unless(pool->locked == 0);
-    fail_unless(pool->avail[i] == TRUE);
+    fail_unless(proxy_pool_is_free(pool, i));
 } END_TEST
 
 Suite *pool_suite(void) {
@@ -164,6 +194,8 @@ Suite *pool_suite(void) {
     TCase *tc_lock = tcase_create("Locking");
     tcase_add_checked_fixture(tc_lock, setup, teardown);
     tcase_add_test(tc_lock, test_pool_get);
+    tcase_add_test(tc_lock, test_pool_try_get);
+    tcase_add_test(tc_lock, test_pool_get_many);
     tcase_add_test(tc_lock, test_pool_get_locked);
     tcase_add_test(tc_lock, test_pool_is_free);
     tcase_add_test(tc_lock, test_pool_return);
@@ -0,0 +1,149 @@
+/******************************************************************************
+ * check_stats.c
+ *
+ * Statistics tests
+ *
+ * Copyright (c) 2010, Michael Mior <mmior@cs.toronto.edu>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+ * Place - Suite 330, Boston, MA 02111-1307 USA.
+ *
+ */
+
+#include "../src/proxy_stats.c"
+
+#include <check.h>
+
+#define SHARDS 4
+
+static void setup() {
+    proxy_stats_init(SHARDS);
+}
+
+static void teardown() {
+    proxy_stats_end();
+}
+
+/**
+ * Take a sample after the given number of
+ * queries have been run at the given time.
+ **/
+static void sample_at(time_t time, ulong queries) {
+    status_t status, published;
+    stats_sample_t *sample;
+
+    proxy_stats_total(&published);
+    status = published;
+    status.queries = queries;
+    proxy_stats_publish(0, &status, &published);
+
+    proxy_stats_sample();
+    sample = &stats_samples[(stats_next + STATS_SAMPLES - 1) % STATS_SAMPLES];
+    sample->time.tv_sec = time;
+    sample->time.tv_usec = 0;
+}
+
+/** @test Shards of different threads are on separate cache lines */
+START_TEST (test_stats_padding) {
+    fail_unless(sizeof(proxy_stats_shard_t) % STATS_CACHE_LINE == 0);
+    fail_unless(((ulong) stats_shards) % STATS_CACHE_LINE == 0);
+} END_TEST
+
+/** @test Only what changed since the last publish is added */
+START_TEST (test_stats_publish) {
+    status_t status, published, total;
+
+    proxy_status_reset(&status);
+    proxy_status_reset(&published);
+
+    status.queries = 3;
+    status.bytes_recv = 100;
+    proxy_stats_publish(1, &status, &published);
+    fail_unless(published.queries == 3);
+
+    status.queries = 5;
+    status.queries_any = 2;
+    proxy_stats_publish(1, &status, &published);
+
+    /* A second connection on another thread */
+    proxy_status_reset(&status);
+    proxy_status_reset(&published);
+    status.queries = 1;
+    status.queries_all = 1;
+    proxy_stats_publish(2, &status, &published);
+
+    /* Threads without a shard are ignored */
+    proxy_stats_publish(SHARDS, &status, &published);
+
+    proxy_stats_total(&total);
+    fail_unless(total.queries == 6);
+    fail_unless(total.queries_any == 2);
+    fail_unless(total.queries_all == 1);
+    fail_unless(total.bytes_recv == 100);
+} END_TEST
+
+/** @test Rates are computed over each window */
+START_TEST (test_stats_rate) {
+    int i;
+
+    fail_unless(proxy_stats_rate(STATS_QUERIES, 1) == 0);
+
+    /* Ten queries per second, then a hundred */
+    for (i=0; i<=10; i++)
+        sample_at(i, i * 10);
+    sample_at(11, 200);
+
+    fail_unless(proxy_stats_rate(STATS_QUERIES, 1) == 100);
+    fail_unless(proxy_stats_rate(STATS_QUERIES, 10) == 19);
+
+    /* Longer windows use all samples so far */
+    fail_unless(proxy_stats_rate(STATS_QUERIES, 60) == 200 / 11);
+    fail_unless(proxy_stats_rate(STATS_QUERIES_ANY, 60) == 0);
+} END_TEST
+
+/** @test Old samples are replaced once the longest window is covered */
+START_TEST (test_stats_window) {
+    int i;
+
+    for (i=0; i<STATS_SAMPLES * 2; i++)
+        sample_at(i, i < STATS_SAMPLES ? 0 : (i - STATS_SAMPLES + 1) * 5);
+
+    fail_unless(stats_nsamples == STATS_SAMPLES);
+    fail_unless(proxy_stats_rate(STATS_QUERIES, 1) == 5);
+    fail_unless(proxy_stats_rate(STATS_QUERIES, STATS_WINDOW_MAX) == 5);
+} END_TEST
+
+Suite *stats_suite(void) {
+    Suite *s = suite_create("Statistics");
+
+    TCase *tc_stats = tcase_create("Statistics");
+    tcase_add_checked_fixture(tc_stats, setup, teardown);
+    tcase_add_test(tc_stats, test_stats_padding);
+    tcase_add_test(tc_stats, test_stats_publish);
+    tcase_add_test(tc_stats, test_stats_rate);
+    tcase_add_test(tc_stats, test_stats_window);
+    suite_add_tcase(s, tc_stats);
+
+    return s;
+}
+
+int main(void) {
+    int failed;
+    Suite *s = stats_suite();
+    SRunner *sr = srunner_create(s);
+
+    srunner_run_all(sr, CK_ENV);
+    failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return (failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
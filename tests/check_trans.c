@@ -63,21 +63,74 @@ START_TEST (test_trans_hash_eq) {
 /** @test Add new transaction to hashtable */
 START_TEST (test_trans_add) {
     ulong key = 1;
-    proxy_trans_t *trans = (proxy_trans_t*) malloc(sizeof(proxy_trans_t));
+    proxy_trans_t *trans = proxy_trans_new();
 
-    proxy_trans_insert(key, trans);
-    fail_unless(hashtable_count(trans_table) == 1);
+    fail_unless(proxy_trans_insert(key, trans) == trans);
+    fail_unless(proxy_trans_count() == 1);
     fail_unless(proxy_trans_search(key) == trans);
 } END_TEST
 
 /** @test Remove a transaction from the hashtable */
 START_TEST (test_trans_remove) {
     ulong key = 1;
-    proxy_trans_t *trans = (proxy_trans_t*) malloc(sizeof(proxy_trans_t));
+    proxy_trans_t *trans = proxy_trans_new();
 
     proxy_trans_insert(key, trans);
     fail_unless(proxy_trans_remove(key) == trans);
-    fail_unless(hashtable_count(trans_table) == 0);
+    fail_unless(proxy_trans_count() == 0);
+    fail_unless(proxy_trans_search(key) == NULL);
+    proxy_trans_free(trans);
+} END_TEST
+
+/** @test Inserting an existing key returns the existing transaction */
+START_TEST (test_trans_add_dup) {
+    ulong key = 1;
+    proxy_trans_t *trans1 = proxy_trans_new(), *trans2 = proxy_trans_new();
+
+    proxy_trans_insert(key, trans1);
+    fail_unless(proxy_trans_insert(key, trans2) == trans1);
+    fail_unless(proxy_trans_count() == 1);
+    proxy_trans_free(trans2);
+} END_TEST
+
+/** @test Many transactions can be added and removed in any order */
+START_TEST (test_trans_many) {
+    ulong key;
+    proxy_trans_t *trans;
+
+    for (key=1; key<=10000; key++) {
+        trans = proxy_trans_new();
+        proxy_trans_insert(key, trans);
+    }
+    fail_unless(proxy_trans_count() == 10000);
+
+    /* Remove every other key and check the rest are still found */
+    for (key=2; key<=10000; key+=2)
+        proxy_trans_free(proxy_trans_remove(key));
+    fail_unless(proxy_trans_count() == 5000);
+
+    for (key=1; key<=10000; key++) {
+        if (key % 2)
+            fail_unless(proxy_trans_search(key) != NULL);
+        else
+            fail_unless(proxy_trans_search(key) == NULL);
+    }
+} END_TEST
+
+/** @test Freed transactions are reused and cleared */
+START_TEST (test_trans_pool) {
+    proxy_trans_t *trans1, *trans2;
+
+    trans1 = proxy_trans_new();
+    trans1->num = 3;
+    trans1->success = FALSE;
+    proxy_trans_free(trans1);
+
+    trans2 = proxy_trans_new();
+    fail_unless(trans2 == trans1);
+    fail_unless(trans2->num == 0);
+    fail_unless(trans2->success == TRUE);
+    proxy_trans_free(trans2);
 } END_TEST
 
 Suite *pool_suite(void) {
@@ -92,6 +145,9 @@ Suite *pool_suite(void) {
     tcase_add_checked_fixture(tc_hashtable, setup, teardown);
     tcase_add_test(tc_hashtable, test_trans_add);
     tcase_add_test(tc_hashtable, test_trans_remove);
+    tcase_add_test(tc_hashtable, test_trans_add_dup);
+    tcase_add_test(tc_hashtable, test_trans_many);
+    tcase_add_test(tc_hashtable, test_trans_pool);
     suite_add_tcase(s, tc_hashtable);
 
     return s;
@@ -0,0 +1,118 @@
+/******************************************************************************
+ * check_wait.c
+ *
+ * Thread waiting tests
+ *
+ * Copyright (c) 2010, Michael Mior <mmior@cs.toronto.edu>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+ * Place - Suite 330, Boston, MA 02111-1307 USA.
+ *
+ */
+
+#include "../src/proxy_wait.c"
+
+#include <check.h>
+
+static volatile int flag;
+
+/** Set the flag after a short delay and wake waiters */
+static void* wait_setter(__attribute__((unused)) void *ptr) {
+    usleep(10000);
+    flag = 1;
+    proxy_wait_wake();
+
+    return NULL;
+}
+
+/** @test Waiting on a condition which already holds does not block */
+START_TEST (test_wait_no_block) {
+    wait_stats_t stats;
+
+    flag = 1;
+    proxy_wait(WAIT_TRANS, flag);
+
+    proxy_wait_stats(WAIT_TRANS, &stats);
+    fail_unless(stats.waits == 0);
+    fail_unless(wait_waiters == 0);
+} END_TEST
+
+/** @test Waiting threads are woken when the condition changes */
+START_TEST (test_wait_wake) {
+    pthread_t thread;
+    wait_stats_t stats;
+
+    flag = 0;
+    pthread_create(&thread, NULL, wait_setter, NULL);
+    proxy_wait(WAIT_QUERY_CLONE, flag);
+    pthread_join(thread, NULL);
+
+    fail_unless(flag == 1);
+    fail_unless(wait_waiters == 0);
+
+    proxy_wait_stats(WAIT_QUERY_CLONE, &stats);
+    fail_unless(stats.waits == 1);
+    fail_unless(stats.usec > 0);
+    fail_unless(stats.max == stats.usec);
+} END_TEST
+
+/** @test Timed waits give up once the time passes */
+START_TEST (test_wait_timed) {
+    pthread_t thread;
+    int expired;
+
+    flag = 0;
+    proxy_wait_timed(WAIT_COMMIT_CLONE, flag, 20, expired);
+    fail_unless(expired);
+    fail_unless(wait_waiters == 0);
+
+    /* A wake before the time passes ends the wait */
+    pthread_create(&thread, NULL, wait_setter, NULL);
+    proxy_wait_timed(WAIT_COMMIT_CLONE, flag, 10000, expired);
+    pthread_join(thread, NULL);
+
+    fail_unless(!expired && flag == 1);
+    fail_unless(wait_waiters == 0);
+} END_TEST
+
+/** @test Every wait site has a name */
+START_TEST (test_wait_names) {
+    int i;
+
+    for (i=0; i<WAIT_SITES; i++)
+        fail_unless(proxy_wait_name(i) != NULL);
+} END_TEST
+
+Suite *wait_suite(void) {
+    Suite *s = suite_create("Wait");
+
+    TCase *tc_wait = tcase_create("Waiting");
+    tcase_add_test(tc_wait, test_wait_no_block);
+    tcase_add_test(tc_wait, test_wait_wake);
+    tcase_add_test(tc_wait, test_wait_timed);
+    tcase_add_test(tc_wait, test_wait_names);
+    suite_add_tcase(s, tc_wait);
+
+    return s;
+}
+
+int main(void) {
+    int failed;
+    Suite *s = wait_suite();
+    SRunner *sr = srunner_create(s);
+
+    srunner_run_all(sr, CK_ENV);
+    failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return (failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
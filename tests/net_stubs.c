@@ -62,6 +62,8 @@ my_bool __wrap_proxy_backend_query(__attribute__((unused)) MYSQL *proxy, const c
 }
 
 /* Don't need to touch the pool here */
+int __wrap_proxy_pool_get(__attribute__((unused)) pool_t *pool) { return 0; }
+int __wrap_proxy_pool_try_get(__attribute__((unused)) pool_t *pool) { return 0; }
 void __wrap_proxy_pool_return(__attribute__((unused)) pool_t *pool, __attribute__((unused)) int idx) {}
 
 /* No need for threading in tests */
@@ -84,3 +86,13 @@ my_bool __wrap_proxy_cmd(
 void __wrap_proxy_options_update_host() {}
 void __wrap_proxy_backend_get_connection(__attribute__((unused)) proxy_conn_idx_t *conn_idx, __attribute__((unused)) int thread_id) {};
 void __wrap_proxy_backend_release_connection(__attribute__((unused)) proxy_conn_idx_t *conn_idx) {};
+void __wrap_proxy_event_service(
+        __attribute__((unused)) proxy_event_conn_t *conn,
+        __attribute__((unused)) int thread_id,
+        __attribute__((unused)) commitdata_t *commit) {}
+void __wrap_proxy_event_release(__attribute__((unused)) int thread_id) {}
+void __wrap_proxy_admit_release(__attribute__((unused)) int thread_id) {}
+void __wrap_proxy_stats_publish(
+        __attribute__((unused)) int shard,
+        __attribute__((unused)) status_t *status,
+        __attribute__((unused)) status_t *published) {}